@@ -5,6 +5,7 @@
 #include <model/model.h>
 
 training_info_t nn_digit_recognizer(neural_network_model_t *model);
+training_info_t nn_digit_recognizer_cnn(neural_network_model_t *model);
 training_info_t nn_AND(neural_network_model_t *model);
 training_info_t nn_XOR(neural_network_model_t *model);
 
@@ -35,6 +35,12 @@ typedef struct DataSet {
 } dataset_t;
 
 #define NUMBER_DISPLAYED_IMAGES 5
+
+// a pixel's red channel v is fed to the model as (255 - v) / 256, dark strokes on a light background become
+// large inputs and the background exactly 0 so the model's input layer can skip it. both constants are
+// powers of two multiples, which keeps v * scale + offset exact in float
+#define IMAGE_PIXEL_SCALE (-1.0f / 256.0f)
+#define IMAGE_PIXEL_OFFSET (255.0f / 256.0f)
 typedef struct ImageDataSetVisualizer {
     dataset_t *dataset;
     int left_image_index;
@@ -64,6 +70,7 @@ void DataSetRemoveImage(dataset_t *dataset, int index);
 void DataSetRemoveImages(dataset_t *dataset, int from_index, int to_index);
 
 void convert_image_to_mymatrix(nmatrix_t* m, Image image);
+void convert_image_to_pixels(uint8_t *pixels, Image image);
 void one_hot_encode_matrix(nmatrix_t *m, int label);
 
 void UnloadDataSet(dataset_t dataset);
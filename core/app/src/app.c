@@ -1,14 +1,19 @@
 #include <app/app.h>
 #include <app/visualizer.h>
 
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #define TIME
 #include <util/profiler.h>
 #include <util/debug_memory.h>
 
 #define SHAPE(...) nshape_constructor(__VA_ARGS__)
+#define DIGIT_RECOGNIZER_MODEL_PATH "digit_recognizer.model"
+#define DIGIT_RECOGNIZER_CNN_MODEL_PATH "digit_recognizer_cnn.model"
 
 static const char* digit_outputs[10] = {
     "0", "1", "2", "3", "4", "5", "6", "7", "8", "9"
@@ -21,9 +26,19 @@ static const training_info_t DEFAULT_TRAIN_INFO = {
     .train_size = 0,
     .train_x = NULL,
     .train_y = NULL,
+    .train_labels = NULL,
+    .train_pixels = NULL,
     .test_size = 0,
     .test_x = NULL,
     .test_y = NULL,
+    .test_labels = NULL,
+    .test_pixels = NULL,
+    .checkpoint_writer = NULL,
+    .shuffle = false,
+    .train_order = NULL,
+    .resume = false,
+    .async_evaluation = false,
+    .pipeline_stages = 0,
     .train_accuracy = 0,
     .avg_train_error = 0,
     .train_correct = 0,
@@ -36,7 +51,8 @@ static const training_info_t DEFAULT_TRAIN_INFO = {
     .target_accuracy = 1,
 };
 
-int main(void) {
+// pass --cnn to run the convolutional digit recognizer instead of the MLP
+int main(int argc, char *argv[]) {
     CLOCK_MARK
     neural_network_model_t nnmodel = {
         .is_training = false,
@@ -61,7 +77,9 @@ int main(void) {
     //     .allow_drawing_panel_as_model_input = false,
     // };
 
-    training_info_t training_info = nn_digit_recognizer(&nnmodel);
+    const bool use_cnn = argc > 1 && strcmp(argv[1], "--cnn") == 0;
+    const char *model_path = use_cnn ? DIGIT_RECOGNIZER_CNN_MODEL_PATH : DIGIT_RECOGNIZER_MODEL_PATH;
+    training_info_t training_info = use_cnn ? nn_digit_recognizer_cnn(&nnmodel) : nn_digit_recognizer(&nnmodel);
     training_info.model = &nnmodel;
     model_calculate(&nnmodel);
 
@@ -73,7 +91,7 @@ int main(void) {
         .is_target_epochs_active = false,
         .is_target_accuracy_active = false,
 
-        .model_name = "Digit Recognizer",
+        .model_name = use_cnn ? "Digit Recognizer (CNN)" : "Digit Recognizer",
         .output_labels = digit_outputs,
         .num_labels = 10,
         .default_dataset_directory = "images\\digits",
@@ -84,6 +102,7 @@ int main(void) {
 
     // clean up
     pthread_join(thread_id, NULL);
+    model_save(&nnmodel, model_path);
     model_free(&nnmodel);
 
     training_info_free(&training_info);
@@ -97,6 +116,11 @@ training_info_t nn_digit_recognizer(neural_network_model_t *model_digit) {
     model_digit->output_layer = NULL;
     model_digit->num_layers = 0;
 
+    // continue from the weights saved by the last session if there are any
+    if (access(DIGIT_RECOGNIZER_MODEL_PATH, F_OK) == 0 && model_load(model_digit, DIGIT_RECOGNIZER_MODEL_PATH)) {
+        return DEFAULT_TRAIN_INFO;
+    }
+
     nmatrix_t input = nmatrix_allocator(SHAPE(2, 784, 1));
     nmatrix_t dense_1 = nmatrix_allocator(SHAPE(2, 32, 1));
     nmatrix_t dense_2 = nmatrix_allocator(SHAPE(2, 16, 1));
@@ -110,8 +134,7 @@ training_info_t nn_digit_recognizer(neural_network_model_t *model_digit) {
     layer_t *activation_layer_2 = layer_activation(model_digit, activation_functions_sigmoid);
     // layer_t *dropout_layer_2 = layer_dropout(model_digit, 0.5);
     layer_t *dense_layer_3 = layer_dense(model_digit, output);
-    layer_t *activation_layer_3 = layer_activation(model_digit, activation_functions_softmax);
-    layer_t *output_layer = layer_output(model_digit, output_make_guess_one_hot_encoded, output_functions_crossentropy, output_cost_categorical_cross_entropy);
+    layer_t *output_layer = layer_output(model_digit, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
 
     model_initialize_matrix_normal_distribution(dense_layer_1->layer.dense.weights, 0, 0.2);
     model_initialize_matrix_normal_distribution(dense_layer_2->layer.dense.weights, 0, 0.2);
@@ -125,6 +148,38 @@ training_info_t nn_digit_recognizer(neural_network_model_t *model_digit) {
     return DEFAULT_TRAIN_INFO;
 }
 
+// small convolutional alternative to the MLP above, 28x28 => 8x14x14 -> 16x7x7 -> 10 x 1 output
+// about 9k parameters against the MLP's 26k
+training_info_t nn_digit_recognizer_cnn(neural_network_model_t *model_digit) {
+    model_digit->input_layer = NULL;
+    model_digit->output_layer = NULL;
+    model_digit->num_layers = 0;
+
+    if (access(DIGIT_RECOGNIZER_CNN_MODEL_PATH, F_OK) == 0 && model_load(model_digit, DIGIT_RECOGNIZER_CNN_MODEL_PATH)) {
+        return DEFAULT_TRAIN_INFO;
+    }
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 784, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 10, 1));
+
+    layer_t *input_layer = layer_input(model_digit, input);
+    layer_t *conv_layer_1 = layer_conv2d(model_digit, 8, 3, 2, 1);
+    layer_t *activation_layer_1 = layer_activation(model_digit, activation_functions_relu);
+    layer_t *conv_layer_2 = layer_conv2d(model_digit, 16, 3, 2, 1);
+    layer_t *activation_layer_2 = layer_activation(model_digit, activation_functions_relu);
+    layer_t *dense_layer = layer_dense(model_digit, output);
+    layer_t *output_layer = layer_output(model_digit, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+
+    // he initialization, filters only see kernel * kernel * channels inputs
+    model_initialize_matrix_normal_distribution(conv_layer_1->layer.conv2d.weights, 0, sqrt(2.0 / conv_layer_1->layer.conv2d.weights.dims[1]));
+    model_initialize_matrix_normal_distribution(conv_layer_2->layer.conv2d.weights, 0, sqrt(2.0 / conv_layer_2->layer.conv2d.weights.dims[1]));
+    model_initialize_matrix_normal_distribution(dense_layer->layer.dense.weights, 0, 0.05);
+
+    nmatrix_free(&input);
+    nmatrix_free(&output);
+
+    return DEFAULT_TRAIN_INFO;
+}
 
 training_info_t nn_XOR(neural_network_model_t *model_xor) {
     model_xor->input_layer = NULL;
@@ -178,9 +233,19 @@ training_info_t nn_XOR(neural_network_model_t *model_xor) {
     training_info.train_size = num_examples;
     training_info.train_x = input_data;
     training_info.train_y = output_data;
+    training_info.train_labels = NULL;
+    training_info.train_pixels = NULL;
     training_info.test_size = 0;
     training_info.test_x = NULL;
     training_info.test_y = NULL;
+    training_info.test_labels = NULL;
+    training_info.test_pixels = NULL;
+    training_info.checkpoint_writer = NULL;
+    training_info.shuffle = false;
+    training_info.train_order = NULL;
+    training_info.resume = false;
+    training_info.async_evaluation = false;
+    training_info.pipeline_stages = 0;
 
     training_info.batch_size = 1;
     training_info.learning_rate = 0.1;
@@ -246,9 +311,19 @@ training_info_t nn_AND(neural_network_model_t *model_and) {
     training_info.train_size = num_examples;
     training_info.train_x = input_data;
     training_info.train_y = output_data;
+    training_info.train_labels = NULL;
+    training_info.train_pixels = NULL;
     training_info.test_size = 0;
     training_info.test_x = NULL;
     training_info.test_y = NULL;
+    training_info.test_labels = NULL;
+    training_info.test_pixels = NULL;
+    training_info.checkpoint_writer = NULL;
+    training_info.shuffle = false;
+    training_info.train_order = NULL;
+    training_info.resume = false;
+    training_info.async_evaluation = false;
+    training_info.pipeline_stages = 0;
 
     training_info.batch_size = 1;
     training_info.learning_rate = 0.1;
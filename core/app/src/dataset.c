@@ -316,12 +316,21 @@ void DataSetRemoveImages(dataset_t *dataset, int from_index, int to_index) {
     images->count -= to_index - from_index;
 }
 
+// same layout as convert_image_to_mymatrix, one byte per pixel, see IMAGE_PIXEL_SCALE and IMAGE_PIXEL_OFFSET
+void convert_image_to_pixels(uint8_t *pixels, Image image) {
+    for (int i = 0; i < image.height; i++) {
+        for (int j = 0; j < image.width; j++) {
+            pixels[j * image.height + i] = GetImageColor(image, j, i).r;
+        }
+    }
+}
+
 void convert_image_to_mymatrix(nmatrix_t* m, Image image) {
     for (int i = 0; i < image.height; i++) {
         for (int j = 0; j < image.width; j++) {
             // mymatrix->matrix[i * image.width + j][0] = 1 - GetImageColor(image, j, i).r / 256.0;
             assert(image.height * image.width == m->n_elements);
-            m->matrix[j * image.height + i] = 1 - GetImageColor(image, j, i).r / 256.0;
+            m->matrix[j * image.height + i] = GetImageColor(image, j, i).r * IMAGE_PIXEL_SCALE + IMAGE_PIXEL_OFFSET;
         }
     }
 }
@@ -343,9 +352,19 @@ void ImageDataSetConvertToTraining(training_info_t *training_info, dataset_t *da
     training_info->train_size = 0;
     training_info->train_x = NULL;
     training_info->train_y = NULL;
+    training_info->train_labels = NULL;
+    training_info->train_pixels = NULL;
     training_info->test_size = 0;
     training_info->test_x = NULL;
     training_info->test_y = NULL;
+    training_info->test_labels = NULL;
+    training_info->test_pixels = NULL;
+    training_info->checkpoint_writer = NULL;
+    training_info->shuffle = false;
+    training_info->train_order = NULL;
+    training_info->resume = false;
+    training_info->async_evaluation = false;
+    training_info->pipeline_stages = 0;
 
     training_info->batch_size = 1;
     training_info->learning_rate = 0.003;
@@ -358,10 +377,8 @@ void ImageDataSetConvertToTraining(training_info_t *training_info, dataset_t *da
     training_info->train_size = ceil(data.count * train_test_split) * num_examples_per_image;
     training_info->test_size = data.count * num_examples_per_image - training_info->train_size;
 
-    training_info->train_x = malloc(training_info->train_size * sizeof(nmatrix_t));
-    training_info->train_y = malloc(training_info->train_size * sizeof(nmatrix_t));
-    training_info->test_x = malloc(training_info->test_size * sizeof(nmatrix_t));
-    training_info->test_y = malloc(training_info->test_size * sizeof(nmatrix_t));
+    training_info->train_labels = malloc(training_info->train_size * sizeof(int));
+    training_info->test_labels = malloc(training_info->test_size * sizeof(int));
 
     struct Example {
         Image image;
@@ -371,7 +388,13 @@ void ImageDataSetConvertToTraining(training_info_t *training_info, dataset_t *da
     // struct Example shuffler[data.count * num_examples_per_image];
     struct Example *shuffler = malloc(sizeof(struct Example) * data.count * num_examples_per_image);
     const int input_size = data.uniform_width * data.uniform_width;
-    const int output_size = data.num_labels;
+
+    // examples are kept as one byte per pixel and only expanded to floats by the input layer
+    training_info->pixels_per_example = input_size;
+    training_info->pixel_scale = IMAGE_PIXEL_SCALE;
+    training_info->pixel_offset = IMAGE_PIXEL_OFFSET;
+    training_info->train_pixels = malloc((size_t) training_info->train_size * input_size);
+    training_info->test_pixels = malloc((size_t) training_info->test_size * input_size);
     
     struct ImageListNode *cur = data.image_list_head;
     struct ImageListNode *nodes[data.count];
@@ -524,19 +547,13 @@ void ImageDataSetConvertToTraining(training_info_t *training_info, dataset_t *da
     }
 
     for (int i = 0; i < training_info->train_size; i++) {
-        training_info->train_x[i] = nmatrix_allocator(SHAPE(2, input_size, 1));
-        training_info->train_y[i] = nmatrix_allocator(SHAPE(2, output_size, 1));
-
-        convert_image_to_mymatrix(&training_info->train_x[i], shuffler[i].image);
-        one_hot_encode_matrix(&training_info->train_y[i], shuffler[i].label);
+        convert_image_to_pixels(training_info->train_pixels + (size_t) i * input_size, shuffler[i].image);
+        training_info->train_labels[i] = shuffler[i].label;
     }
 
     for (int i = 0; i < training_info->test_size; i++) {
-        training_info->test_x[i] = nmatrix_allocator(SHAPE(2, input_size, 1));
-        training_info->test_y[i] = nmatrix_allocator(SHAPE(2, output_size, 1));
-
-        convert_image_to_mymatrix(&training_info->test_x[i], shuffler[i + training_info->train_size].image);
-        one_hot_encode_matrix(&training_info->test_y[i], shuffler[i + training_info->train_size].label);
+        convert_image_to_pixels(training_info->test_pixels + (size_t) i * input_size, shuffler[i + training_info->train_size].image);
+        training_info->test_labels[i] = shuffler[i + training_info->train_size].label;
     }
 
     for (int i = 0; i < data.count * num_examples_per_image; i++) {
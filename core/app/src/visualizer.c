@@ -269,11 +269,7 @@ static void* test_run(void *vargp) {
 static layer_t *get_layer(int layer_index) {
     assert(layer_index < vis_state.vis_args.model->num_layers);
 
-    layer_t *cur = vis_state.vis_args.model->input_layer;
-    for (int i = 0; i < layer_index; i++) {
-        cur = cur->next;
-    }
-    return cur;
+    return vis_state.vis_args.model->ops[layer_index].layer;
 }
 
 static Vector2 get_node_position(int layer_index, int r) {
@@ -353,6 +349,9 @@ static void DrawLayerEdges(int layer_index, layer_t *layer, layer_t *prev) {
                 }
             }
         }
+    } else if (layer->type == CONV2D || layer->type == POOL2D || layer->type == DENSE_LOWRANK) {
+        // filters and pooling windows are shared across the whole image, there are no per neuron edges to draw
+        // and a low rank layer's weights only exist as the product of its factors
     } else { // Activation or Output, one to one connections
         assert(this_neurons.n_elements == prev_neurons.n_elements);
         for (int i = 0; i < prev_neurons.n_elements; i++) {
@@ -411,6 +410,10 @@ static void DrawLayerInformation(int layer_index, layer_t *layer) {
     DrawOutlinedCenteredText(get_layer_name(layer), layer_x, layer_name_y, LAYER_DISPLAY_FONTSIZE, BLACK, 0, BLACK);
     if (layer->type == ACTIVATION) {
         DrawOutlinedCenteredText(get_activation_function_name(&layer->layer.activation), layer_x, layer_function_name_y, layer_info_font_size, BLACK, 0, BLACK);
+    } else if (layer->type == DENSE && layer->layer.dense.activation != DENSE_ACTIVATION_NONE) {
+        DrawOutlinedCenteredText(get_dense_activation_name(&layer->layer.dense), layer_x, layer_function_name_y, layer_info_font_size, BLACK, 0, BLACK);
+    } else if (layer->type == DENSE_LOWRANK) {
+        DrawOutlinedCenteredText(TextFormat("Rank %d", layer->layer.dense_lowrank.rank), layer_x, layer_function_name_y, layer_info_font_size, BLACK, 0, BLACK);
     } else if (layer->type == OUTPUT) {
         DrawOutlinedCenteredText(get_output_function_name(&layer->layer.output), layer_x, layer_function_name_y, layer_info_font_size, BLACK, 0, BLACK);
         int gap = (3 * LAYER_DISPLAY_FONTSIZE) / 2;
@@ -571,7 +574,10 @@ static nmatrix_t set_training_set_display(bool is_train, int loc) {
     neural_network_model_t *model = vis_state.vis_args.training_info->model;
     int *cur = &vis_state.current_example;
     *cur = loc;
-    nmatrix_memcpy(&model->input_layer->layer.input.input_values, is_train ? &t_info->train_x[*cur] : &t_info->test_x[*cur]);
+    nmatrix_t input = training_info_load_input(t_info, is_train, *cur);
+    if (input.matrix != model->input_layer->layer.input.input_values.matrix) {
+        nmatrix_memcpy(&model->input_layer->layer.input.input_values, &input);
+    }
     return model_calculate(model);
 }
 
@@ -591,6 +597,15 @@ static nmatrix_t move_training_set_display(bool is_train, int move) {
     return set_training_set_display(is_train, *cur);
 }
 
+// class index of an example, datasets carry either labels or one hot matrices
+static int expected_label(training_info_t *t_info, bool is_train, int example_i) {
+    int *labels = is_train ? t_info->train_labels : t_info->test_labels;
+    if (labels != NULL) {
+        return labels[example_i];
+    }
+    return unpack_one_hot_encoded(is_train ? t_info->train_y[example_i] : t_info->test_y[example_i]);
+}
+
 static void DrawTrainingExamplesDisplay(void) {
     if (vis_state.vis_args.training_info->train_size == 0 || vis_state.vis_args.training_info->test_size == 0) {
         return;
@@ -649,7 +664,6 @@ static void DrawTrainingExamplesDisplay(void) {
 
         training_info_t *t_info = vis_state.vis_args.training_info;
         bool is_train = vis_state.show_training;
-        nmatrix_t *correct = is_train ? t_info->train_y : t_info->test_y;
         int *cur = &vis_state.current_example;
         int max = is_train ? t_info->train_size : t_info->test_size;
         const char* display_name = is_train ? "Train" : "Test";
@@ -658,7 +672,7 @@ static void DrawTrainingExamplesDisplay(void) {
             nmatrix_t output;
             do {
                 output = move_training_set_display(is_train, -1);
-            } while (nmatrix_equal(&output, &correct[*cur]) && *cur > 0 && *cur < max - 1);
+            } while (nmatrix_argmax(&output) == expected_label(t_info, is_train, *cur) && *cur > 0 && *cur < max - 1);
         }
         if (GuiButton(prev_button_r, "<")) {
             move_training_set_display(is_train, -1);
@@ -672,11 +686,11 @@ static void DrawTrainingExamplesDisplay(void) {
             nmatrix_t output;
             do {
                 output = move_training_set_display(is_train, 1);
-            } while (nmatrix_equal(&output, &correct[*cur]) && *cur > 0 && *cur < max - 1);
+            } while (nmatrix_argmax(&output) == expected_label(t_info, is_train, *cur) && *cur > 0 && *cur < max - 1);
         }
 
         DrawText(TextFormat("Displaying Example: %d", *cur), prev_incorrect_button_r.x, prev_incorrect_button_r.y + 20, 16, BLACK);
-        DrawText(TextFormat("Expected Label: %s", vis_state.vis_args.output_labels[unpack_one_hot_encoded(correct[*cur])]),
+        DrawText(TextFormat("Expected Label: %s", vis_state.vis_args.output_labels[expected_label(t_info, is_train, *cur)]),
                 prev_incorrect_button_r.x, prev_incorrect_button_r.y + 40, 16, BLACK);
     }
 }
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+#include <model/inference.h>
+#include <util/thread_pool.h>
+
+// examples per batched forward pass when the options leave it at 0
+#define EVALUATE_DEFAULT_BATCH 64
+
+typedef struct Evaluate_Options {
+    int batch_size;       // examples per batched forward pass, EVALUATE_DEFAULT_BATCH when 0
+    int n_threads;        // threads of the pool created for the call, one per core when 0, ignored with a pool
+    thread_pool_t *pool;  // runs the batches on an existing pool instead, NULL to create one
+    const int *labels;    // class index targets used instead of y when set
+} evaluate_options_t;
+
+// loss, accuracy and confusion matrix of a model over a set of examples. classes are the argmax of the output, or
+// output >= 0.5 for models with a single output
+typedef struct Evaluation_Stats {
+    unsigned int n_examples;
+    float loss;          // average of the output layer's loss
+    float accuracy;
+    int n_correct;       // examples the training loop would count as passed
+    int n_classes;
+    unsigned int *confusion; // n_classes x n_classes, row is the expected class and column the predicted one
+} evaluation_stats_t;
+
+bool model_evaluate_supported(neural_network_model_t *model);
+evaluation_stats_t model_evaluate(neural_network_model_t *model, nmatrix_t *x, nmatrix_t *y, unsigned int n_examples,
+        const evaluate_options_t *options);
+evaluation_stats_t model_evaluate_test_set(training_info_t *training_info, const evaluate_options_t *options);
+void evaluation_stats_free(evaluation_stats_t *stats);
+
+typedef struct Async_Evaluator async_evaluator_t;
+
+// test set stats of the weights at the end of epoch, with the train stats of that epoch
+typedef struct Evaluation_Result {
+    unsigned int epoch;
+    float train_accuracy;
+    float avg_train_error;
+    float test_accuracy;
+    float avg_test_error;
+    int passed_test;
+} evaluation_result_t;
+
+async_evaluator_t* async_evaluator_create(training_info_t *training_info);
+void async_evaluator_submit(async_evaluator_t *evaluator, neural_network_model_t *model, unsigned int epoch,
+        float train_accuracy, float avg_train_error);
+bool async_evaluator_poll(async_evaluator_t *evaluator, evaluation_result_t *result);
+bool async_evaluator_wait(async_evaluator_t *evaluator, evaluation_result_t *result);
+void async_evaluator_free(async_evaluator_t *evaluator);
+
+#endif // EVALUATE_H
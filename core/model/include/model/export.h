@@ -0,0 +1,13 @@
+#pragma once
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <model/inference.h>
+
+// name of the prediction function in exported sources, declare it as
+// void exported_model_predict(const float *input, float *output);
+#define EXPORT_PREDICT_FUNCTION "exported_model_predict"
+
+bool model_export_c(neural_network_model_t *model, const char *file_path);
+
+#endif // EXPORT_H
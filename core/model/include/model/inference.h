@@ -0,0 +1,89 @@
+#pragma once
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <model/model.h>
+
+// activation applied to a dense op's output before it is written back
+typedef enum Inference_Activation {
+    INFERENCE_ACTIVATION_NONE,
+    INFERENCE_ACTIVATION_SIGMOID,
+    INFERENCE_ACTIVATION_RELU,
+    INFERENCE_ACTIVATION_SOFTMAX,
+    INFERENCE_ACTIVATION_TANH,
+} inference_activation_t;
+
+typedef struct Inference_Op {
+    enum {
+        INFERENCE_DENSE,        // y = act(W.x + b)
+        INFERENCE_DENSE_SPARSE, // y = act(W.x + b) over the kept weights of a pruned layer in compressed sparse rows
+        INFERENCE_CONV2D,       // y = act(W.im2col(x) + b), bias per output channel
+        INFERENCE_MAXPOOL,      // y = max over each kernel x kernel window of every channel
+        INFERENCE_AVGPOOL,      // y = mean over each kernel x kernel window of every channel
+        INFERENCE_ACTIVATION,   // y = act(x), for activations that do not directly follow a dense layer
+        INFERENCE_SCALE,        // y = scale * x, left over from dropout layers that could not be folded
+    } type;
+    inference_activation_t activation;
+    int n_inputs;
+    int n_outputs;
+    float scale;
+
+    // dense: n_outputs x n_inputs and n_outputs x 1
+    // conv2d: out_channels x (in_channels * kernel * kernel) and out_channels x 1
+    // views into the plan's parameter slab
+    const float *weights;
+    const float *bias;
+    int n_weights;
+    int n_bias;
+
+    // dense sparse: weights holds the n_weights kept values row by row, row r's are
+    // [sparse_row_start[r], sparse_row_start[r + 1]) with their columns in sparse_columns. views into the plan's index slab
+    const int *sparse_columns;
+    const int *sparse_row_start;
+
+    // conv2d and pooling geometry, pooling windows are kernel x kernel with a stride of kernel
+    int in_channels, in_height, in_width;
+    int out_channels, out_height, out_width;
+    int kernel, stride, padding;
+} inference_op_t;
+
+// stripped down, immutable execution plan of a trained model that can only make predictions.
+// holds no gradients or backprop scratch, just the weights and two activation buffers that ops
+// ping pong between, each sized to the widest layer, plus one im2col buffer shared by all convolutions
+typedef struct Inference_Model {
+    int num_ops;
+    inference_op_t *ops;
+    int n_inputs;
+    int n_outputs;
+
+    float *parameters;
+    int n_parameters;
+    int *indices;
+    int n_indices;
+
+    float *buffers[2];
+    int buffer_size;
+
+    float *columns;
+    int columns_size;
+} inference_model_t;
+
+// buffers to run a plan on a batch of examples at a time, the plan is only read so every thread can share it
+// with its own batch buffers. examples are stored as rows, inputs is batch_size x n_inputs and filled by the caller
+typedef struct Inference_Batch {
+    int batch_size;
+    float *inputs;
+    float *buffers[2]; // batch_size x buffer_size, ops ping pong between them like inference_predict
+    float *columns;
+} inference_batch_t;
+
+inference_model_t model_compile_inference(neural_network_model_t *model);
+nmatrix_t inference_predict(inference_model_t *plan, nmatrix_t input, nmatrix_t output);
+void inference_run_op(const inference_op_t *op, const float *src, float *dst, float *scratch);
+void inference_activate(inference_activation_t activation, float *values, int n);
+void inference_free(inference_model_t *plan);
+inference_batch_t inference_batch_create(inference_model_t *plan, int batch_size);
+const float* inference_predict_batch(inference_model_t *plan, inference_batch_t *batch, int n_examples);
+void inference_batch_free(inference_batch_t *batch);
+
+#endif // INFERENCE_H
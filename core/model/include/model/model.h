@@ -3,6 +3,8 @@
 #define MODEL_H
 
 #include <util/matrix.h>
+#include <util/math.h>
+#include <util/thread_pool.h>
 
 #include <assert.h>
 #include <memory.h>
@@ -20,10 +22,8 @@
  * add momentum (remembers previous gradients)
  * layer/batch normalization?
  * weights should probably be normalized
- * save model to file
- * load model from file  *so we can pretrain models
  * batch/mini batch, full gradient descent (apparently we are using stochastic gradient descent)
- * add more variety of layers (convolution, pooling, reshaping)
+ * add more variety of layers (reshaping)
  * add variable learning rates for each layer support
  * matrix broadcasting??? support for multi-dimension matrices?????
  *
@@ -48,46 +48,76 @@
 typedef struct Layer layer_t;
 typedef struct NeuralNetworkModel neural_network_model_t;
 typedef struct Input_Layer input_layer_t;
+typedef struct Checkpoint_Writer checkpoint_writer_t;
 typedef struct Dense_Layer dense_layer_t;
+typedef struct Dense_LowRank_Layer dense_lowrank_layer_t;
+typedef struct Conv2D_Layer conv2d_layer_t;
+typedef struct Pool2D_Layer pool2d_layer_t;
 typedef struct Activation_Layer activation_layer_t;
 typedef struct Output_Layer output_layer_t;
 
 typedef struct Layer_Function {
-    nmatrix_t (*feed_forward)(layer_t *this, nmatrix_t input);
-    nmatrix_t (*back_propagation)(layer_t *this, nmatrix_t input_gradient, float learning_rate);
+    nmatrix_t (*feed_forward)(layer_t *layer, nmatrix_t input);
+    nmatrix_t (*back_propagation)(layer_t *layer, nmatrix_t input_gradient, float learning_rate);
 } layer_function_t;
 
 extern const layer_function_t input_functions;
 extern const layer_function_t dense_functions;
+extern const layer_function_t dense_sparse_functions;
+extern const layer_function_t dense_lowrank_functions;
+extern const layer_function_t conv2d_functions;
+extern const layer_function_t maxpool_functions;
+extern const layer_function_t avgpool_functions;
 extern const layer_function_t dropout_functions;
 extern const layer_function_t activation_functions_sigmoid;
 extern const layer_function_t activation_functions_relu;
 extern const layer_function_t activation_functions_softmax;
 extern const layer_function_t output_functions_meansquared;
 extern const layer_function_t output_functions_crossentropy;
+extern const layer_function_t output_functions_softmax_crossentropy;
 
 // first layer of the model
 typedef struct Input_Layer {
     layer_function_t functions;
     nmatrix_t input_values;
+    // indices of the nonzero input values of the last forward pass in increasing order, a dense layer
+    // right after the input only multiplies and updates those columns when there are few of them
+    int *active_indices;
+    int n_active;
     neural_network_model_t *model;
 } input_layer_t;
 
+// most a dense layer's inputs can be nonzero for it to take the indexed path, past this the contiguous
+// loops over every column are faster than the gathers
+#define INPUT_SPARSE_DENSITY 0.3
+
+// activation a dense layer applies to W.X + b before writing its neurons, see layer_dense_activation
+typedef enum Dense_Activation {
+    DENSE_ACTIVATION_NONE,
+    DENSE_ACTIVATION_RELU,
+    DENSE_ACTIVATION_SIGMOID,
+    DENSE_ACTIVATION_TANH,
+} dense_activation_t;
+
 // fully connected inner layer of the model
 // n: number of neurons in this layer
 // m: number of neurons in the previous layer
 typedef struct Dense_Layer {
     layer_function_t functions;
-    // n x 1, this layer's neurons which contain the "output" values
+    // n x 1, this layer's neurons which contain the "output" values, act(W.X + b)
     nmatrix_t activation_values;
 
+    // fused activation, its derivative wrt W.X + b is cached by the forward pass (n x 1)
+    // so back propagation does not recompute any exp/tanh
+    dense_activation_t activation;
+    nmatrix_t activation_derivative;
+
     // W.X + b = Y
     // n x m
     // connecting the previous layer to this layer
     // the edges are the weights
+    // weights, bias and their gradient sums are views into the model's parameter arena
     nmatrix_t weights;
-    nmatrix_t transposed_weights; // to not have to reallocate memory
-    nmatrix_t transposed_inputs;
 
     // n x 1
     nmatrix_t bias;
@@ -95,18 +125,123 @@ typedef struct Dense_Layer {
     // dE/dX = W.T * dE/dY
     // m x 1
     nmatrix_t d_cost_wrt_input;
-    // same dimensions as weight and bias matrices
-    nmatrix_t d_cost_wrt_weight;
-    nmatrix_t d_cost_wrt_bias;
 
+    // same dimensions as weight and bias matrices, back propagation adds lr * dE/dW straight into them
     nmatrix_t d_cost_wrt_weight_sum;
     nmatrix_t d_cost_wrt_bias_sum;
+
+    // n x m, NULL until the layer is pruned. 1 for kept weights, pruned weights are held at exactly 0
+    uint8_t *mask;
+    // column of every kept weight, row r's are sparse_columns[sparse_row_start[r]..sparse_row_start[r + 1]).
+    // the values stay in weights, past DENSE_SPARSE_THRESHOLD the layer switches to dense_sparse_functions
+    // which only visit these
+    int *sparse_columns;
+    int *sparse_row_start;
+    int n_nonzero;
+
+    // dE/dW and dE/db of the last backward pass while they are accumulated on the model's pool, NULL until then
+    struct Dense_Gradient_Task *gradient_task;
     neural_network_model_t *model;
 } dense_layer_t;
 
+// fraction of a pruned dense layer's weights that have to be 0 for it to switch to the compressed sparse row
+// kernels, below this the contiguous loops over every weight are faster than the gathers
+#define DENSE_SPARSE_THRESHOLD 0.7
+
+// fewest weights a dense layer needs for its weight gradient to run as a task on the model's pool, smaller layers
+// are done before a worker could pick the task up
+#define DENSE_PARALLEL_MIN_WEIGHTS 16384
+
+// dense layer whose n x m weights are stored as the product of two thin factors W = U.V of rank r,
+// Y = act(U.(V.X) + b) costs r * (n + m) multiply adds and parameters instead of n * m
+typedef struct Dense_LowRank_Layer {
+    layer_function_t functions;
+    // n x 1, act(U.V.X + b)
+    nmatrix_t activation_values;
+    dense_activation_t activation;
+    nmatrix_t activation_derivative;
+
+    // n x r, r x m and n x 1
+    // factors, bias and their gradient sums are views into the model's parameter arena
+    nmatrix_t u;
+    nmatrix_t v;
+    nmatrix_t bias;
+
+    // r x 1, V.X of the forward pass kept for the backward pass, and its gradient
+    nmatrix_t projection;
+    nmatrix_t d_cost_wrt_projection;
+
+    // m x 1
+    nmatrix_t d_cost_wrt_input;
+
+    nmatrix_t d_cost_wrt_u_sum;
+    nmatrix_t d_cost_wrt_v_sum;
+    nmatrix_t d_cost_wrt_bias_sum;
+    int rank;
+    neural_network_model_t *model;
+} dense_lowrank_layer_t;
+
+// 2D convolution over a C x H x W image, lowered to one matrix multiply per example with im2col
+// neurons are stored flattened as (out_channels * out_height * out_width) x 1, channel major, so
+// dense and activation layers can follow without a reshape
+typedef struct Conv2D_Layer {
+    layer_function_t functions;
+    // (out_channels * out_height * out_width) x 1
+    nmatrix_t output;
+
+    // out_channels x (in_channels * kernel * kernel), one row per filter
+    // out_channels x 1, one bias per filter shared over the whole image
+    // weights, bias and their gradient sums are views into the model's parameter arena
+    nmatrix_t weights;
+    nmatrix_t bias;
+
+    // (in_channels * kernel * kernel) x (out_height * out_width), the unrolled input patches
+    // filled by the forward pass and reused by the backward pass, allocated once with the layer
+    nmatrix_t columns;
+    nmatrix_t d_cost_wrt_columns;
+
+    // (in_channels * in_height * in_width) x 1
+    nmatrix_t d_cost_wrt_input;
+
+    nmatrix_t d_cost_wrt_weight_sum;
+    nmatrix_t d_cost_wrt_bias_sum;
+
+    int in_channels, in_height, in_width;
+    int out_channels, out_height, out_width;
+    int kernel, stride, padding;
+    neural_network_model_t *model;
+} conv2d_layer_t;
+
+// max or average pooling over non overlapping size x size windows of each channel
+// input and output are flattened images like the convolution layer's
+typedef struct Pool2D_Layer {
+    layer_function_t functions;
+    enum {
+        POOL_MAX,
+        POOL_AVERAGE,
+    } mode;
+    // (channels * out_height * out_width) x 1
+    nmatrix_t output;
+    // (channels * in_height * in_width) x 1
+    nmatrix_t d_cost_wrt_input;
+
+    // max pooling only, flat input index of every output's max so back propagation only touches the outputs.
+    // captured by training forward passes, inference skips it
+    int *indices;
+    bool has_indices;
+
+    int channels, in_height, in_width;
+    int out_height, out_width;
+    int size;
+    neural_network_model_t *model;
+} pool2d_layer_t;
+
 typedef struct Dropout_Layer {
     layer_function_t functions;
     nmatrix_t output;
+    // 1 for every unit the last training forward pass kept, back propagation only passes their gradient
+    uint8_t *mask;
+    bool has_mask;
 
     nmatrix_t d_cost_wrt_input;
     float dropout;
@@ -126,13 +261,15 @@ typedef struct Activation_Layer {
 // final layer, compute the cost and derivatives to initiate backprop
 typedef struct Output_Layer {
     layer_function_t functions;
-    nmatrix_t (*make_guess)(layer_t *this, nmatrix_t output);
+    nmatrix_t (*make_guess)(layer_t *layer, nmatrix_t output);
     nmatrix_t output_values;
     // dE/dX = W.T * dE/dY
     // m x 1
     nmatrix_t d_cost_wrt_input;
     nmatrix_t guess;
-    float (*loss)(layer_t *this, nmatrix_t expected_output);
+    float (*loss)(layer_t *layer, nmatrix_t expected_output);
+    // log(sum(exp(logits))) of the last forward pass, only kept by the fused softmax cross entropy output
+    float log_sum_exp;
     neural_network_model_t *model;
 } output_layer_t;
 
@@ -143,12 +280,18 @@ typedef struct Layer {
         DENSE,
         DROPOUT,
         ACTIVATION,
-        OUTPUT
+        OUTPUT,
+        CONV2D,
+        POOL2D,
+        DENSE_LOWRANK,
     } type;
 
     union {
         input_layer_t input;
         dense_layer_t dense;
+        dense_lowrank_layer_t dense_lowrank;
+        conv2d_layer_t conv2d;
+        pool2d_layer_t pool2d;
         dropout_layer_t dropout;
         activation_layer_t activation;
         output_layer_t output;
@@ -158,8 +301,72 @@ typedef struct Layer {
     layer_t *next;
     layer_t *prev;
     neural_network_model_t *model;
+
+    // false once frozen, back propagation leaves the layer's parameters untouched
+    bool requires_grad;
+    // whether back propagation has to produce dE/dX, false when no trainable layer comes before this one
+    bool needs_input_gradient;
 } layer_t;
 
+// what an op record executes. the built in layer functions get their own kind so the interpreter can
+// call them directly, anything else a user plugs in goes through the layer's function pointers
+typedef enum Layer_Op_Kind {
+    OP_INPUT,
+    OP_DENSE,
+    OP_DENSE_SPARSE,
+    OP_DENSE_LOWRANK,
+    OP_CONV2D,
+    OP_MAXPOOL,
+    OP_AVGPOOL,
+    OP_DROPOUT,
+    OP_ACTIVATION_SIGMOID,
+    OP_ACTIVATION_RELU,
+    OP_ACTIVATION_SOFTMAX,
+    OP_ACTIVATION_CUSTOM,
+    OP_OUTPUT_MEAN_SQUARED,
+    OP_OUTPUT_CROSS_ENTROPY,
+    OP_OUTPUT_SOFTMAX_CROSS_ENTROPY,
+    OP_OUTPUT_CUSTOM,
+} layer_op_kind_t;
+
+// one entry of the model's flat execution array, model->ops[i] is the i-th layer from the input.
+// only ever append new fields so code enumerating layers (the visualizer) keeps working
+typedef struct Layer_Op {
+    layer_op_kind_t kind;
+    layer_t *layer;
+} layer_op_t;
+
+// most parameter tensors a single layer can own
+#define LAYER_MAX_PARAMETERS 4
+
+// every trainable parameter of the model laid out back to back in one aligned slab, with a
+// matching slab for the accumulated gradients. each tensor starts on a NMATRIX_ALIGNMENT boundary
+typedef struct Parameter_Arena {
+    float *parameters;
+    float *gradients;
+    unsigned int n_parameters; // floats in each slab, including alignment padding
+
+    // set when parameters point into a memory mapped checkpoint instead of an owned slab
+    void *mapping;
+    size_t mapping_size;
+} parameter_arena_t;
+
+// how long a layer buffer has to hold its value during a training step, see model_plan_memory
+typedef enum Buffer_Lifetime {
+    BUFFER_FORWARD_OUTPUT,  // written by the layer's forward pass, read up to the next layer's backward pass
+    BUFFER_INPUT_GRADIENT,  // written by the layer's backward pass, read by the previous layer's backward pass
+    BUFFER_SAVED,           // written by the layer's forward pass, read by its own backward pass
+    BUFFER_SCRATCH,         // only used within the layer's own backward pass
+} buffer_lifetime_t;
+
+typedef struct Layer_Buffer {
+    nmatrix_t *matrix;
+    buffer_lifetime_t lifetime;
+} layer_buffer_t;
+
+// most plannable buffers a single layer can own
+#define LAYER_MAX_BUFFERS 5
+
 // nn model
 // todo store more useful information of the model like
 //  - training accuracy, avg error, epoch/iterations count
@@ -168,17 +375,37 @@ typedef struct NeuralNetworkModel {
     unsigned int num_layers;
     layer_t *input_layer; // first layer
     layer_t *output_layer; // last layer
+    layer_op_t *ops; // num_layers records in execution order, mirrors the linked list
+    unsigned int first_trainable_layer; // back propagation stops here, num_layers if nothing is trainable
+    parameter_arena_t parameters;
+
+    // activation and gradient buffers packed by model_plan_memory, NULL until planned
+    float *workspace;
+    unsigned int workspace_size;
+
+    // drives dropout masks and the training order, seeded with MODEL_DEFAULT_SEED when the first layer is added
+    // unless it was seeded before. part of the training state, so a resumed run draws the same numbers
+    random_state_t random;
+
+    // back propagation hands the weight gradients of large dense layers to this pool and carries on with dE/dX,
+    // so the previous layer's backward pass does not wait for them, and the training loop's test pass runs its
+    // batches on it. NULL computes everything on the calling thread, the pool belongs to the caller
+    thread_pool_t *pool;
 
     // info data
     bool is_training;
     int batch_size;
 } neural_network_model_t;
 
+#define MODEL_DEFAULT_SEED 2304093940u
+
 typedef struct TrainingInfo {
     neural_network_model_t *model;
     unsigned int train_size;
     nmatrix_t *train_x; // stored as an array of columns
     nmatrix_t *train_y;
+    int *train_labels; // class index of each example, used instead of train_y when set
+    uint8_t *train_pixels; // compact inputs used instead of train_x when set, see pixels_per_example
     unsigned int batch_size;
     float learning_rate;
 
@@ -189,6 +416,30 @@ typedef struct TrainingInfo {
     unsigned int test_size;
     nmatrix_t *test_x;
     nmatrix_t *test_y;
+    int *test_labels;
+    uint8_t *test_pixels;
+
+    // compact inputs are pixels_per_example bytes per example back to back, the input layer expands
+    // each byte to value * pixel_scale + pixel_offset when the example is loaded
+    unsigned int pixels_per_example;
+    float pixel_scale;
+    float pixel_offset;
+
+    // writes periodic checkpoints in the background while model_train_info runs, none when NULL
+    checkpoint_writer_t *checkpoint_writer;
+
+    // reshuffle the training examples every epoch, train_order is the current permutation (allocated on the
+    // first shuffle, NULL trains in stored order)
+    bool shuffle;
+    uint32_t *train_order;
+    // set by training_state_load, model_train_info then continues from epoch and train_index instead of starting over
+    bool resume;
+    // evaluate the test set on a separate thread against the weights of each epoch while the next one trains,
+    // see evaluate.h. early stopping acts on a result as soon as the training loop sees it
+    bool async_evaluation;
+    // trains consecutive groups of layers on this many threads with the examples of a batch streaming through them,
+    // see pipeline.h. 0 or 1 trains on the calling thread
+    unsigned int pipeline_stages;
 
     // stats
     bool in_progress;
@@ -206,31 +457,75 @@ typedef struct TrainingInfo {
     // for data viz
 } training_info_t;
 
-nmatrix_t output_make_guess_one_hot_encoded(layer_t *this, nmatrix_t output);
-nmatrix_t output_make_guess_passforward(layer_t *this, nmatrix_t output);
-nmatrix_t output_make_guess_round(layer_t *this, nmatrix_t output);
-nmatrix_t output_make_guess_softmax(layer_t *this, nmatrix_t output);
+nmatrix_t output_make_guess_one_hot_encoded(layer_t *layer, nmatrix_t output);
+nmatrix_t output_make_guess_passforward(layer_t *layer, nmatrix_t output);
+nmatrix_t output_make_guess_round(layer_t *layer, nmatrix_t output);
+nmatrix_t output_make_guess_softmax(layer_t *layer, nmatrix_t output);
+
+float output_cost_mean_squared(layer_t *layer, nmatrix_t expected_output);
+float output_cost_categorical_cross_entropy(layer_t *layer, nmatrix_t expected_output);
+float output_cost_softmax_cross_entropy(layer_t *layer, nmatrix_t expected_output);
+// columns of the batch output_softmax_cross_entropy_batched keeps the max and sum of at once
+#define SOFTMAX_BATCH_BLOCK 64
+float output_softmax_cross_entropy_batched(nmatrix_t *logits, nmatrix_t *expected, nmatrix_t *probabilities, nmatrix_t *gradient);
 
-float output_cost_mean_squared(layer_t *this, nmatrix_t expected_output);
-float output_cost_categorical_cross_entropy(layer_t *this, nmatrix_t expected_output);
+// class index targets, same as the one hot versions without building the target matrix
+nmatrix_t output_back_propagation_label(layer_t *layer, int label, float learning_rate);
+float output_cost_label(layer_t *layer, int label);
 
 // frees allocated memory for the layer
 void layer_free(layer_t *layer);
 nmatrix_t layer_get_neurons(layer_t *layer);
+bool layer_get_image_shape(layer_t *layer, int *channels, int *height, int *width);
+int layer_get_parameters(layer_t *layer, nmatrix_t **parameters, nmatrix_t **gradients);
+int layer_get_buffers(layer_t *layer, layer_buffer_t *buffers);
+layer_op_kind_t layer_get_op_kind(layer_t *layer);
+void layer_wait_gradients(layer_t *layer);
+nmatrix_t layer_op_feed_forward(layer_op_t *op, nmatrix_t input);
+nmatrix_t layer_op_back_propagation(layer_op_t *op, nmatrix_t d_cost_wrt_output, float learning_rate);
 
 void model_free(neural_network_model_t *model);
 void model_add_layer(neural_network_model_t *model, layer_t *layer);
+void model_bind_parameters(neural_network_model_t *model);
+void layer_freeze(layer_t *layer);
+void layer_unfreeze(layer_t *layer);
+void model_zero_gradients(neural_network_model_t *model);
+unsigned int model_plan_memory(neural_network_model_t *model);
+
+// binary checkpoints, see checkpoint.c for the file layout
+bool model_save(neural_network_model_t *model, const char *file_path);
+bool model_load(neural_network_model_t *model, const char *file_path);
+void model_unmap_parameters(parameter_arena_t *arena);
+bool training_state_save(training_info_t *training_info, const char *file_path);
+bool training_state_load(training_info_t *training_info, const char *file_path);
+checkpoint_writer_t* checkpoint_writer_create(neural_network_model_t *model, const char *file_path,
+        unsigned int every_epochs, float every_seconds);
+void checkpoint_writer_snapshot(checkpoint_writer_t *writer, training_info_t *training_info);
+void checkpoint_writer_step(checkpoint_writer_t *writer, training_info_t *training_info);
+bool checkpoint_writer_wait(checkpoint_writer_t *writer);
+unsigned int checkpoint_writer_written(checkpoint_writer_t *writer);
+void checkpoint_writer_free(checkpoint_writer_t *writer);
 
 // adds an layers to the model
 // todo in future, specify dimensions instead of supply matrix to be then copied
 layer_t* layer_input(neural_network_model_t *model, nmatrix_t input);
 layer_t* layer_dense(neural_network_model_t *model, nmatrix_t neurons);
+layer_t* layer_dense_activation(neural_network_model_t *model, nmatrix_t neurons, dense_activation_t activation);
+layer_t* layer_dense_lowrank(neural_network_model_t *model, nmatrix_t neurons, int rank, dense_activation_t activation);
+void layer_dense_lowrank_factorize(layer_t *lowrank, layer_t *dense);
+void layer_dense_prune(layer_t *layer, float sparsity);
+void layer_dense_set_mask(layer_t *layer, uint8_t *mask);
+void model_prune(neural_network_model_t *model, float sparsity);
+layer_t* layer_conv2d(neural_network_model_t *model, int channels, int kernel, int stride, int padding);
+layer_t* layer_maxpool(neural_network_model_t *model, int size);
+layer_t* layer_avgpool(neural_network_model_t *model, int size);
 layer_t* layer_dropout(neural_network_model_t *model, float dropout);
 layer_t* layer_activation(neural_network_model_t *model, layer_function_t functions);
 layer_t* layer_output(neural_network_model_t *model, nmatrix_t (*make_guess)(layer_t*, nmatrix_t), layer_function_t functions, float (*loss)(layer_t*, nmatrix_t));
 
 char* get_layer_name(layer_t *layer);
 char* get_activation_function_name(activation_layer_t *layer);
+char* get_dense_activation_name(dense_layer_t *layer);
 char* get_output_function_name(output_layer_t *layer);
 char* get_output_guess_function_name(output_layer_t *layer);
 nmatrix_t layer_get_neurons(layer_t *layer);
@@ -239,15 +534,19 @@ nmatrix_t model_predict(neural_network_model_t *model, nmatrix_t input,
                nmatrix_t output);
 
 void model_initialize_matrix_normal_distribution(nmatrix_t model, float mean, float standard_deviation);
+void model_initialize_matrix_normal_distribution_seeded(nmatrix_t matrix, float mean, float standard_deviation, random_state_t *random);
 void model_back_propagate(neural_network_model_t *model, nmatrix_t expected_output, float learning_rate);
+void model_back_propagate_label(neural_network_model_t *model, int label, float learning_rate);
 void model_gradient_descent(neural_network_model_t *model);
 float model_train(neural_network_model_t *model, nmatrix_t *inputs, nmatrix_t *expected_outputs, unsigned int num_examples, float learning_rate);
 void model_test(neural_network_model_t *model, nmatrix_t *inputs, nmatrix_t *expected_outputs, unsigned int num_tests);
 nmatrix_t model_calculate(neural_network_model_t *model);
 
 void training_info_free(training_info_t *training_info);
+nmatrix_t training_info_load_input(training_info_t *training_info, bool train, unsigned int example_i);
 
 void model_train_info(training_info_t *training_info);
+void model_train_pruned(training_info_t *training_info, float target_sparsity, unsigned int n_steps);
 void model_test_info(training_info_t *training_info);
 
 int unpack_one_hot_encoded(nmatrix_t one_hot_encoded);
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <model/model.h>
+
+// examples timed per layer when a training run picks its stage boundaries
+#define PIPELINE_MEASURE_EXAMPLES 8
+
+typedef struct Pipeline pipeline_t;
+
+bool pipeline_supported(neural_network_model_t *model);
+void pipeline_measure_layer_costs(training_info_t *training_info, unsigned int n_examples, double *costs);
+int pipeline_partition(const double *costs, int n_layers, int n_stages, int *stage_first);
+int pipeline_plan(training_info_t *training_info, int n_stages, int *stage_first, bool print);
+
+pipeline_t* pipeline_create(training_info_t *training_info, int n_stages, const int *stage_first);
+void pipeline_push(pipeline_t *pipeline, unsigned int example_i);
+void pipeline_flush(pipeline_t *pipeline, float *cost_sum, int *n_correct);
+void pipeline_free(pipeline_t *pipeline);
+
+#endif // PIPELINE_H
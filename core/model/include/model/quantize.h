@@ -0,0 +1,54 @@
+#pragma once
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <model/inference.h>
+
+// dense op with int8 weights, q_w = round(w / weight_scale) per output row, and int8 inputs
+// y = act(weight_scale[r] * input_scale * sum(q_w * q_x) + b), requantized to int8 with output_scale
+// unless it is the last op, which writes floats
+typedef struct Quantized_Op {
+    inference_activation_t activation;
+    int n_inputs;
+    int n_outputs;
+
+    // n_outputs x n_inputs, views into the plan's weight slab
+    const int8_t *weights;
+    // n_outputs, weight_scale[r] * input_scale folded together, and the float bias
+    // views into the plan's parameter slab
+    const float *scales;
+    const float *bias;
+
+    // 1 / scale of the int8 output, from the activation range seen during calibration
+    float inv_output_scale;
+} quantized_op_t;
+
+// int8 execution plan of a trained model. weights take a quarter of the float plan's memory and the
+// activations passed between ops are int8, only the output layer is computed in float
+typedef struct Quantized_Model {
+    int num_ops;
+    quantized_op_t *ops;
+    int n_inputs;
+    int n_outputs;
+    float inv_input_scale;
+
+    int8_t *weights;
+    int n_weights;
+    float *parameters;
+    int n_parameters;
+
+    // int8 activations ping pong between two buffers, the float one holds an op's values before requantizing
+    int8_t *buffers[2];
+    float *values;
+    int buffer_size;
+
+    // accuracy over the training info's test set, measured by model_quantize
+    float float_accuracy;
+    float accuracy;
+} quantized_model_t;
+
+quantized_model_t model_quantize(training_info_t *training_info, unsigned int n_calibration);
+nmatrix_t quantized_predict(quantized_model_t *plan, nmatrix_t input, nmatrix_t output);
+void quantized_free(quantized_model_t *plan);
+
+#endif // QUANTIZE_H
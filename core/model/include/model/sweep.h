@@ -0,0 +1,50 @@
+#pragma once
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <model/model.h>
+
+// hyperparameters searched by model_sweep, every list needs at least one value
+typedef struct Sweep_Space {
+    const float *learning_rates;
+    int n_learning_rates;
+    const unsigned int *batch_sizes;
+    int n_batch_sizes;
+    const int *depths; // hidden layers, 0 trains a single dense layer
+    int n_depths;
+    const int *widths; // neurons of every hidden layer
+    int n_widths;
+    const dense_activation_t *activations; // fused into the hidden layers
+    int n_activations;
+
+    // 0 trains every combination, otherwise n_samples random ones with the learning rate drawn log uniformly
+    // between the smallest and largest listed rate
+    int n_samples;
+    // seeds the random search and, offset by the configuration index, each model's generator
+    uint64_t seed;
+} sweep_space_t;
+
+typedef struct Sweep_Config {
+    float learning_rate;
+    unsigned int batch_size;
+    int depth;
+    int width;
+    dense_activation_t activation;
+    uint64_t seed;
+} sweep_config_t;
+
+typedef struct Sweep_Result {
+    sweep_config_t config;
+    unsigned int epochs;
+    float train_accuracy;
+    float test_accuracy;
+    float avg_train_error;
+    float avg_test_error;
+    double seconds;
+} sweep_result_t;
+
+int model_sweep(const training_info_t *data, const sweep_space_t *space, int n_threads, const char *csv_path,
+        sweep_result_t **results);
+int sweep_best_result(const sweep_result_t *results, int n_results);
+
+#endif // SWEEP_H
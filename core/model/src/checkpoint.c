@@ -0,0 +1,942 @@
+#include <model/model.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
+
+/**
+ * Checkpoint file layout, all values little endian
+ *
+ * HEADER:              64 BYTES (checkpoint_header_t)
+ * LAYER RECORDS:       num_layers * record size, in input -> output order
+ * PADDING:             zeros up to parameters_offset (multiple of NMATRIX_ALIGNMENT)
+ * PARAMETERS:          n_parameters floats, an exact image of the model's parameter arena
+ *
+ * Models with pruned dense layers are written with CHECKPOINT_SPARSE set instead. Their parameters are every
+ * tensor back to back without alignment padding, and the weights of pruned layers only store the kept ones as
+ * compressed sparse rows: rows + 1 int32 row starts, then an int32 column and a float value per kept weight.
+ * Sparse checkpoints are read into an owned arena rather than mapped.
+ *
+ * The arena layout is fully determined by the layer graph, so loading rebuilds the layers and then points the
+ * arena straight at the mapped parameter blob. Function ids index the tables below, only ever append to them.
+ *
+ * Version history
+ *  1: initial layout
+ *  2: layer records gained config (fused dense activation, convolution and pooling hyperparameters),
+ *     version 1 files are still readable
+ *  3: header gained flags (CHECKPOINT_SPARSE), dense records gained config[1], 1 for pruned layers
+ */
+#define CHECKPOINT_MAGIC 0x4B434E4EU // "NNCK"
+#define CHECKPOINT_VERSION 3
+
+#define CHECKPOINT_SPARSE 0x1
+
+typedef struct Checkpoint_Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_layers;
+    uint32_t n_parameters;
+    uint64_t parameters_offset;
+    uint32_t flags;
+    uint8_t reserved[36];
+} checkpoint_header_t;
+
+typedef struct Checkpoint_Layer {
+    uint32_t type;
+    uint32_t function;  // activation function id, or loss id for the output layer
+    uint32_t guess;     // output layer guess function id
+    uint32_t n_dims;    // shape of the layer's neurons
+    int32_t dims[MAX_DIMS];
+    float rate;         // dropout rate
+    int32_t config[4];  // dense activation (and rank or pruned), convolution channels, kernel, stride, padding or pooling size, mode
+} checkpoint_layer_t;
+
+// layer records of version 1 files end before config
+#define CHECKPOINT_V1_LAYER_SIZE offsetof(checkpoint_layer_t, config)
+
+static size_t layer_record_size(uint32_t version) {
+    return version == 1 ? CHECKPOINT_V1_LAYER_SIZE : sizeof(checkpoint_layer_t);
+}
+
+static const layer_function_t *activation_function_ids[] = {
+    &activation_functions_sigmoid,
+    &activation_functions_relu,
+    &activation_functions_softmax,
+};
+
+static const struct {
+    const layer_function_t *functions;
+    float (*loss)(layer_t*, nmatrix_t);
+} output_function_ids[] = {
+    {&output_functions_meansquared, output_cost_mean_squared},
+    {&output_functions_crossentropy, output_cost_categorical_cross_entropy},
+    {&output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy},
+};
+
+static nmatrix_t (*const guess_function_ids[])(layer_t*, nmatrix_t) = {
+    output_make_guess_one_hot_encoded,
+    output_make_guess_passforward,
+    output_make_guess_round,
+    output_make_guess_softmax,
+};
+
+#define ARRAY_LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+static int find_activation_id(activation_layer_t *activation) {
+    for (size_t i = 0; i < ARRAY_LENGTH(activation_function_ids); i++) {
+        if (activation->functions.feed_forward == activation_function_ids[i]->feed_forward) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static int find_output_id(output_layer_t *output) {
+    for (size_t i = 0; i < ARRAY_LENGTH(output_function_ids); i++) {
+        if (output->functions.back_propagation == output_function_ids[i].functions->back_propagation) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static int find_guess_id(output_layer_t *output) {
+    for (size_t i = 0; i < ARRAY_LENGTH(guess_function_ids); i++) {
+        if (output->make_guess == guess_function_ids[i]) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t parameters_offset(uint32_t version, uint32_t num_layers) {
+    uint64_t offset = sizeof(checkpoint_header_t) + num_layers * layer_record_size(version);
+    return (offset + NMATRIX_ALIGNMENT - 1) / NMATRIX_ALIGNMENT * NMATRIX_ALIGNMENT;
+}
+
+_Static_assert(sizeof(int) == sizeof(int32_t), "sparse rows are written straight from the layer's int arrays");
+
+static bool write_sparse_weights(dense_layer_t *dense, const float *weights, FILE *file) {
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    float *values = malloc(sizeof(float) * (dense->n_nonzero > 0 ? dense->n_nonzero : 1));
+    for (int r = 0; r < n_outputs; r++) {
+        for (int i = dense->sparse_row_start[r]; i < dense->sparse_row_start[r + 1]; i++) {
+            values[i] = weights[r * n_inputs + dense->sparse_columns[i]];
+        }
+    }
+
+    bool success = fwrite(dense->sparse_row_start, sizeof(int32_t), n_outputs + 1, file) == (size_t) (n_outputs + 1)
+            && fwrite(dense->sparse_columns, sizeof(int32_t), dense->n_nonzero, file) == (size_t) dense->n_nonzero
+            && fwrite(values, sizeof(float), dense->n_nonzero, file) == (size_t) dense->n_nonzero;
+    free(values);
+    return success;
+}
+
+// sparse layout of the parameters, see the file layout above. arena is either the model's parameter arena or a copy of it
+static bool write_sparse_parameters(neural_network_model_t *model, const float *arena, FILE *file) {
+    nmatrix_t *parameters[LAYER_MAX_PARAMETERS];
+    nmatrix_t *gradients[LAYER_MAX_PARAMETERS];
+    layer_t *current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        int n_tensors = layer_get_parameters(current, parameters, gradients);
+        for (int i = 0; i < n_tensors; i++) {
+            const float *tensor = arena + (parameters[i]->matrix - model->parameters.parameters);
+            if (current->type == DENSE && parameters[i] == &current->layer.dense.weights && current->layer.dense.mask != NULL) {
+                if (!write_sparse_weights(&current->layer.dense, tensor, file)) {
+                    return false;
+                }
+            } else if (fwrite(tensor, sizeof(float), parameters[i]->n_elements, file) != (size_t) parameters[i]->n_elements) {
+                return false;
+            }
+        }
+        current = current->next;
+    }
+    return true;
+}
+
+static bool write_checkpoint(neural_network_model_t *model, const float *arena, FILE *file) {
+    checkpoint_header_t header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .num_layers = model->num_layers,
+        .n_parameters = model->parameters.n_parameters,
+        .parameters_offset = parameters_offset(CHECKPOINT_VERSION, model->num_layers),
+    };
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        layer_t *layer = model->ops[layer_i].layer;
+        if (layer->type == DENSE && layer->layer.dense.mask != NULL) {
+            header.flags |= CHECKPOINT_SPARSE;
+        }
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        return false;
+    }
+
+    layer_t *current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        nmatrix_t neurons = layer_get_neurons(current);
+        checkpoint_layer_t record = {
+            .type = current->type,
+            .n_dims = neurons.n_dims,
+        };
+        memcpy(record.dims, neurons.dims, sizeof(record.dims));
+
+        switch (current->type) {
+            case ACTIVATION:
+                record.function = find_activation_id(&current->layer.activation);
+                break;
+            case OUTPUT:
+                record.function = find_output_id(&current->layer.output);
+                record.guess = find_guess_id(&current->layer.output);
+                break;
+            case DROPOUT:
+                record.rate = current->layer.dropout.dropout;
+                break;
+            case DENSE:
+                record.config[0] = current->layer.dense.activation;
+                record.config[1] = current->layer.dense.mask != NULL;
+                break;
+            case DENSE_LOWRANK:
+                record.config[0] = current->layer.dense_lowrank.activation;
+                record.config[1] = current->layer.dense_lowrank.rank;
+                break;
+            case CONV2D:
+                record.config[0] = current->layer.conv2d.out_channels;
+                record.config[1] = current->layer.conv2d.kernel;
+                record.config[2] = current->layer.conv2d.stride;
+                record.config[3] = current->layer.conv2d.padding;
+                break;
+            case POOL2D:
+                record.config[0] = current->layer.pool2d.size;
+                record.config[1] = current->layer.pool2d.mode;
+                break;
+            default:
+                break;
+        }
+
+        if ((int32_t) record.function < 0 || (int32_t) record.guess < 0) {
+            printf("Failed to save model, %s layer %d uses a function with no checkpoint id\n", get_layer_name(current), layer_i);
+            return false;
+        }
+
+        if (fwrite(&record, sizeof(record), 1, file) != 1) {
+            return false;
+        }
+        current = current->next;
+    }
+
+    static const unsigned char padding[NMATRIX_ALIGNMENT] = {0};
+    long position = ftell(file);
+    if (fwrite(padding, 1, header.parameters_offset - position, file) != header.parameters_offset - position) {
+        return false;
+    }
+
+    if (header.flags & CHECKPOINT_SPARSE) {
+        return write_sparse_parameters(model, arena, file);
+    }
+    return fwrite(arena, sizeof(float), header.n_parameters, file) == header.n_parameters;
+}
+
+typedef bool (*file_writer_t)(FILE *file, const void *context);
+
+// writes a file next to file_path and renames it over file_path, sync flushes it to disk before it replaces
+// file_path, so a crash leaves either the old or the new file behind
+static bool replace_file(const char *file_path, const char *what, file_writer_t write, const void *context, bool sync) {
+    char temp_path[strlen(file_path) + 5];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", file_path);
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        printf("Failed to save %s, could not open %s\n", what, temp_path);
+        return false;
+    }
+
+    bool success = write(file, context);
+#ifndef _WIN32
+    if (sync) {
+        success = fflush(file) == 0 && fsync(fileno(file)) == 0 && success;
+    }
+#endif
+    success = fclose(file) == 0 && success;
+    if (!success) {
+        printf("Failed to save %s to %s\n", what, file_path);
+        remove(temp_path);
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(file_path); // rename does not replace existing files on windows
+#endif
+    if (rename(temp_path, file_path) != 0) {
+        printf("Failed to save %s, could not replace %s\n", what, file_path);
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+typedef struct Checkpoint_Source {
+    neural_network_model_t *model;
+    const float *arena;
+} checkpoint_source_t;
+
+static bool write_checkpoint_file(FILE *file, const void *context) {
+    const checkpoint_source_t *source = context;
+    return write_checkpoint(source->model, source->arena, file);
+}
+
+// writes the model's layer graph with the given copy of its parameter arena
+static bool save_checkpoint(neural_network_model_t *model, const float *arena, const char *file_path, bool sync) {
+    checkpoint_source_t source = {.model = model, .arena = arena};
+    return replace_file(file_path, "model", write_checkpoint_file, &source, sync);
+}
+
+/**
+ * Saves the layer graph and all parameters of a model.
+ * Written to a temporary file first and renamed over the destination, so a model that is currently
+ * mapped from file_path can safely be saved back to it.
+ */
+bool model_save(neural_network_model_t *model, const char *file_path) {
+    return save_checkpoint(model, model->parameters.parameters, file_path, false);
+}
+
+/**
+ * Training state file layout, everything besides the parameters that model_train_info needs to continue a run
+ *
+ * HEADER:              64 BYTES (training_state_header_t)
+ * ORDER:               train_size uint32, the epoch's training order, only with TRAINING_STATE_ORDER set
+ *
+ * The position is the next example to train on, always at a batch boundary, where the accumulated gradients are
+ * zero. The optimizer is plain SGD and keeps nothing between batches, so there are no moments to store yet, the
+ * version is bumped once there are. The checksum of the parameter arena the state was taken with ties it to one
+ * checkpoint, resuming with weights from another point of the run is refused.
+ */
+#define TRAINING_STATE_MAGIC 0x53544E4EU // "NNTS"
+#define TRAINING_STATE_VERSION 1
+
+#define TRAINING_STATE_ORDER 0x1
+
+typedef struct Training_State_Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t epoch;
+    uint32_t train_index;
+    uint32_t train_size;
+    uint32_t flags;
+    uint64_t random;
+    uint64_t checksum;
+    uint8_t reserved[24];
+} training_state_header_t;
+
+typedef struct Training_State {
+    training_state_header_t header;
+    uint32_t *order; // train_size entries, unused without TRAINING_STATE_ORDER
+} training_state_t;
+
+// FNV-1a over the arena's bytes
+static uint64_t arena_checksum(const float *arena, unsigned int n_parameters) {
+    const unsigned char *bytes = (const unsigned char*) arena;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < (size_t) n_parameters * sizeof(float); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// state of a run whose next example is next_index. past the end of the set the run continues with the next epoch,
+// unless the training loop already counted past the last one
+static void capture_training_state(training_info_t *training_info, unsigned int next_index, training_state_t *state) {
+    unsigned int epoch = training_info->epoch;
+    if (next_index >= training_info->train_size) {
+        next_index = 0;
+        epoch += epoch < training_info->target_epochs;
+    }
+
+    state->header = (training_state_header_t) {
+        .magic = TRAINING_STATE_MAGIC,
+        .version = TRAINING_STATE_VERSION,
+        .epoch = epoch,
+        .train_index = next_index,
+        .train_size = training_info->train_size,
+        .random = training_info->model->random.state,
+    };
+    if (training_info->train_order != NULL) {
+        state->header.flags |= TRAINING_STATE_ORDER;
+        state->order = realloc(state->order, sizeof(uint32_t) * training_info->train_size);
+        memcpy(state->order, training_info->train_order, sizeof(uint32_t) * training_info->train_size);
+    }
+}
+
+static bool write_training_state(FILE *file, const void *context) {
+    const training_state_t *state = context;
+    if (fwrite(&state->header, sizeof(state->header), 1, file) != 1) {
+        return false;
+    }
+    if (state->header.flags & TRAINING_STATE_ORDER) {
+        return fwrite(state->order, sizeof(uint32_t), state->header.train_size, file) == state->header.train_size;
+    }
+    return true;
+}
+
+/**
+ * Saves where a run is, the training order and the model's random state, to go with a model_save of the same
+ * parameters. Meant to be called between model_train_info calls, the checkpoint writer saves one with every
+ * snapshot while training.
+ */
+bool training_state_save(training_info_t *training_info, const char *file_path) {
+    neural_network_model_t *model = training_info->model;
+    training_state_t state = {0};
+    capture_training_state(training_info, training_info->train_index, &state);
+    state.header.checksum = arena_checksum(model->parameters.parameters, model->parameters.n_parameters);
+    bool success = replace_file(file_path, "training state", write_training_state, &state, false);
+    free(state.order);
+    return success;
+}
+
+/**
+ * Restores a state saved by training_state_save (or a checkpoint writer) into a training info whose model holds the
+ * parameters saved with it and whose training set is the same. The next model_train_info continues the run from
+ * the saved example with the same order and random numbers. The running train error and accuracy of a resumed
+ * epoch only cover the examples trained after resuming.
+ */
+bool training_state_load(training_info_t *training_info, const char *file_path) {
+    neural_network_model_t *model = training_info->model;
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL) {
+        printf("Failed to load training state, could not open %s\n", file_path);
+        return false;
+    }
+
+    training_state_header_t header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == TRAINING_STATE_MAGIC
+            && header.version == TRAINING_STATE_VERSION;
+    if (!valid) {
+        fclose(file);
+        printf("Failed to load training state, %s is not a version %d training state\n", file_path, TRAINING_STATE_VERSION);
+        return false;
+    }
+    if (header.train_size != training_info->train_size || header.train_index >= header.train_size || header.random == 0
+            || header.checksum != arena_checksum(model->parameters.parameters, model->parameters.n_parameters)) {
+        fclose(file);
+        printf("Failed to load training state, %s does not belong to this model and training set\n", file_path);
+        return false;
+    }
+
+    uint32_t *order = NULL;
+    if (header.flags & TRAINING_STATE_ORDER) {
+        // a permutation, every example exactly once
+        order = malloc(sizeof(uint32_t) * header.train_size);
+        uint8_t *seen = calloc(header.train_size, 1);
+        valid = fread(order, sizeof(uint32_t), header.train_size, file) == header.train_size;
+        for (uint32_t i = 0; valid && i < header.train_size; i++) {
+            valid = order[i] < header.train_size && !seen[order[i]];
+            if (valid) {
+                seen[order[i]] = 1;
+            }
+        }
+        free(seen);
+    }
+    fclose(file);
+    if (!valid) {
+        free(order);
+        printf("Failed to load training state, %s has an invalid training order\n", file_path);
+        return false;
+    }
+
+    free(training_info->train_order);
+    training_info->train_order = order;
+    training_info->shuffle = order != NULL; // only shuffled runs have an order
+    training_info->epoch = header.epoch;
+    training_info->train_index = header.train_index;
+    training_info->resume = true;
+    model->random.state = header.random;
+    return true;
+}
+
+/**
+ * Periodic checkpoints written off the training thread. Taking a snapshot only copies the parameter arena into
+ * a staging buffer, serializing, fsync and replacing the file happen on the writer's own thread. With two staging
+ * buffers a snapshot never waits for the one being written, a snapshot still queued when the next one is taken
+ * is superseded by it.
+ * Snapshots taken by the training loop also carry the training state, which is written to file_path.state
+ * right after its parameters, so a preempted run can be resumed from the last snapshot.
+ * Only parameter values may change while a writer is attached, not the layer graph or pruning masks.
+ */
+struct Checkpoint_Writer {
+    neural_network_model_t *model;
+    char *file_path;
+    char *state_path;
+    unsigned int every_epochs;
+    float every_seconds;
+    double last_snapshot;
+
+    float *staging[2];
+    training_state_t states[2];
+    bool has_state[2];
+    unsigned int n_parameters;
+    int writing; // staging buffer being serialized, -1 when idle
+    int queued;  // staging buffer waiting to be serialized, -1 when none
+    bool stop;
+    unsigned int n_written;
+    unsigned int n_failed;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a snapshot was queued or the writer is stopping
+    pthread_cond_t idle; // a write finished
+};
+
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void* checkpoint_writer_run(void *argument) {
+    checkpoint_writer_t *writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->queued < 0 && !writer->stop) {
+            pthread_cond_wait(&writer->wake, &writer->lock);
+        }
+        if (writer->queued < 0) {
+            break; // stopping and everything queued is written
+        }
+
+        writer->writing = writer->queued;
+        writer->queued = -1;
+        pthread_mutex_unlock(&writer->lock);
+        int buffer = writer->writing;
+        bool success = save_checkpoint(writer->model, writer->staging[buffer], writer->file_path, true);
+        if (success && writer->has_state[buffer]) {
+            writer->states[buffer].header.checksum = arena_checksum(writer->staging[buffer], writer->n_parameters);
+            success = replace_file(writer->state_path, "training state", write_training_state, &writer->states[buffer], true);
+        }
+        pthread_mutex_lock(&writer->lock);
+
+        writer->n_written += success;
+        writer->n_failed += !success;
+        writer->writing = -1;
+        pthread_cond_broadcast(&writer->idle);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// writes a checkpoint of the model to file_path every every_epochs epochs and at most every_seconds seconds
+// apart (checked at batch boundaries), 0 disables either trigger
+checkpoint_writer_t* checkpoint_writer_create(neural_network_model_t *model, const char *file_path,
+        unsigned int every_epochs, float every_seconds) {
+    checkpoint_writer_t *writer = malloc(sizeof(checkpoint_writer_t));
+    *writer = (checkpoint_writer_t) {
+        .model = model,
+        .file_path = malloc(strlen(file_path) + 1),
+        .state_path = malloc(strlen(file_path) + 7),
+        .every_epochs = every_epochs,
+        .every_seconds = every_seconds,
+        .last_snapshot = monotonic_seconds(),
+        .n_parameters = model->parameters.n_parameters,
+        .writing = -1,
+        .queued = -1,
+    };
+    strcpy(writer->file_path, file_path);
+    sprintf(writer->state_path, "%s.state", file_path);
+    writer->staging[0] = nmatrix_aligned_alloc(writer->n_parameters);
+    writer->staging[1] = nmatrix_aligned_alloc(writer->n_parameters);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    pthread_cond_init(&writer->idle, NULL);
+    pthread_create(&writer->thread, NULL, checkpoint_writer_run, writer);
+    return writer;
+}
+
+static void queue_snapshot(checkpoint_writer_t *writer, training_info_t *training_info, unsigned int next_index) {
+    assert(writer->model->parameters.n_parameters == writer->n_parameters); // layers were added after attaching
+
+    pthread_mutex_lock(&writer->lock);
+    int buffer = writer->writing == 0 ? 1 : 0;
+    writer->queued = -1;
+    pthread_mutex_unlock(&writer->lock);
+
+    memcpy(writer->staging[buffer], writer->model->parameters.parameters, sizeof(float) * writer->n_parameters);
+    writer->has_state[buffer] = training_info != NULL;
+    if (training_info != NULL) {
+        capture_training_state(training_info, next_index, &writer->states[buffer]);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->queued = buffer;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    writer->last_snapshot = monotonic_seconds();
+}
+
+// copies the current parameters, and the training state when training_info is given, and queues them for writing,
+// never waits on the disk. outside model_train_info, the training state is the one training_state_save would save
+void checkpoint_writer_snapshot(checkpoint_writer_t *writer, training_info_t *training_info) {
+    queue_snapshot(writer, training_info, training_info != NULL ? training_info->train_index : 0);
+}
+
+// called by the training loop at every batch boundary (after the parameters were updated), takes a snapshot when one is due
+void checkpoint_writer_step(checkpoint_writer_t *writer, training_info_t *training_info) {
+    unsigned int epoch = training_info->epoch;
+    bool end_of_epoch = training_info->train_index == training_info->train_size - 1;
+    bool due = writer->every_seconds > 0 && monotonic_seconds() - writer->last_snapshot >= writer->every_seconds;
+    due |= end_of_epoch && writer->every_epochs > 0 && (epoch + 1) % writer->every_epochs == 0;
+    if (due) {
+        // train_index was just trained on, the run continues with the one after it
+        queue_snapshot(writer, training_info, training_info->train_index + 1);
+    }
+}
+
+// blocks until every queued snapshot is on disk, false if any write so far failed
+bool checkpoint_writer_wait(checkpoint_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued >= 0 || writer->writing >= 0) {
+        pthread_cond_wait(&writer->idle, &writer->lock);
+    }
+    bool success = writer->n_failed == 0;
+    pthread_mutex_unlock(&writer->lock);
+    return success;
+}
+
+unsigned int checkpoint_writer_written(checkpoint_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    unsigned int n_written = writer->n_written;
+    pthread_mutex_unlock(&writer->lock);
+    return n_written;
+}
+
+// finishes the queued snapshot and stops the writer thread
+void checkpoint_writer_free(checkpoint_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    pthread_cond_destroy(&writer->idle);
+    nmatrix_aligned_free(writer->staging[0]);
+    nmatrix_aligned_free(writer->staging[1]);
+    free(writer->states[0].order);
+    free(writer->states[1].order);
+    free(writer->file_path);
+    free(writer->state_path);
+    free(writer);
+}
+
+// checks a convolution record against the image produced by the previous layer before building it
+static bool conv2d_fits(layer_t *prev, const checkpoint_layer_t *record) {
+    int channels, height, width;
+    if (!layer_get_image_shape(prev, &channels, &height, &width)) {
+        return false;
+    }
+
+    int kernel = record->config[1], padding = record->config[3];
+    return height + 2 * padding >= kernel && width + 2 * padding >= kernel;
+}
+
+static bool pool2d_fits(layer_t *prev, const checkpoint_layer_t *record) {
+    int channels, height, width;
+    int size = record->config[0];
+    return layer_get_image_shape(prev, &channels, &height, &width) && size > 0 && size <= height && size <= width;
+}
+
+static bool build_layers(neural_network_model_t *model, const checkpoint_layer_t *records, uint32_t num_layers) {
+    for (uint32_t layer_i = 0; layer_i < num_layers; layer_i++) {
+        const checkpoint_layer_t *record = &records[layer_i];
+        if (record->n_dims == 0 || record->n_dims > MAX_DIMS) {
+            return false;
+        }
+        if ((layer_i == 0) != (record->type == INPUT)) {
+            return false;
+        }
+
+        nshape_t shape = {.n_dims = record->n_dims};
+        memcpy(shape.dims, record->dims, sizeof(shape.dims));
+        switch (record->type) {
+            case INPUT: {
+                nmatrix_t neurons = nmatrix_allocator(shape);
+                layer_input(model, neurons);
+                nmatrix_free(&neurons);
+                break;
+            }
+            case DENSE: {
+                if (record->config[0] < DENSE_ACTIVATION_NONE || record->config[0] > DENSE_ACTIVATION_TANH
+                        || (record->config[1] != 0 && record->config[1] != 1)) {
+                    return false;
+                }
+                nmatrix_t neurons = nmatrix_allocator(shape);
+                layer_dense_activation(model, neurons, record->config[0]);
+                nmatrix_free(&neurons);
+                break;
+            }
+            case DENSE_LOWRANK: {
+                int rank = record->config[1];
+                if (record->config[0] < DENSE_ACTIVATION_NONE || record->config[0] > DENSE_ACTIVATION_TANH
+                        || rank <= 0 || rank > shape.dims[0] || rank > layer_get_neurons(model->output_layer).dims[0]) {
+                    return false;
+                }
+                nmatrix_t neurons = nmatrix_allocator(shape);
+                layer_dense_lowrank(model, neurons, rank, record->config[0]);
+                nmatrix_free(&neurons);
+                break;
+            }
+            case CONV2D:
+                // the geometry has to match the records shape, or the convolution would read outside its input
+                if (record->config[0] <= 0 || record->config[1] <= 0 || record->config[2] <= 0 || record->config[3] < 0
+                        || !conv2d_fits(model->output_layer, record)) {
+                    return false;
+                }
+                layer_conv2d(model, record->config[0], record->config[1], record->config[2], record->config[3]);
+                break;
+            case POOL2D:
+                if (!pool2d_fits(model->output_layer, record) || (record->config[1] != POOL_MAX && record->config[1] != POOL_AVERAGE)) {
+                    return false;
+                }
+                if (record->config[1] == POOL_MAX) {
+                    layer_maxpool(model, record->config[0]);
+                } else {
+                    layer_avgpool(model, record->config[0]);
+                }
+                break;
+            case DROPOUT:
+                layer_dropout(model, record->rate);
+                break;
+            case ACTIVATION:
+                if (record->function >= ARRAY_LENGTH(activation_function_ids)) {
+                    return false;
+                }
+                layer_activation(model, *activation_function_ids[record->function]);
+                break;
+            case OUTPUT:
+                if (record->function >= ARRAY_LENGTH(output_function_ids) || record->guess >= ARRAY_LENGTH(guess_function_ids)) {
+                    return false;
+                }
+                layer_output(model, guess_function_ids[record->guess], *output_function_ids[record->function].functions,
+                        output_function_ids[record->function].loss);
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// sequential reader over the parameters of a sparse checkpoint, fails rather than reading past the end of the file
+typedef struct Checkpoint_Reader {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+} checkpoint_reader_t;
+
+static bool read_bytes(checkpoint_reader_t *reader, void *destination, size_t bytes) {
+    if (bytes > reader->size - reader->offset) {
+        return false;
+    }
+    memcpy(destination, reader->data + reader->offset, bytes);
+    reader->offset += bytes;
+    return true;
+}
+
+// expands the compressed rows of a pruned layer back into its weights and mask
+static bool read_sparse_weights(checkpoint_reader_t *reader, layer_t *layer) {
+    dense_layer_t *dense = &layer->layer.dense;
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    int32_t *row_start = malloc(sizeof(int32_t) * (n_outputs + 1));
+    bool valid = read_bytes(reader, row_start, sizeof(int32_t) * (n_outputs + 1)) && row_start[0] == 0;
+    for (int r = 0; valid && r < n_outputs; r++) {
+        valid = row_start[r + 1] >= row_start[r] && row_start[r + 1] - row_start[r] <= n_inputs;
+    }
+    if (!valid) {
+        free(row_start);
+        return false;
+    }
+
+    const int n_nonzero = row_start[n_outputs];
+    int32_t *columns = malloc(sizeof(int32_t) * (n_nonzero > 0 ? n_nonzero : 1));
+    float *values = malloc(sizeof(float) * (n_nonzero > 0 ? n_nonzero : 1));
+    uint8_t *mask = calloc(dense->weights.n_elements, 1);
+    valid = read_bytes(reader, columns, sizeof(int32_t) * n_nonzero) && read_bytes(reader, values, sizeof(float) * n_nonzero);
+    memset(dense->weights.matrix, 0, sizeof(float) * dense->weights.n_elements);
+    for (int r = 0; valid && r < n_outputs; r++) {
+        for (int i = row_start[r]; valid && i < row_start[r + 1]; i++) {
+            // columns increase within a row, so every weight is stored at most once
+            valid = columns[i] >= 0 && columns[i] < n_inputs && (i == row_start[r] || columns[i] > columns[i - 1]);
+            if (valid) {
+                mask[r * n_inputs + columns[i]] = 1;
+                dense->weights.matrix[r * n_inputs + columns[i]] = values[i];
+            }
+        }
+    }
+    free(row_start);
+    free(columns);
+    free(values);
+
+    if (!valid) {
+        free(mask);
+        return false;
+    }
+    layer_dense_set_mask(layer, mask);
+    return true;
+}
+
+static bool read_sparse_parameters(neural_network_model_t *model, const checkpoint_layer_t *records, checkpoint_reader_t *reader) {
+    nmatrix_t *parameters[LAYER_MAX_PARAMETERS];
+    nmatrix_t *gradients[LAYER_MAX_PARAMETERS];
+    layer_t *current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        int n_tensors = layer_get_parameters(current, parameters, gradients);
+        for (int i = 0; i < n_tensors; i++) {
+            if (current->type == DENSE && parameters[i] == &current->layer.dense.weights && records[layer_i].config[1]) {
+                if (!read_sparse_weights(reader, current)) {
+                    return false;
+                }
+            } else if (!read_bytes(reader, parameters[i]->matrix, sizeof(float) * parameters[i]->n_elements)) {
+                return false;
+            }
+        }
+        current = current->next;
+    }
+    return reader->offset == reader->size;
+}
+
+/**
+ * Loads a model saved by model_save into an empty model.
+ * The parameter arena points directly into a private copy on write mapping of the file, so no weights are
+ * parsed or copied. Training a loaded model is still fine, touched pages are copied by the OS on first write.
+ */
+bool model_load(neural_network_model_t *model, const char *file_path) {
+    assert(model->num_layers == 0 && model->input_layer == NULL);
+
+#ifdef _WIN32
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL) {
+        printf("Failed to load model, could not open %s\n", file_path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = malloc(size);
+    bool read = fread(data, 1, size, file) == size;
+    fclose(file);
+    if (!read) {
+        free(data);
+        printf("Failed to load model, could not read %s\n", file_path);
+        return false;
+    }
+#else
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to load model, could not open %s\n", file_path);
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(checkpoint_header_t)) {
+        close(fd);
+        printf("Failed to load model, %s is not a checkpoint\n", file_path);
+        return false;
+    }
+    size_t size = file_stat.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Failed to load model, could not map %s\n", file_path);
+        return false;
+    }
+#endif
+
+    parameter_arena_t mapping = {.mapping = data, .mapping_size = size};
+
+    const checkpoint_header_t *header = (const checkpoint_header_t*) data;
+    if (size < sizeof(checkpoint_header_t) || header->magic != CHECKPOINT_MAGIC
+            || header->version == 0 || header->version > CHECKPOINT_VERSION
+            || header->num_layers == 0 || header->parameters_offset != parameters_offset(header->version, header->num_layers)
+            || size < header->parameters_offset
+            || (!(header->flags & CHECKPOINT_SPARSE) && size < header->parameters_offset + (uint64_t) header->n_parameters * sizeof(float))) {
+        printf("Failed to load model, %s is not a version 1-%d checkpoint\n", file_path, CHECKPOINT_VERSION);
+        model_unmap_parameters(&mapping);
+        return false;
+    }
+
+    // widen older records to the current layout, fields they did not have yet are zero
+    const size_t record_size = layer_record_size(header->version);
+    checkpoint_layer_t *records = calloc(header->num_layers, sizeof(checkpoint_layer_t));
+    for (uint32_t layer_i = 0; layer_i < header->num_layers; layer_i++) {
+        memcpy(&records[layer_i], data + sizeof(checkpoint_header_t) + layer_i * record_size, record_size);
+    }
+    bool built = build_layers(model, records, header->num_layers) && model->parameters.n_parameters == header->n_parameters;
+
+    // sparse parameters are expanded into the arena build_layers allocated, the file is not needed afterwards
+    if (built && (header->flags & CHECKPOINT_SPARSE)) {
+        checkpoint_reader_t reader = {.data = data, .size = size, .offset = header->parameters_offset};
+        built = read_sparse_parameters(model, records, &reader);
+        if (built) {
+            free(records);
+            model_unmap_parameters(&mapping);
+            return true;
+        }
+    }
+    free(records);
+
+    if (!built) {
+        printf("Failed to load model, %s has an invalid layer graph\n", file_path);
+        model_free(model);
+        *model = (neural_network_model_t) {.batch_size = model->batch_size, .pool = model->pool};
+        model_unmap_parameters(&mapping);
+        return false;
+    }
+
+    // repoint every parameter view from the freshly allocated slab into the mapping
+    float *parameters = (float*) (data + header->parameters_offset);
+    nmatrix_t *layer_parameters[LAYER_MAX_PARAMETERS];
+    nmatrix_t *layer_gradients[LAYER_MAX_PARAMETERS];
+    layer_t *current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        int n_tensors = layer_get_parameters(current, layer_parameters, layer_gradients);
+        for (int i = 0; i < n_tensors; i++) {
+            layer_parameters[i]->matrix = parameters + (layer_parameters[i]->matrix - model->parameters.parameters);
+        }
+        current = current->next;
+    }
+
+    nmatrix_aligned_free(model->parameters.parameters);
+    model->parameters.parameters = parameters;
+    model->parameters.mapping = mapping.mapping;
+    model->parameters.mapping_size = mapping.mapping_size;
+    return true;
+}
+
+// releases a checkpoint mapping, the arena's parameters no longer point anywhere valid afterwards
+void model_unmap_parameters(parameter_arena_t *arena) {
+    if (arena->mapping == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    free(arena->mapping);
+#else
+    munmap(arena->mapping, arena->mapping_size);
+#endif
+    arena->mapping = NULL;
+    arena->mapping_size = 0;
+    arena->parameters = NULL;
+}
@@ -0,0 +1,418 @@
+#include <model/evaluate.h>
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+
+// examples to evaluate, inputs are either matrices or compact pixels like a training info's
+typedef struct Evaluation_Set {
+    unsigned int n_examples;
+    nmatrix_t *x;
+    nmatrix_t *y;
+    const int *labels;
+    const uint8_t *pixels;
+    unsigned int pixels_per_example;
+    float pixel_scale;
+    float pixel_offset;
+} evaluation_set_t;
+
+// everything a batch needs, only read while the batches run
+typedef struct Evaluation_Context {
+    inference_model_t *plan;
+    const evaluation_set_t *set;
+    layer_op_kind_t output_kind;
+    nmatrix_t (*make_guess)(layer_t*, nmatrix_t);
+    int n_classes;
+} evaluation_context_t;
+
+// one batch of examples with its own partial sums, so the batches reduce in the same order on any number of threads
+typedef struct Evaluation_Task {
+    const evaluation_context_t *context;
+    unsigned int start;
+    int count;
+    double loss;
+    int n_correct;
+    unsigned int *confusion;
+} evaluation_task_t;
+
+bool model_evaluate_supported(neural_network_model_t *model) {
+    layer_op_kind_t kind = layer_get_op_kind(model->output_layer);
+    return kind == OP_OUTPUT_MEAN_SQUARED || kind == OP_OUTPUT_CROSS_ENTROPY || kind == OP_OUTPUT_SOFTMAX_CROSS_ENTROPY;
+}
+
+// same measures as the output layer's loss functions, computed from the plan's output instead of the layer state
+static float evaluation_cost(const evaluation_context_t *context, const float *output, int n_outputs, unsigned int example_i) {
+    const int label = context->set->labels != NULL ? context->set->labels[example_i] : -1;
+    const float *expected = label < 0 ? context->set->y[example_i].matrix : NULL;
+    float cost = 0;
+    for (int i = 0; i < n_outputs; i++) {
+        float target = expected != NULL ? expected[i] : i == label;
+        switch (context->output_kind) {
+            case OP_OUTPUT_MEAN_SQUARED:
+                cost += (target - output[i]) * (target - output[i]);
+                break;
+            case OP_OUTPUT_CROSS_ENTROPY:
+                cost -= target != 0 ? target * logf(output[i] + 0.0001) : 0;
+                break;
+            case OP_OUTPUT_SOFTMAX_CROSS_ENTROPY:
+                // the plan already applied the softmax, the fused layer's log_sum_exp - logit is -log(probability)
+                cost -= target != 0 ? target * logf(fmaxf(output[i], FLT_MIN)) : 0;
+                break;
+            default:
+                assert(0);
+        }
+    }
+    return context->output_kind == OP_OUTPUT_MEAN_SQUARED ? cost / n_outputs : cost;
+}
+
+static int argmax(const float *values, int n) {
+    int max_i = 0;
+    for (int i = 1; i < n; i++) {
+        max_i = values[i] > values[max_i] ? i : max_i;
+    }
+    return max_i;
+}
+
+static int evaluation_class(const float *values, int n) {
+    return n > 1 ? argmax(values, n) : values[0] >= 0.5;
+}
+
+// same decision as the training loop's, with the guess built in the caller's buffer instead of the output layer's
+static bool evaluation_correct(const evaluation_context_t *context, const float *output, int n_outputs,
+        unsigned int example_i, float *guess) {
+    if (context->set->labels != NULL) {
+        return argmax(output, n_outputs) == context->set->labels[example_i];
+    }
+
+    if (context->make_guess == output_make_guess_round) {
+        for (int i = 0; i < n_outputs; i++) {
+            guess[i] = roundf(output[i]);
+        }
+    } else if (context->make_guess == output_make_guess_one_hot_encoded) {
+        float max = -INFINITY;
+        for (int i = 0; i < n_outputs; i++) {
+            max = fmaxf(max, output[i]);
+        }
+        for (int i = 0; i < n_outputs; i++) {
+            guess[i] = output[i] == max;
+        }
+    } else {
+        // passforward, the softmax guess of an already normalized output is the same values
+        memcpy(guess, output, sizeof(float) * n_outputs);
+    }
+    nmatrix_t expected = context->set->y[example_i];
+    nmatrix_t guess_matrix = expected;
+    guess_matrix.matrix = guess;
+    return nmatrix_equal(&expected, &guess_matrix);
+}
+
+static void evaluate_batch(void *argument) {
+    evaluation_task_t *task = argument;
+    const evaluation_context_t *context = task->context;
+    const evaluation_set_t *set = context->set;
+    const int n_inputs = context->plan->n_inputs;
+    const int n_outputs = context->plan->n_outputs;
+
+    inference_batch_t batch = inference_batch_create(context->plan, task->count);
+    for (int i = 0; i < task->count; i++) {
+        float *row = batch.inputs + i * n_inputs;
+        if (set->pixels != NULL) {
+            const uint8_t *pixels = set->pixels + (size_t) (task->start + i) * set->pixels_per_example;
+            for (int p = 0; p < n_inputs; p++) {
+                row[p] = pixels[p] * set->pixel_scale + set->pixel_offset;
+            }
+        } else {
+            memcpy(row, set->x[task->start + i].matrix, sizeof(float) * n_inputs);
+        }
+    }
+
+    const float *outputs = inference_predict_batch(context->plan, &batch, task->count);
+    float guess[n_outputs];
+    for (int i = 0; i < task->count; i++) {
+        const unsigned int example_i = task->start + i;
+        const float *output = outputs + i * n_outputs;
+        task->loss += evaluation_cost(context, output, n_outputs, example_i);
+        task->n_correct += evaluation_correct(context, output, n_outputs, example_i, guess);
+
+        int expected = set->labels != NULL ? set->labels[example_i] : evaluation_class(set->y[example_i].matrix, n_outputs);
+        int predicted = evaluation_class(output, n_outputs);
+        if (expected >= 0 && expected < context->n_classes) {
+            task->confusion[expected * context->n_classes + predicted]++;
+        }
+    }
+    inference_batch_free(&batch);
+}
+
+/**
+ * Evaluates a compiled plan on a set of examples. The set is split into batches, every batch packs its examples
+ * into rows and runs them through the plan at once, and the batches are spread over a thread pool. Each batch
+ * keeps its own loss, count and confusion matrix, summed up in batch order once all are done.
+ */
+static evaluation_stats_t evaluate_plan(const evaluation_context_t *context, const evaluate_options_t *options) {
+    const unsigned int n_examples = context->set->n_examples;
+    const int batch_size = options->batch_size > 0 ? options->batch_size : EVALUATE_DEFAULT_BATCH;
+    const int n_tasks = (n_examples + batch_size - 1) / batch_size;
+    const int n_confusion = context->n_classes * context->n_classes;
+
+    evaluation_stats_t stats = {
+        .n_examples = n_examples,
+        .n_classes = context->n_classes,
+        .confusion = calloc(n_confusion, sizeof(unsigned int)),
+    };
+    if (n_tasks == 0) {
+        return stats;
+    }
+
+    evaluation_task_t *tasks = malloc(sizeof(evaluation_task_t) * n_tasks);
+    unsigned int *confusion = calloc((size_t) n_tasks * n_confusion, sizeof(unsigned int));
+    for (int task_i = 0; task_i < n_tasks; task_i++) {
+        unsigned int start = task_i * batch_size;
+        unsigned int remaining = n_examples - start;
+        tasks[task_i] = (evaluation_task_t) {
+            .context = context,
+            .start = start,
+            .count = remaining < (unsigned int) batch_size ? remaining : (unsigned int) batch_size,
+            .confusion = confusion + (size_t) task_i * n_confusion,
+        };
+    }
+
+    thread_pool_t *pool = options->pool;
+    int n_threads = options->n_threads > 0 ? options->n_threads : thread_pool_default_threads();
+    if (pool == NULL && (n_threads == 1 || n_tasks == 1)) {
+        for (int task_i = 0; task_i < n_tasks; task_i++) {
+            evaluate_batch(&tasks[task_i]);
+        }
+    } else {
+        if (pool == NULL) {
+            pool = thread_pool_create(n_threads < n_tasks ? n_threads : n_tasks);
+        }
+        for (int task_i = 0; task_i < n_tasks; task_i++) {
+            thread_pool_submit(pool, evaluate_batch, &tasks[task_i]);
+        }
+        thread_pool_wait(pool);
+        if (pool != options->pool) {
+            thread_pool_free(pool);
+        }
+    }
+
+    double loss = 0;
+    for (int task_i = 0; task_i < n_tasks; task_i++) {
+        loss += tasks[task_i].loss;
+        stats.n_correct += tasks[task_i].n_correct;
+        for (int i = 0; i < n_confusion; i++) {
+            stats.confusion[i] += tasks[task_i].confusion[i];
+        }
+    }
+    stats.loss = loss / n_examples;
+    stats.accuracy = stats.n_correct / (float) n_examples;
+
+    free(confusion);
+    free(tasks);
+    return stats;
+}
+
+static evaluation_stats_t evaluate_model(neural_network_model_t *model, const evaluation_set_t *set,
+        const evaluate_options_t *options) {
+    assert(model_evaluate_supported(model));
+    evaluate_options_t defaults = {0};
+    inference_model_t plan = model_compile_inference(model);
+    evaluation_context_t context = {
+        .plan = &plan,
+        .set = set,
+        .output_kind = layer_get_op_kind(model->output_layer),
+        .make_guess = model->output_layer->layer.output.make_guess,
+        .n_classes = plan.n_outputs > 1 ? plan.n_outputs : 2,
+    };
+    evaluation_stats_t stats = evaluate_plan(&context, options != NULL ? options : &defaults);
+    inference_free(&plan);
+    return stats;
+}
+
+/**
+ * Loss, accuracy and confusion matrix of a model on n_examples inputs x with targets y (or options->labels).
+ * The model is compiled to an inference plan first, so it is left untouched and can keep training on another
+ * thread as long as its weights are not updated during the compile. Needs an output layer with a built in loss,
+ * see model_evaluate_supported. Free the stats with evaluation_stats_free.
+ */
+evaluation_stats_t model_evaluate(neural_network_model_t *model, nmatrix_t *x, nmatrix_t *y, unsigned int n_examples,
+        const evaluate_options_t *options) {
+    evaluation_set_t set = {
+        .n_examples = n_examples,
+        .x = x,
+        .y = y,
+        .labels = options != NULL ? options->labels : NULL,
+    };
+    return evaluate_model(model, &set, options);
+}
+
+// model_evaluate on the training info's test set, in whichever form it is stored
+evaluation_stats_t model_evaluate_test_set(training_info_t *training_info, const evaluate_options_t *options) {
+    evaluation_set_t set = {
+        .n_examples = training_info->test_size,
+        .x = training_info->test_x,
+        .y = training_info->test_y,
+        .labels = training_info->test_labels,
+        .pixels = training_info->test_pixels,
+        .pixels_per_example = training_info->pixels_per_example,
+        .pixel_scale = training_info->pixel_scale,
+        .pixel_offset = training_info->pixel_offset,
+    };
+    return evaluate_model(training_info->model, &set, options);
+}
+
+void evaluation_stats_free(evaluation_stats_t *stats) {
+    free(stats->confusion);
+    stats->confusion = NULL;
+}
+
+/**
+ * Test set evaluation off the training thread. At an epoch boundary the trainer compiles the model to an inference
+ * plan, which copies every weight, and hands it over. The evaluator runs the test set through that snapshot while
+ * training continues on the live weights, and the trainer picks the result up whenever it next looks.
+ * One evaluation is in flight at a time. The test set, output layer and the training info's input settings are only
+ * ever read, so they must not change while an evaluator is attached.
+ */
+struct Async_Evaluator {
+    // read only copies of the test set and output layer description
+    evaluation_set_t set;
+    layer_op_kind_t output_kind;
+    nmatrix_t (*make_guess)(layer_t*, nmatrix_t);
+
+    inference_model_t plan;
+    evaluation_result_t result;
+    bool pending;    // plan and result.epoch were submitted and are not evaluated yet
+    bool has_result; // result is finished and not consumed yet
+    bool stop;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a plan was submitted or the evaluator is stopping
+    pthread_cond_t idle; // an evaluation finished
+};
+
+static void* async_evaluator_run(void *argument) {
+    async_evaluator_t *evaluator = argument;
+    pthread_mutex_lock(&evaluator->lock);
+    while (true) {
+        while (!evaluator->pending && !evaluator->stop) {
+            pthread_cond_wait(&evaluator->wake, &evaluator->lock);
+        }
+        if (!evaluator->pending) {
+            break;
+        }
+
+        evaluation_result_t result = evaluator->result;
+        pthread_mutex_unlock(&evaluator->lock);
+
+        // batched but on this thread only, the cores are busy training
+        evaluation_context_t context = {
+            .plan = &evaluator->plan,
+            .set = &evaluator->set,
+            .output_kind = evaluator->output_kind,
+            .make_guess = evaluator->make_guess,
+            .n_classes = evaluator->plan.n_outputs > 1 ? evaluator->plan.n_outputs : 2,
+        };
+        evaluation_stats_t stats = evaluate_plan(&context, &(evaluate_options_t) {.n_threads = 1});
+        result.avg_test_error = stats.loss;
+        result.test_accuracy = ((int)(100000.0 * stats.n_correct / stats.n_examples)) * 0.00001;
+        result.passed_test = stats.n_correct;
+        evaluation_stats_free(&stats);
+        inference_free(&evaluator->plan);
+
+        pthread_mutex_lock(&evaluator->lock);
+        evaluator->result = result;
+        evaluator->pending = false;
+        evaluator->has_result = true;
+        pthread_cond_broadcast(&evaluator->idle);
+    }
+    pthread_mutex_unlock(&evaluator->lock);
+    return NULL;
+}
+
+async_evaluator_t* async_evaluator_create(training_info_t *training_info) {
+    neural_network_model_t *model = training_info->model;
+    assert(model_evaluate_supported(model));
+    assert(training_info->test_size > 0);
+
+    async_evaluator_t *evaluator = malloc(sizeof(async_evaluator_t));
+    *evaluator = (async_evaluator_t) {
+        .set = {
+            .n_examples = training_info->test_size,
+            .x = training_info->test_x,
+            .y = training_info->test_y,
+            .labels = training_info->test_labels,
+            .pixels = training_info->test_pixels,
+            .pixels_per_example = training_info->pixels_per_example,
+            .pixel_scale = training_info->pixel_scale,
+            .pixel_offset = training_info->pixel_offset,
+        },
+        .output_kind = layer_get_op_kind(model->output_layer),
+        .make_guess = model->output_layer->layer.output.make_guess,
+    };
+    pthread_mutex_init(&evaluator->lock, NULL);
+    pthread_cond_init(&evaluator->wake, NULL);
+    pthread_cond_init(&evaluator->idle, NULL);
+    pthread_create(&evaluator->thread, NULL, async_evaluator_run, evaluator);
+    return evaluator;
+}
+
+// snapshots the model's weights for the given epoch and starts evaluating them, the train stats are passed through to
+// the result. a finished result that was not consumed yet is dropped, waits if the previous evaluation still runs
+void async_evaluator_submit(async_evaluator_t *evaluator, neural_network_model_t *model, unsigned int epoch,
+        float train_accuracy, float avg_train_error) {
+    inference_model_t plan = model_compile_inference(model);
+
+    pthread_mutex_lock(&evaluator->lock);
+    while (evaluator->pending) {
+        pthread_cond_wait(&evaluator->idle, &evaluator->lock);
+    }
+    evaluator->plan = plan;
+    evaluator->result = (evaluation_result_t) {
+        .epoch = epoch,
+        .train_accuracy = train_accuracy,
+        .avg_train_error = avg_train_error,
+    };
+    evaluator->pending = true;
+    evaluator->has_result = false;
+    pthread_cond_signal(&evaluator->wake);
+    pthread_mutex_unlock(&evaluator->lock);
+}
+
+// takes the finished result if there is one, never blocks
+bool async_evaluator_poll(async_evaluator_t *evaluator, evaluation_result_t *result) {
+    pthread_mutex_lock(&evaluator->lock);
+    bool has_result = evaluator->has_result;
+    if (has_result) {
+        *result = evaluator->result;
+        evaluator->has_result = false;
+    }
+    pthread_mutex_unlock(&evaluator->lock);
+    return has_result;
+}
+
+// waits for the evaluation in flight and takes its result, false if there was nothing left to consume
+bool async_evaluator_wait(async_evaluator_t *evaluator, evaluation_result_t *result) {
+    pthread_mutex_lock(&evaluator->lock);
+    while (evaluator->pending) {
+        pthread_cond_wait(&evaluator->idle, &evaluator->lock);
+    }
+    pthread_mutex_unlock(&evaluator->lock);
+    return async_evaluator_poll(evaluator, result);
+}
+
+// finishes the evaluation in flight and stops the evaluator thread
+void async_evaluator_free(async_evaluator_t *evaluator) {
+    pthread_mutex_lock(&evaluator->lock);
+    evaluator->stop = true;
+    pthread_cond_signal(&evaluator->wake);
+    pthread_mutex_unlock(&evaluator->lock);
+    pthread_join(evaluator->thread, NULL);
+
+    pthread_mutex_destroy(&evaluator->lock);
+    pthread_cond_destroy(&evaluator->wake);
+    pthread_cond_destroy(&evaluator->idle);
+    free(evaluator);
+}
@@ -0,0 +1,288 @@
+#include <model/export.h>
+
+#include <stdio.h>
+
+// ops with at most this many weights are emitted as straight line code with the weights as literals,
+// larger ones loop over static const arrays with compile time bounds
+#define EXPORT_UNROLL_WEIGHTS 256
+
+// 9 significant digits, every weight round trips to the exact same float
+static void write_float(FILE *file, float value) {
+    fprintf(file, "%.8ef", value);
+}
+
+static void write_float_array(FILE *file, const float *values, int n, int per_row) {
+    for (int i = 0; i < n; i++) {
+        fprintf(file, i % per_row == 0 ? "\n    " : " ");
+        write_float(file, values[i]);
+        fprintf(file, ",");
+    }
+    fprintf(file, "\n");
+}
+
+// rows x columns initializer, one braced row per line
+static void write_float_rows(FILE *file, const float *values, int rows, int columns) {
+    for (int r = 0; r < rows; r++) {
+        fprintf(file, "\n    {");
+        for (int c = 0; c < columns; c++) {
+            fprintf(file, c == 0 ? "" : " ");
+            write_float(file, values[r * columns + c]);
+            fprintf(file, ",");
+        }
+        fprintf(file, "},");
+    }
+    fprintf(file, "\n");
+}
+
+static void write_int_array(FILE *file, const int *values, int n) {
+    for (int i = 0; i < n; i++) {
+        fprintf(file, i % 16 == 0 ? "\n    " : " ");
+        fprintf(file, "%d,", values[i]);
+    }
+    fprintf(file, "\n");
+}
+
+// elementwise activation wrapped around each output, softmax is applied to the whole output afterwards
+static const char* activation_function(inference_activation_t activation) {
+    switch (activation) {
+        case INFERENCE_ACTIVATION_SIGMOID:
+            return "sigmoid";
+        case INFERENCE_ACTIVATION_RELU:
+            return "relu";
+        case INFERENCE_ACTIVATION_TANH:
+            return "tanhf";
+        default:
+            return "";
+    }
+}
+
+static void write_preamble(FILE *file, inference_model_t *plan) {
+    fprintf(file,
+            "// generated by model_export_c, standalone prediction for a trained model\n"
+            "// void " EXPORT_PREDICT_FUNCTION "(const float *input, float *output);\n"
+            "#include <math.h>\n"
+            "#include <string.h>\n"
+            "\n"
+            "#define EXPORTED_MODEL_N_INPUTS %d\n"
+            "#define EXPORTED_MODEL_N_OUTPUTS %d\n"
+            "#define EXPORTED_MODEL_BUFFER_SIZE %d\n"
+            "\n"
+            "static inline float relu(float z) {\n"
+            "    return z > 0 ? z : 0;\n"
+            "}\n"
+            "\n"
+            "static inline float sigmoid(float z) {\n"
+            "    return 1.0f / (1.0f + expf(-z));\n"
+            "}\n"
+            "\n"
+            "static inline void softmax(float *values, int n) {\n"
+            "    float max = -INFINITY;\n"
+            "    for (int i = 0; i < n; i++) {\n"
+            "        max = fmaxf(max, values[i]);\n"
+            "    }\n"
+            "    float sum = 0;\n"
+            "    for (int i = 0; i < n; i++) {\n"
+            "        values[i] = expf(values[i] - max);\n"
+            "        sum += values[i];\n"
+            "    }\n"
+            "    for (int i = 0; i < n; i++) {\n"
+            "        values[i] /= sum;\n"
+            "    }\n"
+            "}\n",
+            plan->n_inputs, plan->n_outputs, plan->buffer_size);
+}
+
+// y[r] = act(w . x + b) with every nonzero weight as a literal, pruned weights disappear from the expression
+static void write_unrolled_dense(FILE *file, const inference_op_t *op) {
+    const char *act = activation_function(op->activation);
+    for (int r = 0; r < op->n_outputs; r++) {
+        int begin = op->type == INFERENCE_DENSE_SPARSE ? op->sparse_row_start[r] : r * op->n_inputs;
+        int end = op->type == INFERENCE_DENSE_SPARSE ? op->sparse_row_start[r + 1] : (r + 1) * op->n_inputs;
+        fprintf(file, "    y[%d] = %s(", r, act);
+        for (int i = begin; i < end; i++) {
+            if (op->weights[i] == 0) {
+                continue;
+            }
+            int column = op->type == INFERENCE_DENSE_SPARSE ? op->sparse_columns[i] : i - begin;
+            write_float(file, op->weights[i]);
+            fprintf(file, " * x[%d] + ", column);
+        }
+        write_float(file, op->bias[r]);
+        fprintf(file, ");\n");
+    }
+}
+
+static void write_dense_arrays(FILE *file, const inference_op_t *op, int op_i) {
+    if (op->type == INFERENCE_DENSE_SPARSE) {
+        fprintf(file, "\nstatic _Alignas(64) const float op_%d_weights[%d] = {", op_i, op->n_weights);
+        write_float_array(file, op->weights, op->n_weights, 8);
+        fprintf(file, "};\nstatic const int op_%d_columns[%d] = {", op_i, op->n_weights);
+        write_int_array(file, op->sparse_columns, op->n_weights);
+        fprintf(file, "};\nstatic const int op_%d_row_start[%d] = {", op_i, op->n_outputs + 1);
+        write_int_array(file, op->sparse_row_start, op->n_outputs + 1);
+        fprintf(file, "};\n");
+    } else {
+        fprintf(file, "\nstatic _Alignas(64) const float op_%d_weights[%d][%d] = {", op_i, op->n_outputs, op->n_inputs);
+        write_float_rows(file, op->weights, op->n_outputs, op->n_inputs);
+        fprintf(file, "};\n");
+    }
+    fprintf(file, "static _Alignas(64) const float op_%d_bias[%d] = {", op_i, op->n_bias);
+    write_float_array(file, op->bias, op->n_bias, 8);
+    fprintf(file, "};\n");
+}
+
+static void write_dense_loop(FILE *file, const inference_op_t *op, int op_i) {
+    fprintf(file, "    for (int r = 0; r < %d; r++) {\n", op->n_outputs);
+    fprintf(file, "        float z = op_%d_bias[r];\n", op_i);
+    if (op->type == INFERENCE_DENSE_SPARSE) {
+        fprintf(file, "        for (int i = op_%d_row_start[r]; i < op_%d_row_start[r + 1]; i++) {\n", op_i, op_i);
+        fprintf(file, "            z += op_%d_weights[i] * x[op_%d_columns[i]];\n", op_i, op_i);
+    } else {
+        fprintf(file, "        for (int c = 0; c < %d; c++) {\n", op->n_inputs);
+        fprintf(file, "            z += op_%d_weights[r][c] * x[c];\n", op_i);
+    }
+    fprintf(file, "        }\n");
+    fprintf(file, "        y[r] = %s(z);\n", activation_function(op->activation));
+    fprintf(file, "    }\n");
+}
+
+static void write_conv2d(FILE *file, const inference_op_t *op, int op_i) {
+    fprintf(file, "    for (int oc = 0; oc < %d; oc++) {\n", op->out_channels);
+    fprintf(file, "        for (int oy = 0; oy < %d; oy++) {\n", op->out_height);
+    fprintf(file, "            for (int ox = 0; ox < %d; ox++) {\n", op->out_width);
+    fprintf(file, "                float z = op_%d_bias[oc];\n", op_i);
+    fprintf(file, "                for (int ic = 0; ic < %d; ic++) {\n", op->in_channels);
+    fprintf(file, "                    for (int ky = 0; ky < %d; ky++) {\n", op->kernel);
+    fprintf(file, "                        const int iy = oy * %d - %d + ky;\n", op->stride, op->padding);
+    fprintf(file, "                        for (int kx = 0; kx < %d; kx++) {\n", op->kernel);
+    fprintf(file, "                            const int ix = ox * %d - %d + kx;\n", op->stride, op->padding);
+    fprintf(file, "                            if (iy >= 0 && iy < %d && ix >= 0 && ix < %d) {\n", op->in_height, op->in_width);
+    fprintf(file, "                                z += op_%d_weights[oc][(ic * %d + ky) * %d + kx] * x[(ic * %d + iy) * %d + ix];\n",
+            op_i, op->kernel, op->kernel, op->in_height, op->in_width);
+    fprintf(file, "                            }\n");
+    fprintf(file, "                        }\n");
+    fprintf(file, "                    }\n");
+    fprintf(file, "                }\n");
+    fprintf(file, "                y[(oc * %d + oy) * %d + ox] = %s(z);\n", op->out_height, op->out_width, activation_function(op->activation));
+    fprintf(file, "            }\n");
+    fprintf(file, "        }\n");
+    fprintf(file, "    }\n");
+}
+
+static void write_pool(FILE *file, const inference_op_t *op) {
+    const bool max = op->type == INFERENCE_MAXPOOL;
+    fprintf(file, "    for (int c = 0; c < %d; c++) {\n", op->out_channels);
+    fprintf(file, "        for (int oy = 0; oy < %d; oy++) {\n", op->out_height);
+    fprintf(file, "            for (int ox = 0; ox < %d; ox++) {\n", op->out_width);
+    fprintf(file, "                float pooled = %s;\n", max ? "-INFINITY" : "0");
+    fprintf(file, "                for (int ky = 0; ky < %d; ky++) {\n", op->kernel);
+    fprintf(file, "                    for (int kx = 0; kx < %d; kx++) {\n", op->kernel);
+    fprintf(file, "                        const float value = x[(c * %d + oy * %d + ky) * %d + ox * %d + kx];\n",
+            op->in_height, op->kernel, op->in_width, op->kernel);
+    fprintf(file, max ? "                        pooled = fmaxf(pooled, value);\n" : "                        pooled += value;\n");
+    fprintf(file, "                    }\n");
+    fprintf(file, "                }\n");
+    if (max) {
+        fprintf(file, "                y[(c * %d + oy) * %d + ox] = %s(pooled);\n", op->out_height, op->out_width, activation_function(op->activation));
+    } else {
+        fprintf(file, "                y[(c * %d + oy) * %d + ox] = %s(pooled * ", op->out_height, op->out_width, activation_function(op->activation));
+        write_float(file, 1.0f / (op->kernel * op->kernel));
+        fprintf(file, ");\n");
+    }
+    fprintf(file, "            }\n");
+    fprintf(file, "        }\n");
+    fprintf(file, "    }\n");
+}
+
+static void write_op(FILE *file, const inference_op_t *op, int op_i) {
+    const bool unrolled = (op->type == INFERENCE_DENSE || op->type == INFERENCE_DENSE_SPARSE) && op->n_weights <= EXPORT_UNROLL_WEIGHTS;
+    if (op->type == INFERENCE_CONV2D) {
+        fprintf(file, "\nstatic _Alignas(64) const float op_%d_weights[%d][%d] = {", op_i, op->out_channels, op->n_weights / op->out_channels);
+        write_float_rows(file, op->weights, op->out_channels, op->n_weights / op->out_channels);
+        fprintf(file, "};\nstatic _Alignas(64) const float op_%d_bias[%d] = {", op_i, op->n_bias);
+        write_float_array(file, op->bias, op->n_bias, 8);
+        fprintf(file, "};\n");
+    } else if (!unrolled && (op->type == INFERENCE_DENSE || op->type == INFERENCE_DENSE_SPARSE)) {
+        write_dense_arrays(file, op, op_i);
+    }
+
+    fprintf(file, "\n// %d -> %d\n", op->n_inputs, op->n_outputs);
+    fprintf(file, "static inline void op_%d(const float *restrict x, float *restrict y) {\n", op_i);
+    switch (op->type) {
+        case INFERENCE_DENSE:
+        case INFERENCE_DENSE_SPARSE:
+            if (unrolled) {
+                write_unrolled_dense(file, op);
+            } else {
+                write_dense_loop(file, op, op_i);
+            }
+            break;
+        case INFERENCE_CONV2D:
+            write_conv2d(file, op, op_i);
+            break;
+        case INFERENCE_MAXPOOL:
+        case INFERENCE_AVGPOOL:
+            write_pool(file, op);
+            break;
+        case INFERENCE_ACTIVATION:
+            fprintf(file, "    for (int i = 0; i < %d; i++) {\n", op->n_outputs);
+            fprintf(file, "        y[i] = %s(x[i]);\n", activation_function(op->activation));
+            fprintf(file, "    }\n");
+            break;
+        case INFERENCE_SCALE:
+            fprintf(file, "    for (int i = 0; i < %d; i++) {\n", op->n_outputs);
+            fprintf(file, "        y[i] = %s(x[i] * ", activation_function(op->activation));
+            write_float(file, op->scale);
+            fprintf(file, ");\n");
+            fprintf(file, "    }\n");
+            break;
+    }
+    if (op->activation == INFERENCE_ACTIVATION_SOFTMAX) {
+        fprintf(file, "    softmax(y, %d);\n", op->n_outputs);
+    }
+    fprintf(file, "}\n");
+}
+
+/**
+ * Writes a standalone C source file that computes the same predictions as the model's inference plan, with
+ * no dependency on util or model. Every dimension is a compile time constant, small dense layers are unrolled
+ * into straight line code with their weights as literals and larger ones loop over static const arrays, so the
+ * compiler can specialize and vectorize each layer. The file defines
+ *  void exported_model_predict(const float *input, float *output);
+ */
+bool model_export_c(neural_network_model_t *model, const char *file_path) {
+    FILE *file = fopen(file_path, "w");
+    if (file == NULL) {
+        printf("Failed to export model, could not open %s\n", file_path);
+        return false;
+    }
+
+    inference_model_t plan = model_compile_inference(model);
+    write_preamble(file, &plan);
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        write_op(file, &plan.ops[op_i], op_i);
+    }
+
+    // ops ping pong between two stack buffers, the last one writes straight to the output
+    fprintf(file, "\nvoid " EXPORT_PREDICT_FUNCTION "(const float *restrict input, float *restrict output) {\n");
+    if (plan.num_ops == 0) {
+        fprintf(file, "    memcpy(output, input, sizeof(float) * EXPORTED_MODEL_N_INPUTS);\n");
+    } else if (plan.num_ops > 1) {
+        fprintf(file, "    _Alignas(64) float buffers[2][EXPORTED_MODEL_BUFFER_SIZE];\n");
+    }
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        const char *src = op_i == 0 ? "input" : (op_i - 1) % 2 == 0 ? "buffers[0]" : "buffers[1]";
+        const char *dst = op_i == plan.num_ops - 1 ? "output" : op_i % 2 == 0 ? "buffers[0]" : "buffers[1]";
+        fprintf(file, "    op_%d(%s, %s);\n", op_i, src, dst);
+    }
+    fprintf(file, "}\n");
+    inference_free(&plan);
+
+    bool success = !ferror(file);
+    success = fclose(file) == 0 && success;
+    if (!success) {
+        printf("Failed to export model to %s\n", file_path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,468 @@
+#include <model/inference.h>
+
+#include <math.h>
+#include <string.h>
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
+
+static inference_activation_t find_dense_activation(dense_activation_t activation) {
+    switch (activation) {
+        case DENSE_ACTIVATION_RELU:
+            return INFERENCE_ACTIVATION_RELU;
+        case DENSE_ACTIVATION_SIGMOID:
+            return INFERENCE_ACTIVATION_SIGMOID;
+        case DENSE_ACTIVATION_TANH:
+            return INFERENCE_ACTIVATION_TANH;
+        default:
+            return INFERENCE_ACTIVATION_NONE;
+    }
+}
+
+static inference_activation_t find_activation(activation_layer_t *activation) {
+    if (activation->functions.feed_forward == activation_functions_sigmoid.feed_forward) {
+        return INFERENCE_ACTIVATION_SIGMOID;
+    } else if (activation->functions.feed_forward == activation_functions_relu.feed_forward) {
+        return INFERENCE_ACTIVATION_RELU;
+    } else if (activation->functions.feed_forward == activation_functions_softmax.feed_forward) {
+        return INFERENCE_ACTIVATION_SOFTMAX;
+    }
+    assert(0); // custom activations can not be compiled
+    return INFERENCE_ACTIVATION_NONE;
+}
+
+/**
+ * Compiles a model into an inference only plan. Weights are copied out so the training model can be freed afterwards.
+ *  - activation layers directly after a dense or convolution layer are fused into its epilogue
+ *  - dropout layers are dropped, their inference time scaling is folded into the next dense or convolution layer's weights
+ *  - low rank dense layers become two dense ops, the first without bias or activation
+ *  - dense layers running on their sparse kernels keep only their nonzero weights, in compressed sparse rows
+ */
+inference_model_t model_compile_inference(neural_network_model_t *model) {
+    assert(model->input_layer != NULL && model->input_layer->type == INPUT);
+    assert(model->output_layer != NULL && model->output_layer->type == OUTPUT);
+
+    inference_model_t plan = {
+        .ops = malloc(sizeof(inference_op_t) * 2 * model->num_layers), // low rank layers compile to two ops
+        .n_inputs = layer_get_neurons(model->input_layer).n_elements,
+    };
+    plan.buffer_size = plan.n_inputs;
+
+    // source weights of each dense op, copied into the plan's slab once all ops are known. ops without
+    // a source bias get a zero one
+    const float *source_weights[2 * model->num_layers];
+    const float *source_bias[2 * model->num_layers];
+    const dense_layer_t *source_sparse[2 * model->num_layers];
+    memset(source_sparse, 0, sizeof(source_sparse));
+
+    float pending_scale = 1;
+    int width = plan.n_inputs;
+    layer_t *current = model->input_layer->next;
+    for (int layer_i = 1; layer_i < (int) model->num_layers - 1; layer_i++) {
+        inference_op_t *last = plan.num_ops > 0 ? &plan.ops[plan.num_ops - 1] : NULL;
+        switch (current->type) {
+            case DENSE: {
+                dense_layer_t *dense = &current->layer.dense;
+                bool sparse = layer_get_op_kind(current) == OP_DENSE_SPARSE;
+                source_weights[plan.num_ops] = dense->weights.matrix;
+                source_bias[plan.num_ops] = dense->bias.matrix;
+                source_sparse[plan.num_ops] = sparse ? dense : NULL;
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = sparse ? INFERENCE_DENSE_SPARSE : INFERENCE_DENSE,
+                    .activation = find_dense_activation(dense->activation),
+                    .n_inputs = dense->weights.dims[1],
+                    .n_outputs = dense->weights.dims[0],
+                    .scale = pending_scale,
+                    .n_weights = sparse ? dense->n_nonzero : dense->weights.n_elements,
+                    .n_bias = dense->bias.n_elements,
+                };
+                if (sparse) {
+                    plan.n_indices += dense->n_nonzero + dense->weights.dims[0] + 1;
+                }
+                pending_scale = 1;
+                width = dense->weights.dims[0];
+                break;
+            }
+            case DENSE_LOWRANK: {
+                // V.X then U.(V.X) + b, the dropout scale goes into V and the activation into the second op
+                dense_lowrank_layer_t *dense = &current->layer.dense_lowrank;
+                source_weights[plan.num_ops] = dense->v.matrix;
+                source_bias[plan.num_ops] = NULL;
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = INFERENCE_DENSE,
+                    .activation = INFERENCE_ACTIVATION_NONE,
+                    .n_inputs = dense->v.dims[1],
+                    .n_outputs = dense->rank,
+                    .scale = pending_scale,
+                    .n_weights = dense->v.n_elements,
+                    .n_bias = dense->rank,
+                };
+                source_weights[plan.num_ops] = dense->u.matrix;
+                source_bias[plan.num_ops] = dense->bias.matrix;
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = INFERENCE_DENSE,
+                    .activation = find_dense_activation(dense->activation),
+                    .n_inputs = dense->rank,
+                    .n_outputs = dense->u.dims[0],
+                    .scale = 1,
+                    .n_weights = dense->u.n_elements,
+                    .n_bias = dense->bias.n_elements,
+                };
+                pending_scale = 1;
+                width = dense->u.dims[0];
+                break;
+            }
+            case CONV2D: {
+                conv2d_layer_t *conv = &current->layer.conv2d;
+                source_weights[plan.num_ops] = conv->weights.matrix;
+                source_bias[plan.num_ops] = conv->bias.matrix;
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = INFERENCE_CONV2D,
+                    .activation = INFERENCE_ACTIVATION_NONE,
+                    .n_inputs = conv->d_cost_wrt_input.n_elements,
+                    .n_outputs = conv->output.n_elements,
+                    .scale = pending_scale,
+                    .n_weights = conv->weights.n_elements,
+                    .n_bias = conv->bias.n_elements,
+                    .in_channels = conv->in_channels, .in_height = conv->in_height, .in_width = conv->in_width,
+                    .out_channels = conv->out_channels, .out_height = conv->out_height, .out_width = conv->out_width,
+                    .kernel = conv->kernel, .stride = conv->stride, .padding = conv->padding,
+                };
+                pending_scale = 1;
+                width = conv->output.n_elements;
+                if (conv->columns.n_elements > plan.columns_size) {
+                    plan.columns_size = conv->columns.n_elements;
+                }
+                break;
+            }
+            case POOL2D: {
+                // max and average pooling commute with a positive scale, so pending dropout scales pass through
+                pool2d_layer_t *pool = &current->layer.pool2d;
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = pool->mode == POOL_MAX ? INFERENCE_MAXPOOL : INFERENCE_AVGPOOL,
+                    .activation = INFERENCE_ACTIVATION_NONE,
+                    .n_inputs = pool->d_cost_wrt_input.n_elements,
+                    .n_outputs = pool->output.n_elements,
+                    .in_channels = pool->channels, .in_height = pool->in_height, .in_width = pool->in_width,
+                    .out_channels = pool->channels, .out_height = pool->out_height, .out_width = pool->out_width,
+                    .kernel = pool->size, .stride = pool->size,
+                };
+                width = pool->output.n_elements;
+                break;
+            }
+            case DROPOUT:
+                pending_scale *= 1 - current->layer.dropout.dropout;
+                break;
+            case ACTIVATION:
+                if (pending_scale != 1) {
+                    plan.ops[plan.num_ops++] = (inference_op_t) {
+                        .type = INFERENCE_SCALE, .n_inputs = width, .n_outputs = width, .scale = pending_scale,
+                    };
+                    pending_scale = 1;
+                } else if (last != NULL && (last->type == INFERENCE_DENSE || last->type == INFERENCE_DENSE_SPARSE
+                        || last->type == INFERENCE_CONV2D)
+                        && last->activation == INFERENCE_ACTIVATION_NONE) {
+                    last->activation = find_activation(&current->layer.activation);
+                    break;
+                }
+
+                plan.ops[plan.num_ops++] = (inference_op_t) {
+                    .type = INFERENCE_ACTIVATION,
+                    .activation = find_activation(&current->layer.activation),
+                    .n_inputs = width,
+                    .n_outputs = width,
+                };
+                break;
+            default:
+                assert(0);
+        }
+
+        if (width > plan.buffer_size) {
+            plan.buffer_size = width;
+        }
+        current = current->next;
+    }
+
+    if (pending_scale != 1) {
+        plan.ops[plan.num_ops++] = (inference_op_t) {
+            .type = INFERENCE_SCALE, .n_inputs = width, .n_outputs = width, .scale = pending_scale,
+        };
+    }
+
+    // the fused softmax cross entropy output layer applies the softmax itself
+    if (layer_get_op_kind(model->output_layer) == OP_OUTPUT_SOFTMAX_CROSS_ENTROPY) {
+        inference_op_t *last = plan.num_ops > 0 ? &plan.ops[plan.num_ops - 1] : NULL;
+        if (last != NULL && last->activation == INFERENCE_ACTIVATION_NONE) {
+            last->activation = INFERENCE_ACTIVATION_SOFTMAX;
+        } else {
+            plan.ops[plan.num_ops++] = (inference_op_t) {
+                .type = INFERENCE_ACTIVATION, .activation = INFERENCE_ACTIVATION_SOFTMAX, .n_inputs = width, .n_outputs = width,
+            };
+        }
+    }
+    plan.n_outputs = width;
+
+    // every op with weights has a bias, a fully pruned layer can have no weights left
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        if (plan.ops[op_i].n_bias > 0) {
+            plan.n_parameters += nmatrix_aligned_size(plan.ops[op_i].n_weights);
+            plan.n_parameters += nmatrix_aligned_size(plan.ops[op_i].n_bias);
+        }
+    }
+
+    plan.parameters = plan.n_parameters > 0 ? nmatrix_aligned_alloc(plan.n_parameters) : NULL;
+    plan.indices = plan.n_indices > 0 ? malloc(sizeof(int) * plan.n_indices) : NULL;
+    int offset = 0, index_offset = 0;
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        inference_op_t *op = &plan.ops[op_i];
+        if (op->n_bias == 0) {
+            continue;
+        }
+
+        float *weights = plan.parameters + offset;
+        if (source_sparse[op_i] != NULL) {
+            // gather the kept weights into contiguous rows
+            const dense_layer_t *dense = source_sparse[op_i];
+            int *row_start = plan.indices + index_offset;
+            int *columns = row_start + op->n_outputs + 1;
+            memcpy(row_start, dense->sparse_row_start, sizeof(int) * (op->n_outputs + 1));
+            memcpy(columns, dense->sparse_columns, sizeof(int) * op->n_weights);
+            for (int r = 0; r < op->n_outputs; r++) {
+                for (int i = row_start[r]; i < row_start[r + 1]; i++) {
+                    weights[i] = source_weights[op_i][r * op->n_inputs + columns[i]] * op->scale;
+                }
+            }
+            index_offset += op->n_outputs + 1 + op->n_weights;
+            op->sparse_row_start = row_start;
+            op->sparse_columns = columns;
+        } else {
+            for (int i = 0; i < op->n_weights; i++) {
+                weights[i] = source_weights[op_i][i] * op->scale;
+            }
+        }
+        offset += nmatrix_aligned_size(op->n_weights);
+
+        float *bias = plan.parameters + offset;
+        if (source_bias[op_i] != NULL) {
+            memcpy(bias, source_bias[op_i], sizeof(float) * op->n_bias);
+        } else {
+            memset(bias, 0, sizeof(float) * op->n_bias);
+        }
+        offset += nmatrix_aligned_size(op->n_bias);
+
+        op->weights = weights;
+        op->bias = bias;
+        op->scale = 1;
+    }
+
+    plan.buffers[0] = nmatrix_aligned_alloc(plan.buffer_size);
+    plan.buffers[1] = nmatrix_aligned_alloc(plan.buffer_size);
+    plan.columns = plan.columns_size > 0 ? nmatrix_aligned_alloc(plan.columns_size) : NULL;
+    return plan;
+}
+
+void inference_activate(inference_activation_t activation, float *values, int n) {
+    switch (activation) {
+        case INFERENCE_ACTIVATION_NONE:
+            break;
+        case INFERENCE_ACTIVATION_SIGMOID:
+            for (int i = 0; i < n; i++) {
+                values[i] = 1. / (1 + exp(-values[i]));
+            }
+            break;
+        case INFERENCE_ACTIVATION_RELU:
+            for (int i = 0; i < n; i++) {
+                values[i] = fmax(0, values[i]);
+            }
+            break;
+        case INFERENCE_ACTIVATION_TANH:
+            for (int i = 0; i < n; i++) {
+                values[i] = tanh(values[i]);
+            }
+            break;
+        case INFERENCE_ACTIVATION_SOFTMAX: {
+            float max = -INFINITY;
+            for (int i = 0; i < n; i++) {
+                max = fmaxf(max, values[i]);
+            }
+
+            float sum = 0;
+            for (int i = 0; i < n; i++) {
+                values[i] = expf(values[i] - max);
+                sum += values[i];
+            }
+
+            float inv_sum = 1.0 / sum;
+            for (int i = 0; i < n; i++) {
+                values[i] *= inv_sum;
+            }
+            break;
+        }
+    }
+}
+
+// runs one op of a plan, dst has room for op->n_outputs values and scratch for the plan's largest im2col buffer
+void inference_run_op(const inference_op_t *op, const float *src, float *dst, float *scratch) {
+    switch (op->type) {
+        case INFERENCE_DENSE:
+            for (int r = 0; r < op->n_outputs; r++) {
+                const float *row = op->weights + r * op->n_inputs;
+                float dot = 0;
+                for (int c = 0; c < op->n_inputs; c++) {
+                    dot += row[c] * src[c];
+                }
+                dst[r] = dot + op->bias[r];
+            }
+            break;
+        case INFERENCE_DENSE_SPARSE:
+            for (int r = 0; r < op->n_outputs; r++) {
+                float dot = 0;
+                for (int i = op->sparse_row_start[r]; i < op->sparse_row_start[r + 1]; i++) {
+                    dot += op->weights[i] * src[op->sparse_columns[i]];
+                }
+                dst[r] = dot + op->bias[r];
+            }
+            break;
+        case INFERENCE_CONV2D: {
+            const int patch_size = op->in_channels * op->kernel * op->kernel;
+            const int n_pixels = op->out_height * op->out_width;
+            nmatrix_t image = nmatrix_constructor(op->n_inputs, (float*) src, SHAPE(3, op->in_channels, op->in_height, op->in_width));
+            nmatrix_t columns = nmatrix_constructor(patch_size * n_pixels, scratch, SHAPE(2, patch_size, n_pixels));
+            nmatrix_t weights = nmatrix_constructor(op->n_weights, (float*) op->weights, SHAPE(2, op->out_channels, patch_size));
+            nmatrix_t output = nmatrix_constructor(op->n_outputs, dst, SHAPE(2, op->out_channels, n_pixels));
+            nmatrix_im2col(&image, op->kernel, op->stride, op->padding, &columns);
+            nmatrix_gemm(false, false, 1, &weights, &columns, 0, &output);
+            for (int channel = 0; channel < op->out_channels; channel++) {
+                for (int i = 0; i < n_pixels; i++) {
+                    dst[channel * n_pixels + i] += op->bias[channel];
+                }
+            }
+            break;
+        }
+        case INFERENCE_MAXPOOL:
+        case INFERENCE_AVGPOOL: {
+            nmatrix_t image = nmatrix_constructor(op->n_inputs, (float*) src, SHAPE(3, op->in_channels, op->in_height, op->in_width));
+            nmatrix_t output = nmatrix_constructor(op->n_outputs, dst, SHAPE(3, op->out_channels, op->out_height, op->out_width));
+            if (op->type == INFERENCE_MAXPOOL) {
+                nmatrix_maxpool(&image, SHAPE(3, 1, op->kernel, op->kernel), &output);
+            } else {
+                nmatrix_avgpool(&image, SHAPE(3, 1, op->kernel, op->kernel), &output);
+            }
+            break;
+        }
+        case INFERENCE_ACTIVATION:
+            memcpy(dst, src, sizeof(float) * op->n_outputs);
+            break;
+        case INFERENCE_SCALE:
+            for (int i = 0; i < op->n_outputs; i++) {
+                dst[i] = src[i] * op->scale;
+            }
+            break;
+    }
+    inference_activate(op->activation, dst, op->n_outputs);
+}
+
+// runs the plan on a single example, input and output are column vectors matching the compiled model
+nmatrix_t inference_predict(inference_model_t *plan, nmatrix_t input, nmatrix_t output) {
+    assert(input.n_elements == plan->n_inputs);
+    assert(output.n_elements == plan->n_outputs);
+
+    const float *src = input.matrix;
+    int buffer_i = 0;
+    for (int op_i = 0; op_i < plan->num_ops; op_i++) {
+        float *dst = plan->buffers[buffer_i];
+        inference_run_op(&plan->ops[op_i], src, dst, plan->columns);
+        src = dst;
+        buffer_i ^= 1;
+    }
+
+    memcpy(output.matrix, src, sizeof(float) * plan->n_outputs);
+    return output;
+}
+
+void inference_free(inference_model_t *plan) {
+    free(plan->ops);
+    nmatrix_aligned_free(plan->parameters);
+    free(plan->indices);
+    nmatrix_aligned_free(plan->buffers[0]);
+    nmatrix_aligned_free(plan->buffers[1]);
+    nmatrix_aligned_free(plan->columns);
+    *plan = (inference_model_t) {0};
+}
+
+inference_batch_t inference_batch_create(inference_model_t *plan, int batch_size) {
+    const int size = batch_size * plan->buffer_size;
+    return (inference_batch_t) {
+        .batch_size = batch_size,
+        .inputs = nmatrix_aligned_alloc(batch_size * plan->n_inputs),
+        .buffers = {nmatrix_aligned_alloc(size), nmatrix_aligned_alloc(size)},
+        .columns = plan->columns_size > 0 ? nmatrix_aligned_alloc(plan->columns_size) : NULL,
+    };
+}
+
+// examples a dense op computes together, each weight is loaded once per tile and feeds that many independent sums
+#define INFERENCE_BATCH_TILE 4
+
+// dense op over the whole batch. the examples of a tile share every weight load and their sums do not wait on each
+// other, where the per example loop loads the whole weight matrix again for every example and adds into a single sum
+static void inference_run_dense_batch(const inference_op_t *op, const float *src, float *dst, int n_examples) {
+    const int n_inputs = op->n_inputs, n_outputs = op->n_outputs;
+    for (int example_i = 0; example_i < n_examples; example_i += INFERENCE_BATCH_TILE) {
+        // a short last tile repeats its last example and drops the repeated sums
+        const int tile = n_examples - example_i < INFERENCE_BATCH_TILE ? n_examples - example_i : INFERENCE_BATCH_TILE;
+        const float *x[INFERENCE_BATCH_TILE];
+        for (int t = 0; t < INFERENCE_BATCH_TILE; t++) {
+            x[t] = src + (example_i + (t < tile ? t : tile - 1)) * n_inputs;
+        }
+
+        for (int r = 0; r < n_outputs; r++) {
+            const float *row = op->weights + r * n_inputs;
+            float dot0 = 0, dot1 = 0, dot2 = 0, dot3 = 0;
+            for (int c = 0; c < n_inputs; c++) {
+                const float weight = row[c];
+                dot0 += weight * x[0][c];
+                dot1 += weight * x[1][c];
+                dot2 += weight * x[2][c];
+                dot3 += weight * x[3][c];
+            }
+            const float dots[INFERENCE_BATCH_TILE] = {dot0, dot1, dot2, dot3};
+            for (int t = 0; t < tile; t++) {
+                dst[(example_i + t) * n_outputs + r] = dots[t] + op->bias[r];
+            }
+        }
+    }
+
+    for (int example_i = 0; example_i < n_examples; example_i++) {
+        inference_activate(op->activation, dst + example_i * n_outputs, n_outputs);
+    }
+}
+
+// runs the plan on the first n_examples rows of batch->inputs, returns their outputs as n_examples x n_outputs rows,
+// valid until the batch is used again
+const float* inference_predict_batch(inference_model_t *plan, inference_batch_t *batch, int n_examples) {
+    assert(n_examples > 0 && n_examples <= batch->batch_size);
+
+    const float *src = batch->inputs;
+    int buffer_i = 0;
+    for (int op_i = 0; op_i < plan->num_ops; op_i++) {
+        const inference_op_t *op = &plan->ops[op_i];
+        float *dst = batch->buffers[buffer_i];
+        if (op->type == INFERENCE_DENSE && n_examples > 1) {
+            inference_run_dense_batch(op, src, dst, n_examples);
+        } else {
+            for (int example_i = 0; example_i < n_examples; example_i++) {
+                inference_run_op(op, src + example_i * op->n_inputs, dst + example_i * op->n_outputs, batch->columns);
+            }
+        }
+        src = dst;
+        buffer_i ^= 1;
+    }
+    return src;
+}
+
+void inference_batch_free(inference_batch_t *batch) {
+    nmatrix_aligned_free(batch->inputs);
+    nmatrix_aligned_free(batch->buffers[0]);
+    nmatrix_aligned_free(batch->buffers[1]);
+    nmatrix_aligned_free(batch->columns);
+    *batch = (inference_batch_t) {0};
+}
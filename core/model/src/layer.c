@@ -2,6 +2,11 @@
 #include <util/math.h>
 
 #include <math.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
 
 nmatrix_t feedforward_donothing(layer_t *this, nmatrix_t input) {
     assert(0);
@@ -14,43 +19,232 @@ nmatrix_t backpropagation_donothing(layer_t *this, nmatrix_t d_error_wrt_output,
 }
 
 nmatrix_t input_feed_forward(layer_t *this, nmatrix_t input) {
-    nmatrix_memcpy(&this->layer.input.input_values, &input);
-    return this->layer.input.input_values;
+    // examples expanded from compact storage are already written in place
+    input_layer_t *input_layer = &this->layer.input;
+    if (input.matrix != input_layer->input_values.matrix) {
+        nmatrix_memcpy(&input_layer->input_values, &input);
+    }
+
+    // branch free compaction, every index is written and only the nonzero ones advance the count
+    const float *x = input_layer->input_values.matrix;
+    int n_active = 0;
+    for (int i = 0; i < input_layer->input_values.n_elements; i++) {
+        input_layer->active_indices[n_active] = i;
+        n_active += x[i] != 0;
+    }
+    input_layer->n_active = n_active;
+    return input_layer->input_values;
 }
 const layer_function_t input_functions = {
     .back_propagation = backpropagation_donothing,
     .feed_forward = input_feed_forward
 };
 
+// nonzero columns of the input when the layer directly follows a sparse enough input layer, NULL otherwise
+static const int* dense_active_inputs(layer_t *this, int *n_active) {
+    if (this->prev == NULL || this->prev->type != INPUT) {
+        return NULL;
+    }
+
+    const input_layer_t *input_layer = &this->prev->layer.input;
+    if (input_layer->n_active > INPUT_SPARSE_DENSITY * input_layer->input_values.n_elements) {
+        return NULL;
+    }
+    *n_active = input_layer->n_active;
+    return input_layer->active_indices;
+}
+
+// act(z) of a fused dense activation, its derivative wrt z is written to derivative
+static inline float dense_activate(dense_activation_t activation, float z, float *derivative) {
+    float y;
+    switch (activation) {
+        case DENSE_ACTIVATION_RELU:
+            *derivative = z > 0;
+            return fmax(0, z);
+        case DENSE_ACTIVATION_SIGMOID:
+            y = 1. / (1 + exp(-z));
+            *derivative = y * (1 - y);
+            return y;
+        case DENSE_ACTIVATION_TANH:
+            y = tanh(z);
+            *derivative = 1 - y * y;
+            return y;
+        default:
+            return z;
+    }
+}
+
+// Y = act(W.X + b), the activation and its derivative are computed while the dot product is still in a register
 nmatrix_t dense_feed_forward(layer_t *this, nmatrix_t input) {
-    nmatrix_multiply(&this->layer.dense.weights, &input, &this->layer.dense.activation_values);
-    nmatrix_add(&this->layer.dense.activation_values, &this->layer.dense.bias, &this->layer.dense.activation_values);
-    return this->layer.dense.activation_values;
+    dense_layer_t *dense = &this->layer.dense;
+    assert(input.n_elements == dense->weights.dims[1]);
+
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    const float *x = input.matrix;
+    float *y = dense->activation_values.matrix;
+    float *derivative = dense->activation_derivative.matrix;
+    int n_active = 0;
+    const int *active = dense_active_inputs(this, &n_active);
+    for (int r = 0; r < n_outputs; r++) {
+        const float *row = dense->weights.matrix + r * n_inputs;
+        float z = 0;
+        if (active != NULL) {
+            for (int i = 0; i < n_active; i++) {
+                z += row[active[i]] * x[active[i]];
+            }
+        } else {
+            for (int c = 0; c < n_inputs; c++) {
+                z += row[c] * x[c];
+            }
+        }
+        z += dense->bias.matrix[r];
+        y[r] = dense_activate(dense->activation, z, &derivative[r]);
+    }
+    return dense->activation_values;
+}
+
+// row r of dE/dW = dE/dY . X^T is the rank 1 update lr * dy[r] * X^T, accumulated straight into the sum, dE/db = dE/dY
+static inline void dense_accumulate_row(dense_layer_t *dense, int r, const float *x, float scaled_dy,
+        const int *active, int n_active) {
+    const int n_inputs = dense->weights.dims[1];
+    float *sum_row = dense->d_cost_wrt_weight_sum.matrix + r * n_inputs;
+    if (active != NULL) {
+        for (int i = 0; i < n_active; i++) {
+            sum_row[active[i]] += scaled_dy * x[active[i]];
+        }
+    } else {
+        for (int c = 0; c < n_inputs; c++) {
+            sum_row[c] += scaled_dy * x[c];
+        }
+    }
+    dense->d_cost_wrt_bias_sum.matrix[r] += scaled_dy;
+}
+
+// weight and bias gradients of a dense layer's backward pass, accumulated on the model's pool. x, dy and the active
+// columns are copies, the planned workspace hands their buffers to the previous layers' backward passes
+typedef struct Dense_Gradient_Task {
+    layer_t *layer;
+    float *x;
+    float *dy;
+    int *active;
+    int n_active; // -1 when every column gets a gradient
+    float learning_rate;
+    bool pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} dense_gradient_task_t;
+
+static void dense_gradient_run(void *argument) {
+    dense_gradient_task_t *task = argument;
+    dense_layer_t *dense = &task->layer->layer.dense;
+    const int *active = task->n_active >= 0 ? task->active : NULL;
+    for (int r = 0; r < dense->weights.dims[0]; r++) {
+        dense_accumulate_row(dense, r, task->x, task->learning_rate * task->dy[r], active, task->n_active);
+    }
+
+    pthread_mutex_lock(&task->lock);
+    task->pending = false;
+    pthread_cond_signal(&task->done);
+    pthread_mutex_unlock(&task->lock);
+}
+
+// waits until the weight gradients of a dense layer's last backward pass are in its gradient sums,
+// back propagation calls it for every layer before it returns
+void layer_wait_gradients(layer_t *layer) {
+    if (layer->type != DENSE || layer->layer.dense.gradient_task == NULL) {
+        return;
+    }
+    dense_gradient_task_t *task = layer->layer.dense.gradient_task;
+    pthread_mutex_lock(&task->lock);
+    while (task->pending) {
+        pthread_cond_wait(&task->done, &task->lock);
+    }
+    pthread_mutex_unlock(&task->lock);
+}
+
+static void dense_submit_gradients(layer_t *this, const float *x, const float *dy, const int *active, int n_active,
+        float learning_rate) {
+    dense_layer_t *dense = &this->layer.dense;
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    dense_gradient_task_t *task = dense->gradient_task;
+    if (task == NULL) {
+        task = malloc(sizeof(dense_gradient_task_t));
+        *task = (dense_gradient_task_t) {
+            .layer = this,
+            .x = malloc(sizeof(float) * n_inputs),
+            .dy = malloc(sizeof(float) * n_outputs),
+            .active = malloc(sizeof(int) * n_inputs),
+        };
+        pthread_mutex_init(&task->lock, NULL);
+        pthread_cond_init(&task->done, NULL);
+        dense->gradient_task = task;
+    }
+    layer_wait_gradients(this);
+
+    memcpy(task->x, x, sizeof(float) * n_inputs);
+    memcpy(task->dy, dy, sizeof(float) * n_outputs);
+    task->n_active = active != NULL ? n_active : -1;
+    if (active != NULL) {
+        memcpy(task->active, active, sizeof(int) * n_active);
+    }
+    task->learning_rate = learning_rate;
+    pthread_mutex_lock(&task->lock);
+    task->pending = true;
+    pthread_mutex_unlock(&task->lock);
+    thread_pool_submit(dense->model->pool, dense_gradient_run, task);
 }
 
 nmatrix_t dense_back_propagation(layer_t *this, nmatrix_t d_error_wrt_output, float learning_rate) {
-    // transpose input matrix
-    // todo see if this needs optimization, likely does since allocation on every iteration is a lot of work
+    // dE/d(W.X + b) = dE/dY * act'(W.X + b), written over the cached derivative which is not needed anymore
+    if (this->layer.dense.activation != DENSE_ACTIVATION_NONE) {
+        nmatrix_elementwise_multiply(&d_error_wrt_output, &this->layer.dense.activation_derivative, &this->layer.dense.activation_derivative);
+        d_error_wrt_output = this->layer.dense.activation_derivative;
+    }
+
+    dense_layer_t *dense = &this->layer.dense;
     nmatrix_t X = layer_get_neurons(this->prev);
-    nmatrix_t X_T = this->layer.dense.transposed_inputs;
-    nmatrix_transpose(&X, &X_T);
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    const float *x = X.matrix;
+    const float *dy = d_error_wrt_output.matrix;
+    float *dx = dense->d_cost_wrt_input.matrix;
 
-    nmatrix_t W = this->layer.dense.weights;
-    nmatrix_t W_T = this->layer.dense.transposed_weights;
-    nmatrix_transpose(&W, &W_T);
+    // frozen layers skip their parameter gradients, the earliest trainable layer skips dE/dX
+    bool update_parameters = this->requires_grad;
+    const bool propagate = this->needs_input_gradient;
 
-    nmatrix_multiply(&d_error_wrt_output, &X_T, &this->layer.dense.d_cost_wrt_weight);
-    nmatrix_memcpy(&this->layer.dense.d_cost_wrt_bias, &d_error_wrt_output);
-    nmatrix_multiply(&W_T, &d_error_wrt_output, &this->layer.dense.d_cost_wrt_input);
+    // columns of zero inputs get no weight gradient
+    int n_active = 0;
+    const int *active = dense_active_inputs(this, &n_active);
 
-    // apply adjustments
-    nmatrix_multiply_scalar(&this->layer.dense.d_cost_wrt_weight, learning_rate, &this->layer.dense.d_cost_wrt_weight);
-    nmatrix_multiply_scalar(&this->layer.dense.d_cost_wrt_bias, learning_rate, &this->layer.dense.d_cost_wrt_bias);
+    // dE/dX is all the previous layer waits for, so on a large layer dE/dW and dE/db become a task on the model's
+    // pool and run beside the rest of back propagation
+    if (update_parameters && propagate && dense->model->pool != NULL && n_outputs * n_inputs >= DENSE_PARALLEL_MIN_WEIGHTS) {
+        dense_submit_gradients(this, x, dy, active, n_active, learning_rate);
+        update_parameters = false;
+    }
 
-    nmatrix_add(&this->layer.dense.d_cost_wrt_weight_sum, &this->layer.dense.d_cost_wrt_weight, &this->layer.dense.d_cost_wrt_weight_sum);
-    nmatrix_add(&this->layer.dense.d_cost_wrt_bias_sum, &this->layer.dense.d_cost_wrt_bias, &this->layer.dense.d_cost_wrt_bias_sum);
+    // otherwise one sweep over the weights and their gradient sums, row r gets its dE/dW and dE/db update and
+    //  dE/dX = W^T . dE/dY gets row r of W scaled by dy[r]
+    if (propagate) {
+        memset(dx, 0, sizeof(float) * n_inputs);
+    }
+    for (int r = 0; r < n_outputs; r++) {
+        if (update_parameters) {
+            dense_accumulate_row(dense, r, x, learning_rate * dy[r], active, n_active);
+        }
 
-    return this->layer.dense.d_cost_wrt_input;
+        if (propagate) {
+            const float *w_row = dense->weights.matrix + r * n_inputs;
+            for (int c = 0; c < n_inputs; c++) {
+                dx[c] += dy[r] * w_row[c];
+            }
+        }
+    }
+
+    return dense->d_cost_wrt_input;
 }
 
 const layer_function_t dense_functions = {
@@ -58,26 +252,280 @@ const layer_function_t dense_functions = {
     .back_propagation = dense_back_propagation,
 };
 
-nmatrix_t dropout_feedforward(layer_t *this, nmatrix_t input) {
-    float keep = 1 - this->layer.dropout.dropout;
-    if (keep < 1) {
-        if (this->layer.dropout.model->is_training) {
-            for (int i = 0; i < input.n_elements; i++) {
-                this->layer.dropout.output.matrix[i] = input.matrix[i] * (random_uniform_range(1) <= keep);
+// Y = act(W.X + b) of a pruned layer, a CSR SpMV that only visits the kept weights of each row
+nmatrix_t dense_sparse_feed_forward(layer_t *this, nmatrix_t input) {
+    dense_layer_t *dense = &this->layer.dense;
+    assert(input.n_elements == dense->weights.dims[1]);
+
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    const int *columns = dense->sparse_columns;
+    const int *row_start = dense->sparse_row_start;
+    const float *x = input.matrix;
+    float *y = dense->activation_values.matrix;
+    float *derivative = dense->activation_derivative.matrix;
+    for (int r = 0; r < n_outputs; r++) {
+        const float *row = dense->weights.matrix + r * n_inputs;
+        float z = 0;
+        for (int i = row_start[r]; i < row_start[r + 1]; i++) {
+            z += row[columns[i]] * x[columns[i]];
+        }
+        z += dense->bias.matrix[r];
+        y[r] = dense_activate(dense->activation, z, &derivative[r]);
+    }
+    return dense->activation_values;
+}
+
+// same gradients as dense_back_propagation restricted to the kept weights, pruned weights get no gradient
+nmatrix_t dense_sparse_back_propagation(layer_t *this, nmatrix_t d_error_wrt_output, float learning_rate) {
+    dense_layer_t *dense = &this->layer.dense;
+    if (dense->activation != DENSE_ACTIVATION_NONE) {
+        nmatrix_elementwise_multiply(&d_error_wrt_output, &dense->activation_derivative, &dense->activation_derivative);
+        d_error_wrt_output = dense->activation_derivative;
+    }
+
+    nmatrix_t X = layer_get_neurons(this->prev);
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    const int *columns = dense->sparse_columns;
+    const int *row_start = dense->sparse_row_start;
+    const float *x = X.matrix;
+    const float *dy = d_error_wrt_output.matrix;
+    float *dx = dense->d_cost_wrt_input.matrix;
+    const bool update_parameters = this->requires_grad;
+    const bool propagate = this->needs_input_gradient;
+
+    if (propagate) {
+        memset(dx, 0, sizeof(float) * n_inputs);
+    }
+    for (int r = 0; r < n_outputs; r++) {
+        if (update_parameters) {
+            float *sum_row = dense->d_cost_wrt_weight_sum.matrix + r * n_inputs;
+            const float scaled_dy = learning_rate * dy[r];
+            for (int i = row_start[r]; i < row_start[r + 1]; i++) {
+                sum_row[columns[i]] += scaled_dy * x[columns[i]];
             }
-        } else {
-            for (int i = 0; i < input.n_elements; i++) {
-                this->layer.dropout.output.matrix[i] = input.matrix[i] * keep;
+            dense->d_cost_wrt_bias_sum.matrix[r] += scaled_dy;
+        }
+
+        if (propagate) {
+            const float *w_row = dense->weights.matrix + r * n_inputs;
+            for (int i = row_start[r]; i < row_start[r + 1]; i++) {
+                dx[columns[i]] += dy[r] * w_row[columns[i]];
             }
         }
+    }
+
+    return dense->d_cost_wrt_input;
+}
+
+const layer_function_t dense_sparse_functions = {
+    .feed_forward = dense_sparse_feed_forward,
+    .back_propagation = dense_sparse_back_propagation,
+};
+
+// Y = act(U.(V.X) + b), two thin matrix vector products through the rank r projection
+nmatrix_t dense_lowrank_feed_forward(layer_t *this, nmatrix_t input) {
+    dense_lowrank_layer_t *dense = &this->layer.dense_lowrank;
+    assert(input.n_elements == dense->v.dims[1]);
+
+    nmatrix_t x = nmatrix_constructor(input.n_elements, input.matrix, SHAPE(2, input.n_elements, 1));
+    nmatrix_gemm(false, false, 1, &dense->v, &x, 0, &dense->projection);
+    nmatrix_gemm(false, false, 1, &dense->u, &dense->projection, 0, &dense->activation_values);
+
+    float *y = dense->activation_values.matrix;
+    float *derivative = dense->activation_derivative.matrix;
+    for (int r = 0; r < dense->activation_values.n_elements; r++) {
+        y[r] = dense_activate(dense->activation, y[r] + dense->bias.matrix[r], &derivative[r]);
+    }
+    return dense->activation_values;
+}
+
+nmatrix_t dense_lowrank_back_propagation(layer_t *this, nmatrix_t d_error_wrt_output, float learning_rate) {
+    dense_lowrank_layer_t *dense = &this->layer.dense_lowrank;
+    if (dense->activation != DENSE_ACTIVATION_NONE) {
+        nmatrix_elementwise_multiply(&d_error_wrt_output, &dense->activation_derivative, &dense->activation_derivative);
+        d_error_wrt_output = dense->activation_derivative;
+    }
+
+    nmatrix_t X = layer_get_neurons(this->prev);
+    nmatrix_t x = nmatrix_constructor(X.n_elements, X.matrix, SHAPE(2, X.n_elements, 1));
+    nmatrix_t dy = nmatrix_constructor(d_error_wrt_output.n_elements, d_error_wrt_output.matrix, SHAPE(2, d_error_wrt_output.n_elements, 1));
+
+    // dE/dP = U^T . dE/dY for the projection P = V.X, needed by V's gradient and dE/dX
+    nmatrix_gemm(true, false, 1, &dense->u, &dy, 0, &dense->d_cost_wrt_projection);
+
+    // dE/dU = dE/dY . P^T, dE/dV = dE/dP . X^T, dE/db = dE/dY, accumulated straight into the sums
+    if (this->requires_grad) {
+        nmatrix_gemm(false, true, learning_rate, &dy, &dense->projection, 1, &dense->d_cost_wrt_u_sum);
+        nmatrix_gemm(false, true, learning_rate, &dense->d_cost_wrt_projection, &x, 1, &dense->d_cost_wrt_v_sum);
+        for (int r = 0; r < dy.n_elements; r++) {
+            dense->d_cost_wrt_bias_sum.matrix[r] += learning_rate * dy.matrix[r];
+        }
+    }
+
+    // dE/dX = V^T . dE/dP
+    if (this->needs_input_gradient) {
+        nmatrix_gemm(true, false, 1, &dense->v, &dense->d_cost_wrt_projection, 0, &dense->d_cost_wrt_input);
+    }
+    return dense->d_cost_wrt_input;
+}
+
+const layer_function_t dense_lowrank_functions = {
+    .feed_forward = dense_lowrank_feed_forward,
+    .back_propagation = dense_lowrank_back_propagation,
+};
+
+// Y = W . im2col(X) + b, where each row of Y is one output channel
+nmatrix_t conv2d_feed_forward(layer_t *this, nmatrix_t input) {
+    conv2d_layer_t *conv = &this->layer.conv2d;
+    nmatrix_t image = nmatrix_constructor(input.n_elements, input.matrix, SHAPE(3, conv->in_channels, conv->in_height, conv->in_width));
+    nmatrix_im2col(&image, conv->kernel, conv->stride, conv->padding, &conv->columns);
+
+    const int n_pixels = conv->out_height * conv->out_width;
+    nmatrix_t output = nmatrix_constructor(conv->output.n_elements, conv->output.matrix, SHAPE(2, conv->out_channels, n_pixels));
+    nmatrix_gemm(false, false, 1, &conv->weights, &conv->columns, 0, &output);
+    for (int channel = 0; channel < conv->out_channels; channel++) {
+        float *row = output.matrix + channel * n_pixels;
+        float bias = conv->bias.matrix[channel];
+        for (int i = 0; i < n_pixels; i++) {
+            row[i] += bias;
+        }
+    }
+    return conv->output;
+}
+
+// dE/dW = dE/dY . im2col(X)^T, dE/db = row sums of dE/dY, dE/dX = col2im(W^T . dE/dY)
+nmatrix_t conv2d_back_propagation(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
+    conv2d_layer_t *conv = &this->layer.conv2d;
+    const int n_pixels = conv->out_height * conv->out_width;
+    nmatrix_t dY = nmatrix_constructor(d_cost_wrt_output.n_elements, d_cost_wrt_output.matrix, SHAPE(2, conv->out_channels, n_pixels));
+
+    // accumulate straight into the gradient sums, already scaled by the learning rate
+    if (this->requires_grad) {
+        nmatrix_gemm(false, true, learning_rate, &dY, &conv->columns, 1, &conv->d_cost_wrt_weight_sum);
+        for (int channel = 0; channel < conv->out_channels; channel++) {
+            const float *row = dY.matrix + channel * n_pixels;
+            float sum = 0;
+            for (int i = 0; i < n_pixels; i++) {
+                sum += row[i];
+            }
+            conv->d_cost_wrt_bias_sum.matrix[channel] += learning_rate * sum;
+        }
+    }
+
+    if (!this->needs_input_gradient) {
+        return conv->d_cost_wrt_input;
+    }
+
+    nmatrix_gemm(true, false, 1, &conv->weights, &dY, 0, &conv->d_cost_wrt_columns);
+    nmatrix_t image = nmatrix_constructor(conv->d_cost_wrt_input.n_elements, conv->d_cost_wrt_input.matrix,
+            SHAPE(3, conv->in_channels, conv->in_height, conv->in_width));
+    nmatrix_col2im(&conv->d_cost_wrt_columns, conv->kernel, conv->stride, conv->padding, &image);
+    return conv->d_cost_wrt_input;
+}
+
+const layer_function_t conv2d_functions = {
+    .feed_forward = conv2d_feed_forward,
+    .back_propagation = conv2d_back_propagation,
+};
+
+nmatrix_t maxpool_feed_forward(layer_t *this, nmatrix_t input) {
+    pool2d_layer_t *pool = &this->layer.pool2d;
+    nmatrix_t image = nmatrix_constructor(input.n_elements, input.matrix, SHAPE(3, pool->channels, pool->in_height, pool->in_width));
+    nmatrix_t output = nmatrix_constructor(pool->output.n_elements, pool->output.matrix, SHAPE(3, pool->channels, pool->out_height, pool->out_width));
+
+    // only training passes are followed by back propagation, don't bother remembering the max otherwise
+    pool->has_indices = pool->model->is_training;
+    nmatrix_maxpool_indexed(&image, SHAPE(3, 1, pool->size, pool->size), &output, pool->has_indices ? pool->indices : NULL);
+    return pool->output;
+}
+
+// the gradient only flows to the input that was the max of each window
+nmatrix_t maxpool_back_propagation(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
+    pool2d_layer_t *pool = &this->layer.pool2d;
+    assert(pool->has_indices); // the forward pass has to run with model->is_training set
+
+    nmatrix_memset(&pool->d_cost_wrt_input, 0);
+    for (int i = 0; i < d_cost_wrt_output.n_elements; i++) {
+        pool->d_cost_wrt_input.matrix[pool->indices[i]] += d_cost_wrt_output.matrix[i];
+    }
+    return pool->d_cost_wrt_input;
+}
+
+const layer_function_t maxpool_functions = {
+    .feed_forward = maxpool_feed_forward,
+    .back_propagation = maxpool_back_propagation,
+};
+
+nmatrix_t avgpool_feed_forward(layer_t *this, nmatrix_t input) {
+    pool2d_layer_t *pool = &this->layer.pool2d;
+    nmatrix_t image = nmatrix_constructor(input.n_elements, input.matrix, SHAPE(3, pool->channels, pool->in_height, pool->in_width));
+    nmatrix_t output = nmatrix_constructor(pool->output.n_elements, pool->output.matrix, SHAPE(3, pool->channels, pool->out_height, pool->out_width));
+    nmatrix_avgpool(&image, SHAPE(3, 1, pool->size, pool->size), &output);
+    return pool->output;
+}
+
+// every input of a window gets an equal share of the window's gradient, inputs outside any window get none
+nmatrix_t avgpool_back_propagation(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
+    pool2d_layer_t *pool = &this->layer.pool2d;
+    const float share = 1.0 / (pool->size * pool->size);
+
+    nmatrix_memset(&pool->d_cost_wrt_input, 0);
+    for (int channel = 0; channel < pool->channels; channel++) {
+        float *dst = pool->d_cost_wrt_input.matrix + channel * pool->in_height * pool->in_width;
+        const float *src = d_cost_wrt_output.matrix + channel * pool->out_height * pool->out_width;
+        for (int r = 0; r < pool->out_height * pool->size; r++) {
+            const float *src_row = src + (r / pool->size) * pool->out_width;
+            for (int c = 0; c < pool->out_width * pool->size; c++) {
+                dst[r * pool->in_width + c] = src_row[c / pool->size] * share;
+            }
+        }
+    }
+    return pool->d_cost_wrt_input;
+}
+
+const layer_function_t avgpool_functions = {
+    .feed_forward = avgpool_feed_forward,
+    .back_propagation = avgpool_back_propagation,
+};
+
+nmatrix_t dropout_feedforward(layer_t *this, nmatrix_t input) {
+    dropout_layer_t *dropout = &this->layer.dropout;
+    float keep = 1 - dropout->dropout;
+    dropout->has_mask = keep < 1 && dropout->model->is_training;
+    if (dropout->has_mask) {
+        random_state_t *random = &dropout->model->random;
+        for (int i = 0; i < input.n_elements; i++) {
+            dropout->mask[i] = random_uniform(random) < keep;
+            dropout->output.matrix[i] = input.matrix[i] * dropout->mask[i];
+        }
+    } else if (keep < 1) {
+        for (int i = 0; i < input.n_elements; i++) {
+            dropout->output.matrix[i] = input.matrix[i] * keep;
+        }
     } else {
-        nmatrix_memcpy(&this->layer.dropout.output, &input);
+        nmatrix_memcpy(&dropout->output, &input);
     }
+    return dropout->output;
 }
 
+// dropped units did not contribute to the output, so they get no gradient. a pass without a mask scaled every unit
 nmatrix_t dropout_backpropagation(layer_t *this, nmatrix_t d_error_wrt_output, float learning_rate) {
-    nmatrix_memcpy(&this->layer.dropout.d_cost_wrt_input, &d_error_wrt_output);
-    return this->layer.dropout.d_cost_wrt_input;
+    dropout_layer_t *dropout = &this->layer.dropout;
+    float keep = 1 - dropout->dropout;
+    if (dropout->has_mask) {
+        for (int i = 0; i < d_error_wrt_output.n_elements; i++) {
+            dropout->d_cost_wrt_input.matrix[i] = d_error_wrt_output.matrix[i] * dropout->mask[i];
+        }
+    } else if (keep < 1) {
+        for (int i = 0; i < d_error_wrt_output.n_elements; i++) {
+            dropout->d_cost_wrt_input.matrix[i] = d_error_wrt_output.matrix[i] * keep;
+        }
+    } else {
+        nmatrix_memcpy(&dropout->d_cost_wrt_input, &d_error_wrt_output);
+    }
+    return dropout->d_cost_wrt_input;
 }
 
 const layer_function_t dropout_functions = {
@@ -103,49 +551,62 @@ nmatrix_t activation_feed_forward_relu(layer_t *this, nmatrix_t input) {
     return this->layer.activation.activated_values;
 }
 
-nmatrix_t activation_feed_forward_softmax(layer_t *this, nmatrix_t input) {
+// numerically stable softmax, one exp per element with the max subtracted so large logits can not overflow
+// returns log(sum(exp(x))), so log(y[i]) = x[i] - returned value without another log per element
+static float softmax(const float *x, float *y, int n) {
+    float max = -INFINITY;
+    for (int i = 0; i < n; i++) {
+        max = fmaxf(max, x[i]);
+    }
+
     float sum = 0;
-    for (int i = 0; i < input.n_elements; i++) {
-        sum += exp(input.matrix[i]);
+    for (int i = 0; i < n; i++) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
     }
 
-    float inv_sum = 1.0/sum;
-    for (int i = 0; i < input.n_elements; i++) {
-        this->layer.activation.activated_values.matrix[i] = exp(input.matrix[i]) * inv_sum;
+    float inv_sum = 1.0 / sum;
+    for (int i = 0; i < n; i++) {
+        y[i] *= inv_sum;
     }
+    return max + logf(sum);
+}
+
+nmatrix_t activation_feed_forward_softmax(layer_t *this, nmatrix_t input) {
+    softmax(input.matrix, this->layer.activation.activated_values.matrix, input.n_elements);
     return this->layer.activation.activated_values;
 }
 
 nmatrix_t activation_back_propagation_sigmoid(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
     nmatrix_t X = layer_get_neurons(this->prev);
 
-    // nmatrix_for_each_operator(&X, sigmoid_prime, &this->layer.activation.activated_values);
+    // nmatrix_for_each_operator(&X, sigmoid_prime, &this->layer.activation.d_cost_wrt_input);
     for (int i = 0; i < X.n_elements; i++) {
         float z = 1.0 / (1 + exp(-X.matrix[i]));
-        this->layer.activation.activated_values.matrix[i] = z * (1-z);
+        this->layer.activation.d_cost_wrt_input.matrix[i] = z * (1-z);
     }
 
-    nmatrix_elementwise_multiply(&d_cost_wrt_output, &this->layer.activation.activated_values, &this->layer.activation.activated_values);
-    return this->layer.activation.activated_values;
+    nmatrix_elementwise_multiply(&d_cost_wrt_output, &this->layer.activation.d_cost_wrt_input, &this->layer.activation.d_cost_wrt_input);
+    return this->layer.activation.d_cost_wrt_input;
 }
 
 nmatrix_t activation_back_propagation_relu(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
     nmatrix_t X = layer_get_neurons(this->prev);
 
-    // nmatrix_for_each_operator(&X, relu_prime, &this->layer.activation.activated_values);
+    // nmatrix_for_each_operator(&X, relu_prime, &this->layer.activation.d_cost_wrt_input);
     for (int i = 0; i < X.n_elements; i++) {
-        this->layer.activation.activated_values.matrix[i] = X.matrix[i] > 0;
+        this->layer.activation.d_cost_wrt_input.matrix[i] = X.matrix[i] > 0;
     }
 
-    nmatrix_elementwise_multiply(&d_cost_wrt_output, &this->layer.activation.activated_values, &this->layer.activation.activated_values);
-    return this->layer.activation.activated_values;
+    nmatrix_elementwise_multiply(&d_cost_wrt_output, &this->layer.activation.d_cost_wrt_input, &this->layer.activation.d_cost_wrt_input);
+    return this->layer.activation.d_cost_wrt_input;
 }
 
 // this uses the trick described here  https://stackoverflow.com/questions/58461808/understanding-backpropagation-with-softmax
 // which requires another layer before this to compute the partial derivatives
 nmatrix_t activation_back_propagation_softmax(layer_t *this, nmatrix_t d_cost_wrt_output, float learning_rate) {
-    nmatrix_memcpy(&this->layer.activation.activated_values, &d_cost_wrt_output);
-    return this->layer.activation.activated_values;
+    nmatrix_memcpy(&this->layer.activation.d_cost_wrt_input, &d_cost_wrt_output);
+    return this->layer.activation.d_cost_wrt_input;
 }
 
 const layer_function_t activation_functions_sigmoid = {
@@ -189,15 +650,7 @@ nmatrix_t output_make_guess_round(layer_t *this, nmatrix_t output) {
 }
 
 nmatrix_t output_make_guess_softmax(layer_t *this, nmatrix_t output) {
-    float sum = 0;
-    for (int i = 0; i < output.n_elements; i++) {
-        sum += exp(output.matrix[i]);
-    }
-
-    float inv_sum = 1.0 / sum;
-    for (int i = 0; i < output.n_elements; i++) {
-        this->layer.output.guess.matrix[i] = exp(output.matrix[i]) * inv_sum;
-    }
+    softmax(output.matrix, this->layer.output.guess.matrix, output.n_elements);
     return this->layer.output.guess;
 }
 
@@ -229,13 +682,166 @@ float output_cost_mean_squared(layer_t *this, nmatrix_t expected_output) {
 const float epsilon = 0.0001;
 float output_cost_categorical_cross_entropy(layer_t *this, nmatrix_t expected_output) {
     float cross_entropy = 0;
-    nmatrix_t actual_output = this->layer.output.guess; // USES guess (assumption that softmax is used)
+    nmatrix_t actual_output = this->layer.output.output_values; // assumes a softmax activation layer came before
     for (int i = 0; i < actual_output.n_elements; i++) {
-        cross_entropy += expected_output.matrix[i] * log10(actual_output.matrix[i] + epsilon);
+        if (expected_output.matrix[i] != 0) {
+            cross_entropy += expected_output.matrix[i] * logf(actual_output.matrix[i] + epsilon);
+        }
     }
     return -cross_entropy;
 }
 
+// Softmax fused into Categorical Cross Entropy, the output layer takes raw logits from the previous layer
+// the forward pass stores the probabilities in output_values and log(sum(exp(logits))), so
+//  loss = sum(y* * (log_sum_exp - logits)) needs no log per element
+//  gradient = softmax(logits) - y*
+nmatrix_t output_feed_forward_softmax_cross_entropy(layer_t *this, nmatrix_t logits) {
+    this->layer.output.log_sum_exp = softmax(logits.matrix, this->layer.output.output_values.matrix, logits.n_elements);
+    return this->layer.output.output_values;
+}
+
+nmatrix_t output_back_propagation_softmax_cross_entropy(layer_t *this, nmatrix_t expected_output, float learning_rate) {
+    nmatrix_sub(&this->layer.output.output_values, &expected_output, &this->layer.output.d_cost_wrt_input);
+    return this->layer.output.d_cost_wrt_input;
+}
+
+float output_cost_softmax_cross_entropy(layer_t *this, nmatrix_t expected_output) {
+    const float *logits = layer_get_neurons(this->prev).matrix;
+    const float log_sum_exp = this->layer.output.log_sum_exp;
+    float cross_entropy = 0;
+    for (int i = 0; i < expected_output.n_elements; i++) {
+        cross_entropy += expected_output.matrix[i] * (log_sum_exp - logits[i]);
+    }
+    return cross_entropy;
+}
+
+/**
+ * Softmax cross entropy over a batch stored as columns, logits and expected are n_classes x batch.
+ * Every pass runs across a block of up to SOFTMAX_BATCH_BLOCK columns so the max, exp and sums vectorize over
+ * the columns while their per column state stays on the stack.
+ * probabilities and gradient (both n_classes x batch) may be NULL when not needed. Returns the summed loss.
+ */
+float output_softmax_cross_entropy_batched(nmatrix_t *logits, nmatrix_t *expected, nmatrix_t *probabilities, nmatrix_t *gradient) {
+    assert(logits->n_dims == 2);
+    assert(expected->n_elements == logits->n_elements);
+    const int n_classes = logits->dims[0];
+    const int batch = logits->dims[1];
+    // exp(logit - max) goes wherever there is room for it, probabilities are normalized once the sums are known
+    float *exps = probabilities != NULL ? probabilities->matrix : gradient != NULL ? gradient->matrix : NULL;
+
+    float loss = 0;
+    float max[SOFTMAX_BATCH_BLOCK], sum[SOFTMAX_BATCH_BLOCK];
+    for (int first = 0; first < batch; first += SOFTMAX_BATCH_BLOCK) {
+        const int n_columns = batch - first < SOFTMAX_BATCH_BLOCK ? batch - first : SOFTMAX_BATCH_BLOCK;
+        for (int b = 0; b < n_columns; b++) {
+            max[b] = -INFINITY;
+            sum[b] = 0;
+        }
+        for (int r = 0; r < n_classes; r++) {
+            const float *row = logits->matrix + r * batch + first;
+            for (int b = 0; b < n_columns; b++) {
+                max[b] = fmaxf(max[b], row[b]);
+            }
+        }
+
+        for (int r = 0; r < n_classes; r++) {
+            const float *row = logits->matrix + r * batch + first;
+            for (int b = 0; b < n_columns; b++) {
+                float e = expf(row[b] - max[b]);
+                sum[b] += e;
+                if (exps != NULL) {
+                    exps[r * batch + first + b] = e;
+                }
+            }
+        }
+
+        for (int b = 0; b < n_columns; b++) {
+            max[b] += logf(sum[b]); // now log_sum_exp of each column
+            sum[b] = 1.0 / sum[b];
+        }
+        for (int r = 0; r < n_classes; r++) {
+            const int offset = r * batch + first;
+            const float *row = logits->matrix + offset;
+            const float *y = expected->matrix + offset;
+            for (int b = 0; b < n_columns; b++) {
+                loss += y[b] * (max[b] - row[b]);
+                if (exps != NULL) {
+                    float p = exps[offset + b] * sum[b];
+                    if (probabilities != NULL) {
+                        probabilities->matrix[offset + b] = p;
+                    }
+                    if (gradient != NULL) {
+                        gradient->matrix[offset + b] = p - y[b];
+                    }
+                }
+            }
+        }
+    }
+    return loss;
+}
+
+// label mode, the target is a class index instead of a one hot matrix so the built in outputs index it
+// directly. custom outputs only understand matrices and get a temporary one hot target built for them
+static nmatrix_t one_hot_target(layer_t *this, int label) {
+    nmatrix_t target = nmatrix_copy(&this->layer.output.output_values);
+    memset(target.matrix, 0, sizeof(float) * target.n_elements);
+    target.matrix[label] = 1;
+    return target;
+}
+
+nmatrix_t output_back_propagation_label(layer_t *this, int label, float learning_rate) {
+    nmatrix_t output = this->layer.output.output_values;
+    nmatrix_t d_cost_wrt_input = this->layer.output.d_cost_wrt_input;
+    assert(label >= 0 && label < output.n_elements);
+
+    switch (layer_get_op_kind(this)) {
+        case OP_OUTPUT_MEAN_SQUARED: {
+            const float scale = 2.0 / (float) output.n_elements;
+            for (int i = 0; i < output.n_elements; i++) {
+                d_cost_wrt_input.matrix[i] = output.matrix[i] * scale;
+            }
+            d_cost_wrt_input.matrix[label] -= scale;
+            return d_cost_wrt_input;
+        }
+        case OP_OUTPUT_CROSS_ENTROPY:
+        case OP_OUTPUT_SOFTMAX_CROSS_ENTROPY:
+            nmatrix_memcpy(&d_cost_wrt_input, &output);
+            d_cost_wrt_input.matrix[label] -= 1;
+            return d_cost_wrt_input;
+        default: {
+            nmatrix_t target = one_hot_target(this, label);
+            this->layer.output.functions.back_propagation(this, target, learning_rate);
+            nmatrix_free(&target);
+            return this->layer.output.d_cost_wrt_input;
+        }
+    }
+}
+
+float output_cost_label(layer_t *this, int label) {
+    nmatrix_t output = this->layer.output.output_values;
+    assert(label >= 0 && label < output.n_elements);
+
+    if (this->layer.output.loss == output_cost_softmax_cross_entropy) {
+        return this->layer.output.log_sum_exp - layer_get_neurons(this->prev).matrix[label];
+    } else if (this->layer.output.loss == output_cost_categorical_cross_entropy) {
+        return -logf(output.matrix[label] + epsilon);
+    } else if (this->layer.output.loss == output_cost_mean_squared) {
+        // measured on the guess like output_cost_mean_squared
+        nmatrix_t guess = layer_get_neurons(this);
+        float mean_squared = 0;
+        for (int i = 0; i < guess.n_elements; i++) {
+            mean_squared += guess.matrix[i] * guess.matrix[i];
+        }
+        mean_squared += 1 - 2 * guess.matrix[label];
+        return mean_squared / guess.n_elements;
+    }
+
+    nmatrix_t target = one_hot_target(this, label);
+    float cost = this->layer.output.loss(this, target);
+    nmatrix_free(&target);
+    return cost;
+}
+
 const layer_function_t output_functions_meansquared = {
     .feed_forward = feedforward_donothing,
     .back_propagation = output_back_propagation_mean_squared,
@@ -244,6 +850,10 @@ const layer_function_t output_functions_crossentropy = {
     .feed_forward = feedforward_donothing,
     .back_propagation = output_back_propagation_categorical_cross_entropy
 };
+const layer_function_t output_functions_softmax_crossentropy = {
+    .feed_forward = output_feed_forward_softmax_cross_entropy,
+    .back_propagation = output_back_propagation_softmax_cross_entropy,
+};
 
 
 
@@ -253,6 +863,12 @@ char* get_layer_name(layer_t *layer) {
             return "Input";
         case DENSE:
             return "Dense";
+        case DENSE_LOWRANK:
+            return "Dense Low Rank";
+        case CONV2D:
+            return "Conv2D";
+        case POOL2D:
+            return layer->layer.pool2d.mode == POOL_MAX ? "MaxPool" : "AvgPool";
         case DROPOUT:
             return "Dropout";
         case ACTIVATION:
@@ -276,11 +892,28 @@ char* get_activation_function_name(activation_layer_t *layer) {
     }
 }
 
+char* get_dense_activation_name(dense_layer_t *layer) {
+    switch (layer->activation) {
+        case DENSE_ACTIVATION_NONE:
+            return "None";
+        case DENSE_ACTIVATION_RELU:
+            return "RELU";
+        case DENSE_ACTIVATION_SIGMOID:
+            return "Sigmoid";
+        case DENSE_ACTIVATION_TANH:
+            return "Tanh";
+        default:
+            assert(0);
+    }
+}
+
 char* get_output_function_name(output_layer_t *layer) {
     if (layer->functions.back_propagation == output_back_propagation_mean_squared) {
         return "Mean Squared Loss";
     } else if (layer->functions.back_propagation == output_back_propagation_categorical_cross_entropy) {
         return "Cross Entropy Loss";
+    } else if (layer->functions.back_propagation == output_back_propagation_softmax_cross_entropy) {
+        return "Softmax Cross Entropy Loss";
     } else {
         assert(0);
     }
@@ -300,33 +933,71 @@ char* get_output_guess_function_name(output_layer_t *layer) {
     }
 }
 
+// buffers placed by the memory planner live in the model's workspace and are released with it
+static void layer_free_buffer(layer_t *layer, nmatrix_t *buffer) {
+    float *workspace = layer->model->workspace;
+    if (workspace != NULL && buffer->matrix >= workspace && buffer->matrix < workspace + layer->model->workspace_size) {
+        return;
+    }
+    nmatrix_free(buffer);
+}
+
 void layer_free(layer_t *layer) {
     switch (layer->type) {
         case INPUT:
             nmatrix_free(&layer->layer.input.input_values);
+            free(layer->layer.input.active_indices);
             break;
         case DENSE:
-            nmatrix_free(&layer->layer.dense.activation_values);
-            nmatrix_free(&layer->layer.dense.weights);
-            nmatrix_free(&layer->layer.dense.bias);
-            nmatrix_free(&layer->layer.dense.d_cost_wrt_input);
-            nmatrix_free(&layer->layer.dense.d_cost_wrt_weight);
-            nmatrix_free(&layer->layer.dense.d_cost_wrt_bias);
-            nmatrix_free(&layer->layer.dense.d_cost_wrt_weight_sum);
-            nmatrix_free(&layer->layer.dense.d_cost_wrt_bias_sum);
+            // weights, bias and gradient sums belong to the model's parameter arena
+            layer_free_buffer(layer, &layer->layer.dense.activation_values);
+            layer_free_buffer(layer, &layer->layer.dense.activation_derivative);
+            layer_free_buffer(layer, &layer->layer.dense.d_cost_wrt_input);
+            free(layer->layer.dense.mask);
+            free(layer->layer.dense.sparse_columns);
+            free(layer->layer.dense.sparse_row_start);
+            if (layer->layer.dense.gradient_task != NULL) {
+                dense_gradient_task_t *task = layer->layer.dense.gradient_task;
+                layer_wait_gradients(layer);
+                pthread_mutex_destroy(&task->lock);
+                pthread_cond_destroy(&task->done);
+                free(task->x);
+                free(task->dy);
+                free(task->active);
+                free(task);
+            }
+            break;
+        case DENSE_LOWRANK:
+            layer_free_buffer(layer, &layer->layer.dense_lowrank.activation_values);
+            layer_free_buffer(layer, &layer->layer.dense_lowrank.activation_derivative);
+            layer_free_buffer(layer, &layer->layer.dense_lowrank.projection);
+            layer_free_buffer(layer, &layer->layer.dense_lowrank.d_cost_wrt_projection);
+            layer_free_buffer(layer, &layer->layer.dense_lowrank.d_cost_wrt_input);
+            break;
+        case CONV2D:
+            layer_free_buffer(layer, &layer->layer.conv2d.output);
+            layer_free_buffer(layer, &layer->layer.conv2d.columns);
+            layer_free_buffer(layer, &layer->layer.conv2d.d_cost_wrt_columns);
+            layer_free_buffer(layer, &layer->layer.conv2d.d_cost_wrt_input);
+            break;
+        case POOL2D:
+            layer_free_buffer(layer, &layer->layer.pool2d.output);
+            layer_free_buffer(layer, &layer->layer.pool2d.d_cost_wrt_input);
+            free(layer->layer.pool2d.indices);
             break;
         case DROPOUT:
-            nmatrix_free(&layer->layer.dropout.output);
-            nmatrix_free(&layer->layer.dropout.d_cost_wrt_input);
+            layer_free_buffer(layer, &layer->layer.dropout.output);
+            layer_free_buffer(layer, &layer->layer.dropout.d_cost_wrt_input);
+            free(layer->layer.dropout.mask);
             break;
         case ACTIVATION:
-            nmatrix_free(&layer->layer.activation.activated_values);
-            nmatrix_free(&layer->layer.activation.d_cost_wrt_input);
+            layer_free_buffer(layer, &layer->layer.activation.activated_values);
+            layer_free_buffer(layer, &layer->layer.activation.d_cost_wrt_input);
             break;
         case OUTPUT:
             nmatrix_free(&layer->layer.output.output_values);
             nmatrix_free(&layer->layer.output.guess);
-            nmatrix_free(&layer->layer.output.d_cost_wrt_input);
+            layer_free_buffer(layer, &layer->layer.output.d_cost_wrt_input);
             break;
     }
     free(layer);
@@ -340,6 +1011,12 @@ nmatrix_t layer_get_neurons(layer_t *layer) {
             return layer->layer.dropout.output;
         case DENSE:
             return layer->layer.dense.activation_values;
+        case DENSE_LOWRANK:
+            return layer->layer.dense_lowrank.activation_values;
+        case CONV2D:
+            return layer->layer.conv2d.output;
+        case POOL2D:
+            return layer->layer.pool2d.output;
         case ACTIVATION:
             return layer->layer.activation.activated_values;
         case OUTPUT:
@@ -347,4 +1024,226 @@ nmatrix_t layer_get_neurons(layer_t *layer) {
         default:
             assert(0);
     }
+}
+
+// channels, height and width of the image a layer outputs. convolution and pooling layers know their own, shape
+// preserving layers (dropout, activation) pass through the previous layer's and anything else is read as a single
+// channel square image. returns false if the neurons can not be viewed as an image
+bool layer_get_image_shape(layer_t *layer, int *channels, int *height, int *width) {
+    while (layer->type == DROPOUT || layer->type == ACTIVATION) {
+        layer = layer->prev;
+    }
+
+    if (layer->type == CONV2D) {
+        *channels = layer->layer.conv2d.out_channels;
+        *height = layer->layer.conv2d.out_height;
+        *width = layer->layer.conv2d.out_width;
+        return true;
+    } else if (layer->type == POOL2D) {
+        *channels = layer->layer.pool2d.channels;
+        *height = layer->layer.pool2d.out_height;
+        *width = layer->layer.pool2d.out_width;
+        return true;
+    }
+
+    int n_elements = layer_get_neurons(layer).n_elements;
+    int side = (int) round(sqrt(n_elements));
+    *channels = 1;
+    *height = side;
+    *width = side;
+    return side * side == n_elements;
+}
+
+// collects the trainable tensors of a layer and their matching gradient sums
+// returns the number of tensors, at most LAYER_MAX_PARAMETERS
+int layer_get_parameters(layer_t *layer, nmatrix_t **parameters, nmatrix_t **gradients) {
+    switch (layer->type) {
+        case DENSE:
+            parameters[0] = &layer->layer.dense.weights;
+            gradients[0] = &layer->layer.dense.d_cost_wrt_weight_sum;
+            parameters[1] = &layer->layer.dense.bias;
+            gradients[1] = &layer->layer.dense.d_cost_wrt_bias_sum;
+            return 2;
+        case DENSE_LOWRANK:
+            parameters[0] = &layer->layer.dense_lowrank.u;
+            gradients[0] = &layer->layer.dense_lowrank.d_cost_wrt_u_sum;
+            parameters[1] = &layer->layer.dense_lowrank.v;
+            gradients[1] = &layer->layer.dense_lowrank.d_cost_wrt_v_sum;
+            parameters[2] = &layer->layer.dense_lowrank.bias;
+            gradients[2] = &layer->layer.dense_lowrank.d_cost_wrt_bias_sum;
+            return 3;
+        case CONV2D:
+            parameters[0] = &layer->layer.conv2d.weights;
+            gradients[0] = &layer->layer.conv2d.d_cost_wrt_weight_sum;
+            parameters[1] = &layer->layer.conv2d.bias;
+            gradients[1] = &layer->layer.conv2d.d_cost_wrt_bias_sum;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// collects the activation and gradient buffers of a layer that the memory planner may place in a shared workspace
+// returns the number of buffers, at most LAYER_MAX_BUFFERS
+int layer_get_buffers(layer_t *layer, layer_buffer_t *buffers) {
+    switch (layer->type) {
+        case DENSE:
+            buffers[0] = (layer_buffer_t) {&layer->layer.dense.activation_values, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.dense.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            buffers[2] = (layer_buffer_t) {&layer->layer.dense.activation_derivative, BUFFER_SAVED};
+            return 3;
+        case DENSE_LOWRANK:
+            buffers[0] = (layer_buffer_t) {&layer->layer.dense_lowrank.activation_values, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.dense_lowrank.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            buffers[2] = (layer_buffer_t) {&layer->layer.dense_lowrank.activation_derivative, BUFFER_SAVED};
+            buffers[3] = (layer_buffer_t) {&layer->layer.dense_lowrank.projection, BUFFER_SAVED};
+            buffers[4] = (layer_buffer_t) {&layer->layer.dense_lowrank.d_cost_wrt_projection, BUFFER_SCRATCH};
+            return 5;
+        case CONV2D:
+            buffers[0] = (layer_buffer_t) {&layer->layer.conv2d.output, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.conv2d.columns, BUFFER_SAVED};
+            buffers[2] = (layer_buffer_t) {&layer->layer.conv2d.d_cost_wrt_columns, BUFFER_SCRATCH};
+            buffers[3] = (layer_buffer_t) {&layer->layer.conv2d.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            return 4;
+        case POOL2D:
+            buffers[0] = (layer_buffer_t) {&layer->layer.pool2d.output, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.pool2d.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            return 2;
+        case DROPOUT:
+            buffers[0] = (layer_buffer_t) {&layer->layer.dropout.output, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.dropout.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            return 2;
+        case ACTIVATION:
+            buffers[0] = (layer_buffer_t) {&layer->layer.activation.activated_values, BUFFER_FORWARD_OUTPUT};
+            buffers[1] = (layer_buffer_t) {&layer->layer.activation.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            return 2;
+        case OUTPUT:
+            // output_values and guess are read outside of training steps (loss, accuracy, visualizer)
+            buffers[0] = (layer_buffer_t) {&layer->layer.output.d_cost_wrt_input, BUFFER_INPUT_GRADIENT};
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+layer_op_kind_t layer_get_op_kind(layer_t *layer) {
+    switch (layer->type) {
+        case INPUT:
+            return OP_INPUT;
+        case DENSE:
+            return layer->layer.dense.functions.feed_forward == dense_sparse_feed_forward ? OP_DENSE_SPARSE : OP_DENSE;
+        case DENSE_LOWRANK:
+            return OP_DENSE_LOWRANK;
+        case CONV2D:
+            return OP_CONV2D;
+        case POOL2D:
+            return layer->layer.pool2d.mode == POOL_MAX ? OP_MAXPOOL : OP_AVGPOOL;
+        case DROPOUT:
+            return OP_DROPOUT;
+        case ACTIVATION:
+            if (layer->layer.activation.functions.feed_forward == activation_feed_forward_sigmoid
+                    && layer->layer.activation.functions.back_propagation == activation_back_propagation_sigmoid) {
+                return OP_ACTIVATION_SIGMOID;
+            } else if (layer->layer.activation.functions.feed_forward == activation_feed_forward_relu
+                    && layer->layer.activation.functions.back_propagation == activation_back_propagation_relu) {
+                return OP_ACTIVATION_RELU;
+            } else if (layer->layer.activation.functions.feed_forward == activation_feed_forward_softmax
+                    && layer->layer.activation.functions.back_propagation == activation_back_propagation_softmax) {
+                return OP_ACTIVATION_SOFTMAX;
+            }
+            return OP_ACTIVATION_CUSTOM;
+        case OUTPUT:
+            if (layer->layer.output.functions.back_propagation == output_back_propagation_mean_squared) {
+                return OP_OUTPUT_MEAN_SQUARED;
+            } else if (layer->layer.output.functions.back_propagation == output_back_propagation_categorical_cross_entropy) {
+                return OP_OUTPUT_CROSS_ENTROPY;
+            } else if (layer->layer.output.functions.back_propagation == output_back_propagation_softmax_cross_entropy
+                    && layer->layer.output.functions.feed_forward == output_feed_forward_softmax_cross_entropy) {
+                return OP_OUTPUT_SOFTMAX_CROSS_ENTROPY;
+            }
+            return OP_OUTPUT_CUSTOM;
+        default:
+            assert(0);
+    }
+}
+
+// switch dispatched interpreter over the op records, the built in kernels are called directly
+nmatrix_t layer_op_feed_forward(layer_op_t *op, nmatrix_t input) {
+    layer_t *layer = op->layer;
+    switch (op->kind) {
+        case OP_INPUT:
+            return input_feed_forward(layer, input);
+        case OP_DENSE:
+            return dense_feed_forward(layer, input);
+        case OP_DENSE_SPARSE:
+            return dense_sparse_feed_forward(layer, input);
+        case OP_DENSE_LOWRANK:
+            return dense_lowrank_feed_forward(layer, input);
+        case OP_CONV2D:
+            return conv2d_feed_forward(layer, input);
+        case OP_MAXPOOL:
+            return maxpool_feed_forward(layer, input);
+        case OP_AVGPOOL:
+            return avgpool_feed_forward(layer, input);
+        case OP_DROPOUT:
+            return dropout_feedforward(layer, input);
+        case OP_ACTIVATION_SIGMOID:
+            return activation_feed_forward_sigmoid(layer, input);
+        case OP_ACTIVATION_RELU:
+            return activation_feed_forward_relu(layer, input);
+        case OP_ACTIVATION_SOFTMAX:
+            return activation_feed_forward_softmax(layer, input);
+        case OP_ACTIVATION_CUSTOM:
+            return layer->layer.activation.functions.feed_forward(layer, input);
+        case OP_OUTPUT_SOFTMAX_CROSS_ENTROPY:
+            return output_feed_forward_softmax_cross_entropy(layer, input);
+        case OP_OUTPUT_MEAN_SQUARED:
+        case OP_OUTPUT_CROSS_ENTROPY:
+        case OP_OUTPUT_CUSTOM:
+            // plain output layers just hold on to the previous layer's values
+            nmatrix_memcpy(&layer->layer.output.output_values, &input);
+            return layer->layer.output.output_values;
+        default:
+            assert(0);
+            return input;
+    }
+}
+
+nmatrix_t layer_op_back_propagation(layer_op_t *op, nmatrix_t d_cost_wrt_output, float learning_rate) {
+    layer_t *layer = op->layer;
+    switch (op->kind) {
+        case OP_DENSE:
+            return dense_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_DENSE_SPARSE:
+            return dense_sparse_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_DENSE_LOWRANK:
+            return dense_lowrank_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_CONV2D:
+            return conv2d_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_MAXPOOL:
+            return maxpool_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_AVGPOOL:
+            return avgpool_back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_DROPOUT:
+            return dropout_backpropagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_ACTIVATION_SIGMOID:
+            return activation_back_propagation_sigmoid(layer, d_cost_wrt_output, learning_rate);
+        case OP_ACTIVATION_RELU:
+            return activation_back_propagation_relu(layer, d_cost_wrt_output, learning_rate);
+        case OP_ACTIVATION_SOFTMAX:
+            return activation_back_propagation_softmax(layer, d_cost_wrt_output, learning_rate);
+        case OP_ACTIVATION_CUSTOM:
+            return layer->layer.activation.functions.back_propagation(layer, d_cost_wrt_output, learning_rate);
+        case OP_OUTPUT_MEAN_SQUARED:
+            return output_back_propagation_mean_squared(layer, d_cost_wrt_output, learning_rate);
+        case OP_OUTPUT_CROSS_ENTROPY:
+            return output_back_propagation_categorical_cross_entropy(layer, d_cost_wrt_output, learning_rate);
+        case OP_OUTPUT_SOFTMAX_CROSS_ENTROPY:
+            return output_back_propagation_softmax_cross_entropy(layer, d_cost_wrt_output, learning_rate);
+        case OP_OUTPUT_CUSTOM:
+            return layer->layer.output.functions.back_propagation(layer, d_cost_wrt_output, learning_rate);
+        default:
+            assert(0); // the input layer does not back propagate
+            return d_cost_wrt_output;
+    }
 }
\ No newline at end of file
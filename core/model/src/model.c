@@ -1,4 +1,6 @@
 #include <model/model.h>
+#include <model/evaluate.h>
+#include <model/pipeline.h>
 #include <util/math.h>
 #include <unistd.h>
 
@@ -9,6 +11,15 @@
 #define SHAPE(...) nshape_constructor(__VA_ARGS__)
 
 
+static void model_release_parameters(parameter_arena_t *arena) {
+    if (arena->mapping != NULL) {
+        model_unmap_parameters(arena);
+    } else {
+        nmatrix_aligned_free(arena->parameters);
+    }
+    nmatrix_aligned_free(arena->gradients);
+    *arena = (parameter_arena_t) {0};
+}
 
 void model_free(neural_network_model_t *model) {
     layer_t *current = model->input_layer;
@@ -18,10 +29,51 @@ void model_free(neural_network_model_t *model) {
         layer_free(prev);
     }
     assert(current == NULL); // ensure freed all layers
+    free(model->ops);
+    model->ops = NULL;
+
+    model_release_parameters(&model->parameters);
+    nmatrix_aligned_free(model->workspace);
+    model->workspace = NULL;
+    model->workspace_size = 0;
+}
+
+// finds where back propagation can stop and which layers have to pass gradients down. gradients only
+// have to reach the earliest layer with trainable parameters, everything before it is never updated
+static void model_update_gradient_flags(neural_network_model_t *model) {
+    nmatrix_t *parameters[LAYER_MAX_PARAMETERS];
+    nmatrix_t *gradients[LAYER_MAX_PARAMETERS];
+
+    model->first_trainable_layer = model->num_layers;
+    bool seen_trainable = false;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        layer_t *layer = model->ops[layer_i].layer;
+        layer->needs_input_gradient = seen_trainable;
+        if (!seen_trainable && layer->requires_grad && layer_get_parameters(layer, parameters, gradients) > 0) {
+            seen_trainable = true;
+            model->first_trainable_layer = layer_i;
+        }
+    }
+}
+
+void layer_freeze(layer_t *layer) {
+    layer->requires_grad = false;
+    model_update_gradient_flags(layer->model);
+}
+
+void layer_unfreeze(layer_t *layer) {
+    layer->requires_grad = true;
+    model_update_gradient_flags(layer->model);
 }
 
 void model_add_layer(neural_network_model_t *model, layer_t *layer) {
+    assert(model->workspace == NULL); // buffer lifetimes depend on the full layer list, plan memory after building
+    layer->model = model;
+    layer->requires_grad = true;
     if (model->input_layer == NULL) {
+        if (model->random.state == 0) {
+            random_seed(&model->random, MODEL_DEFAULT_SEED);
+        }
         model->input_layer = layer;
         model->output_layer = layer;
         model->input_layer->prev = NULL;
@@ -30,8 +82,70 @@ void model_add_layer(neural_network_model_t *model, layer_t *layer) {
         model->output_layer->next->prev = model->output_layer;
         model->output_layer = layer;
     }
+    model->ops = realloc(model->ops, sizeof(layer_op_t) * (model->num_layers + 1));
+    model->ops[model->num_layers] = (layer_op_t) {
+        .kind = layer_get_op_kind(layer),
+        .layer = layer,
+    };
+
     model->num_layers++;
     model->output_layer->next = NULL;
+    model_update_gradient_flags(model);
+}
+
+// lays out every layer's parameters back to back in one aligned slab (and the gradient sums in a matching slab)
+// and points the layer matrices at their slice. existing values are carried over, tensors without storage yet start zeroed.
+// called whenever a layer with parameters is added, so layer offsets only ever grow
+void model_bind_parameters(neural_network_model_t *model) {
+    nmatrix_t *parameters[LAYER_MAX_PARAMETERS];
+    nmatrix_t *gradients[LAYER_MAX_PARAMETERS];
+
+    unsigned int n_parameters = 0;
+    layer_t *current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        int n_tensors = layer_get_parameters(current, parameters, gradients);
+        for (int i = 0; i < n_tensors; i++) {
+            n_parameters += nmatrix_aligned_size(parameters[i]->n_elements);
+        }
+        current = current->next;
+    }
+
+    parameter_arena_t arena = {
+        .parameters = n_parameters > 0 ? nmatrix_aligned_alloc(n_parameters) : NULL,
+        .gradients = n_parameters > 0 ? nmatrix_aligned_alloc(n_parameters) : NULL,
+        .n_parameters = n_parameters,
+    };
+
+    unsigned int offset = 0;
+    current = model->input_layer;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        int n_tensors = layer_get_parameters(current, parameters, gradients);
+        for (int i = 0; i < n_tensors; i++) {
+            assert(parameters[i]->n_elements == gradients[i]->n_elements);
+            size_t bytes = sizeof(float) * parameters[i]->n_elements;
+            if (parameters[i]->matrix != NULL) {
+                memcpy(arena.parameters + offset, parameters[i]->matrix, bytes);
+            }
+            if (gradients[i]->matrix != NULL) {
+                memcpy(arena.gradients + offset, gradients[i]->matrix, bytes);
+            }
+            parameters[i]->matrix = arena.parameters + offset;
+            gradients[i]->matrix = arena.gradients + offset;
+            offset += nmatrix_aligned_size(parameters[i]->n_elements);
+        }
+        current = current->next;
+    }
+    assert(offset == n_parameters);
+
+    model_release_parameters(&model->parameters);
+    model->parameters = arena;
+}
+
+void model_zero_gradients(neural_network_model_t *model) {
+    if (model->parameters.gradients == NULL) {
+        return;
+    }
+    memset(model->parameters.gradients, 0, sizeof(float) * model->parameters.n_parameters);
 }
 
 
@@ -42,6 +156,8 @@ layer_t* layer_input(neural_network_model_t *model, nmatrix_t input) {
     layer->type = INPUT;
     input_layer_t *input_layer = &layer->layer.input;
     input_layer->input_values = nmatrix_copy(&input);
+    input_layer->active_indices = malloc(sizeof(int) * input.n_elements);
+    input_layer->n_active = input.n_elements;
     input_layer->functions = input_functions;
     input_layer->model = model;
 
@@ -50,6 +166,11 @@ layer_t* layer_input(neural_network_model_t *model, nmatrix_t input) {
 }
 
 layer_t* layer_dense(neural_network_model_t *model, nmatrix_t neurons) {
+    return layer_dense_activation(model, neurons, DENSE_ACTIVATION_NONE);
+}
+
+// dense layer with the activation fused in, replaces a dense layer followed by an activation layer
+layer_t* layer_dense_activation(neural_network_model_t *model, nmatrix_t neurons, dense_activation_t activation) {
     assert(model->num_layers > 0 && model->input_layer != NULL && model->input_layer->type == INPUT);
 
     layer_t *layer = malloc(sizeof(layer_t));
@@ -57,24 +178,239 @@ layer_t* layer_dense(neural_network_model_t *model, nmatrix_t neurons) {
 
     dense_layer_t *dense = &layer->layer.dense;
     dense->activation_values = nmatrix_copy(&neurons);
+    dense->activation = activation;
+    dense->activation_derivative = nmatrix_allocator(SHAPE(2, neurons.dims[0], 1));
     nmatrix_t prev_output = layer_get_neurons(model->output_layer);
-    dense->weights = nmatrix_allocator(SHAPE(2, neurons.dims[0], prev_output.dims[0]));
-    dense->transposed_weights = nmatrix_allocator(SHAPE(2, dense->weights.dims[1], dense->weights.dims[0]));
-    dense->transposed_inputs = nmatrix_allocator(SHAPE(2, prev_output.dims[1], prev_output.dims[0]));
-    dense->bias = nmatrix_allocator(SHAPE(2, neurons.dims[0], 1));
+    // parameter storage is handed out by the model's arena once the layer is added
+    dense->weights = nmatrix_constructor(neurons.dims[0] * prev_output.dims[0], NULL, SHAPE(2, neurons.dims[0], prev_output.dims[0]));
+    dense->bias = nmatrix_constructor(neurons.dims[0], NULL, SHAPE(2, neurons.dims[0], 1));
     dense->d_cost_wrt_input = nmatrix_allocator(SHAPE(2, prev_output.dims[0], 1));
-    dense->d_cost_wrt_weight = nmatrix_allocator(SHAPE(2, dense->weights.dims[0], dense->weights.dims[1]));
-    dense->d_cost_wrt_bias = nmatrix_allocator(SHAPE(2, dense->bias.dims[0], dense->bias.dims[1]));
-    dense->d_cost_wrt_weight_sum = nmatrix_copy(&dense->d_cost_wrt_weight);
-    dense->d_cost_wrt_bias_sum = nmatrix_copy(&dense->d_cost_wrt_bias);
+    dense->d_cost_wrt_weight_sum = nmatrix_constructor(dense->weights.n_elements, NULL, SHAPE(2, dense->weights.dims[0], dense->weights.dims[1]));
+    dense->d_cost_wrt_bias_sum = nmatrix_constructor(dense->bias.n_elements, NULL, SHAPE(2, dense->bias.dims[0], dense->bias.dims[1]));
+    dense->mask = NULL;
+    dense->sparse_columns = NULL;
+    dense->sparse_row_start = NULL;
+    dense->n_nonzero = dense->weights.n_elements;
+    dense->gradient_task = NULL;
     dense->model = model;
 
     dense->functions = dense_functions;
 
     model_add_layer(model, layer);
+    model_bind_parameters(model);
     return layer;
 }
 
+// dense layer with its weights factored into rank x inputs and neurons x rank matrices, see dense_lowrank_layer_t
+layer_t* layer_dense_lowrank(neural_network_model_t *model, nmatrix_t neurons, int rank, dense_activation_t activation) {
+    assert(model->num_layers > 0 && model->input_layer != NULL && model->input_layer->type == INPUT);
+
+    layer_t *layer = malloc(sizeof(layer_t));
+    layer->type = DENSE_LOWRANK;
+
+    dense_lowrank_layer_t *dense = &layer->layer.dense_lowrank;
+    const int n_outputs = neurons.dims[0];
+    const int n_inputs = layer_get_neurons(model->output_layer).dims[0];
+    assert(rank > 0 && rank <= n_outputs && rank <= n_inputs);
+    dense->rank = rank;
+    dense->activation_values = nmatrix_copy(&neurons);
+    dense->activation = activation;
+    dense->activation_derivative = nmatrix_allocator(SHAPE(2, n_outputs, 1));
+    // parameter storage is handed out by the model's arena once the layer is added
+    dense->u = nmatrix_constructor(n_outputs * rank, NULL, SHAPE(2, n_outputs, rank));
+    dense->v = nmatrix_constructor(rank * n_inputs, NULL, SHAPE(2, rank, n_inputs));
+    dense->bias = nmatrix_constructor(n_outputs, NULL, SHAPE(2, n_outputs, 1));
+    dense->d_cost_wrt_u_sum = nmatrix_constructor(dense->u.n_elements, NULL, SHAPE(2, n_outputs, rank));
+    dense->d_cost_wrt_v_sum = nmatrix_constructor(dense->v.n_elements, NULL, SHAPE(2, rank, n_inputs));
+    dense->d_cost_wrt_bias_sum = nmatrix_constructor(dense->bias.n_elements, NULL, SHAPE(2, n_outputs, 1));
+    dense->projection = nmatrix_allocator(SHAPE(2, rank, 1));
+    dense->d_cost_wrt_projection = nmatrix_allocator(SHAPE(2, rank, 1));
+    dense->d_cost_wrt_input = nmatrix_allocator(SHAPE(2, n_inputs, 1));
+    dense->model = model;
+
+    dense->functions = dense_lowrank_functions;
+
+    model_add_layer(model, layer);
+    model_bind_parameters(model);
+    return layer;
+}
+
+// power iterations per singular vector when factoring a trained dense layer
+#define LOWRANK_POWER_ITERATIONS 100
+
+// initializes a low rank layer from a trained dense layer of the same shape with the best rank r approximation
+// of its weights (truncated SVD), the bias is copied as is
+void layer_dense_lowrank_factorize(layer_t *lowrank, layer_t *dense) {
+    assert(lowrank->type == DENSE_LOWRANK && dense->type == DENSE);
+    dense_lowrank_layer_t *factored = &lowrank->layer.dense_lowrank;
+    assert(factored->u.dims[0] == dense->layer.dense.weights.dims[0]);
+    assert(factored->v.dims[1] == dense->layer.dense.weights.dims[1]);
+
+    nmatrix_factorize_low_rank(&dense->layer.dense.weights, LOWRANK_POWER_ITERATIONS, &factored->u, &factored->v);
+    nmatrix_memcpy(&factored->bias, &dense->layer.dense.bias);
+}
+
+typedef struct Prune_Candidate {
+    float magnitude;
+    int index;
+} prune_candidate_t;
+
+static int compare_prune_candidates(const void *a, const void *b) {
+    float difference = ((const prune_candidate_t*) a)->magnitude - ((const prune_candidate_t*) b)->magnitude;
+    return (difference > 0) - (difference < 0);
+}
+
+// magnitude pruning, zeroes the smallest |w| until the given fraction of the layer's weights is pruned.
+// weights pruned by an earlier call stay pruned, so repeated calls with a growing sparsity prune iteratively
+void layer_dense_prune(layer_t *layer, float sparsity) {
+    assert(layer->type == DENSE && sparsity >= 0 && sparsity <= 1);
+    dense_layer_t *dense = &layer->layer.dense;
+    const int n_weights = dense->weights.n_elements;
+
+    prune_candidate_t *candidates = malloc(sizeof(prune_candidate_t) * n_weights);
+    for (int i = 0; i < n_weights; i++) {
+        // already pruned weights sort first
+        bool kept = dense->mask == NULL || dense->mask[i];
+        candidates[i] = (prune_candidate_t) {kept ? fabsf(dense->weights.matrix[i]) : -1, i};
+    }
+    qsort(candidates, n_weights, sizeof(prune_candidate_t), compare_prune_candidates);
+
+    int n_pruned = sparsity * n_weights;
+    if (n_pruned < n_weights - dense->n_nonzero) {
+        n_pruned = n_weights - dense->n_nonzero;
+    }
+    uint8_t *mask = malloc(n_weights);
+    memset(mask, 1, n_weights);
+    for (int i = 0; i < n_pruned; i++) {
+        mask[candidates[i].index] = 0;
+    }
+    free(candidates);
+
+    layer_dense_set_mask(layer, mask);
+}
+
+// takes ownership of a n x m pruning mask, zeroes the pruned weights and rebuilds the compressed rows of the kept ones.
+// the layer's op switches to the sparse kernels once enough of it is pruned
+void layer_dense_set_mask(layer_t *layer, uint8_t *mask) {
+    assert(layer->type == DENSE);
+    dense_layer_t *dense = &layer->layer.dense;
+    const int n_outputs = dense->weights.dims[0];
+    const int n_inputs = dense->weights.dims[1];
+    if (dense->mask != mask) {
+        free(dense->mask);
+        dense->mask = mask;
+    }
+
+    int n_nonzero = 0;
+    for (int i = 0; i < dense->weights.n_elements; i++) {
+        dense->weights.matrix[i] *= mask[i];
+        n_nonzero += mask[i];
+    }
+    dense->n_nonzero = n_nonzero;
+    dense->sparse_columns = realloc(dense->sparse_columns, sizeof(int) * (n_nonzero > 0 ? n_nonzero : 1));
+    dense->sparse_row_start = realloc(dense->sparse_row_start, sizeof(int) * (n_outputs + 1));
+    int nonzero_i = 0;
+    for (int r = 0; r < n_outputs; r++) {
+        dense->sparse_row_start[r] = nonzero_i;
+        for (int c = 0; c < n_inputs; c++) {
+            if (mask[r * n_inputs + c]) {
+                dense->sparse_columns[nonzero_i++] = c;
+            }
+        }
+    }
+    dense->sparse_row_start[n_outputs] = nonzero_i;
+
+    bool sparse = n_nonzero <= (1 - DENSE_SPARSE_THRESHOLD) * dense->weights.n_elements;
+    dense->functions = sparse ? dense_sparse_functions : dense_functions;
+    for (unsigned int layer_i = 0; layer_i < layer->model->num_layers; layer_i++) {
+        if (layer->model->ops[layer_i].layer == layer) {
+            layer->model->ops[layer_i].kind = layer_get_op_kind(layer);
+        }
+    }
+}
+
+// prunes every dense layer of the model to the given sparsity
+void model_prune(neural_network_model_t *model, float sparsity) {
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        if (model->ops[layer_i].layer->type == DENSE) {
+            layer_dense_prune(model->ops[layer_i].layer, sparsity);
+        }
+    }
+}
+
+// channels: number of filters, kernel: width and height of each filter
+layer_t* layer_conv2d(neural_network_model_t *model, int channels, int kernel, int stride, int padding) {
+    assert(model->num_layers > 0 && model->input_layer != NULL && model->input_layer->type == INPUT);
+
+    layer_t *layer = malloc(sizeof(layer_t));
+    layer->type = CONV2D;
+
+    conv2d_layer_t *conv = &layer->layer.conv2d;
+    bool is_image = layer_get_image_shape(model->output_layer, &conv->in_channels, &conv->in_height, &conv->in_width);
+    assert(is_image); // flat inputs to a convolution must be square images
+    conv->out_channels = channels;
+    conv->out_height = nmatrix_convolution_size(conv->in_height, kernel, stride, padding);
+    conv->out_width = nmatrix_convolution_size(conv->in_width, kernel, stride, padding);
+    conv->kernel = kernel;
+    conv->stride = stride;
+    conv->padding = padding;
+
+    const int patch_size = conv->in_channels * kernel * kernel;
+    const int n_pixels = conv->out_height * conv->out_width;
+    conv->output = nmatrix_allocator(SHAPE(2, channels * n_pixels, 1));
+    // parameter storage is handed out by the model's arena once the layer is added
+    conv->weights = nmatrix_constructor(channels * patch_size, NULL, SHAPE(2, channels, patch_size));
+    conv->bias = nmatrix_constructor(channels, NULL, SHAPE(2, channels, 1));
+    conv->d_cost_wrt_weight_sum = nmatrix_constructor(conv->weights.n_elements, NULL, SHAPE(2, channels, patch_size));
+    conv->d_cost_wrt_bias_sum = nmatrix_constructor(conv->bias.n_elements, NULL, SHAPE(2, channels, 1));
+    conv->columns = nmatrix_allocator(SHAPE(2, patch_size, n_pixels));
+    conv->d_cost_wrt_columns = nmatrix_allocator(SHAPE(2, patch_size, n_pixels));
+    conv->d_cost_wrt_input = nmatrix_allocator(SHAPE(2, conv->in_channels * conv->in_height * conv->in_width, 1));
+    conv->model = model;
+
+    conv->functions = conv2d_functions;
+
+    model_add_layer(model, layer);
+    model_bind_parameters(model);
+    return layer;
+}
+
+static layer_t* layer_pool2d(neural_network_model_t *model, int size, int mode, layer_function_t functions) {
+    assert(model->num_layers > 0 && model->input_layer != NULL && model->input_layer->type == INPUT);
+
+    layer_t *layer = malloc(sizeof(layer_t));
+    layer->type = POOL2D;
+
+    pool2d_layer_t *pool = &layer->layer.pool2d;
+    bool is_image = layer_get_image_shape(model->output_layer, &pool->channels, &pool->in_height, &pool->in_width);
+    assert(is_image); // flat inputs to a pooling layer must be square images
+    assert(size > 0 && size <= pool->in_height && size <= pool->in_width);
+    pool->mode = mode;
+    pool->size = size;
+    pool->out_height = pool->in_height / size;
+    pool->out_width = pool->in_width / size;
+
+    const int n_outputs = pool->channels * pool->out_height * pool->out_width;
+    pool->output = nmatrix_allocator(SHAPE(2, n_outputs, 1));
+    pool->d_cost_wrt_input = nmatrix_allocator(SHAPE(2, pool->channels * pool->in_height * pool->in_width, 1));
+    pool->indices = mode == POOL_MAX ? malloc(sizeof(int) * n_outputs) : NULL;
+    pool->has_indices = false;
+    pool->functions = functions;
+    pool->model = model;
+
+    model_add_layer(model, layer);
+    return layer;
+}
+
+// size x size windows with a stride of size, trailing rows and columns that do not fill a window are dropped
+layer_t* layer_maxpool(neural_network_model_t *model, int size) {
+    return layer_pool2d(model, size, POOL_MAX, maxpool_functions);
+}
+
+layer_t* layer_avgpool(neural_network_model_t *model, int size) {
+    return layer_pool2d(model, size, POOL_AVERAGE, avgpool_functions);
+}
+
 layer_t* layer_dropout(neural_network_model_t *model, float dropout) {
     assert(model->num_layers > 0 && model->input_layer != NULL && model->input_layer->type == INPUT);
 
@@ -84,7 +420,11 @@ layer_t* layer_dropout(neural_network_model_t *model, float dropout) {
     nmatrix_t prev_output = layer_get_neurons(model->output_layer);
     dropout_layer->output = nmatrix_allocator(SHAPE(2, prev_output.dims[0], prev_output.dims[1]));
     dropout_layer->functions = dropout_functions;
+    dropout_layer->dropout = dropout;
+    dropout_layer->model = model;
     dropout_layer->d_cost_wrt_input = nmatrix_allocator(SHAPE(2, prev_output.dims[0], prev_output.dims[1]));
+    dropout_layer->mask = malloc(sizeof(uint8_t) * prev_output.n_elements);
+    dropout_layer->has_mask = false;
 
     model_add_layer(model, layer);
     return layer;
@@ -133,55 +473,88 @@ void model_initialize_matrix_normal_distribution(nmatrix_t matrix, float mean, f
     }
 }
 
+// same as model_initialize_matrix_normal_distribution with an explicit generator instead of rand()
+void model_initialize_matrix_normal_distribution_seeded(nmatrix_t matrix, float mean, float standard_deviation, random_state_t *random) {
+    for (int i = 0; i < matrix.n_elements; i++) {
+        matrix.matrix[i] = random_normal(random, standard_deviation) + mean;
+    }
+}
+
 nmatrix_t model_predict(neural_network_model_t *model, nmatrix_t input,
                         nmatrix_t output) {
-    layer_t *current = model->input_layer;
+    layer_op_t *ops = model->ops;
     nmatrix_t prev_output = input;
-    int num_iterations = model->num_layers-1;
-    for (int layer_i = 0; layer_i < num_iterations; layer_i++) {
-        assert(current->type != OUTPUT);
-
-        // since the different layer structs are arranged in a way that the function pointers are in the same "locations"
-        // this should work for all layers without having to use a switch
-        prev_output = current->layer.input.functions.feed_forward(current, prev_output);
-        current = current->next;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        prev_output = layer_op_feed_forward(&ops[layer_i], prev_output);
     }
 
-    model->output_layer->layer.output.make_guess(model->output_layer, prev_output);
-    nmatrix_memcpy(&current->layer.output.output_values, &prev_output);
-    nmatrix_memcpy(&output, &prev_output);
+    layer_t *output_layer = model->output_layer;
+    output_layer->layer.output.make_guess(output_layer, prev_output);
+    if (output.matrix != prev_output.matrix) {
+        nmatrix_memcpy(&output, &prev_output);
+    }
     return output;
 }
 
+// large dense layers accumulate their weight gradients on the model's pool, back propagation returns once they are done
+static void model_wait_gradients(neural_network_model_t *model) {
+    if (model->pool == NULL) {
+        return;
+    }
+    for (unsigned int layer_i = model->first_trainable_layer; layer_i < model->num_layers; layer_i++) {
+        layer_wait_gradients(model->ops[layer_i].layer);
+    }
+}
+
 void model_back_propagate(neural_network_model_t *model, nmatrix_t expected_output, float learning_rate) {
-    layer_t *current = model->output_layer;
+    layer_op_t *ops = model->ops;
     nmatrix_t d_cost_wrt_Y = expected_output;
-    for (int layer_i = model->num_layers; layer_i > 1; layer_i--) {
-        assert(current->type != INPUT);
+    for (int layer_i = model->num_layers - 1; layer_i >= (int) model->first_trainable_layer; layer_i--) {
+        d_cost_wrt_Y = layer_op_back_propagation(&ops[layer_i], d_cost_wrt_Y, learning_rate);
 
-        // works for all layers since the member variables align.
-        // TODO in future, move "functions" outside and into the actual generic layer struct, not the union
-        d_cost_wrt_Y = current->layer.dense.functions.back_propagation(current, d_cost_wrt_Y, learning_rate);
-        current = current->prev;
-
-        // printf("\n%s: de/dy: \n", get_layer_name(current->next));
+        // printf("\n%s: de/dy: \n", get_layer_name(ops[layer_i].layer));
         // matrix_print(d_cost_wrt_Y);
     }
+    model_wait_gradients(model);
 }
 
+// same as model_back_propagate with a class index target, the output layer indexes it instead of reading
+// a one hot matrix
+void model_back_propagate_label(neural_network_model_t *model, int label, float learning_rate) {
+    layer_op_t *ops = model->ops;
+    int layer_i = model->num_layers - 1;
+    if (layer_i < (int) model->first_trainable_layer) {
+        return;
+    }
+
+    nmatrix_t d_cost_wrt_Y = output_back_propagation_label(ops[layer_i].layer, label, learning_rate);
+    for (layer_i--; layer_i >= (int) model->first_trainable_layer; layer_i--) {
+        d_cost_wrt_Y = layer_op_back_propagation(&ops[layer_i], d_cost_wrt_Y, learning_rate);
+    }
+    model_wait_gradients(model);
+}
+
+// gradient sums are already scaled by the learning rate, so the step is a single pass over the arena
 void model_gradient_descent(neural_network_model_t *model) {
-    layer_t *current = model->input_layer;
-    for (int layer_i = 0; layer_i < model->num_layers; layer_i++) {
-        if (current->type == DENSE) {
-            nmatrix_sub(&current->layer.dense.weights, &current->layer.dense.d_cost_wrt_weight_sum, &current->layer.dense.weights);
-            nmatrix_sub(&current->layer.dense.bias, &current->layer.dense.d_cost_wrt_bias_sum, &current->layer.dense.bias);
+    float *parameters = model->parameters.parameters;
+    float *gradients = model->parameters.gradients;
+    unsigned int n_parameters = model->parameters.n_parameters;
+    for (unsigned int i = 0; i < n_parameters; i++) {
+        parameters[i] -= gradients[i];
+    }
 
-            nmatrix_memset(&current->layer.dense.d_cost_wrt_weight_sum, 0);
-            nmatrix_memset(&current->layer.dense.d_cost_wrt_bias_sum, 0);
+    // pruned weights stay pruned, the dense kernels still accumulate gradients for them
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        if (model->ops[layer_i].kind != OP_DENSE || model->ops[layer_i].layer->layer.dense.mask == NULL) {
+            continue;
+        }
+        dense_layer_t *dense = &model->ops[layer_i].layer->layer.dense;
+        for (int i = 0; i < dense->weights.n_elements; i++) {
+            dense->weights.matrix[i] *= dense->mask[i];
         }
-
-        current = current->next;
     }
+
+    model_zero_gradients(model);
 }
 
 float model_train(neural_network_model_t *model, nmatrix_t *inputs, nmatrix_t *expected_outputs, unsigned int num_examples, float learning_rate) {
@@ -226,27 +599,115 @@ void model_test(neural_network_model_t *model, nmatrix_t *inputs, nmatrix_t *exp
 }
 
 nmatrix_t model_calculate(neural_network_model_t *model) {
-    layer_t *current = model->input_layer;
+    layer_op_t *ops = model->ops;
     nmatrix_t prev_output = model->input_layer->layer.input.input_values;
-    for (int layer_i = 0; layer_i < model->num_layers-1; layer_i++) {
-        assert(current->type != OUTPUT);
-
-        // since the different layer structs are arranged in a way that the function pointers are in the same "locations"
-        // this should work for all layers without having to use a switch
-        prev_output = current->layer.input.functions.feed_forward(current, prev_output);
-        current = current->next;
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        prev_output = layer_op_feed_forward(&ops[layer_i], prev_output);
     }
 
-    model->output_layer->layer.output.make_guess(model->output_layer, prev_output);
-    nmatrix_memcpy(&current->layer.output.output_values, &prev_output);
-    return current->layer.output.guess;
+    layer_t *output_layer = model->output_layer;
+    output_layer->layer.output.make_guess(output_layer, prev_output);
+    return output_layer->layer.output.guess;
 }
 
 void training_info_free(training_info_t *training_info) {
-    free_nmatrix_list(training_info->train_size, training_info->train_x);
-    free_nmatrix_list(training_info->train_size, training_info->train_y);
-    free_nmatrix_list(training_info->test_size, training_info->test_x);
-    free_nmatrix_list(training_info->test_size, training_info->test_y);
+    if (training_info->train_pixels != NULL) {
+        free(training_info->train_pixels);
+    } else {
+        free_nmatrix_list(training_info->train_size, training_info->train_x);
+    }
+    if (training_info->test_pixels != NULL) {
+        free(training_info->test_pixels);
+    } else {
+        free_nmatrix_list(training_info->test_size, training_info->test_x);
+    }
+    if (training_info->train_labels != NULL) {
+        free(training_info->train_labels);
+    } else {
+        free_nmatrix_list(training_info->train_size, training_info->train_y);
+    }
+    if (training_info->test_labels != NULL) {
+        free(training_info->test_labels);
+    } else {
+        free_nmatrix_list(training_info->test_size, training_info->test_y);
+    }
+    free(training_info->train_order);
+    training_info->train_order = NULL;
+}
+
+// input of a train or test example, compact pixels are expanded straight into the input layer's buffer
+nmatrix_t training_info_load_input(training_info_t *training_info, bool train, unsigned int example_i) {
+    uint8_t *pixels = train ? training_info->train_pixels : training_info->test_pixels;
+    if (pixels == NULL) {
+        return train ? training_info->train_x[example_i] : training_info->test_x[example_i];
+    }
+
+    nmatrix_t input = training_info->model->input_layer->layer.input.input_values;
+    assert((unsigned int) input.n_elements == training_info->pixels_per_example);
+    nmatrix_from_uint8(&input, pixels + (size_t) example_i * training_info->pixels_per_example,
+                       training_info->pixel_scale, training_info->pixel_offset);
+    return input;
+}
+
+// an example's target is either a one hot matrix in y or a class index in labels, whichever the set carries
+static float example_cost(neural_network_model_t *model, nmatrix_t *y, int *labels, unsigned int example_i) {
+    layer_t *output_layer = model->output_layer;
+    if (labels != NULL) {
+        return output_cost_label(output_layer, labels[example_i]);
+    }
+    return output_layer->layer.output.loss(output_layer, y[example_i]);
+}
+
+static bool example_correct(neural_network_model_t *model, nmatrix_t *output, nmatrix_t *y, int *labels, unsigned int example_i) {
+    if (labels != NULL) {
+        return nmatrix_argmax(output) == labels[example_i];
+    }
+    layer_t *output_layer = model->output_layer;
+    nmatrix_t model_guess = output_layer->layer.output.make_guess(output_layer, *output);
+    return nmatrix_equal(&y[example_i], &model_guess);
+}
+
+// new random order of the training examples, drawn from the model's generator so it is covered by the training state
+static void training_info_shuffle(training_info_t *training_info) {
+    uint32_t *order = training_info->train_order;
+    if (order == NULL) {
+        order = malloc(sizeof(uint32_t) * training_info->train_size);
+        for (unsigned int i = 0; i < training_info->train_size; i++) {
+            order[i] = i;
+        }
+        training_info->train_order = order;
+    }
+
+    for (unsigned int i = training_info->train_size; i > 1; i--) {
+        uint32_t j = random_below(&training_info->model->random, i);
+        uint32_t temp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = temp;
+    }
+}
+
+// batched test pass of the training loop. it runs on the model's pool when the caller gave it one and on the calling
+// thread otherwise, so a training run never creates threads of its own (the sweep already runs one per core)
+static evaluation_stats_t training_info_evaluate_test_set(training_info_t *training_info) {
+    evaluate_options_t options = {.n_threads = 1, .pool = training_info->model->pool};
+    return model_evaluate_test_set(training_info, &options);
+}
+
+// records the test stats of an evaluated epoch and prints them every print_every epochs, true when the epoch met the
+// target accuracy and training can stop
+static bool training_info_report(training_info_t *training_info, const evaluation_result_t *result, int print_every) {
+    training_info->avg_test_error = result->avg_test_error;
+    training_info->test_accuracy = result->test_accuracy;
+
+    if (((result->epoch + 1) % print_every == 0 && result->epoch != 0) || result->epoch == training_info->target_epochs - 1) {
+        printf("==== Epoch %d ==== \ntrain_error: %f, train_accuracy: %f\ntest_error: %f, test_accuracy: %f (passed=%d)\n\n", result->epoch + 1,
+                result->avg_train_error, result->train_accuracy,
+                result->avg_test_error, result->test_accuracy,
+                result->passed_test);
+    }
+
+    // check if we can stop
+    return training_info->target_accuracy <= result->test_accuracy && training_info->target_accuracy <= result->train_accuracy;
 }
 
 void model_train_info(training_info_t *training_info) {
@@ -257,94 +718,202 @@ void model_train_info(training_info_t *training_info) {
     unsigned int target_epochs = training_info->target_epochs;
     unsigned int *train_index = &training_info->train_index;
     unsigned int train_size = training_info->train_size;
-    float train_size_reciprocal = 1.0 / train_size;
     unsigned int *test_index = &training_info->test_index;
     unsigned int test_size = training_info->test_size;
-    float test_size_reciprocal = 1.0 / test_size;
+    // a run without a test set reports 0 test error and accuracy, which never meets a target accuracy
+    float test_size_reciprocal = test_size > 0 ? 1.0 / test_size : 0;
 
     output_layer_t output_layer = model->output_layer->layer.output;
-    nmatrix_t *train_x = training_info->train_x;
     nmatrix_t *train_y = training_info->train_y;
-    nmatrix_t *test_x = training_info->test_x;
+    int *train_labels = training_info->train_labels;
     nmatrix_t *test_y = training_info->test_y;
+    int *test_labels = training_info->test_labels;
+
+    // a loaded training state continues at the example it was saved at, anything else starts a new run
+    unsigned int first_epoch = 0, first_index = 0;
+    if (training_info->resume) {
+        first_epoch = *epoch;
+        first_index = *train_index;
+        training_info->resume = false;
+    }
+
+    // with asynchronous evaluation the test pass of an epoch overlaps the next epoch's training, and a result
+    // that meets the target accuracy stops training at the next batch boundary after it arrives
+    async_evaluator_t *evaluator = NULL;
+    if (training_info->async_evaluation && test_size > 0 && model_evaluate_supported(model)) {
+        evaluator = async_evaluator_create(training_info);
+    }
+    bool stopped = false;
+
+    // pipeline training splits the layers into stages of about the same measured cost, each on its own thread
+    int *stage_first = NULL;
+    int n_stages = 1;
+    if (training_info->pipeline_stages > 1) {
+        stage_first = malloc(sizeof(int) * training_info->pipeline_stages);
+        n_stages = pipeline_plan(training_info, training_info->pipeline_stages, stage_first, false);
+    }
 
     nmatrix_t actual_output = nmatrix_copy(&output_layer.output_values);
     int print_every = target_epochs < 10 ? 10 : target_epochs / 10;
-    for (*epoch = 0; *epoch < target_epochs; (*epoch)++) {
+    for (*epoch = first_epoch; *epoch < target_epochs; (*epoch)++) {
+        // a resumed epoch keeps the order it was saved with
+        if (training_info->shuffle && first_index == 0) {
+            training_info_shuffle(training_info);
+        }
+        uint32_t *order = training_info->train_order;
+
         // perform training
         float avg_train_error = 0;
         int passed_train = 0;
-        for (*train_index = 0; *train_index < train_size; (*train_index)++) {
-            model_predict(model, train_x[*train_index], actual_output);
-            avg_train_error += output_layer.loss(model->output_layer, train_y[*train_index]);
-            model_back_propagate(model, train_y[*train_index], training_info->learning_rate);
+        float train_size_reciprocal = 1.0 / (train_size - first_index);
+        model->is_training = true;
+        pipeline_t *pipeline = n_stages > 1 ? pipeline_create(training_info, n_stages, stage_first) : NULL;
+        for (*train_index = first_index; *train_index < train_size; (*train_index)++) {
+            unsigned int example_i = order != NULL ? order[*train_index] : *train_index;
+            if (pipeline != NULL) {
+                // the example starts through the stages while the next ones are pushed
+                pipeline_push(pipeline, example_i);
+            } else {
+                model_predict(model, training_info_load_input(training_info, true, example_i), actual_output);
+                avg_train_error += example_cost(model, train_y, train_labels, example_i);
+                if (train_labels != NULL) {
+                    model_back_propagate_label(model, train_labels[example_i], training_info->learning_rate);
+                } else {
+                    model_back_propagate(model, train_y[example_i], training_info->learning_rate);
+                }
+            }
 
             if ((1 + *train_index) % batch_size == 0 || *train_index == train_size-1) {
+                if (pipeline != NULL) {
+                    pipeline_flush(pipeline, &avg_train_error, &passed_train);
+                }
                 model_gradient_descent(model);
+                if (training_info->checkpoint_writer != NULL) {
+                    checkpoint_writer_step(training_info->checkpoint_writer, training_info);
+                }
+
+                evaluation_result_t result;
+                if (evaluator != NULL && async_evaluator_poll(evaluator, &result)
+                        && training_info_report(training_info, &result, print_every)) {
+                    stopped = true;
+                    break;
+                }
             }
 
-            nmatrix_t model_guess = output_layer.make_guess(model->output_layer, actual_output);
-            if (nmatrix_equal(&train_y[*train_index], &model_guess)) {
-                passed_train++;
+            if (pipeline == NULL) {
+                passed_train += example_correct(model, &actual_output, train_y, train_labels, example_i);
             }
         }
+        if (pipeline != NULL) {
+            pipeline_free(pipeline);
+        }
+        if (stopped) {
+            model->is_training = false;
+            break; // finish early, the rest of the epoch is not trained
+        }
+        first_index = 0;
+        model->is_training = false;
         training_info->avg_train_error = avg_train_error * train_size_reciprocal;
         training_info->train_accuracy = ((int)(100000.0 * passed_train * train_size_reciprocal)) * 0.00001;
 
+        evaluation_result_t result = {
+            .epoch = *epoch,
+            .train_accuracy = training_info->train_accuracy,
+            .avg_train_error = training_info->avg_train_error,
+        };
+        if (evaluator != NULL) {
+            // the previous epoch's evaluation normally finished while this one trained
+            evaluation_result_t previous;
+            if (async_evaluator_wait(evaluator, &previous) && training_info_report(training_info, &previous, print_every)) {
+                stopped = true;
+                break;
+            }
+            async_evaluator_submit(evaluator, model, *epoch, result.train_accuracy, result.avg_train_error);
+            continue;
+        }
+
         // perform test
         float avg_test_error = 0;
         int passed_test = 0;
-        for (*test_index = 0; *test_index < test_size; (*test_index)++) {
-            model_predict(model, test_x[*test_index], actual_output);
-            avg_test_error += output_layer.loss(model->output_layer, test_y[*test_index]);
-
-            nmatrix_t model_guess = output_layer.make_guess(model->output_layer, actual_output);
-            if (nmatrix_equal(&test_y[*test_index], &model_guess)) {
-                passed_test++;
+        if (test_size > 0 && model_evaluate_supported(model)) {
+            evaluation_stats_t stats = training_info_evaluate_test_set(training_info);
+            avg_test_error = stats.loss * test_size;
+            passed_test = stats.n_correct;
+            *test_index = test_size;
+            evaluation_stats_free(&stats);
+        } else {
+            for (*test_index = 0; *test_index < test_size; (*test_index)++) {
+                model_predict(model, training_info_load_input(training_info, false, *test_index), actual_output);
+                avg_test_error += example_cost(model, test_y, test_labels, *test_index);
+                passed_test += example_correct(model, &actual_output, test_y, test_labels, *test_index);
             }
         }
 
-        training_info->avg_test_error = avg_test_error * test_size_reciprocal;
-        training_info->test_accuracy = ((int)(100000.0 * passed_test * test_size_reciprocal)) * 0.00001;
-
-        if ((((*epoch) + 1) % print_every == 0 && *epoch != 0) || *epoch == target_epochs - 1) {
-            printf("==== Epoch %d ==== \ntrain_error: %f, train_accuracy: %f\ntest_error: %f, test_accuracy: %f (passed=%d)\n\n", (*epoch) + 1,
-                    training_info->avg_train_error, training_info->train_accuracy,
-                    training_info->avg_test_error, training_info->test_accuracy,
-                    passed_test);
+        result.avg_test_error = avg_test_error * test_size_reciprocal;
+        result.test_accuracy = ((int)(100000.0 * passed_test * test_size_reciprocal)) * 0.00001;
+        result.passed_test = passed_test;
+        if (training_info_report(training_info, &result, print_every)) {
+            break; // finish early
         }
+    }
 
-        // check if we can stop
-        if (training_info->target_accuracy <= training_info->test_accuracy && training_info->target_accuracy <= training_info->train_accuracy) {
-            break; // finish early
+    if (evaluator != NULL) {
+        evaluation_result_t last;
+        if (!stopped && async_evaluator_wait(evaluator, &last)) {
+            training_info_report(training_info, &last, print_every);
         }
+        async_evaluator_free(evaluator);
     }
+    free(stage_first);
     nmatrix_free(&actual_output);
 }
 
+/**
+ * Iterative magnitude pruning. Each of the n_steps prunes every dense layer a bit further, linearly up to
+ * target_sparsity, and then fine tunes the remaining weights for the training info's target_epochs.
+ * Dense layers that end up sparse enough run on the compressed sparse row kernels afterwards.
+ */
+void model_train_pruned(training_info_t *training_info, float target_sparsity, unsigned int n_steps) {
+    for (unsigned int step = 1; step <= n_steps; step++) {
+        float sparsity = target_sparsity * step / n_steps;
+        model_prune(training_info->model, sparsity);
+        printf("==== Pruned to %f sparsity (step %d/%d) ====\n", sparsity, step, n_steps);
+        model_train_info(training_info);
+    }
+}
+
 void model_test_info(training_info_t *training_info) {
     // perform test
     neural_network_model_t *model = training_info->model;
     output_layer_t output_layer = model->output_layer->layer.output;
     nmatrix_t actual_output = nmatrix_copy(&output_layer.output_values);
-    nmatrix_t *test_x = training_info->test_x;
     nmatrix_t *test_y = training_info->test_y;
+    int *test_labels = training_info->test_labels;
     unsigned int *test_index = &training_info->test_index;
     unsigned int test_size = training_info->test_size;
     float avg_test_error = 0;
     int passed_test = 0;
-    for (*test_index = 0; *test_index < test_size; (*test_index)++) {
-        model_predict(model, test_x[*test_index], actual_output);
-        avg_test_error += output_layer.loss(model->output_layer, test_y[*test_index]);
-
-        nmatrix_t model_guess = output_layer.make_guess(model->output_layer, actual_output);
-        if (nmatrix_equal(&test_y[*test_index], &model_guess)) {
-            passed_test++;
+    if (test_size > 0 && model_evaluate_supported(model)) {
+        evaluation_stats_t stats = training_info_evaluate_test_set(training_info);
+        avg_test_error = stats.loss * test_size;
+        passed_test = stats.n_correct;
+        *test_index = test_size;
+        evaluation_stats_free(&stats);
+    } else {
+        for (*test_index = 0; *test_index < test_size; (*test_index)++) {
+            model_predict(model, training_info_load_input(training_info, false, *test_index), actual_output);
+            avg_test_error += example_cost(model, test_y, test_labels, *test_index);
+            passed_test += example_correct(model, &actual_output, test_y, test_labels, *test_index);
         }
     }
 
-    training_info->avg_test_error = avg_test_error / (float) test_size;
-    training_info->test_accuracy = ((int)(100.0 * (float) passed_test / (float) test_size)) / 100.0;
+    if (test_size == 0) {
+        training_info->avg_test_error = 0;
+        training_info->test_accuracy = 0;
+    } else {
+        training_info->avg_test_error = avg_test_error / (float) test_size;
+        training_info->test_accuracy = ((int)(100.0 * (float) passed_test / (float) test_size)) / 100.0;
+    }
 
     nmatrix_free(&actual_output);
 }
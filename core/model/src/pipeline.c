@@ -0,0 +1,613 @@
+#include <model/pipeline.h>
+
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+// fixed size queue of vectors between two neighbouring stages, micro-batches pass through it in order
+typedef struct Pipeline_Channel {
+    float *entries; // capacity x size
+    int size;
+    int capacity;
+    int head;
+    int count;
+} pipeline_channel_t;
+
+// a layer buffer pointed at the pipeline's own storage while the pipeline exists. buffers that hold a micro-batch
+// from its forward to its backward pass get one copy per slot, stride floats apart, the others share one copy
+typedef struct Pipeline_Buffer {
+    nmatrix_t *matrix;
+    float *original;
+    float *storage;
+    int stride;
+} pipeline_buffer_t;
+
+// same for the index arrays of the input and max pooling layers
+typedef struct Pipeline_Indices {
+    int **indices;
+    int *original;
+    int *storage;
+    int stride;
+} pipeline_indices_t;
+
+// a run of consecutive layers trained on its own thread
+typedef struct Pipeline_Stage {
+    pipeline_t *pipeline;
+    int index;
+    int first; // ops first..last of the model
+    int last;
+    int stop;  // backward passes run from last down to this op, the first trainable one if it is in the stage
+    bool backward;       // false when every layer of the stage is before the first trainable one
+    bool sends_gradient; // the previous stage needs dE/dX of the stage's first layer
+
+    // micro-batch m uses slot m % n_slots, one forward one backward keeps at most n_slots of them in flight
+    int n_slots;
+    pipeline_buffer_t *buffers;
+    int n_buffers;
+    pipeline_indices_t *indices;
+    int n_indices;
+    int *slot_n_active; // nonzero input count of every slot, only in the stage with the input layer
+
+    // copy of the previous stage's last layer, whose neurons hold the slot's input. the stage's first layer is linked
+    // to it instead, so its backward pass never reads a buffer of the other thread
+    layer_t boundary;
+    layer_t *original_prev;
+
+    nmatrix_t gradient; // dE/dY of the last layer, received from the next stage
+
+    // micro-batches of the current batch that went through the forward pass and that are done with
+    unsigned int forwarded;
+    unsigned int completed;
+    pthread_t thread;
+    pthread_cond_t wake;
+} pipeline_stage_t;
+
+struct Pipeline {
+    training_info_t *training_info;
+    neural_network_model_t *model;
+    int n_stages;
+    pipeline_stage_t *stages;
+    pipeline_channel_t *activations; // n_stages - 1, outputs of stage s for stage s + 1
+    pipeline_channel_t *gradients;   // n_stages - 1, input gradients of stage s + 1 for stage s
+
+    // micro-batch m of the current batch is the training example examples[m], the last stage writes its loss to
+    // costs[m] and whether it was guessed right to correct[m]
+    unsigned int *examples;
+    float *costs;
+    bool *correct;
+    unsigned int capacity;
+    unsigned int n_pushed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    bool stop;
+};
+
+static double pipeline_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// dropout masks are drawn from the model's single generator in forward order, which stages running side by side
+// would draw in a different order. every other built in layer keeps a micro-batch's state in its buffers
+bool pipeline_supported(neural_network_model_t *model) {
+    if (model->num_layers < 3) {
+        return false;
+    }
+    for (unsigned int layer_i = 0; layer_i < model->num_layers; layer_i++) {
+        if (model->ops[layer_i].kind == OP_DROPOUT && model->ops[layer_i].layer->layer.dropout.dropout > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Average seconds of every layer's forward and backward pass over the first n_examples training examples.
+ * The backward passes run with a learning rate of 0, so the gradient sums do not move.
+ */
+void pipeline_measure_layer_costs(training_info_t *training_info, unsigned int n_examples, double *costs) {
+    neural_network_model_t *model = training_info->model;
+    layer_op_t *ops = model->ops;
+    const int n_layers = model->num_layers;
+    n_examples = n_examples < training_info->train_size ? n_examples : training_info->train_size;
+    memset(costs, 0, sizeof(double) * n_layers);
+
+    const bool was_training = model->is_training;
+    model->is_training = true;
+    for (unsigned int example_i = 0; example_i < n_examples; example_i++) {
+        nmatrix_t values = training_info_load_input(training_info, true, example_i);
+        for (int layer_i = 0; layer_i < n_layers; layer_i++) {
+            double start = pipeline_seconds();
+            values = layer_op_feed_forward(&ops[layer_i], values);
+            costs[layer_i] += pipeline_seconds() - start;
+        }
+
+        int layer_i = n_layers - 1;
+        if (layer_i < (int) model->first_trainable_layer) {
+            continue;
+        }
+        double start = pipeline_seconds();
+        nmatrix_t d_cost_wrt_Y = training_info->train_labels != NULL
+                ? output_back_propagation_label(ops[layer_i].layer, training_info->train_labels[example_i], 0)
+                : layer_op_back_propagation(&ops[layer_i], training_info->train_y[example_i], 0);
+        costs[layer_i] += pipeline_seconds() - start;
+        for (layer_i--; layer_i >= (int) model->first_trainable_layer; layer_i--) {
+            start = pipeline_seconds();
+            d_cost_wrt_Y = layer_op_back_propagation(&ops[layer_i], d_cost_wrt_Y, 0);
+            layer_wait_gradients(ops[layer_i].layer);
+            costs[layer_i] += pipeline_seconds() - start;
+        }
+    }
+    model->is_training = was_training;
+
+    for (int layer_i = 0; n_examples > 0 && layer_i < n_layers; layer_i++) {
+        costs[layer_i] /= n_examples;
+    }
+}
+
+/**
+ * Splits layers 0..n_layers-1 into n_stages runs of consecutive layers so that the most expensive stage costs as
+ * little as possible, stage s starts at layer stage_first[s]. The first stage keeps the input layer together with
+ * the layer after it, which reads the input layer's nonzero indices.
+ * Returns the number of stages, fewer than asked for when there are not enough layers.
+ */
+int pipeline_partition(const double *costs, int n_layers, int n_stages, int *stage_first) {
+    assert(n_layers >= 2 && n_stages >= 1);
+    n_stages = n_stages < n_layers - 1 ? n_stages : n_layers - 1;
+
+    double prefix[n_layers + 1];
+    prefix[0] = 0;
+    for (int layer_i = 0; layer_i < n_layers; layer_i++) {
+        prefix[layer_i + 1] = prefix[layer_i] + costs[layer_i];
+    }
+
+    // best[s][j] is the cost of the most expensive stage when the first j layers form stages 0..s,
+    // split[s][j] the layer stage s starts at
+    double (*best)[n_layers + 1] = malloc(sizeof(double) * n_stages * (n_layers + 1));
+    int (*split)[n_layers + 1] = malloc(sizeof(int) * n_stages * (n_layers + 1));
+    for (int j = 0; j <= n_layers; j++) {
+        best[0][j] = j >= 2 ? prefix[j] : DBL_MAX;
+        split[0][j] = 0;
+    }
+    for (int s = 1; s < n_stages; s++) {
+        for (int j = 0; j <= n_layers; j++) {
+            best[s][j] = DBL_MAX;
+            split[s][j] = -1;
+            for (int i = s + 1; i < j; i++) {
+                if (best[s - 1][i] == DBL_MAX) {
+                    continue;
+                }
+                double stage_cost = prefix[j] - prefix[i];
+                double cost = best[s - 1][i] > stage_cost ? best[s - 1][i] : stage_cost;
+                if (cost < best[s][j]) {
+                    best[s][j] = cost;
+                    split[s][j] = i;
+                }
+            }
+        }
+    }
+
+    int j = n_layers;
+    for (int s = n_stages - 1; s > 0; s--) {
+        stage_first[s] = split[s][j];
+        j = split[s][j];
+    }
+    stage_first[0] = 0;
+
+    free(best);
+    free(split);
+    return n_stages;
+}
+
+/**
+ * Stage boundaries for pipeline training training_info's model on up to n_stages threads, balanced by the measured
+ * cost of every layer. Returns the number of stages, 1 when the model can not be pipelined and trains serially.
+ * With print set it lists the layers and measured cost of each stage. model_train_info plans quietly, it replans
+ * on every call.
+ */
+int pipeline_plan(training_info_t *training_info, int n_stages, int *stage_first, bool print) {
+    neural_network_model_t *model = training_info->model;
+    stage_first[0] = 0;
+    if (n_stages < 2) {
+        return 1;
+    }
+    if (!pipeline_supported(model)) {
+        printf("Pipeline training needs at least 3 layers and no dropout, training on a single thread\n");
+        return 1;
+    }
+
+    double *costs = malloc(sizeof(double) * model->num_layers);
+    pipeline_measure_layer_costs(training_info, PIPELINE_MEASURE_EXAMPLES, costs);
+    n_stages = pipeline_partition(costs, model->num_layers, n_stages, stage_first);
+    for (int s = 0; print && s < n_stages; s++) {
+        const int end = s + 1 < n_stages ? stage_first[s + 1] : (int) model->num_layers;
+        double stage_cost = 0;
+        for (int layer_i = stage_first[s]; layer_i < end; layer_i++) {
+            stage_cost += costs[layer_i];
+        }
+        printf("Pipeline stage %d: layers %d to %d, %f ms per example\n", s, stage_first[s], end - 1, stage_cost * 1000);
+    }
+    free(costs);
+    return n_stages;
+}
+
+static pipeline_channel_t pipeline_channel_create(int size, int capacity) {
+    return (pipeline_channel_t) {
+        .entries = malloc(sizeof(float) * size * capacity),
+        .size = size,
+        .capacity = capacity,
+    };
+}
+
+// the channels are sized so that the in flight limits never fill them
+static void pipeline_channel_push(pipeline_channel_t *channel, const float *values) {
+    assert(channel->count < channel->capacity);
+    int tail = (channel->head + channel->count) % channel->capacity;
+    memcpy(channel->entries + tail * channel->size, values, sizeof(float) * channel->size);
+    channel->count++;
+}
+
+static void pipeline_channel_pop(pipeline_channel_t *channel, float *values) {
+    assert(channel->count > 0);
+    memcpy(values, channel->entries + channel->head * channel->size, sizeof(float) * channel->size);
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+}
+
+static void pipeline_add_buffer(pipeline_stage_t *stage, nmatrix_t *matrix, bool per_slot) {
+    const int size = nmatrix_aligned_size(matrix->n_elements);
+    const int n_copies = per_slot ? stage->n_slots : 1;
+    stage->buffers[stage->n_buffers++] = (pipeline_buffer_t) {
+        .matrix = matrix,
+        .original = matrix->matrix,
+        .storage = nmatrix_aligned_alloc(size * n_copies),
+        .stride = per_slot ? size : 0,
+    };
+    matrix->matrix = stage->buffers[stage->n_buffers - 1].storage;
+}
+
+static void pipeline_add_indices(pipeline_stage_t *stage, int **indices, int size) {
+    stage->indices[stage->n_indices++] = (pipeline_indices_t) {
+        .indices = indices,
+        .original = *indices,
+        .storage = malloc(sizeof(int) * size * stage->n_slots),
+        .stride = size,
+    };
+    *indices = stage->indices[stage->n_indices - 1].storage;
+}
+
+// gives every buffer of the stage's layers storage of its own, the model's workspace shares buffers across stages
+static void pipeline_stage_bind(pipeline_stage_t *stage) {
+    neural_network_model_t *model = stage->pipeline->model;
+    const int max_buffers = (stage->last - stage->first + 1) * LAYER_MAX_BUFFERS + 2;
+    stage->buffers = malloc(sizeof(pipeline_buffer_t) * max_buffers);
+    stage->indices = malloc(sizeof(pipeline_indices_t) * (stage->last - stage->first + 1));
+
+    layer_buffer_t buffers[LAYER_MAX_BUFFERS];
+    for (int layer_i = stage->first; layer_i <= stage->last; layer_i++) {
+        layer_t *layer = model->ops[layer_i].layer;
+        int n_buffers = layer_get_buffers(layer, buffers);
+        for (int i = 0; i < n_buffers; i++) {
+            const bool per_slot = buffers[i].lifetime == BUFFER_FORWARD_OUTPUT || buffers[i].lifetime == BUFFER_SAVED;
+            pipeline_add_buffer(stage, buffers[i].matrix, per_slot);
+        }
+
+        if (layer->type == INPUT) {
+            input_layer_t *input = &layer->layer.input;
+            pipeline_add_buffer(stage, &input->input_values, true);
+            pipeline_add_indices(stage, &input->active_indices, input->input_values.n_elements);
+            stage->slot_n_active = calloc(stage->n_slots, sizeof(int));
+        } else if (layer->type == POOL2D && layer->layer.pool2d.indices != NULL) {
+            pipeline_add_indices(stage, &layer->layer.pool2d.indices, layer->layer.pool2d.output.n_elements);
+        }
+    }
+
+    if (stage->index > 0) {
+        layer_t *first = model->ops[stage->first].layer;
+        stage->boundary = *first->prev;
+        stage->original_prev = first->prev;
+        first->prev = &stage->boundary;
+
+        int n_buffers = layer_get_buffers(&stage->boundary, buffers);
+        int output_i = 0;
+        while (output_i < n_buffers && buffers[output_i].lifetime != BUFFER_FORWARD_OUTPUT) {
+            output_i++;
+        }
+        assert(output_i < n_buffers);
+        pipeline_add_buffer(stage, buffers[output_i].matrix, true);
+    }
+
+    nmatrix_t neurons = layer_get_neurons(model->ops[stage->last].layer);
+    stage->gradient = neurons;
+    stage->gradient.matrix = nmatrix_aligned_alloc(neurons.n_elements);
+}
+
+// points the stage's layers at the buffers of a slot
+static void pipeline_stage_select(pipeline_stage_t *stage, int slot) {
+    for (int i = 0; i < stage->n_buffers; i++) {
+        stage->buffers[i].matrix->matrix = stage->buffers[i].storage + slot * stage->buffers[i].stride;
+    }
+    for (int i = 0; i < stage->n_indices; i++) {
+        *stage->indices[i].indices = stage->indices[i].storage + slot * stage->indices[i].stride;
+    }
+    if (stage->slot_n_active != NULL) {
+        stage->pipeline->model->input_layer->layer.input.n_active = stage->slot_n_active[slot];
+    }
+}
+
+static nmatrix_t pipeline_forward(pipeline_stage_t *stage, nmatrix_t values) {
+    layer_op_t *ops = stage->pipeline->model->ops;
+    for (int layer_i = stage->first; layer_i <= stage->last; layer_i++) {
+        values = layer_op_feed_forward(&ops[layer_i], values);
+    }
+    return values;
+}
+
+static nmatrix_t pipeline_backward(pipeline_stage_t *stage, int from, nmatrix_t d_cost_wrt_Y) {
+    layer_op_t *ops = stage->pipeline->model->ops;
+    const float learning_rate = stage->pipeline->training_info->learning_rate;
+    for (int layer_i = from; layer_i >= stage->stop; layer_i--) {
+        d_cost_wrt_Y = layer_op_back_propagation(&ops[layer_i], d_cost_wrt_Y, learning_rate);
+    }
+    // weight gradients handed to the model's pool finish before the slot is reused
+    for (int layer_i = from; layer_i >= stage->stop; layer_i--) {
+        layer_wait_gradients(ops[layer_i].layer);
+    }
+    return d_cost_wrt_Y;
+}
+
+// loss, guess and backward pass of a micro-batch at the end of the last stage, the same steps model_train_info takes
+// for an example. returns dE/dX of the stage's first layer
+static nmatrix_t pipeline_output(pipeline_stage_t *stage, unsigned int micro_batch, nmatrix_t output) {
+    pipeline_t *pipeline = stage->pipeline;
+    training_info_t *training_info = pipeline->training_info;
+    layer_t *output_layer = pipeline->model->output_layer;
+    const unsigned int example_i = pipeline->examples[micro_batch];
+    const int *labels = training_info->train_labels;
+
+    if (labels != NULL) {
+        pipeline->costs[micro_batch] = output_cost_label(output_layer, labels[example_i]);
+        pipeline->correct[micro_batch] = nmatrix_argmax(&output) == labels[example_i];
+    } else {
+        pipeline->costs[micro_batch] = output_layer->layer.output.loss(output_layer, training_info->train_y[example_i]);
+        nmatrix_t guess = output_layer->layer.output.make_guess(output_layer, output);
+        pipeline->correct[micro_batch] = nmatrix_equal(&training_info->train_y[example_i], &guess);
+    }
+
+    if (!stage->backward) {
+        return output;
+    }
+    layer_op_t *ops = pipeline->model->ops;
+    nmatrix_t d_cost_wrt_Y = labels != NULL
+            ? output_back_propagation_label(ops[stage->last].layer, labels[example_i], training_info->learning_rate)
+            : layer_op_back_propagation(&ops[stage->last], training_info->train_y[example_i], training_info->learning_rate);
+    return pipeline_backward(stage, stage->last - 1, d_cost_wrt_Y);
+}
+
+// called with the lock held
+static void pipeline_stage_complete(pipeline_stage_t *stage) {
+    stage->completed++;
+    if (stage->completed == stage->pipeline->n_pushed) {
+        pthread_cond_broadcast(&stage->pipeline->drained);
+    }
+}
+
+static void* pipeline_stage_run(void *argument) {
+    pipeline_stage_t *stage = argument;
+    pipeline_t *pipeline = stage->pipeline;
+    const bool last_stage = stage->index == pipeline->n_stages - 1;
+    pipeline_channel_t *activations_in = stage->index > 0 ? &pipeline->activations[stage->index - 1] : NULL;
+    pipeline_channel_t *activations_out = last_stage ? NULL : &pipeline->activations[stage->index];
+    pipeline_channel_t *gradients_in = !last_stage && stage->backward ? &pipeline->gradients[stage->index] : NULL;
+    pipeline_channel_t *gradients_out = stage->sends_gradient ? &pipeline->gradients[stage->index - 1] : NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (true) {
+        // one forward one backward, a waiting gradient goes first so the oldest micro-batch frees its slot
+        if (gradients_in != NULL && gradients_in->count > 0) {
+            const int slot = stage->completed % stage->n_slots;
+            pipeline_channel_pop(gradients_in, stage->gradient.matrix);
+            pthread_mutex_unlock(&pipeline->lock);
+
+            pipeline_stage_select(stage, slot);
+            nmatrix_t d_cost_wrt_input = pipeline_backward(stage, stage->last, stage->gradient);
+
+            pthread_mutex_lock(&pipeline->lock);
+            if (gradients_out != NULL) {
+                pipeline_channel_push(gradients_out, d_cost_wrt_input.matrix);
+                pthread_cond_signal(&pipeline->stages[stage->index - 1].wake);
+            }
+            pipeline_stage_complete(stage);
+            continue;
+        }
+
+        const bool can_forward = stage->forwarded < pipeline->n_pushed
+                && stage->forwarded - stage->completed < (unsigned int) stage->n_slots
+                && (activations_in == NULL || activations_in->count > 0)
+                && (activations_out == NULL || activations_out->count < activations_out->capacity);
+        if (can_forward) {
+            const unsigned int micro_batch = stage->forwarded++;
+            const int slot = micro_batch % stage->n_slots;
+            pipeline_stage_select(stage, slot);
+            if (activations_in != NULL) {
+                // the previous stage may be waiting for room in the channel
+                pipeline_channel_pop(activations_in, layer_get_neurons(&stage->boundary).matrix);
+                pthread_cond_signal(&pipeline->stages[stage->index - 1].wake);
+            }
+            pthread_mutex_unlock(&pipeline->lock);
+
+            nmatrix_t input = activations_in != NULL
+                    ? layer_get_neurons(&stage->boundary)
+                    : training_info_load_input(pipeline->training_info, true, pipeline->examples[micro_batch]);
+            nmatrix_t output = pipeline_forward(stage, input);
+            if (stage->slot_n_active != NULL) {
+                stage->slot_n_active[slot] = pipeline->model->input_layer->layer.input.n_active;
+            }
+            nmatrix_t d_cost_wrt_input = last_stage ? pipeline_output(stage, micro_batch, output) : output;
+
+            pthread_mutex_lock(&pipeline->lock);
+            if (activations_out != NULL) {
+                pipeline_channel_push(activations_out, output.matrix);
+                pthread_cond_signal(&pipeline->stages[stage->index + 1].wake);
+            }
+            if (last_stage && gradients_out != NULL) {
+                pipeline_channel_push(gradients_out, d_cost_wrt_input.matrix);
+                pthread_cond_signal(&pipeline->stages[stage->index - 1].wake);
+            }
+            if (last_stage || !stage->backward) {
+                pipeline_stage_complete(stage);
+            }
+            continue;
+        }
+
+        if (pipeline->stop) {
+            break;
+        }
+        pthread_cond_wait(&stage->wake, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/**
+ * Starts a thread for every stage of training_info's model, stage s runs ops stage_first[s] up to the next stage's
+ * first one. Examples pushed into the pipeline are micro-batches of one example: the forward pass of one overlaps
+ * the backward passes of earlier ones on the other stages. Every stage trains its micro-batches in order, so the
+ * gradient sums after pipeline_flush are the same as training the batch's examples one after another.
+ * The stages own the model's layer buffers until pipeline_free.
+ */
+pipeline_t* pipeline_create(training_info_t *training_info, int n_stages, const int *stage_first) {
+    neural_network_model_t *model = training_info->model;
+    assert(pipeline_supported(model));
+    assert(n_stages > 1 && stage_first[0] == 0 && stage_first[1] >= 2);
+
+    pipeline_t *pipeline = malloc(sizeof(pipeline_t));
+    *pipeline = (pipeline_t) {
+        .training_info = training_info,
+        .model = model,
+        .n_stages = n_stages,
+        .stages = calloc(n_stages, sizeof(pipeline_stage_t)),
+        .activations = malloc(sizeof(pipeline_channel_t) * (n_stages - 1)),
+        .gradients = malloc(sizeof(pipeline_channel_t) * (n_stages - 1)),
+        .examples = malloc(sizeof(unsigned int) * training_info->batch_size),
+        .costs = malloc(sizeof(float) * training_info->batch_size),
+        .correct = malloc(sizeof(bool) * training_info->batch_size),
+        .capacity = training_info->batch_size,
+    };
+
+    for (int s = 0; s < n_stages; s++) {
+        pipeline_stage_t *stage = &pipeline->stages[s];
+        stage->pipeline = pipeline;
+        stage->index = s;
+        stage->first = stage_first[s];
+        stage->last = (s + 1 < n_stages ? stage_first[s + 1] : (int) model->num_layers) - 1;
+        assert(stage->first <= stage->last);
+        stage->stop = stage->first > (int) model->first_trainable_layer ? stage->first : (int) model->first_trainable_layer;
+        stage->backward = stage->last >= (int) model->first_trainable_layer;
+        stage->sends_gradient = s > 0 && stage->first > (int) model->first_trainable_layer;
+        stage->n_slots = stage->backward ? n_stages - s : 1;
+        pipeline_stage_bind(stage);
+        pthread_cond_init(&stage->wake, NULL);
+    }
+    for (int s = 0; s + 1 < n_stages; s++) {
+        const int size = layer_get_neurons(model->ops[pipeline->stages[s].last].layer).n_elements;
+        pipeline->activations[s] = pipeline_channel_create(size, n_stages);
+        pipeline->gradients[s] = pipeline_channel_create(size, n_stages);
+    }
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->drained, NULL);
+    for (int s = 0; s < n_stages; s++) {
+        pthread_create(&pipeline->stages[s].thread, NULL, pipeline_stage_run, &pipeline->stages[s]);
+    }
+    return pipeline;
+}
+
+// adds a training example to the current batch, it starts through the stages right away
+void pipeline_push(pipeline_t *pipeline, unsigned int example_i) {
+    pthread_mutex_lock(&pipeline->lock);
+    assert(pipeline->n_pushed < pipeline->capacity);
+    pipeline->examples[pipeline->n_pushed++] = example_i;
+    pthread_cond_signal(&pipeline->stages[0].wake);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static bool pipeline_drained(pipeline_t *pipeline) {
+    for (int s = 0; s < pipeline->n_stages; s++) {
+        if (pipeline->stages[s].completed < pipeline->n_pushed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// waits until every example of the batch went through all stages and adds their losses and correct guesses in
+// example order. the gradient sums are then complete for the gradient descent step
+void pipeline_flush(pipeline_t *pipeline, float *cost_sum, int *n_correct) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline_drained(pipeline)) {
+        pthread_cond_wait(&pipeline->drained, &pipeline->lock);
+    }
+    for (unsigned int micro_batch = 0; micro_batch < pipeline->n_pushed; micro_batch++) {
+        *cost_sum += pipeline->costs[micro_batch];
+        *n_correct += pipeline->correct[micro_batch];
+    }
+    for (int s = 0; s < pipeline->n_stages; s++) {
+        pipeline->stages[s].forwarded = 0;
+        pipeline->stages[s].completed = 0;
+    }
+    pipeline->n_pushed = 0;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+// stops the stage threads and gives the layers their buffers back, the batch has to be flushed
+void pipeline_free(pipeline_t *pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    assert(pipeline->n_pushed == 0);
+    pipeline->stop = true;
+    for (int s = 0; s < pipeline->n_stages; s++) {
+        pthread_cond_signal(&pipeline->stages[s].wake);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (int s = 0; s < pipeline->n_stages; s++) {
+        pipeline_stage_t *stage = &pipeline->stages[s];
+        pthread_join(stage->thread, NULL);
+        pthread_cond_destroy(&stage->wake);
+
+        for (int i = 0; i < stage->n_buffers; i++) {
+            stage->buffers[i].matrix->matrix = stage->buffers[i].original;
+            nmatrix_aligned_free(stage->buffers[i].storage);
+        }
+        for (int i = 0; i < stage->n_indices; i++) {
+            *stage->indices[i].indices = stage->indices[i].original;
+            free(stage->indices[i].storage);
+        }
+        if (stage->original_prev != NULL) {
+            pipeline->model->ops[stage->first].layer->prev = stage->original_prev;
+        }
+        free(stage->buffers);
+        free(stage->indices);
+        free(stage->slot_n_active);
+        nmatrix_aligned_free(stage->gradient.matrix);
+    }
+    for (int s = 0; s + 1 < pipeline->n_stages; s++) {
+        free(pipeline->activations[s].entries);
+        free(pipeline->gradients[s].entries);
+    }
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->drained);
+    free(pipeline->stages);
+    free(pipeline->activations);
+    free(pipeline->gradients);
+    free(pipeline->examples);
+    free(pipeline->costs);
+    free(pipeline->correct);
+    free(pipeline);
+}
@@ -0,0 +1,129 @@
+#include <model/model.h>
+
+#include <string.h>
+
+// a plannable buffer and the span of training step times in which it holds a live value
+typedef struct Planned_Buffer {
+    nmatrix_t *matrix;
+    int size;   // aligned float count
+    int start;
+    int end;    // inclusive
+    int offset; // placement in the workspace, -1 until placed
+} planned_buffer_t;
+
+static int compare_size_descending(const void *a, const void *b) {
+    return ((const planned_buffer_t*) b)->size - ((const planned_buffer_t*) a)->size;
+}
+
+static bool lifetimes_overlap(const planned_buffer_t *a, const planned_buffer_t *b) {
+    return a->start <= b->end && b->start <= a->end;
+}
+
+/**
+ * Packs the activation and gradient buffers of every layer into one shared workspace.
+ *
+ * A training step is modeled as a timeline: the forward pass of layer i runs at time i, the backward
+ * pass of layer i at time 2N-1-i (N layers). Each buffer is live from the step that writes it to the
+ * last step that reads it
+ *  - forward outputs of layer i are read by layer i+1's forward and backward pass: [i, 2N-2-i]
+ *  - input gradients of layer i are read by layer i-1's backward pass: [2N-1-i, 2N-i]
+ *  - saved buffers of layer i (im2col columns) are kept for its own backward pass: [i, 2N-1-i]
+ *  - scratch buffers only live within the layer's own backward pass
+ * Buffers whose lifetimes do not overlap can share storage. They are placed largest first at the lowest
+ * offset that does not collide with an already placed, simultaneously live buffer.
+ *
+ * Forward outputs are all live at the end of the forward pass, so after model_predict/model_calculate
+ * every layer's neurons are still valid. During back propagation they get overwritten by gradients.
+ *
+ * Must be called after the last layer is added. Returns the workspace size in floats.
+ */
+unsigned int model_plan_memory(neural_network_model_t *model) {
+    assert(model->workspace == NULL);
+
+    const int N = model->num_layers;
+    planned_buffer_t *planned = malloc(sizeof(planned_buffer_t) * N * LAYER_MAX_BUFFERS);
+    int n_planned = 0;
+
+    layer_buffer_t buffers[LAYER_MAX_BUFFERS];
+    layer_t *current = model->input_layer;
+    for (int layer_i = 0; layer_i < N; layer_i++) {
+        int n_buffers = layer_get_buffers(current, buffers);
+        for (int i = 0; i < n_buffers; i++) {
+            planned_buffer_t *buffer = &planned[n_planned++];
+            buffer->matrix = buffers[i].matrix;
+            buffer->size = nmatrix_aligned_size(buffers[i].matrix->n_elements);
+            buffer->offset = -1;
+
+            const int backward = 2 * N - 1 - layer_i;
+            switch (buffers[i].lifetime) {
+                case BUFFER_FORWARD_OUTPUT:
+                    buffer->start = layer_i;
+                    buffer->end = backward - 1;
+                    break;
+                case BUFFER_INPUT_GRADIENT:
+                    buffer->start = backward;
+                    buffer->end = backward + 1;
+                    break;
+                case BUFFER_SAVED:
+                    buffer->start = layer_i;
+                    buffer->end = backward;
+                    break;
+                case BUFFER_SCRATCH:
+                    buffer->start = backward;
+                    buffer->end = backward;
+                    break;
+            }
+        }
+        current = current->next;
+    }
+
+    qsort(planned, n_planned, sizeof(planned_buffer_t), compare_size_descending);
+
+    unsigned int workspace_size = 0;
+    planned_buffer_t *conflicts[n_planned > 0 ? n_planned : 1];
+    for (int i = 0; i < n_planned; i++) {
+        // gather placed buffers that are live at the same time, ordered by offset
+        int n_conflicts = 0;
+        for (int j = 0; j < i; j++) {
+            if (!lifetimes_overlap(&planned[i], &planned[j])) {
+                continue;
+            }
+
+            int k = n_conflicts++;
+            while (k > 0 && conflicts[k - 1]->offset > planned[j].offset) {
+                conflicts[k] = conflicts[k - 1];
+                k--;
+            }
+            conflicts[k] = &planned[j];
+        }
+
+        // first gap large enough
+        int offset = 0;
+        for (int j = 0; j < n_conflicts; j++) {
+            if (conflicts[j]->offset - offset >= planned[i].size) {
+                break;
+            }
+            int conflict_end = conflicts[j]->offset + conflicts[j]->size;
+            offset = conflict_end > offset ? conflict_end : offset;
+        }
+
+        planned[i].offset = offset;
+        unsigned int end = offset + planned[i].size;
+        if (end > workspace_size) {
+            workspace_size = end;
+        }
+    }
+
+    if (workspace_size > 0) {
+        model->workspace = nmatrix_aligned_alloc(workspace_size);
+        model->workspace_size = workspace_size;
+    }
+
+    for (int i = 0; i < n_planned; i++) {
+        nmatrix_free(planned[i].matrix);
+        planned[i].matrix->matrix = model->workspace + planned[i].offset;
+    }
+
+    free(planned);
+    return workspace_size;
+}
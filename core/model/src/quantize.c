@@ -0,0 +1,212 @@
+#include <model/quantize.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
+
+// symmetric int8 range, -128 is left out so the range is the same on both sides of 0
+#define QUANTIZED_MAX 127
+
+// int8 weight slices start on a cache line like the float tensors do
+#define QUANTIZED_ALIGNED_SIZE(n) (((n) + NMATRIX_ALIGNMENT - 1) / NMATRIX_ALIGNMENT * NMATRIX_ALIGNMENT)
+
+static inline int8_t quantize_value(float value, float inv_scale) {
+    float q = roundf(value * inv_scale);
+    q = q > QUANTIZED_MAX ? QUANTIZED_MAX : q;
+    q = q < -QUANTIZED_MAX ? -QUANTIZED_MAX : q;
+    return (int8_t) q;
+}
+
+// multiplier mapping [-max_abs, max_abs] onto the int8 range
+static float inverse_scale(float max_abs) {
+    return max_abs > 0 ? QUANTIZED_MAX / max_abs : 1;
+}
+
+static float max_abs(const float *values, int n, float max) {
+    for (int i = 0; i < n; i++) {
+        max = fmaxf(max, fabsf(values[i]));
+    }
+    return max;
+}
+
+// class a test example is labelled with, from whichever target the set carries
+static int expected_class(training_info_t *training_info, unsigned int example_i) {
+    if (training_info->test_labels != NULL) {
+        return training_info->test_labels[example_i];
+    }
+    return unpack_one_hot_encoded(training_info->test_y[example_i]);
+}
+
+/**
+ * Post training int8 quantization of a trained model. The model is compiled to an inference plan first, so
+ * activations are fused, dropout is folded and low rank layers are split, and every op of that plan has to be dense.
+ *  - weights are quantized symmetrically with one scale per output row
+ *  - the first n_calibration test examples are run through the float plan to find the range of the input and of
+ *    every op's output, which fixes the scale each int8 activation is requantized with
+ *  - the float and the int8 plan are both evaluated on the whole test set, the accuracy delta is printed and
+ *    kept in the returned plan
+ * Returns an empty plan (no ops) if the model can not be quantized.
+ */
+quantized_model_t model_quantize(training_info_t *training_info, unsigned int n_calibration) {
+    inference_model_t float_plan = model_compile_inference(training_info->model);
+    for (int op_i = 0; op_i < float_plan.num_ops; op_i++) {
+        if (float_plan.ops[op_i].type != INFERENCE_DENSE) {
+            printf("Failed to quantize model, op %d is not a dense layer and has no int8 kernel\n", op_i);
+            inference_free(&float_plan);
+            return (quantized_model_t) {0};
+        }
+    }
+    if (float_plan.num_ops == 0 || training_info->test_size == 0) {
+        printf("Failed to quantize model, it needs at least one dense layer and a test set to calibrate on\n");
+        inference_free(&float_plan);
+        return (quantized_model_t) {0};
+    }
+
+    // calibration, the widest value every activation takes on
+    if (n_calibration == 0 || n_calibration > training_info->test_size) {
+        n_calibration = training_info->test_size;
+    }
+    float input_max = 0;
+    float output_max[float_plan.num_ops];
+    memset(output_max, 0, sizeof(output_max));
+    for (unsigned int example_i = 0; example_i < n_calibration; example_i++) {
+        nmatrix_t input = training_info_load_input(training_info, false, example_i);
+        input_max = max_abs(input.matrix, input.n_elements, input_max);
+
+        const float *src = input.matrix;
+        for (int op_i = 0; op_i < float_plan.num_ops; op_i++) {
+            float *dst = float_plan.buffers[op_i & 1];
+            inference_run_op(&float_plan.ops[op_i], src, dst, float_plan.columns);
+            output_max[op_i] = max_abs(dst, float_plan.ops[op_i].n_outputs, output_max[op_i]);
+            src = dst;
+        }
+    }
+
+    quantized_model_t plan = {
+        .num_ops = float_plan.num_ops,
+        .ops = malloc(sizeof(quantized_op_t) * float_plan.num_ops),
+        .n_inputs = float_plan.n_inputs,
+        .n_outputs = float_plan.n_outputs,
+        .inv_input_scale = inverse_scale(input_max),
+        .buffer_size = float_plan.buffer_size,
+    };
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        plan.n_weights += QUANTIZED_ALIGNED_SIZE(float_plan.ops[op_i].n_weights);
+        plan.n_parameters += 2 * nmatrix_aligned_size(float_plan.ops[op_i].n_outputs);
+    }
+    plan.weights = (int8_t*) nmatrix_aligned_alloc((plan.n_weights + sizeof(float) - 1) / sizeof(float));
+    plan.parameters = nmatrix_aligned_alloc(plan.n_parameters);
+
+    int weight_offset = 0, parameter_offset = 0;
+    float input_scale = 1 / plan.inv_input_scale;
+    for (int op_i = 0; op_i < plan.num_ops; op_i++) {
+        const inference_op_t *source = &float_plan.ops[op_i];
+        int8_t *weights = plan.weights + weight_offset;
+        float *scales = plan.parameters + parameter_offset;
+        float *bias = scales + nmatrix_aligned_size(source->n_outputs);
+        weight_offset += QUANTIZED_ALIGNED_SIZE(source->n_weights);
+        parameter_offset += 2 * nmatrix_aligned_size(source->n_outputs);
+
+        for (int r = 0; r < source->n_outputs; r++) {
+            const float *row = source->weights + r * source->n_inputs;
+            float inv_row_scale = inverse_scale(max_abs(row, source->n_inputs, 0));
+            for (int c = 0; c < source->n_inputs; c++) {
+                weights[r * source->n_inputs + c] = quantize_value(row[c], inv_row_scale);
+            }
+            scales[r] = input_scale / inv_row_scale;
+        }
+        memcpy(bias, source->bias, sizeof(float) * source->n_outputs);
+
+        plan.ops[op_i] = (quantized_op_t) {
+            .activation = source->activation,
+            .n_inputs = source->n_inputs,
+            .n_outputs = source->n_outputs,
+            .weights = weights,
+            .scales = scales,
+            .bias = bias,
+            .inv_output_scale = inverse_scale(output_max[op_i]),
+        };
+        input_scale = 1 / plan.ops[op_i].inv_output_scale;
+    }
+
+    plan.buffers[0] = (int8_t*) nmatrix_aligned_alloc((plan.buffer_size + sizeof(float) - 1) / sizeof(float));
+    plan.buffers[1] = (int8_t*) nmatrix_aligned_alloc((plan.buffer_size + sizeof(float) - 1) / sizeof(float));
+    plan.values = nmatrix_aligned_alloc(plan.buffer_size);
+
+    // accuracy delta against the float model
+    int float_correct = 0, correct = 0;
+    nmatrix_t float_output = nmatrix_allocator(SHAPE(2, plan.n_outputs, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, plan.n_outputs, 1));
+    for (unsigned int example_i = 0; example_i < training_info->test_size; example_i++) {
+        nmatrix_t input = training_info_load_input(training_info, false, example_i);
+        inference_predict(&float_plan, input, float_output);
+        quantized_predict(&plan, input, output);
+
+        int label = expected_class(training_info, example_i);
+        float_correct += nmatrix_argmax(&float_output) == label;
+        correct += nmatrix_argmax(&output) == label;
+    }
+    plan.float_accuracy = float_correct / (float) training_info->test_size;
+    plan.accuracy = correct / (float) training_info->test_size;
+    printf("Quantized model: accuracy %f, float accuracy %f (delta %+f), %d weight bytes instead of %d\n",
+            plan.accuracy, plan.float_accuracy, plan.accuracy - plan.float_accuracy,
+            plan.n_weights, (int) sizeof(float) * plan.n_weights);
+
+    nmatrix_free(&float_output);
+    nmatrix_free(&output);
+    inference_free(&float_plan);
+    return plan;
+}
+
+// runs the int8 plan on a single example, input and output are float column vectors like inference_predict's
+nmatrix_t quantized_predict(quantized_model_t *plan, nmatrix_t input, nmatrix_t output) {
+    assert(plan->num_ops > 0);
+    assert(input.n_elements == plan->n_inputs);
+    assert(output.n_elements == plan->n_outputs);
+
+    int8_t *src = plan->buffers[0];
+    for (int i = 0; i < plan->n_inputs; i++) {
+        src[i] = quantize_value(input.matrix[i], plan->inv_input_scale);
+    }
+
+    int buffer_i = 1;
+    float *values = plan->values;
+    for (int op_i = 0; op_i < plan->num_ops; op_i++) {
+        const quantized_op_t *op = &plan->ops[op_i];
+        for (int r = 0; r < op->n_outputs; r++) {
+            const int8_t *row = op->weights + r * op->n_inputs;
+            int32_t dot = 0;
+            for (int c = 0; c < op->n_inputs; c++) {
+                dot += row[c] * src[c];
+            }
+            values[r] = dot * op->scales[r] + op->bias[r];
+        }
+        inference_activate(op->activation, values, op->n_outputs);
+        if (op_i == plan->num_ops - 1) {
+            break; // the output layer stays in float
+        }
+
+        // requantize for the next op
+        int8_t *dst = plan->buffers[buffer_i];
+        for (int r = 0; r < op->n_outputs; r++) {
+            dst[r] = quantize_value(values[r], op->inv_output_scale);
+        }
+        src = dst;
+        buffer_i ^= 1;
+    }
+
+    memcpy(output.matrix, values, sizeof(float) * plan->n_outputs);
+    return output;
+}
+
+void quantized_free(quantized_model_t *plan) {
+    free(plan->ops);
+    nmatrix_aligned_free((float*) plan->weights);
+    nmatrix_aligned_free(plan->parameters);
+    nmatrix_aligned_free((float*) plan->buffers[0]);
+    nmatrix_aligned_free((float*) plan->buffers[1]);
+    nmatrix_aligned_free(plan->values);
+    *plan = (quantized_model_t) {0};
+}
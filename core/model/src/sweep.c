@@ -0,0 +1,216 @@
+#include <model/sweep.h>
+#include <util/thread_pool.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
+
+typedef struct Sweep_Task {
+    const training_info_t *data;
+    sweep_result_t *result;
+} sweep_task_t;
+
+static double sweep_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// outputs of the models, one per class for labelled sets and otherwise the width of the targets
+static int sweep_n_outputs(const training_info_t *data) {
+    if (data->train_labels == NULL) {
+        return data->train_y[0].n_elements;
+    }
+
+    int max_label = 1;
+    for (unsigned int i = 0; i < data->train_size; i++) {
+        max_label = data->train_labels[i] > max_label ? data->train_labels[i] : max_label;
+    }
+    for (unsigned int i = 0; data->test_labels != NULL && i < data->test_size; i++) {
+        max_label = data->test_labels[i] > max_label ? data->test_labels[i] : max_label;
+    }
+    return max_label + 1;
+}
+
+/**
+ * Multilayer perceptron for a sweep configuration. A single output is a sigmoid rounded to 0 or 1 like nn_XOR,
+ * more outputs are classes trained with softmax cross entropy like the digit model. Weights are drawn from the
+ * model's own generator, scaled by the fan in (He for relu layers), biases start at zero.
+ */
+static void sweep_build_model(neural_network_model_t *model, const training_info_t *data, const sweep_config_t *config) {
+    *model = (neural_network_model_t) {0};
+    random_seed(&model->random, config->seed);
+
+    nmatrix_t input = data->train_pixels != NULL ? nmatrix_allocator(SHAPE(2, data->pixels_per_example, 1))
+                                                 : nmatrix_copy(&data->train_x[0]);
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, config->width, 1));
+    const int n_outputs = sweep_n_outputs(data);
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, n_outputs, 1));
+
+    layer_input(model, input);
+    for (int layer_i = 0; layer_i < config->depth; layer_i++) {
+        layer_dense_activation(model, hidden, config->activation);
+    }
+    if (n_outputs == 1) {
+        layer_dense_activation(model, output, DENSE_ACTIVATION_SIGMOID);
+        layer_output(model, output_make_guess_round, output_functions_meansquared, output_cost_mean_squared);
+    } else {
+        layer_dense(model, output);
+        layer_output(model, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+    }
+
+    for (layer_t *current = model->input_layer; current != NULL; current = current->next) {
+        if (current->type == DENSE) {
+            dense_layer_t *dense = &current->layer.dense;
+            float gain = dense->activation == DENSE_ACTIVATION_RELU ? 2 : 1;
+            model_initialize_matrix_normal_distribution_seeded(dense->weights, 0, sqrtf(gain / dense->weights.dims[1]), &model->random);
+        }
+    }
+
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+}
+
+// trains one configuration, runs on a pool worker. the examples are shared, everything written is the task's own
+static void sweep_run(void *argument) {
+    sweep_task_t *task = argument;
+    sweep_result_t *result = task->result;
+
+    neural_network_model_t model;
+    sweep_build_model(&model, task->data, &result->config);
+
+    training_info_t training_info = *task->data;
+    training_info.model = &model;
+    training_info.batch_size = result->config.batch_size;
+    training_info.learning_rate = result->config.learning_rate;
+    training_info.checkpoint_writer = NULL;
+    training_info.train_order = NULL;
+    training_info.resume = false;
+
+    double start = sweep_seconds();
+    model_train_info(&training_info);
+    result->seconds = sweep_seconds() - start;
+
+    // the loop counts past the last epoch when it runs out, and stays on the epoch it stopped early in
+    result->epochs = training_info.epoch < training_info.target_epochs ? training_info.epoch + 1 : training_info.target_epochs;
+    result->train_accuracy = training_info.train_accuracy;
+    result->test_accuracy = training_info.test_accuracy;
+    result->avg_train_error = training_info.avg_train_error;
+    result->avg_test_error = training_info.avg_test_error;
+
+    free(training_info.train_order);
+    model_free(&model);
+}
+
+static int sweep_configs(const sweep_space_t *space, sweep_config_t **configs) {
+    const int n_grid = space->n_learning_rates * space->n_batch_sizes * space->n_depths * space->n_widths * space->n_activations;
+    const int n_configs = space->n_samples > 0 ? space->n_samples : n_grid;
+    *configs = malloc(sizeof(sweep_config_t) * n_configs);
+
+    random_state_t random;
+    random_seed(&random, space->seed);
+    float min_rate = space->learning_rates[0], max_rate = space->learning_rates[0];
+    for (int i = 1; i < space->n_learning_rates; i++) {
+        min_rate = fminf(min_rate, space->learning_rates[i]);
+        max_rate = fmaxf(max_rate, space->learning_rates[i]);
+    }
+
+    for (int config_i = 0; config_i < n_configs; config_i++) {
+        sweep_config_t *config = &(*configs)[config_i];
+        if (space->n_samples > 0) {
+            config->learning_rate = min_rate * powf(max_rate / min_rate, random_uniform(&random));
+            config->batch_size = space->batch_sizes[random_below(&random, space->n_batch_sizes)];
+            config->depth = space->depths[random_below(&random, space->n_depths)];
+            config->width = space->widths[random_below(&random, space->n_widths)];
+            config->activation = space->activations[random_below(&random, space->n_activations)];
+        } else {
+            // mixed radix digits of the index, the learning rate changes fastest
+            int index = config_i;
+            config->learning_rate = space->learning_rates[index % space->n_learning_rates];
+            index /= space->n_learning_rates;
+            config->batch_size = space->batch_sizes[index % space->n_batch_sizes];
+            index /= space->n_batch_sizes;
+            config->depth = space->depths[index % space->n_depths];
+            index /= space->n_depths;
+            config->width = space->widths[index % space->n_widths];
+            index /= space->n_widths;
+            config->activation = space->activations[index];
+        }
+        config->seed = space->seed + 1 + config_i;
+    }
+    return n_configs;
+}
+
+static bool sweep_write_csv(const sweep_result_t *results, int n_results, const char *csv_path) {
+    FILE *file = fopen(csv_path, "w");
+    if (file == NULL) {
+        printf("Failed to write sweep results, could not open %s\n", csv_path);
+        return false;
+    }
+
+    fprintf(file, "learning_rate,batch_size,depth,width,activation,seed,epochs,train_accuracy,test_accuracy,avg_train_error,avg_test_error,seconds\n");
+    for (int result_i = 0; result_i < n_results; result_i++) {
+        const sweep_result_t *result = &results[result_i];
+        dense_layer_t activation = {.activation = result->config.activation};
+        fprintf(file, "%g,%u,%d,%d,%s,%llu,%u,%f,%f,%f,%f,%f\n",
+                result->config.learning_rate, result->config.batch_size, result->config.depth, result->config.width,
+                get_dense_activation_name(&activation), (unsigned long long) result->config.seed, result->epochs,
+                result->train_accuracy, result->test_accuracy, result->avg_train_error, result->avg_test_error, result->seconds);
+    }
+    return fclose(file) == 0;
+}
+
+/**
+ * Trains a model for every configuration of a hyperparameter grid (or a random sample of it) on a thread pool,
+ * one model per worker at a time. All models train on data's examples, which are only ever read, with data's
+ * target_epochs, target_accuracy and shuffle. Each model draws its weights, dropout masks and training order
+ * from its own generator, so results do not depend on the number of threads or on scheduling.
+ * Results are returned in configuration order in *results (free it), and also written to csv_path unless it is NULL.
+ * Returns the number of configurations trained.
+ */
+int model_sweep(const training_info_t *data, const sweep_space_t *space, int n_threads, const char *csv_path,
+        sweep_result_t **results) {
+    assert(space->n_learning_rates > 0 && space->n_batch_sizes > 0 && space->n_depths > 0
+            && space->n_widths > 0 && space->n_activations > 0);
+    assert(data->train_size > 0);
+
+    sweep_config_t *configs;
+    const int n_configs = sweep_configs(space, &configs);
+    *results = calloc(n_configs, sizeof(sweep_result_t));
+    sweep_task_t *tasks = malloc(sizeof(sweep_task_t) * n_configs);
+
+    double start = sweep_seconds();
+    thread_pool_t *pool = thread_pool_create(n_threads);
+    for (int config_i = 0; config_i < n_configs; config_i++) {
+        (*results)[config_i].config = configs[config_i];
+        tasks[config_i] = (sweep_task_t) {.data = data, .result = &(*results)[config_i]};
+        thread_pool_submit(pool, sweep_run, &tasks[config_i]);
+    }
+    thread_pool_wait(pool);
+    printf("Sweep trained %d models on %d threads in %f seconds\n", n_configs, thread_pool_size(pool), sweep_seconds() - start);
+    thread_pool_free(pool);
+
+    if (csv_path != NULL) {
+        sweep_write_csv(*results, n_configs, csv_path);
+    }
+
+    free(tasks);
+    free(configs);
+    return n_configs;
+}
+
+// index of the result with the best test accuracy, ties go to the lower test error
+int sweep_best_result(const sweep_result_t *results, int n_results) {
+    int best = 0;
+    for (int result_i = 1; result_i < n_results; result_i++) {
+        const sweep_result_t *result = &results[result_i];
+        if (result->test_accuracy > results[best].test_accuracy
+                || (result->test_accuracy == results[best].test_accuracy && result->avg_test_error < results[best].avg_test_error)) {
+            best = result_i;
+        }
+    }
+    return best;
+}
@@ -2,6 +2,8 @@
 #ifndef MY_MATH_H
 #define MY_MATH_H
 
+#include <stdint.h>
+
 // random float precision floating point number following the normal distribution ()
 // using the Box Muller Transform algorithm
 float random_normal_distribution_BoxMullerTransform(float standard_deviation);
@@ -9,6 +11,21 @@ float random_normal_distribution_BoxMullerTransform(float standard_deviation);
 // random float precision floating point number from 0 to a_max
 float random_uniform_range(float a_max);
 
+// xorshift64* generator, unlike rand() its whole state is one value that can be saved and restored,
+// and separately seeded generators give independent streams
+typedef struct Random_State {
+    uint64_t state;
+} random_state_t;
+
+void random_seed(random_state_t *random, uint64_t seed);
+uint32_t random_next(random_state_t *random);
+// uniform float in [0, 1)
+float random_uniform(random_state_t *random);
+// uniform integer in [0, n)
+uint32_t random_below(random_state_t *random, uint32_t n);
+// normal distribution with mean 0, Box Muller Transform like random_normal_distribution_BoxMullerTransform
+float random_normal(random_state_t *random, float standard_deviation);
+
 
 float sigmoid(float z);
 float relu(float z);
@@ -9,6 +9,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,6 +24,15 @@ extern "C" {
 #define MAX_DIMS 4
 #endif
 
+/**
+ * \brief               Byte alignment of slabs returned by \ref nmatrix_aligned_alloc
+ * \note                One cache line, also wide enough for any SIMD register
+ * \hideinitializer
+ */
+#ifndef NMATRIX_ALIGNMENT
+#define NMATRIX_ALIGNMENT 64
+#endif
+
 /**
  * \defgroup            N-dimensional Matrix library
  * \{
@@ -54,6 +64,9 @@ nshape_t nshape_constructor(int n_dims, ...);
 void free_nmatrix_list(int size, nmatrix_t *list);
 
 nmatrix_t nmatrix_allocator(nshape_t shape);
+float*    nmatrix_aligned_alloc(int n_elements);
+void      nmatrix_aligned_free(float *data);
+int       nmatrix_aligned_size(int n_elements);
 nmatrix_t nmatrix_constructor(int n_elements, float *matrix, nshape_t shape);
 
 void nmatrix_reshape(nmatrix_t *m, nshape_t shape);
@@ -66,14 +79,27 @@ void        nmatrix_free(nmatrix_t *m);
 nmatrix_t   nmatrix_copy(nmatrix_t *src);
 void        nmatrix_memcpy(nmatrix_t *dst, nmatrix_t *src);
 void        nmatrix_memset(nmatrix_t *m, float val);
+void        nmatrix_from_uint8(nmatrix_t *m, const uint8_t *values, float scale, float offset);
 
+int  nmatrix_convolution_size(int size, int kernel, int stride, int padding);
 void nmatrix_convolve(nmatrix_t *m1, nmatrix_t *m2,
                       nmatrix_t *result);
+void nmatrix_im2col(nmatrix_t *image, int kernel, int stride, int padding,
+                    nmatrix_t *columns);
+void nmatrix_col2im(nmatrix_t *columns, int kernel, int stride, int padding,
+                    nmatrix_t *image);
 void nmatrix_maxpool(nmatrix_t *m1, nshape_t shape,
                      nmatrix_t *result);
+void nmatrix_maxpool_indexed(nmatrix_t *m1, nshape_t shape,
+                             nmatrix_t *result, int *indices);
+void nmatrix_avgpool(nmatrix_t *m1, nshape_t shape,
+                     nmatrix_t *result);
 
 void nmatrix_multiply(nmatrix_t *m1, nmatrix_t *m2,
                       nmatrix_t *result);
+void nmatrix_gemm(bool transpose_a, bool transpose_b, float alpha, nmatrix_t *a, nmatrix_t *b,
+                  float beta, nmatrix_t *c);
+void nmatrix_factorize_low_rank(nmatrix_t *m, int iterations, nmatrix_t *u, nmatrix_t *v);
 // todo int nmatrix_multiply_size(nmatrix_t *m1, nmatrix_t *m2);
 
 void nmatrix_multiply_scalar(nmatrix_t *m, float scalar,
@@ -93,6 +119,7 @@ void nmatrix_transpose(nmatrix_t *m,
                             // nmatrix_t *result, ...);
 
 bool nmatrix_equal(nmatrix_t *m1, nmatrix_t *m2);
+int nmatrix_argmax(nmatrix_t *m);
 
 void nmatrix_for_each_operator(nmatrix_t *m, float (*op)(float),
                                nmatrix_t *result);
@@ -0,0 +1,71 @@
+/**
+ * \file                thread_pool.h
+ * \brief               Fixed size pool of worker threads running submitted tasks
+ */
+
+#pragma once
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/**
+ * \defgroup            Thread pool
+ * \{
+ */
+
+/**
+ * \brief               Task run by a worker, receives the argument it was submitted with
+ */
+typedef void (*thread_pool_task_t)(void *argument);
+
+/**
+ * \brief               Opaque pool, tasks are taken from one queue in submission order
+ */
+typedef struct Thread_Pool thread_pool_t;
+
+/**
+ * \brief               Number of online processors, at least 1
+ */
+int thread_pool_default_threads(void);
+
+/**
+ * \brief               Starts a pool
+ * \param[in]           n_threads: number of workers, \ref thread_pool_default_threads when 0 or less
+ * \return              The pool, release it with \ref thread_pool_free
+ */
+thread_pool_t* thread_pool_create(int n_threads);
+
+/**
+ * \brief               Number of workers of the pool
+ */
+int thread_pool_size(thread_pool_t *pool);
+
+/**
+ * \brief               Queues a task, never blocks
+ * \note                Tasks may submit further tasks to the same pool
+ */
+void thread_pool_submit(thread_pool_t *pool, thread_pool_task_t task, void *argument);
+
+/**
+ * \brief               Blocks until every task submitted so far, and everything they submitted, has finished
+ * \note                Must not be called from a task of the same pool
+ */
+void thread_pool_wait(thread_pool_t *pool);
+
+/**
+ * \brief               Finishes the queued tasks, stops the workers and frees the pool
+ */
+void thread_pool_free(thread_pool_t *pool);
+
+/**
+ * \}
+ */
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif // THREAD_POOL_H
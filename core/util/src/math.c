@@ -35,6 +35,38 @@ float random_uniform_range(float a) {
     return (float) rand() / (float) (RAND_MAX / a);
 }
 
+void random_seed(random_state_t *random, uint64_t seed) {
+    // splitmix64 spreads nearby seeds apart, xorshift can not leave a zero state
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    random->state = z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+}
+
+uint32_t random_next(random_state_t *random) {
+    uint64_t x = random->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random->state = x;
+    return (uint32_t) ((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+float random_uniform(random_state_t *random) {
+    return (random_next(random) >> 8) * (1.0f / 16777216);
+}
+
+uint32_t random_below(random_state_t *random, uint32_t n) {
+    return (uint32_t) (((uint64_t) random_next(random) * n) >> 32);
+}
+
+float random_normal(random_state_t *random, float standard_deviation) {
+    float U1 = 1 - random_uniform(random); // (0, 1], log(0) is undefined
+    float U2 = random_uniform(random);
+    return sqrtf(-2 * logf(U1)) * cosf(2 * acosf(-1) * U2) * standard_deviation;
+}
+
 float sigmoid(float z) {
     return 1. / (1 + exp(-z));
 }
@@ -6,6 +6,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 /**
  * \brief               Constructs a nshape object
  *
@@ -74,6 +78,58 @@ nmatrix_allocator(nshape_t shape) {
     return m;
 }
 
+/**
+ * \brief               Heap allocates a float buffer aligned to \ref NMATRIX_ALIGNMENT bytes
+ * \note                Free with \ref nmatrix_aligned_free, not free()
+ *
+ * \param[in]           n_elements: number of floats to allocate
+ * \return              pointer to the zeroed buffer
+ */
+float*
+nmatrix_aligned_alloc(int n_elements) {
+    assert(n_elements > 0);
+
+    size_t bytes = sizeof(float) * nmatrix_aligned_size(n_elements);
+#ifdef _WIN32
+    float *data = _aligned_malloc(bytes, NMATRIX_ALIGNMENT);
+#else
+    float *data = aligned_alloc(NMATRIX_ALIGNMENT, bytes);
+#endif
+    assert(data != NULL);
+    memset(data, 0, bytes);
+    return data;
+}
+
+/**
+ * \brief               Frees a buffer allocated by \ref nmatrix_aligned_alloc
+ *
+ * \param[in]           data: buffer to free, may be NULL
+ */
+void
+nmatrix_aligned_free(float *data) {
+    if (data == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+/**
+ * \brief               Rounds a float count up so the next buffer placed after it stays aligned
+ *
+ * \param[in]           n_elements: number of floats
+ * \return              n_elements padded to a multiple of \ref NMATRIX_ALIGNMENT bytes
+ */
+int
+nmatrix_aligned_size(int n_elements) {
+    const int floats_per_line = NMATRIX_ALIGNMENT / sizeof(float);
+    return (n_elements + floats_per_line - 1) / floats_per_line * floats_per_line;
+}
+
 /**
  * \brief               Creates a matrix with supplied data
  *
@@ -230,17 +286,244 @@ void nmatrix_memset(nmatrix_t *m, float val) {
     }
 }
 
-// TODO
+// expands compactly stored bytes into the matrix, m[i] = values[i] * scale + offset
+// a straight widening loop with no branches so the compiler turns it into vector converts
+void nmatrix_from_uint8(nmatrix_t *m, const uint8_t *values, float scale, float offset) {
+    float *matrix = m->matrix;
+    const int n_elements = m->n_elements;
+    for (int i = 0; i < n_elements; i++) {
+        matrix[i] = (float) values[i] * scale + offset;
+    }
+}
+
+// output size along one spatial dimension of a convolution or pooling window
+int nmatrix_convolution_size(int size, int kernel, int stride, int padding) {
+    assert(kernel > 0 && stride > 0 && padding >= 0);
+    assert(size + 2 * padding >= kernel);
+    return (size + 2 * padding - kernel) / stride + 1;
+}
+
+// valid cross correlation (what ML calls convolution) with a stride of 1
+// 2D: (H x W) * (KH x KW) -> (H-KH+1 x W-KW+1)
+// 3D: (C x H x W) * (C x KH x KW) -> (1 x H-KH+1 x W-KW+1), summed over the channels
 void nmatrix_convolve(nmatrix_t *m1, nmatrix_t *m2,
                       nmatrix_t *result) {
     assert(m1->n_dims == m2->n_dims);
     assert(m2->n_dims == result->n_dims);
+    assert(m1->n_dims == 2 || m1->n_dims == 3);
+
+    int d = m1->n_dims - 2;
+    int channels = d == 1 ? m1->dims[0] : 1;
+    assert(d == 0 || (m2->dims[0] == channels && result->dims[0] == 1));
+
+    int height = m1->dims[d], width = m1->dims[d+1];
+    int kernel_height = m2->dims[d], kernel_width = m2->dims[d+1];
+    int out_height = nmatrix_convolution_size(height, kernel_height, 1, 0);
+    int out_width = nmatrix_convolution_size(width, kernel_width, 1, 0);
+    assert(result->dims[d] == out_height && result->dims[d+1] == out_width);
+
+    for (int r = 0; r < out_height; r++) {
+        for (int c = 0; c < out_width; c++) {
+            float sum = 0;
+            for (int ch = 0; ch < channels; ch++) {
+                const float *image = m1->matrix + ch * height * width;
+                const float *kernel = m2->matrix + ch * kernel_height * kernel_width;
+                for (int kr = 0; kr < kernel_height; kr++) {
+                    for (int kc = 0; kc < kernel_width; kc++) {
+                        sum += image[(r + kr) * width + c + kc] * kernel[kr * kernel_width + kc];
+                    }
+                }
+            }
+            result->matrix[r * out_width + c] = sum;
+        }
+    }
 }
 
-void nmatrix_maxpool(nmatrix_t *m1, nshape_t shape,
-                     nmatrix_t *result) {
+/**
+ * \brief               Unrolls every kernel sized patch of an image into a column so a convolution becomes one matrix multiply
+ * \note                Out of bounds (padding) pixels are 0
+ *
+ * \param[in]           image: C x H x W image
+ * \param[in]           kernel: width and height of the square kernel
+ * \param[in]           stride: step between patches
+ * \param[in]           padding: zeros added to each side of the image
+ * \param[out]          columns: (C*kernel*kernel) x (OH*OW) matrix, one column per output pixel
+ */
+void nmatrix_im2col(nmatrix_t *image, int kernel, int stride, int padding,
+                    nmatrix_t *columns) {
+    assert(image->n_dims == 3);
+    int channels = image->dims[0], height = image->dims[1], width = image->dims[2];
+    int out_height = nmatrix_convolution_size(height, kernel, stride, padding);
+    int out_width = nmatrix_convolution_size(width, kernel, stride, padding);
+    assert(columns->n_elements == channels * kernel * kernel * out_height * out_width);
+
+    int n_patches = out_height * out_width;
+    for (int ch = 0; ch < channels; ch++) {
+        const float *src = image->matrix + ch * height * width;
+        for (int kr = 0; kr < kernel; kr++) {
+            for (int kc = 0; kc < kernel; kc++) {
+                float *dst = columns->matrix + ((ch * kernel + kr) * kernel + kc) * n_patches;
+                for (int r = 0; r < out_height; r++) {
+                    int image_r = r * stride - padding + kr;
+                    for (int c = 0; c < out_width; c++) {
+                        int image_c = c * stride - padding + kc;
+                        bool inside = image_r >= 0 && image_r < height && image_c >= 0 && image_c < width;
+                        dst[r * out_width + c] = inside ? src[image_r * width + image_c] : 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief               Inverse of \ref nmatrix_im2col, sums every column entry back onto the pixel it was read from
+ * \note                Used to turn the gradient wrt the columns into the gradient wrt the image
+ *
+ * \param[in]           columns: (C*kernel*kernel) x (OH*OW) matrix
+ * \param[in]           kernel: width and height of the square kernel
+ * \param[in]           stride: step between patches
+ * \param[in]           padding: zeros added to each side of the image
+ * \param[out]          image: C x H x W image, overwritten
+ */
+void nmatrix_col2im(nmatrix_t *columns, int kernel, int stride, int padding,
+                    nmatrix_t *image) {
+    assert(image->n_dims == 3);
+    int channels = image->dims[0], height = image->dims[1], width = image->dims[2];
+    int out_height = nmatrix_convolution_size(height, kernel, stride, padding);
+    int out_width = nmatrix_convolution_size(width, kernel, stride, padding);
+    assert(columns->n_elements == channels * kernel * kernel * out_height * out_width);
+
+    memset(image->matrix, 0, sizeof(float) * image->n_elements);
+    int n_patches = out_height * out_width;
+    for (int ch = 0; ch < channels; ch++) {
+        float *dst = image->matrix + ch * height * width;
+        for (int kr = 0; kr < kernel; kr++) {
+            for (int kc = 0; kc < kernel; kc++) {
+                const float *src = columns->matrix + ((ch * kernel + kr) * kernel + kc) * n_patches;
+                for (int r = 0; r < out_height; r++) {
+                    int image_r = r * stride - padding + kr;
+                    if (image_r < 0 || image_r >= height) {
+                        continue;
+                    }
+                    for (int c = 0; c < out_width; c++) {
+                        int image_c = c * stride - padding + kc;
+                        if (image_c >= 0 && image_c < width) {
+                            dst[image_r * width + image_c] += src[r * out_width + c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// pooling windows span the last 2 dimensions, every leading dimension (channels) is pooled independently
+static int pool_geometry(nmatrix_t *m1, nshape_t shape, nmatrix_t *result) {
     assert(m1->n_dims == shape.n_dims);
     assert(m1->n_dims == result->n_dims);
+    assert(m1->n_dims >= 2);
+
+    int n_images = 1;
+    for (int i = 0; i < m1->n_dims - 2; i++) {
+        assert(shape.dims[i] == 1);
+        assert(result->dims[i] == m1->dims[i]);
+        n_images *= m1->dims[i];
+    }
+
+    int d = m1->n_dims - 2;
+    assert(result->dims[d] == m1->dims[d] / shape.dims[d]);
+    assert(result->dims[d+1] == m1->dims[d+1] / shape.dims[d+1]);
+    return n_images;
+}
+
+/**
+ * \brief               Max pooling with non overlapping windows, optionally remembering where each max came from
+ * \note                Trailing rows and columns that do not fill a whole window are dropped
+ *
+ * \param[in]           m1: matrix to pool, the window slides over the last 2 dimensions
+ * \param[in]           shape: window shape, 1 for every leading dimension
+ * \param[out]          result: pooled matrix
+ * \param[out]          indices: flat index into m1 of every result element's max, NULL to skip capturing them
+ */
+void nmatrix_maxpool_indexed(nmatrix_t *m1, nshape_t shape,
+                             nmatrix_t *result, int *indices) {
+    const int n_images = pool_geometry(m1, shape, result);
+    const int d = m1->n_dims - 2;
+    const int height = m1->dims[d], width = m1->dims[d+1];
+    const int kernel_height = shape.dims[d], kernel_width = shape.dims[d+1];
+    const int out_height = result->dims[d], out_width = result->dims[d+1];
+
+    for (int image = 0; image < n_images; image++) {
+        const float *src = m1->matrix + image * height * width;
+        for (int r = 0; r < out_height; r++) {
+            float *dst = result->matrix + (image * out_height + r) * out_width;
+            int *dst_indices = indices != NULL ? indices + (image * out_height + r) * out_width : NULL;
+            for (int c = 0; c < out_width; c++) {
+                dst[c] = -INFINITY;
+                if (dst_indices != NULL) {
+                    dst_indices[c] = image * height * width + r * kernel_height * width + c * kernel_width;
+                }
+            }
+
+            // walk the window one offset at a time so the inner loop runs across the output row
+            for (int kr = 0; kr < kernel_height; kr++) {
+                const float *row = src + (r * kernel_height + kr) * width;
+                for (int kc = 0; kc < kernel_width; kc++) {
+                    if (dst_indices == NULL) {
+                        for (int c = 0; c < out_width; c++) {
+                            dst[c] = fmaxf(dst[c], row[c * kernel_width + kc]);
+                        }
+                        continue;
+                    }
+
+                    const int offset = image * height * width + (r * kernel_height + kr) * width + kc;
+                    for (int c = 0; c < out_width; c++) {
+                        float value = row[c * kernel_width + kc];
+                        if (value > dst[c]) {
+                            dst[c] = value;
+                            dst_indices[c] = offset + c * kernel_width;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void nmatrix_maxpool(nmatrix_t *m1, nshape_t shape,
+                     nmatrix_t *result) {
+    nmatrix_maxpool_indexed(m1, shape, result, NULL);
+}
+
+// average pooling with non overlapping windows, same layout rules as nmatrix_maxpool
+void nmatrix_avgpool(nmatrix_t *m1, nshape_t shape,
+                     nmatrix_t *result) {
+    const int n_images = pool_geometry(m1, shape, result);
+    const int d = m1->n_dims - 2;
+    const int height = m1->dims[d], width = m1->dims[d+1];
+    const int kernel_height = shape.dims[d], kernel_width = shape.dims[d+1];
+    const int out_height = result->dims[d], out_width = result->dims[d+1];
+    const float inv_window = 1.0 / (kernel_height * kernel_width);
+
+    for (int image = 0; image < n_images; image++) {
+        const float *src = m1->matrix + image * height * width;
+        for (int r = 0; r < out_height; r++) {
+            float *dst = result->matrix + (image * out_height + r) * out_width;
+            memset(dst, 0, sizeof(float) * out_width);
+            for (int kr = 0; kr < kernel_height; kr++) {
+                const float *row = src + (r * kernel_height + kr) * width;
+                for (int kc = 0; kc < kernel_width; kc++) {
+                    for (int c = 0; c < out_width; c++) {
+                        dst[c] += row[c * kernel_width + kc];
+                    }
+                }
+            }
+            for (int c = 0; c < out_width; c++) {
+                dst[c] *= inv_window;
+            }
+        }
+    }
 }
 
 void matrix_2d_multiply(int r1, int c1, float *m1, int r2, int c2, float *m2,
@@ -260,6 +543,153 @@ void matrix_2d_multiply(int r1, int c1, float *m1, int r2, int c2, float *m2,
     }
 }
 
+/**
+ * \brief               General matrix multiply, C = alpha * op(A) . op(B) + beta * C
+ * \note                Transposes are read in place, so no transposed copies of A or B are needed.
+ *                      With beta = 0, C does not have to be initialized.
+ *
+ * \param[in]           transpose_a: use A^T instead of A
+ * \param[in]           transpose_b: use B^T instead of B
+ * \param[in]           alpha: scale of the product
+ * \param[in]           a: 2D matrix, op(A) is M x K
+ * \param[in]           b: 2D matrix, op(B) is K x N
+ * \param[in]           beta: scale of the existing values of C
+ * \param[in,out]       c: 2D M x N matrix
+ */
+void nmatrix_gemm(bool transpose_a, bool transpose_b, float alpha, nmatrix_t *a, nmatrix_t *b,
+                  float beta, nmatrix_t *c) {
+    assert(a->n_dims == 2 && b->n_dims == 2 && c->n_dims == 2);
+
+    int M = transpose_a ? a->dims[1] : a->dims[0];
+    int K = transpose_a ? a->dims[0] : a->dims[1];
+    int N = transpose_b ? b->dims[0] : b->dims[1];
+    assert((transpose_b ? b->dims[1] : b->dims[0]) == K);
+    assert(c->dims[0] == M && c->dims[1] == N);
+
+    // strides of op(A) and op(B) along their rows (r) and columns (k)
+    int a_r = transpose_a ? 1 : a->dims[1], a_k = transpose_a ? a->dims[1] : 1;
+    int b_k = transpose_b ? 1 : b->dims[1], b_c = transpose_b ? b->dims[1] : 1;
+
+    for (int r = 0; r < M; r++) {
+        float *dst = c->matrix + r * N;
+        if (beta == 0) {
+            memset(dst, 0, sizeof(float) * N);
+        } else if (beta != 1) {
+            for (int col = 0; col < N; col++) {
+                dst[col] *= beta;
+            }
+        }
+
+        if (!transpose_b) {
+            // i-k-j order, B is streamed row by row
+            for (int k = 0; k < K; k++) {
+                float val = alpha * a->matrix[r * a_r + k * a_k];
+                const float *src = b->matrix + k * b_k;
+                for (int col = 0; col < N; col++) {
+                    dst[col] += val * src[col];
+                }
+            }
+        } else {
+            // rows of B^T are contiguous, plain dot products
+            for (int col = 0; col < N; col++) {
+                float dot = 0;
+                for (int k = 0; k < K; k++) {
+                    dot += a->matrix[r * a_r + k * a_k] * b->matrix[col * b_c + k];
+                }
+                dst[col] += alpha * dot;
+            }
+        }
+    }
+}
+
+/**
+ * \brief               Truncated SVD by power iteration, M ~= U . V with rank r
+ * \note                Each right singular vector is found by iterating v <- M^T . M . v while keeping v
+ *                      orthogonal to the ones already found, which deflates M without forming it again.
+ *                      Start vectors are deterministic, so the same matrix always factors the same way.
+ *
+ * \param[in]           m: 2D N x K matrix
+ * \param[in]           iterations: power iterations per singular vector
+ * \param[out]          u: 2D N x r matrix, left singular vectors scaled by their singular values
+ * \param[out]          v: 2D r x K matrix, right singular vectors as rows
+ */
+void nmatrix_factorize_low_rank(nmatrix_t *m, int iterations, nmatrix_t *u, nmatrix_t *v) {
+    assert(m->n_dims == 2 && u->n_dims == 2 && v->n_dims == 2);
+    const int N = m->dims[0], K = m->dims[1], rank = u->dims[1];
+    assert(u->dims[0] == N && v->dims[0] == rank && v->dims[1] == K);
+    assert(rank <= N && rank <= K);
+
+    float *mv = malloc(sizeof(float) * N);
+    for (int r = 0; r < rank; r++) {
+        float *vec = v->matrix + r * K;
+        unsigned int state = 2463534242u + r;
+        for (int k = 0; k < K; k++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            vec[k] = (float) (state & 0xFFFF) / 0xFFFF - 0.5f;
+        }
+
+        for (int iteration = 0; iteration <= iterations; iteration++) {
+            for (int prev = 0; prev < r; prev++) {
+                const float *prev_vec = v->matrix + prev * K;
+                float dot = 0;
+                for (int k = 0; k < K; k++) {
+                    dot += vec[k] * prev_vec[k];
+                }
+                for (int k = 0; k < K; k++) {
+                    vec[k] -= dot * prev_vec[k];
+                }
+            }
+
+            float norm = 0;
+            for (int k = 0; k < K; k++) {
+                norm += vec[k] * vec[k];
+            }
+            norm = sqrtf(norm);
+            if (norm < 1e-30f) {
+                // M has lower rank than asked for, the remaining directions contribute nothing
+                memset(vec, 0, sizeof(float) * K);
+                break;
+            }
+            for (int k = 0; k < K; k++) {
+                vec[k] /= norm;
+            }
+            if (iteration == iterations) {
+                break;
+            }
+
+            // vec <- M^T . (M . vec)
+            for (int n = 0; n < N; n++) {
+                const float *row = m->matrix + n * K;
+                float dot = 0;
+                for (int k = 0; k < K; k++) {
+                    dot += row[k] * vec[k];
+                }
+                mv[n] = dot;
+            }
+            memset(vec, 0, sizeof(float) * K);
+            for (int n = 0; n < N; n++) {
+                const float *row = m->matrix + n * K;
+                for (int k = 0; k < K; k++) {
+                    vec[k] += mv[n] * row[k];
+                }
+            }
+        }
+
+        // column r of U is M . v_r = sigma_r * u_r
+        for (int n = 0; n < N; n++) {
+            const float *row = m->matrix + n * K;
+            float dot = 0;
+            for (int k = 0; k < K; k++) {
+                dot += row[k] * vec[k];
+            }
+            u->matrix[n * rank + r] = dot;
+        }
+    }
+    free(mv);
+}
+
 // like numpy's matmul https://numpy.org/doc/stable/reference/generated/numpy.matmul.html
 // todo parallelize with omp library https://medium.com/tech-vision/parallel-matrix-multiplication-c-parallel-processing-5e3aadb36f27
 void nmatrix_multiply(nmatrix_t *m1, nmatrix_t *m2,
@@ -455,6 +885,25 @@ bool nmatrix_equal(nmatrix_t *m1, nmatrix_t *m2) {
     return memcmp(m1->matrix, m2->matrix, sizeof(float) * m1->n_elements) == 0;
 }
 
+/**
+ * \brief               Index of the largest element, the first one on ties
+ *
+ * \param[in]           m: matrix to search, treated as a flat array
+ * \return              flat index of the largest element
+ */
+int
+nmatrix_argmax(nmatrix_t *m) {
+    assert(m->n_elements > 0);
+
+    int max_i = 0;
+    for (int i = 1; i < m->n_elements; i++) {
+        if (m->matrix[i] > m->matrix[max_i]) {
+            max_i = i;
+        }
+    }
+    return max_i;
+}
+
 void nmatrix_for_each_operator(nmatrix_t *m, float (*op)(float),
                                nmatrix_t *result) {
     assert(m->n_dims == result->n_dims);
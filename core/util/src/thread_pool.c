@@ -0,0 +1,144 @@
+#include <util/thread_pool.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct Thread_Pool_Entry {
+    thread_pool_task_t task;
+    void *argument;
+} thread_pool_entry_t;
+
+struct Thread_Pool {
+    pthread_t *threads;
+    int n_threads;
+
+    // ring buffer of queued tasks, grows when full
+    thread_pool_entry_t *queue;
+    int capacity;
+    int head;
+    int count;
+    int running; // tasks taken off the queue that have not finished
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a task was queued or the pool is stopping
+    pthread_cond_t done; // the queue drained and no task is running
+};
+
+int thread_pool_default_threads(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int n = info.dwNumberOfProcessors;
+#else
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? n : 1;
+}
+
+static void* thread_pool_worker(void *argument) {
+    thread_pool_t *pool = argument;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->count == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->count == 0) {
+            break; // stopping and the queue is drained
+        }
+
+        thread_pool_entry_t entry = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        entry.task(entry.argument);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->count == 0 && pool->running == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+thread_pool_t* thread_pool_create(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = thread_pool_default_threads();
+    }
+
+    thread_pool_t *pool = malloc(sizeof(thread_pool_t));
+    *pool = (thread_pool_t) {
+        .threads = malloc(sizeof(pthread_t) * n_threads),
+        .n_threads = n_threads,
+        .capacity = 64,
+    };
+    pool->queue = malloc(sizeof(thread_pool_entry_t) * pool->capacity);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool);
+    }
+    return pool;
+}
+
+int thread_pool_size(thread_pool_t *pool) {
+    return pool->n_threads;
+}
+
+void thread_pool_submit(thread_pool_t *pool, thread_pool_task_t task, void *argument) {
+    pthread_mutex_lock(&pool->lock);
+    assert(!pool->stop);
+    if (pool->count == pool->capacity) {
+        // unwrap the ring into a buffer twice the size
+        thread_pool_entry_t *queue = malloc(sizeof(thread_pool_entry_t) * pool->capacity * 2);
+        for (int i = 0; i < pool->count; i++) {
+            queue[i] = pool->queue[(pool->head + i) % pool->capacity];
+        }
+        free(pool->queue);
+        pool->queue = queue;
+        pool->head = 0;
+        pool->capacity *= 2;
+    }
+    pool->queue[(pool->head + pool->count) % pool->capacity] = (thread_pool_entry_t) {task, argument};
+    pool->count++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count > 0 || pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#ifndef MODEL_TEST_H
+#define MODEL_TEST_H
+
+#include <gtest/gtest.h>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+extern "C" {
+#include <model/model.h>
+#include <model/inference.h>
+#include <model/quantize.h>
+#include <model/export.h>
+#include <model/sweep.h>
+#include <model/evaluate.h>
+#include <model/pipeline.h>
+}
+
+#endif // MODEL_TEST_H
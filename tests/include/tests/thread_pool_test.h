@@ -0,0 +1,11 @@
+#pragma once
+#ifndef THREAD_POOL_TEST_H
+#define THREAD_POOL_TEST_H
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <util/thread_pool.h>
+}
+
+#endif // THREAD_POOL_TEST_H
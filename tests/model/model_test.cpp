@@ -0,0 +1,2012 @@
+#include <tests/model_test.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define SHAPE(...) nshape_constructor(__VA_ARGS__)
+
+// a layer after the input of a test model. dense layers have size neurons, a fused activation and an optional
+// activation layer after them. convolutions have size 3x3 filters over the square input image and are followed by
+// 2x2 max pooling
+struct test_layer_t {
+    int size;
+    dense_activation_t fused;
+    const layer_function_t *activation;
+    bool conv;
+};
+
+// the last layer feeds the output, a fused softmax cross entropy or a softmax layer and a cross entropy output.
+// weights, then biases when init_bias is set, are drawn from N(0, stddev) in layer order
+struct test_model_spec_t {
+    int n_inputs;
+    std::vector<test_layer_t> layers;
+    bool softmax_cross_entropy;
+    float stddev;
+    bool init_bias;
+};
+
+static const test_model_spec_t small_test_model = {
+    3, {{5, DENSE_ACTIVATION_NONE, &activation_functions_relu, false}, {2, DENSE_ACTIVATION_NONE, NULL, false}}, false, 0.5, true,
+};
+
+// image input, convolution, max pooling and fused dense activations, so every kind of per example state the pipeline
+// stages keep is in the model
+static const test_model_spec_t pipeline_test_model = {
+    16, {{2, DENSE_ACTIVATION_NONE, NULL, true}, {8, DENSE_ACTIVATION_RELU, NULL, false}, {6, DENSE_ACTIVATION_TANH, NULL, false},
+         {2, DENSE_ACTIVATION_NONE, NULL, false}}, true, 0.5, false,
+};
+
+// the two middle layers are past DENSE_PARALLEL_MIN_WEIGHTS
+static const test_model_spec_t wide_test_model = {
+    64, {{256, DENSE_ACTIVATION_RELU, NULL, false}, {128, DENSE_ACTIVATION_TANH, NULL, false}, {128, DENSE_ACTIVATION_RELU, NULL, false},
+         {4, DENSE_ACTIVATION_NONE, NULL, false}}, true, 0.1, false,
+};
+
+static void build_test_model(neural_network_model_t *model, const test_model_spec_t &spec = small_test_model) {
+    *model = (neural_network_model_t) {};
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, spec.n_inputs, 1));
+    layer_input(model, input);
+    nmatrix_free(&input);
+    std::vector<layer_t*> trainable;
+    for (const test_layer_t &layer : spec.layers) {
+        if (layer.conv) {
+            trainable.push_back(layer_conv2d(model, layer.size, 3, 1, 1));
+            layer_maxpool(model, 2);
+            continue;
+        }
+        nmatrix_t neurons = nmatrix_allocator(SHAPE(2, layer.size, 1));
+        trainable.push_back(layer_dense_activation(model, neurons, layer.fused));
+        nmatrix_free(&neurons);
+        if (layer.activation != NULL) {
+            layer_activation(model, *layer.activation);
+        }
+    }
+    if (spec.softmax_cross_entropy) {
+        layer_output(model, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+    } else {
+        layer_activation(model, activation_functions_softmax);
+        layer_output(model, output_make_guess_one_hot_encoded, output_functions_crossentropy, output_cost_categorical_cross_entropy);
+    }
+
+    for (layer_t *layer : trainable) {
+        bool conv = layer->type == layer_t::CONV2D;
+        model_initialize_matrix_normal_distribution(conv ? layer->layer.conv2d.weights : layer->layer.dense.weights, 0, spec.stddev);
+        if (spec.init_bias) {
+            model_initialize_matrix_normal_distribution(conv ? layer->layer.conv2d.bias : layer->layer.dense.bias, 0, spec.stddev);
+        }
+    }
+}
+
+// a labelled data set that is both the train and the test set of a run that never stops early. labels or y may be NULL
+static training_info_t build_training_info(nmatrix_t *x, nmatrix_t *y, int *labels, unsigned int n_examples,
+        unsigned int batch_size, float learning_rate, unsigned int target_epochs) {
+    training_info_t training_info = {};
+    training_info.train_size = n_examples;
+    training_info.train_x = x;
+    training_info.train_y = y;
+    training_info.train_labels = labels;
+    training_info.test_size = n_examples;
+    training_info.test_x = x;
+    training_info.test_y = y;
+    training_info.test_labels = labels;
+    training_info.batch_size = batch_size;
+    training_info.learning_rate = learning_rate;
+    training_info.target_epochs = target_epochs;
+    training_info.target_accuracy = 2; // never stops early
+    return training_info;
+}
+
+static unsigned int total_buffer_size(neural_network_model_t *model) {
+    unsigned int size = 0;
+    layer_buffer_t buffers[LAYER_MAX_BUFFERS];
+    for (layer_t *current = model->input_layer; current != NULL; current = current->next) {
+        int n_buffers = layer_get_buffers(current, buffers);
+        for (int i = 0; i < n_buffers; i++) {
+            size += nmatrix_aligned_size(buffers[i].matrix->n_elements);
+        }
+    }
+    return size;
+}
+
+TEST(model, parameter_arena) {
+    neural_network_model_t model;
+    build_test_model(&model);
+
+    layer_t *dense = model.input_layer->next;
+    ASSERT_STREQ(get_layer_name(dense), "Dense");
+    EXPECT_EQ(dense->layer.dense.weights.matrix, model.parameters.parameters);
+    EXPECT_EQ((uintptr_t) dense->layer.dense.bias.matrix % NMATRIX_ALIGNMENT, 0u);
+    EXPECT_EQ(dense->layer.dense.d_cost_wrt_weight_sum.matrix, model.parameters.gradients);
+
+    model_free(&model);
+}
+
+TEST(model, parameter_arena_relayout_and_descent) {
+    neural_network_model_t model = {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 3, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 5, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    layer_input(&model, input);
+    layer_t *dense_1 = layer_dense(&model, hidden);
+    for (int i = 0; i < dense_1->layer.dense.weights.n_elements; i++) {
+        dense_1->layer.dense.weights.matrix[i] = i * 0.125;
+    }
+
+    // adding a layer with parameters lays the arena out again and keeps the values set so far
+    layer_activation(&model, activation_functions_relu);
+    layer_t *dense_2 = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+    EXPECT_EQ(model.parameters.n_parameters, nmatrix_aligned_size(15) + nmatrix_aligned_size(5) + nmatrix_aligned_size(10)
+              + nmatrix_aligned_size(2));
+    for (int i = 0; i < dense_1->layer.dense.weights.n_elements; i++) {
+        EXPECT_EQ(dense_1->layer.dense.weights.matrix[i], i * 0.125f);
+    }
+    // tensors follow each other in layer order, each aligned, with their gradient sums at the same offsets
+    nmatrix_t *tensors[4] = {&dense_1->layer.dense.weights, &dense_1->layer.dense.bias, &dense_2->layer.dense.weights, &dense_2->layer.dense.bias};
+    nmatrix_t *gradients[4] = {&dense_1->layer.dense.d_cost_wrt_weight_sum, &dense_1->layer.dense.d_cost_wrt_bias_sum,
+                               &dense_2->layer.dense.d_cost_wrt_weight_sum, &dense_2->layer.dense.d_cost_wrt_bias_sum};
+    unsigned int offset = 0;
+    for (int t = 0; t < 4; t++) {
+        EXPECT_EQ(tensors[t]->matrix, model.parameters.parameters + offset);
+        EXPECT_EQ(gradients[t]->matrix, model.parameters.gradients + offset);
+        offset += nmatrix_aligned_size(tensors[t]->n_elements);
+    }
+
+    // one pass over the slab subtracts every gradient sum and clears them
+    nmatrix_t before = nmatrix_copy(&dense_2->layer.dense.weights);
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        model.parameters.gradients[i] = 0.5;
+    }
+    model_gradient_descent(&model);
+    for (int i = 0; i < before.n_elements; i++) {
+        EXPECT_EQ(dense_2->layer.dense.weights.matrix[i], before.matrix[i] - 0.5f);
+    }
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        EXPECT_EQ(model.parameters.gradients[i], 0);
+    }
+
+    // back propagation accumulates into the same slab
+    float a[3] = {0.5, -0.25, 1}, b[2] = {1, 0};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&model, x, actual);
+    model_back_propagate(&model, y, 1);
+    float sum = 0;
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        sum += fabsf(model.parameters.gradients[i]);
+    }
+    EXPECT_GT(sum, 0);
+    model_zero_gradients(&model);
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        EXPECT_EQ(model.parameters.gradients[i], 0);
+    }
+
+    nmatrix_free(&before);
+    nmatrix_free(&actual);
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+    model_free(&model);
+}
+
+TEST(model, checkpoint_round_trip) {
+    neural_network_model_t model;
+    build_test_model(&model);
+
+    const char *path = "model_test_checkpoint.model";
+    ASSERT_TRUE(model_save(&model, path));
+
+    neural_network_model_t loaded = {};
+    ASSERT_TRUE(model_load(&loaded, path));
+    ASSERT_EQ(loaded.num_layers, model.num_layers);
+    ASSERT_EQ(loaded.parameters.n_parameters, model.parameters.n_parameters);
+    EXPECT_EQ((uintptr_t) loaded.parameters.parameters % NMATRIX_ALIGNMENT, 0u);
+    EXPECT_EQ(memcmp(loaded.parameters.parameters, model.parameters.parameters, sizeof(float) * model.parameters.n_parameters), 0);
+
+    float a[3] = {0.5, -1, 2};
+    nmatrix_t input = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&model, input, expected);
+    model_predict(&loaded, input, actual);
+    EXPECT_TRUE(nmatrix_equal(&expected, &actual));
+
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    model_free(&loaded);
+    model_free(&model);
+    std::remove(path);
+}
+
+TEST(model, checkpoint_rejects_invalid_file) {
+    const char *path = "model_test_invalid.model";
+    FILE *file = std::fopen(path, "wb");
+    ASSERT_NE(file, nullptr);
+    std::fputs("not a checkpoint, just some text that is long enough to fill a header", file);
+    std::fclose(file);
+
+    neural_network_model_t model = {};
+    EXPECT_FALSE(model_load(&model, path));
+    EXPECT_EQ(model.num_layers, 0u);
+    std::remove(path);
+}
+
+TEST(model, compile_inference_matches_predict) {
+    neural_network_model_t model;
+    build_test_model(&model);
+
+    inference_model_t plan = model_compile_inference(&model);
+    EXPECT_EQ(plan.num_ops, 2); // both activations fused into the dense layers
+    EXPECT_EQ(plan.n_inputs, 3);
+    EXPECT_EQ(plan.n_outputs, 2);
+    EXPECT_EQ(plan.buffer_size, 5);
+
+    float a[3] = {0.25, 1.5, -0.75};
+    nmatrix_t input = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&model, input, expected);
+    model_free(&model); // the plan owns its weights
+    inference_predict(&plan, input, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    inference_free(&plan);
+}
+
+TEST(model, compile_inference_folds_dropout) {
+    neural_network_model_t model = {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 1, 1));
+    layer_input(&model, input);
+    layer_dropout(&model, 0.5);
+    layer_t *dense = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+    model_initialize_matrix_normal_distribution(dense->layer.dense.weights, 0, 1);
+
+    inference_model_t plan = model_compile_inference(&model);
+    ASSERT_EQ(plan.num_ops, 1);
+
+    float a[2] = {1, 2};
+    nmatrix_t x = nmatrix_constructor(2, a, SHAPE(2, 2, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 1, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 1, 1));
+    model_predict(&model, x, expected);
+    inference_predict(&plan, x, actual);
+    EXPECT_NEAR(expected.matrix[0], actual.matrix[0], 1e-6);
+
+    nmatrix_free(&input);
+    nmatrix_free(&output);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    inference_free(&plan);
+    model_free(&model);
+}
+
+TEST(model, plan_memory_matches_unplanned_training) {
+    neural_network_model_t unplanned, planned;
+    srand(42);
+    build_test_model(&unplanned);
+    srand(42);
+    build_test_model(&planned);
+
+    unsigned int unplanned_size = total_buffer_size(&planned);
+    unsigned int workspace_size = model_plan_memory(&planned);
+    EXPECT_GT(workspace_size, 0u);
+    EXPECT_LT(workspace_size, unplanned_size);
+
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t input = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    for (int step = 0; step < 5; step++) {
+        model_train(&unplanned, &input, &expected, 1, 0.1);
+        model_train(&planned, &input, &expected, 1, 0.1);
+    }
+
+    ASSERT_EQ(planned.parameters.n_parameters, unplanned.parameters.n_parameters);
+    EXPECT_EQ(memcmp(planned.parameters.parameters, unplanned.parameters.parameters,
+            sizeof(float) * planned.parameters.n_parameters), 0);
+
+    model_free(&planned);
+    model_free(&unplanned);
+}
+
+// the function pointers a layer carries, which the op interpreter bypasses for the built in kernels
+static layer_function_t layer_functions(layer_t *layer) {
+    switch (layer->type) {
+        case layer_t::INPUT:
+            return layer->layer.input.functions;
+        case layer_t::DENSE:
+            return layer->layer.dense.functions;
+        case layer_t::DENSE_LOWRANK:
+            return layer->layer.dense_lowrank.functions;
+        case layer_t::CONV2D:
+            return layer->layer.conv2d.functions;
+        case layer_t::POOL2D:
+            return layer->layer.pool2d.functions;
+        case layer_t::DROPOUT:
+            return layer->layer.dropout.functions;
+        case layer_t::ACTIVATION:
+            return layer->layer.activation.functions;
+        default:
+            return layer->layer.output.functions;
+    }
+}
+
+static nmatrix_t custom_sigmoid_feed_forward(layer_t *layer, nmatrix_t input) {
+    return activation_functions_sigmoid.feed_forward(layer, input);
+}
+
+static nmatrix_t custom_sigmoid_back_propagation(layer_t *layer, nmatrix_t input_gradient, float learning_rate) {
+    return activation_functions_sigmoid.back_propagation(layer, input_gradient, learning_rate);
+}
+
+// checks the kind of every op record against its layer, and that model_predict over the ops computes what chaining
+// the layers' own feed forward functions does
+static void expect_ops_match_layers(neural_network_model_t *model, const layer_op_kind_t *kinds, unsigned int n_layers) {
+    ASSERT_EQ(model->num_layers, n_layers);
+    layer_t *layer = model->input_layer;
+    for (unsigned int i = 0; i < n_layers; i++, layer = layer->next) {
+        EXPECT_EQ(model->ops[i].layer, layer);
+        EXPECT_EQ(model->ops[i].kind, kinds[i]) << "layer " << i << " " << get_layer_name(layer);
+        EXPECT_EQ(model->ops[i].kind, layer_get_op_kind(layer));
+    }
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, model->input_layer->layer.input.input_values.n_elements, 1));
+    model_initialize_matrix_normal_distribution(input, 0, 1);
+    nmatrix_t expected = nmatrix_copy(&model->output_layer->layer.output.output_values);
+    nmatrix_t actual = nmatrix_copy(&expected);
+    nmatrix_t values = input;
+    for (layer = model->input_layer; layer != NULL; layer = layer->next) {
+        // plain output layers have nothing to compute, the output is the previous layer's values
+        if (layer->type == layer_t::OUTPUT && layer_functions(layer).feed_forward == output_functions_meansquared.feed_forward) {
+            break;
+        }
+        values = layer_functions(layer).feed_forward(layer, values);
+    }
+    nmatrix_memcpy(&expected, &values);
+    model_predict(model, input, actual);
+    EXPECT_TRUE(nmatrix_equal(&expected, &actual));
+
+    nmatrix_free(&input);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+}
+
+TEST(model, ops_match_layers_and_layer_functions) {
+    const layer_function_t custom_sigmoid = {custom_sigmoid_feed_forward, custom_sigmoid_back_propagation};
+    nmatrix_t image = nmatrix_allocator(SHAPE(2, 16, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 6, 1));
+    nmatrix_t lowrank = nmatrix_allocator(SHAPE(2, 4, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    srand(71);
+
+    // convolution, max pooling, dropout, a pruned dense layer, a custom activation, low rank and separate softmax
+    neural_network_model_t model = {};
+    layer_input(&model, image);
+    layer_t *conv = layer_conv2d(&model, 2, 3, 1, 1);
+    layer_activation(&model, activation_functions_sigmoid);
+    layer_maxpool(&model, 2);
+    layer_dropout(&model, 0.2);
+    layer_t *dense_1 = layer_dense(&model, hidden);
+    layer_activation(&model, custom_sigmoid);
+    layer_t *factorized = layer_dense_lowrank(&model, lowrank, 2, DENSE_ACTIVATION_NONE);
+    layer_t *dense_2 = layer_dense(&model, output);
+    layer_activation(&model, activation_functions_softmax);
+    layer_output(&model, output_make_guess_one_hot_encoded, output_functions_crossentropy, output_cost_categorical_cross_entropy);
+    model_initialize_matrix_normal_distribution(conv->layer.conv2d.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_1->layer.dense.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(factorized->layer.dense_lowrank.u, 0, 0.5);
+    model_initialize_matrix_normal_distribution(factorized->layer.dense_lowrank.v, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_2->layer.dense.weights, 0, 0.5);
+    layer_dense_prune(dense_1, 0.8);
+    const layer_op_kind_t kinds[11] = {
+        OP_INPUT, OP_CONV2D, OP_ACTIVATION_SIGMOID, OP_MAXPOOL, OP_DROPOUT, OP_DENSE_SPARSE, OP_ACTIVATION_CUSTOM,
+        OP_DENSE_LOWRANK, OP_DENSE, OP_ACTIVATION_SOFTMAX, OP_OUTPUT_CROSS_ENTROPY,
+    };
+    expect_ops_match_layers(&model, kinds, 11);
+    model_free(&model);
+
+    // average pooling, relu and the fused softmax cross entropy output
+    model = (neural_network_model_t) {};
+    layer_input(&model, image);
+    conv = layer_conv2d(&model, 1, 3, 1, 1);
+    layer_avgpool(&model, 2);
+    layer_activation(&model, activation_functions_relu);
+    dense_1 = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+    model_initialize_matrix_normal_distribution(conv->layer.conv2d.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_1->layer.dense.weights, 0, 0.5);
+    const layer_op_kind_t pooled_kinds[6] = {OP_INPUT, OP_CONV2D, OP_AVGPOOL, OP_ACTIVATION_RELU, OP_DENSE, OP_OUTPUT_SOFTMAX_CROSS_ENTROPY};
+    expect_ops_match_layers(&model, pooled_kinds, 6);
+    model_free(&model);
+
+    // mean squared output
+    model = (neural_network_model_t) {};
+    layer_input(&model, image);
+    dense_1 = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+    model_initialize_matrix_normal_distribution(dense_1->layer.dense.weights, 0, 0.5);
+    const layer_op_kind_t mean_squared_kinds[3] = {OP_INPUT, OP_DENSE, OP_OUTPUT_MEAN_SQUARED};
+    expect_ops_match_layers(&model, mean_squared_kinds, 3);
+    model_free(&model);
+
+    nmatrix_free(&image);
+    nmatrix_free(&hidden);
+    nmatrix_free(&lowrank);
+    nmatrix_free(&output);
+}
+
+// back propagates one (x, y) example of a mean squared error model and compares the gradient sums of each tensor
+// with central differences of the loss. every pass is a training pass from the same random state, so dropout layers
+// drop the same units each time
+static void expect_gradients_match_finite_difference(neural_network_model_t *model, nmatrix_t x, nmatrix_t y,
+        nmatrix_t *const *tensors, nmatrix_t *const *gradients, int n_tensors) {
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, y.n_elements, 1));
+    const random_state_t random = model->random;
+    model->is_training = true;
+    model_predict(model, x, actual);
+    model_back_propagate(model, y, 1);
+
+    const float h = 1e-3;
+    for (int t = 0; t < n_tensors; t++) {
+        for (int i = 0; i < tensors[t]->n_elements; i++) {
+            float original = tensors[t]->matrix[i];
+            tensors[t]->matrix[i] = original + h;
+            model->random = random;
+            model_predict(model, x, actual);
+            float loss_plus = output_cost_mean_squared(model->output_layer, y);
+            tensors[t]->matrix[i] = original - h;
+            model->random = random;
+            model_predict(model, x, actual);
+            float loss_minus = output_cost_mean_squared(model->output_layer, y);
+            tensors[t]->matrix[i] = original;
+
+            EXPECT_NEAR(gradients[t]->matrix[i], (loss_plus - loss_minus) / (2 * h), 1e-3);
+        }
+    }
+    model->is_training = false;
+    nmatrix_free(&actual);
+}
+
+static void build_conv_test_model(neural_network_model_t *model) {
+    *model = (neural_network_model_t) {};
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 16, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+
+    layer_input(model, input);
+    layer_t *conv = layer_conv2d(model, 2, 3, 1, 1);
+    layer_activation(model, activation_functions_sigmoid);
+    layer_t *dense = layer_dense(model, output);
+    layer_output(model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+
+    model_initialize_matrix_normal_distribution(conv->layer.conv2d.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(conv->layer.conv2d.bias, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense->layer.dense.weights, 0, 0.5);
+
+    nmatrix_free(&input);
+    nmatrix_free(&output);
+}
+
+TEST(model, conv2d_gradient_matches_finite_difference) {
+    neural_network_model_t model;
+    build_conv_test_model(&model);
+
+    conv2d_layer_t *conv = &model.input_layer->next->layer.conv2d;
+    ASSERT_STREQ(get_layer_name(model.input_layer->next), "Conv2D");
+    EXPECT_EQ(conv->out_height, 4);
+    EXPECT_EQ(conv->out_width, 4);
+    EXPECT_EQ(conv->output.n_elements, 32);
+
+    float a[16], b[2] = {0.25, 0.75};
+    for (int i = 0; i < 16; i++) {
+        a[i] = (i % 5) * 0.2 - 0.4;
+    }
+    nmatrix_t input = nmatrix_constructor(16, a, SHAPE(2, 16, 1));
+    nmatrix_t expected = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t *tensors[2] = {&conv->weights, &conv->bias};
+    nmatrix_t *gradients[2] = {&conv->d_cost_wrt_weight_sum, &conv->d_cost_wrt_bias_sum};
+    expect_gradients_match_finite_difference(&model, input, expected, tensors, gradients, 2);
+
+    model_free(&model);
+}
+
+TEST(model, conv2d_input_gradient_matches_finite_difference) {
+    // convolutions after another trainable layer pass dE/dX back through col2im, with stride 1 and 2 on either side
+    const int first_strides[3] = {1, 2, 0}; // 0 starts with a dense layer instead
+    const int second_strides[3] = {2, 1, 2};
+    srand(61);
+    for (int config = 0; config < 3; config++) {
+        neural_network_model_t model = {};
+        nmatrix_t input = nmatrix_allocator(SHAPE(2, 36, 1));
+        nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 16, 1));
+        nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+        layer_input(&model, input);
+        layer_t *first = first_strides[config] > 0
+                ? layer_conv2d(&model, 2, 3, first_strides[config], 1)
+                : layer_dense_activation(&model, hidden, DENSE_ACTIVATION_TANH);
+        layer_activation(&model, activation_functions_sigmoid);
+        layer_t *conv = layer_conv2d(&model, 2, 3, second_strides[config], 1);
+        layer_t *dense = layer_dense(&model, output);
+        layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+        EXPECT_TRUE(conv->needs_input_gradient);
+
+        nmatrix_t *tensors[6], *gradients[6];
+        if (first->type == layer_t::CONV2D) {
+            tensors[0] = &first->layer.conv2d.weights;
+            tensors[1] = &first->layer.conv2d.bias;
+            gradients[0] = &first->layer.conv2d.d_cost_wrt_weight_sum;
+            gradients[1] = &first->layer.conv2d.d_cost_wrt_bias_sum;
+        } else {
+            tensors[0] = &first->layer.dense.weights;
+            tensors[1] = &first->layer.dense.bias;
+            gradients[0] = &first->layer.dense.d_cost_wrt_weight_sum;
+            gradients[1] = &first->layer.dense.d_cost_wrt_bias_sum;
+        }
+        tensors[2] = &conv->layer.conv2d.weights;
+        tensors[3] = &conv->layer.conv2d.bias;
+        gradients[2] = &conv->layer.conv2d.d_cost_wrt_weight_sum;
+        gradients[3] = &conv->layer.conv2d.d_cost_wrt_bias_sum;
+        tensors[4] = &dense->layer.dense.weights;
+        tensors[5] = &dense->layer.dense.bias;
+        gradients[4] = &dense->layer.dense.d_cost_wrt_weight_sum;
+        gradients[5] = &dense->layer.dense.d_cost_wrt_bias_sum;
+        for (int t = 0; t < 6; t++) {
+            model_initialize_matrix_normal_distribution(*tensors[t], 0, 0.3);
+        }
+
+        float a[36], b[2] = {0.25, 0.75};
+        for (int i = 0; i < 36; i++) {
+            a[i] = ((i * 5) % 7) * 0.2 - 0.6;
+        }
+        nmatrix_t x = nmatrix_constructor(36, a, SHAPE(2, 36, 1));
+        nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+        expect_gradients_match_finite_difference(&model, x, y, tensors, gradients, 6);
+
+        nmatrix_free(&input);
+        nmatrix_free(&hidden);
+        nmatrix_free(&output);
+        model_free(&model);
+    }
+}
+
+TEST(model, conv2d_checkpoint_and_inference_match_predict) {
+    neural_network_model_t model;
+    build_conv_test_model(&model);
+
+    const char *path = "model_test_conv.model";
+    ASSERT_TRUE(model_save(&model, path));
+    neural_network_model_t loaded = {};
+    ASSERT_TRUE(model_load(&loaded, path));
+    inference_model_t plan = model_compile_inference(&model);
+    EXPECT_EQ(plan.num_ops, 2); // sigmoid fused into the convolution
+
+    float a[16];
+    for (int i = 0; i < 16; i++) {
+        a[i] = (i % 3) * 0.5 - 0.5;
+    }
+    nmatrix_t input = nmatrix_constructor(16, a, SHAPE(2, 16, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&model, input, expected);
+    model_predict(&loaded, input, actual);
+    EXPECT_TRUE(nmatrix_equal(&expected, &actual));
+    inference_predict(&plan, input, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    inference_free(&plan);
+    model_free(&loaded);
+    model_free(&model);
+    std::remove(path);
+}
+
+TEST(model, pooling_gradient_matches_finite_difference) {
+    layer_t* (*pools[2])(neural_network_model_t*, int) = {layer_maxpool, layer_avgpool};
+    for (int pool_i = 0; pool_i < 2; pool_i++) {
+        neural_network_model_t model = {};
+        nmatrix_t input = nmatrix_allocator(SHAPE(2, 25, 1));
+        nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+        layer_input(&model, input);
+        layer_t *conv = layer_conv2d(&model, 2, 3, 1, 1);
+        layer_t *pool = pools[pool_i](&model, 2);
+        layer_t *dense = layer_dense(&model, output);
+        layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+        model_initialize_matrix_normal_distribution(conv->layer.conv2d.weights, 0, 0.5);
+        model_initialize_matrix_normal_distribution(dense->layer.dense.weights, 0, 0.5);
+        EXPECT_EQ(pool->layer.pool2d.out_height, 2); // 5x5 pools to 2x2
+        EXPECT_EQ(layer_get_neurons(pool).n_elements, 8);
+
+        float a[25], b[2] = {1, -1};
+        for (int i = 0; i < 25; i++) {
+            a[i] = ((i * 7) % 11) * 0.1 - 0.5;
+        }
+        nmatrix_t x = nmatrix_constructor(25, a, SHAPE(2, 25, 1));
+        nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+        nmatrix_t *weights = &conv->layer.conv2d.weights;
+        nmatrix_t *gradient = &conv->layer.conv2d.d_cost_wrt_weight_sum;
+        expect_gradients_match_finite_difference(&model, x, y, &weights, &gradient, 1);
+        model_predict(&model, x, output);
+        EXPECT_FALSE(pool->layer.pool2d.has_indices); // inference passes skip index capture
+
+        nmatrix_free(&input);
+        nmatrix_free(&output);
+        model_free(&model);
+    }
+}
+
+TEST(model, dropout_gradient_matches_finite_difference) {
+    neural_network_model_t model = {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 8, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 12, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    srand(71);
+    layer_input(&model, input);
+    layer_t *first = layer_dense(&model, hidden);
+    layer_activation(&model, activation_functions_sigmoid);
+    layer_t *dropout = layer_dropout(&model, 0.5);
+    layer_t *second = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+    model_initialize_matrix_normal_distribution(first->layer.dense.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(first->layer.dense.bias, 0, 0.5);
+    model_initialize_matrix_normal_distribution(second->layer.dense.weights, 0, 0.5);
+
+    float a[8], b[2] = {0.25, 0.75};
+    for (int i = 0; i < 8; i++) {
+        a[i] = ((i * 3) % 5) * 0.3 - 0.6;
+    }
+    nmatrix_t x = nmatrix_constructor(8, a, SHAPE(2, 8, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t *tensors[3] = {&first->layer.dense.weights, &first->layer.dense.bias, &second->layer.dense.weights};
+    nmatrix_t *gradients[3] = {&first->layer.dense.d_cost_wrt_weight_sum, &first->layer.dense.d_cost_wrt_bias_sum,
+            &second->layer.dense.d_cost_wrt_weight_sum};
+    expect_gradients_match_finite_difference(&model, x, y, tensors, gradients, 3);
+
+    // the mask dropped some units and kept others, the dropped ones got no gradient
+    dropout_layer_t *layer = &dropout->layer.dropout;
+    EXPECT_TRUE(layer->has_mask);
+    int n_kept = 0;
+    for (int r = 0; r < 12; r++) {
+        n_kept += layer->mask[r];
+        if (!layer->mask[r]) {
+            EXPECT_EQ(layer->d_cost_wrt_input.matrix[r], 0);
+            EXPECT_EQ(first->layer.dense.d_cost_wrt_bias_sum.matrix[r], 0);
+        }
+    }
+    EXPECT_GT(n_kept, 0);
+    EXPECT_LT(n_kept, 12);
+
+    // inference passes scale instead of drawing a mask
+    model_predict(&model, x, output);
+    EXPECT_FALSE(layer->has_mask);
+
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+    model_free(&model);
+}
+
+TEST(model, train_info_sets_is_training_for_the_training_pass_only) {
+    // max pooling only keeps its indices, and dropout only drops, while model->is_training is set
+    neural_network_model_t model = {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 16, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    srand(67);
+    layer_input(&model, input);
+    layer_t *conv = layer_conv2d(&model, 2, 3, 1, 1);
+    layer_t *pool = layer_maxpool(&model, 2);
+    layer_dropout(&model, 0.5);
+    layer_t *dense = layer_dense(&model, output);
+    layer_output(&model, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+    model_initialize_matrix_normal_distribution(conv->layer.conv2d.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense->layer.dense.weights, 0, 0.5);
+
+    const int n_examples = 6;
+    nmatrix_t x[n_examples];
+    int labels[n_examples];
+    for (int i = 0; i < n_examples; i++) {
+        x[i] = nmatrix_allocator(SHAPE(2, 16, 1));
+        model_initialize_matrix_normal_distribution(x[i], 0, 1);
+        labels[i] = x[i].matrix[5] > 0;
+    }
+    training_info_t training_info = build_training_info(x, NULL, labels, n_examples, 2, 0.1, 2);
+    training_info.model = &model;
+    nmatrix_t weights = nmatrix_copy(&conv->layer.conv2d.weights);
+    uint64_t random_state = model.random.state;
+
+    // the pooling layer back propagates from the indices of the training pass, dropout draws its masks there
+    model_train_info(&training_info);
+    EXPECT_FALSE(nmatrix_equal(&weights, &conv->layer.conv2d.weights));
+    EXPECT_NE(model.random.state, random_state);
+    EXPECT_FALSE(model.is_training);
+
+    // the test pass runs as inference and draws no dropout masks, so it reports what a later test pass does
+    float test_accuracy = training_info.test_accuracy;
+    float avg_test_error = training_info.avg_test_error;
+    random_state = model.random.state;
+    model_test_info(&training_info);
+    EXPECT_EQ(model.random.state, random_state);
+    EXPECT_NEAR(training_info.test_accuracy, test_accuracy, 0.01);
+    EXPECT_NEAR(training_info.avg_test_error, avg_test_error, 1e-5);
+
+    // and predictions after training neither drop nor capture indices
+    nmatrix_t first = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t second = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&model, x[0], first);
+    model_predict(&model, x[0], second);
+    EXPECT_TRUE(nmatrix_equal(&first, &second));
+    EXPECT_FALSE(pool->layer.pool2d.has_indices);
+    EXPECT_EQ(model.random.state, random_state);
+    nmatrix_free(&first);
+    nmatrix_free(&second);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&x[i]);
+    }
+    nmatrix_free(&weights);
+    nmatrix_free(&input);
+    nmatrix_free(&output);
+    model_free(&model);
+}
+
+TEST(model, fused_dense_activation_matches_separate_layers) {
+    const dense_activation_t fused[3] = {DENSE_ACTIVATION_RELU, DENSE_ACTIVATION_SIGMOID, DENSE_ACTIVATION_TANH};
+    // tanh only exists fused, it is checked against finite differences alone
+    const layer_function_t *separate[3] = {&activation_functions_relu, &activation_functions_sigmoid, NULL};
+    for (int act_i = 0; act_i < 3; act_i++) {
+        neural_network_model_t model = {}, unfused = {};
+        nmatrix_t input = nmatrix_allocator(SHAPE(2, 3, 1));
+        nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 4, 1));
+        nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+        layer_input(&model, input);
+        layer_t *dense_1 = layer_dense_activation(&model, hidden, fused[act_i]);
+        layer_t *dense_2 = layer_dense(&model, output);
+        layer_output(&model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+        model_initialize_matrix_normal_distribution(dense_1->layer.dense.weights, 0, 0.5);
+        model_initialize_matrix_normal_distribution(dense_1->layer.dense.bias, 0, 0.5);
+        model_initialize_matrix_normal_distribution(dense_2->layer.dense.weights, 0, 0.5);
+
+        float a[3] = {0.5, -1, 0.25}, b[2] = {1, 0};
+        nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+        nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+        nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+        nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+
+        if (separate[act_i] != NULL) {
+            // the same weights as a dense layer followed by an activation layer
+            layer_input(&unfused, input);
+            layer_t *unfused_1 = layer_dense(&unfused, hidden);
+            layer_activation(&unfused, *separate[act_i]);
+            layer_t *unfused_2 = layer_dense(&unfused, output);
+            layer_output(&unfused, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+            ASSERT_EQ(unfused.parameters.n_parameters, model.parameters.n_parameters);
+            memcpy(unfused.parameters.parameters, model.parameters.parameters, sizeof(float) * model.parameters.n_parameters);
+
+            model_predict(&unfused, x, expected);
+            model_predict(&model, x, actual);
+            for (int i = 0; i < 2; i++) {
+                EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+            }
+            model_back_propagate(&unfused, y, 1);
+            model_back_propagate(&model, y, 1);
+            nmatrix_t *unfused_gradients[2] = {&unfused_1->layer.dense.d_cost_wrt_weight_sum, &unfused_2->layer.dense.d_cost_wrt_weight_sum};
+            nmatrix_t *fused_gradients[2] = {&dense_1->layer.dense.d_cost_wrt_weight_sum, &dense_2->layer.dense.d_cost_wrt_weight_sum};
+            for (int t = 0; t < 2; t++) {
+                for (int i = 0; i < fused_gradients[t]->n_elements; i++) {
+                    EXPECT_NEAR(unfused_gradients[t]->matrix[i], fused_gradients[t]->matrix[i], 1e-6);
+                }
+            }
+            model_zero_gradients(&model);
+            model_free(&unfused);
+        }
+
+        nmatrix_t *weights = &dense_1->layer.dense.weights;
+        nmatrix_t *gradient = &dense_1->layer.dense.d_cost_wrt_weight_sum;
+        expect_gradients_match_finite_difference(&model, x, y, &weights, &gradient, 1);
+
+        // the plan applies the same activation in its dense epilogue
+        inference_model_t plan = model_compile_inference(&model);
+        EXPECT_EQ(plan.num_ops, 2);
+        model_predict(&model, x, expected);
+        inference_predict(&plan, x, actual);
+        for (int i = 0; i < 2; i++) {
+            EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+        }
+
+        inference_free(&plan);
+        nmatrix_free(&input);
+        nmatrix_free(&hidden);
+        nmatrix_free(&output);
+        nmatrix_free(&expected);
+        nmatrix_free(&actual);
+        model_free(&model);
+    }
+}
+
+TEST(model, frozen_layers_skip_gradients) {
+    neural_network_model_t model;
+    build_test_model(&model);
+
+    layer_t *dense_1 = model.input_layer->next;
+    layer_t *dense_2 = dense_1->next->next;
+    EXPECT_EQ(model.first_trainable_layer, 1u);
+    EXPECT_FALSE(dense_1->needs_input_gradient); // nothing before the first dense layer can learn
+    EXPECT_TRUE(dense_2->needs_input_gradient);
+
+    layer_freeze(dense_1);
+    EXPECT_EQ(model.first_trainable_layer, 3u);
+    EXPECT_FALSE(dense_2->needs_input_gradient);
+
+    nmatrix_t frozen = nmatrix_copy(&dense_1->layer.dense.weights);
+    nmatrix_t trained = nmatrix_copy(&dense_2->layer.dense.weights);
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t input = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    model_train(&model, &input, &expected, 1, 0.1);
+
+    EXPECT_TRUE(nmatrix_equal(&frozen, &dense_1->layer.dense.weights));
+    EXPECT_FALSE(nmatrix_equal(&trained, &dense_2->layer.dense.weights));
+
+    layer_unfreeze(dense_1);
+    EXPECT_EQ(model.first_trainable_layer, 1u);
+    model_train(&model, &input, &expected, 1, 0.1);
+    EXPECT_FALSE(nmatrix_equal(&frozen, &dense_1->layer.dense.weights));
+
+    nmatrix_free(&frozen);
+    nmatrix_free(&trained);
+    model_free(&model);
+}
+
+TEST(model, softmax_cross_entropy_matches_separate_softmax) {
+    neural_network_model_t separate, fused;
+    srand(7);
+    build_test_model(&separate);
+    srand(7);
+    fused = (neural_network_model_t) {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 3, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 5, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    layer_input(&fused, input);
+    layer_t *dense_1 = layer_dense(&fused, hidden);
+    layer_activation(&fused, activation_functions_relu);
+    layer_t *dense_2 = layer_dense(&fused, output);
+    layer_output(&fused, output_make_guess_one_hot_encoded, output_functions_softmax_crossentropy, output_cost_softmax_cross_entropy);
+    model_initialize_matrix_normal_distribution(dense_1->layer.dense.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_1->layer.dense.bias, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_2->layer.dense.weights, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense_2->layer.dense.bias, 0, 0.5);
+
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&separate, x, expected);
+    model_predict(&fused, x, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6); // both output probabilities
+    }
+    EXPECT_NEAR(output_cost_softmax_cross_entropy(fused.output_layer, y), -logf(expected.matrix[1]), 1e-4);
+
+    model_back_propagate(&separate, y, 0.1);
+    model_back_propagate(&fused, y, 0.1);
+    for (unsigned int i = 0; i < fused.parameters.n_parameters; i++) {
+        EXPECT_NEAR(separate.parameters.gradients[i], fused.parameters.gradients[i], 1e-6);
+    }
+
+    // huge logits do not overflow, and the batched kernel agrees with each column on its own
+    float logits[6] = {1000, 0, -3,
+                       999, 2, 5};
+    float targets[6] = {1, 0, 0.5,
+                        0, 1, 0.5};
+    nmatrix_t batch_logits = nmatrix_constructor(6, logits, SHAPE(2, 2, 3));
+    nmatrix_t batch_targets = nmatrix_constructor(6, targets, SHAPE(2, 2, 3));
+    nmatrix_t probabilities = nmatrix_allocator(SHAPE(2, 2, 3));
+    nmatrix_t gradient = nmatrix_allocator(SHAPE(2, 2, 3));
+    float loss = output_softmax_cross_entropy_batched(&batch_logits, &batch_targets, &probabilities, &gradient);
+    float expected_loss = 0;
+    for (int b = 0; b < 3; b++) {
+        float column_logits[2] = {logits[b], logits[3 + b]};
+        float column_targets[2] = {targets[b], targets[3 + b]};
+        nmatrix_t l = nmatrix_constructor(2, column_logits, SHAPE(2, 2, 1));
+        nmatrix_t t = nmatrix_constructor(2, column_targets, SHAPE(2, 2, 1));
+        expected_loss += output_softmax_cross_entropy_batched(&l, &t, NULL, NULL);
+        EXPECT_NEAR(probabilities.matrix[b] + probabilities.matrix[3 + b], 1, 1e-6);
+        EXPECT_NEAR(gradient.matrix[b], probabilities.matrix[b] - targets[b], 1e-6);
+    }
+    EXPECT_TRUE(std::isfinite(loss));
+    EXPECT_NEAR(loss, expected_loss, 1e-4);
+    EXPECT_NEAR(probabilities.matrix[0], 1 / (1 + expf(-1)), 1e-6);
+
+    // a batch wider than one block of columns, with a partial last block
+    const int wide = SOFTMAX_BATCH_BLOCK + 3;
+    nmatrix_t wide_logits = nmatrix_allocator(SHAPE(2, 2, wide));
+    nmatrix_t wide_targets = nmatrix_allocator(SHAPE(2, 2, wide));
+    nmatrix_t wide_probabilities = nmatrix_allocator(SHAPE(2, 2, wide));
+    for (int b = 0; b < wide; b++) {
+        wide_logits.matrix[b] = b * 0.125;
+        wide_logits.matrix[wide + b] = 1;
+        wide_targets.matrix[b] = b % 2;
+        wide_targets.matrix[wide + b] = 1 - b % 2;
+    }
+    loss = output_softmax_cross_entropy_batched(&wide_logits, &wide_targets, &wide_probabilities, NULL);
+    expected_loss = 0;
+    for (int b = 0; b < wide; b++) {
+        float p = 1 / (1 + expf(1 - b * 0.125));
+        EXPECT_NEAR(wide_probabilities.matrix[b], p, 1e-6);
+        EXPECT_NEAR(wide_probabilities.matrix[wide + b], 1 - p, 1e-6);
+        expected_loss -= logf(b % 2 ? p : 1 - p);
+    }
+    EXPECT_NEAR(loss, expected_loss, 1e-3);
+
+    nmatrix_free(&wide_logits);
+    nmatrix_free(&wide_targets);
+    nmatrix_free(&wide_probabilities);
+
+    nmatrix_free(&probabilities);
+    nmatrix_free(&gradient);
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    model_free(&separate);
+    model_free(&fused);
+}
+
+TEST(model, label_targets_match_one_hot_targets) {
+    const layer_function_t *functions[3] = {&output_functions_crossentropy, &output_functions_meansquared, &output_functions_softmax_crossentropy};
+    float (*losses[3])(layer_t*, nmatrix_t) = {output_cost_categorical_cross_entropy, output_cost_mean_squared, output_cost_softmax_cross_entropy};
+
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    for (int i = 0; i < 3; i++) {
+        neural_network_model_t one_hot, label;
+        srand(11);
+        build_test_model(&one_hot);
+        srand(11);
+        build_test_model(&label);
+        neural_network_model_t *models[2] = {&one_hot, &label};
+        for (neural_network_model_t *model : models) {
+            model->output_layer->layer.output.functions = *functions[i];
+            model->output_layer->layer.output.loss = losses[i];
+            model->ops[model->num_layers - 1].kind = layer_get_op_kind(model->output_layer);
+        }
+
+        nmatrix_t output = model_predict(&one_hot, x, one_hot.output_layer->layer.output.output_values);
+        model_predict(&label, x, label.output_layer->layer.output.output_values);
+        EXPECT_NEAR(one_hot.output_layer->layer.output.loss(one_hot.output_layer, y), output_cost_label(label.output_layer, 1), 1e-5);
+        EXPECT_EQ(unpack_one_hot_encoded(one_hot.output_layer->layer.output.guess), nmatrix_argmax(&output));
+
+        model_back_propagate(&one_hot, y, 0.1);
+        model_back_propagate_label(&label, 1, 0.1);
+        for (unsigned int j = 0; j < one_hot.parameters.n_parameters; j++) {
+            EXPECT_NEAR(one_hot.parameters.gradients[j], label.parameters.gradients[j], 1e-6);
+        }
+
+        model_free(&one_hot);
+        model_free(&label);
+    }
+}
+
+TEST(model, sparse_input_matches_dense_input) {
+    // a dropout layer that drops nothing keeps the second model's dense layer off the sparse path
+    neural_network_model_t sparse = {}, dense = {};
+    neural_network_model_t *models[2] = {&sparse, &dense};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 20, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 4, 1));
+    for (neural_network_model_t *model : models) {
+        srand(5);
+        layer_input(model, input);
+        if (model == &dense) {
+            layer_dropout(model, 0);
+        }
+        layer_t *dense_layer = layer_dense_activation(model, hidden, DENSE_ACTIVATION_SIGMOID);
+        layer_output(model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+        model_initialize_matrix_normal_distribution(dense_layer->layer.dense.weights, 0, 0.5);
+        model_initialize_matrix_normal_distribution(dense_layer->layer.dense.bias, 0, 0.5);
+    }
+
+    float a[20] = {};
+    a[3] = 0.5;
+    a[11] = -1;
+    a[19] = 0.25;
+    float b[4] = {0, 1, 0, 1};
+    nmatrix_t x = nmatrix_constructor(20, a, SHAPE(2, 20, 1));
+    nmatrix_t y = nmatrix_constructor(4, b, SHAPE(2, 4, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 4, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 4, 1));
+    model_predict(&dense, x, expected);
+    model_predict(&sparse, x, actual);
+    EXPECT_EQ(sparse.input_layer->layer.input.n_active, 3);
+    EXPECT_EQ(sparse.input_layer->layer.input.active_indices[2], 19);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    model_back_propagate(&dense, y, 0.1);
+    model_back_propagate(&sparse, y, 0.1);
+    for (unsigned int i = 0; i < sparse.parameters.n_parameters; i++) {
+        EXPECT_NEAR(dense.parameters.gradients[i], sparse.parameters.gradients[i], 1e-6);
+    }
+
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    model_free(&sparse);
+    model_free(&dense);
+}
+
+static layer_t* build_lowrank_test_model(neural_network_model_t *model, int rank) {
+    *model = (neural_network_model_t) {};
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 6, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 4, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+
+    layer_input(model, input);
+    layer_t *lowrank = layer_dense_lowrank(model, hidden, rank, DENSE_ACTIVATION_TANH);
+    layer_t *dense = layer_dense(model, output);
+    layer_output(model, output_make_guess_passforward, output_functions_meansquared, output_cost_mean_squared);
+
+    model_initialize_matrix_normal_distribution(lowrank->layer.dense_lowrank.u, 0, 0.5);
+    model_initialize_matrix_normal_distribution(lowrank->layer.dense_lowrank.v, 0, 0.5);
+    model_initialize_matrix_normal_distribution(lowrank->layer.dense_lowrank.bias, 0, 0.5);
+    model_initialize_matrix_normal_distribution(dense->layer.dense.weights, 0, 0.5);
+
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+    return lowrank;
+}
+
+TEST(model, dense_lowrank_gradient_matches_finite_difference) {
+    neural_network_model_t model;
+    dense_lowrank_layer_t *lowrank = &build_lowrank_test_model(&model, 2)->layer.dense_lowrank;
+    ASSERT_STREQ(get_layer_name(model.input_layer->next), "Dense Low Rank");
+    // U 4 x 2, V 2 x 6, bias 4, then the 2 x 4 dense layer and its bias
+    EXPECT_EQ(model.parameters.n_parameters, nmatrix_aligned_size(8) * 2 + nmatrix_aligned_size(12) + nmatrix_aligned_size(4)
+              + nmatrix_aligned_size(2));
+
+    float a[6] = {0.5, -0.25, 1, 0, 0.75, -1}, b[2] = {0.25, 0.75};
+    nmatrix_t input = nmatrix_constructor(6, a, SHAPE(2, 6, 1));
+    nmatrix_t expected = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t *tensors[3] = {&lowrank->u, &lowrank->v, &lowrank->bias};
+    nmatrix_t *gradients[3] = {&lowrank->d_cost_wrt_u_sum, &lowrank->d_cost_wrt_v_sum, &lowrank->d_cost_wrt_bias_sum};
+    expect_gradients_match_finite_difference(&model, input, expected, tensors, gradients, 3);
+
+    model_free(&model);
+}
+
+TEST(model, dense_lowrank_factorize_checkpoint_and_inference) {
+    // a full rank factorization reproduces the dense layer it came from
+    neural_network_model_t dense_model, model;
+    srand(3);
+    build_test_model(&dense_model);
+    model = (neural_network_model_t) {};
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, 3, 1));
+    nmatrix_t hidden = nmatrix_allocator(SHAPE(2, 5, 1));
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    layer_input(&model, input);
+    layer_t *lowrank = layer_dense_lowrank(&model, hidden, 3, DENSE_ACTIVATION_NONE);
+    layer_activation(&model, activation_functions_relu);
+    layer_t *dense = layer_dense_lowrank(&model, output, 2, DENSE_ACTIVATION_NONE);
+    layer_activation(&model, activation_functions_softmax);
+    layer_output(&model, output_make_guess_one_hot_encoded, output_functions_crossentropy, output_cost_categorical_cross_entropy);
+    layer_dense_lowrank_factorize(lowrank, dense_model.input_layer->next);
+    layer_dense_lowrank_factorize(dense, dense_model.input_layer->next->next->next);
+
+    float a[3] = {0.5, -0.25, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&dense_model, x, expected);
+    model_predict(&model, x, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-4);
+    }
+
+    const char *path = "model_test_lowrank.model";
+    ASSERT_TRUE(model_save(&model, path));
+    neural_network_model_t loaded = {};
+    ASSERT_TRUE(model_load(&loaded, path));
+    model_predict(&loaded, x, expected);
+    EXPECT_TRUE(nmatrix_equal(&expected, &actual));
+    EXPECT_EQ(loaded.input_layer->next->layer.dense_lowrank.rank, 3);
+
+    inference_model_t plan = model_compile_inference(&model);
+    EXPECT_EQ(plan.num_ops, 4); // each low rank layer is two dense ops, activations fused
+    inference_predict(&plan, x, expected);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    nmatrix_free(&input);
+    nmatrix_free(&hidden);
+    nmatrix_free(&output);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    inference_free(&plan);
+    model_free(&loaded);
+    model_free(&model);
+    model_free(&dense_model);
+    std::remove(path);
+}
+
+TEST(model, quantized_predict_matches_float_model) {
+    neural_network_model_t model;
+    srand(5);
+    build_test_model(&model);
+
+    // label the test set with the float model's own guesses, so it scores 1 and the int8 plan has to agree
+    const int n_examples = 32;
+    nmatrix_t test_x[n_examples];
+    int test_labels[n_examples];
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    for (int i = 0; i < n_examples; i++) {
+        test_x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(test_x[i], 0, 1);
+        model_predict(&model, test_x[i], output);
+        test_labels[i] = nmatrix_argmax(&output);
+    }
+    training_info_t training_info = {};
+    training_info.model = &model;
+    training_info.test_size = n_examples;
+    training_info.test_x = test_x;
+    training_info.test_labels = test_labels;
+
+    quantized_model_t plan = model_quantize(&training_info, 16);
+    ASSERT_EQ(plan.num_ops, 2);
+    EXPECT_FLOAT_EQ(plan.float_accuracy, 1);
+    EXPECT_GE(plan.accuracy, 0.9f);
+
+    nmatrix_t quantized = nmatrix_allocator(SHAPE(2, 2, 1));
+    for (int i = 0; i < n_examples; i++) {
+        model_predict(&model, test_x[i], output);
+        quantized_predict(&plan, test_x[i], quantized);
+        for (int j = 0; j < 2; j++) {
+            EXPECT_NEAR(output.matrix[j], quantized.matrix[j], 0.05);
+        }
+    }
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&test_x[i]);
+    }
+    nmatrix_free(&output);
+    nmatrix_free(&quantized);
+    quantized_free(&plan);
+    model_free(&model);
+}
+
+TEST(model, pruned_dense_layers_run_sparse_and_checkpoint_sparse) {
+    neural_network_model_t model, reference;
+    srand(9);
+    build_test_model(&model);
+    srand(9);
+    build_test_model(&reference);
+    layer_t *dense_1 = model.input_layer->next;
+    layer_t *dense_2 = dense_1->next->next;
+
+    // below the threshold the layer stays on the dense kernels
+    layer_dense_prune(dense_2, 0.5);
+    EXPECT_EQ(dense_2->layer.dense.n_nonzero, 5);
+    EXPECT_EQ(model.ops[3].kind, OP_DENSE);
+    layer_dense_prune(dense_1, 0.8);
+    EXPECT_EQ(dense_1->layer.dense.n_nonzero, 3);
+    EXPECT_EQ(model.ops[1].kind, OP_DENSE_SPARSE);
+
+    // the sparse kernels agree with the dense ones on the same zeroed weights
+    nmatrix_t *weights[2] = {&dense_1->layer.dense.weights, &dense_2->layer.dense.weights};
+    nmatrix_t *reference_weights[2] = {&reference.input_layer->next->layer.dense.weights, &reference.input_layer->next->next->next->layer.dense.weights};
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < weights[i]->n_elements; j++) {
+            if (weights[i]->matrix[j] == 0) {
+                reference_weights[i]->matrix[j] = 0;
+            }
+        }
+    }
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&reference, x, expected);
+    model_predict(&model, x, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    // fine tuning keeps pruned weights at 0
+    for (int step = 0; step < 3; step++) {
+        model_predict(&model, x, actual);
+        model_back_propagate(&model, y, 0.5);
+        model_gradient_descent(&model);
+    }
+    for (int i = 0; i < 2; i++) {
+        int n_nonzero = 0;
+        for (int j = 0; j < weights[i]->n_elements; j++) {
+            n_nonzero += weights[i]->matrix[j] != 0;
+        }
+        EXPECT_LE(n_nonzero, i == 0 ? 3 : 5);
+    }
+    model_predict(&model, x, actual);
+
+    const char *path = "model_test_pruned.model";
+    ASSERT_TRUE(model_save(&model, path));
+    neural_network_model_t loaded = {};
+    ASSERT_TRUE(model_load(&loaded, path));
+    EXPECT_EQ(loaded.ops[1].kind, OP_DENSE_SPARSE);
+    EXPECT_EQ(loaded.ops[3].kind, OP_DENSE);
+    EXPECT_EQ(loaded.input_layer->next->layer.dense.n_nonzero, 3);
+    model_predict(&loaded, x, expected);
+    EXPECT_TRUE(nmatrix_equal(&expected, &actual));
+
+    inference_model_t plan = model_compile_inference(&model);
+    ASSERT_EQ(plan.num_ops, 2);
+    EXPECT_EQ(plan.ops[0].type, inference_op_t::INFERENCE_DENSE_SPARSE);
+    EXPECT_EQ(plan.ops[0].n_weights, 3);
+    inference_predict(&plan, x, expected);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    inference_free(&plan);
+    model_free(&loaded);
+    model_free(&model);
+    model_free(&reference);
+    std::remove(path);
+}
+
+TEST(model, dense_mask_with_pruned_trailing_columns) {
+    neural_network_model_t model, reference;
+    srand(10);
+    build_test_model(&model);
+    srand(10);
+    build_test_model(&reference);
+    layer_t *dense = model.input_layer->next;
+    nmatrix_t *reference_weights = &reference.input_layer->next->layer.dense.weights;
+
+    // the first 4 rows keep only their first input and the last row is pruned entirely,
+    // so every row ends in pruned columns
+    uint8_t *mask = (uint8_t*) malloc(15);
+    for (int i = 0; i < 15; i++) {
+        mask[i] = i % 3 == 0 && i < 12;
+        if (!mask[i]) {
+            reference_weights->matrix[i] = 0;
+        }
+    }
+    layer_dense_set_mask(dense, mask);
+    ASSERT_EQ(dense->layer.dense.n_nonzero, 4);
+    EXPECT_EQ(model.ops[1].kind, OP_DENSE_SPARSE);
+    for (int r = 0; r < 4; r++) {
+        EXPECT_EQ(dense->layer.dense.sparse_row_start[r], r);
+        EXPECT_EQ(dense->layer.dense.sparse_columns[r], 0);
+    }
+    EXPECT_EQ(dense->layer.dense.sparse_row_start[4], 4);
+    EXPECT_EQ(dense->layer.dense.sparse_row_start[5], 4);
+
+    float a[3] = {0.5, -0.25, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t expected = nmatrix_allocator(SHAPE(2, 2, 1));
+    nmatrix_t actual = nmatrix_allocator(SHAPE(2, 2, 1));
+    model_predict(&reference, x, expected);
+    model_predict(&model, x, actual);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-6);
+    }
+
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    model_free(&model);
+    model_free(&reference);
+}
+
+// builds the exported source into a shared library with the system C compiler and compares its predictions with the
+// model's on random inputs
+static void expect_exported_predictions_match(neural_network_model_t *model, const char *source_path) {
+#ifdef _WIN32
+    GTEST_SKIP() << "exported sources are only compiled on POSIX systems";
+#else
+    if (std::system("cc --version > /dev/null 2>&1") != 0) {
+        GTEST_SKIP() << "no C compiler to build the exported source with";
+    }
+    const std::string library_path = std::string("./") + source_path + ".so";
+    const std::string command = std::string("cc -std=c99 -O2 -shared -fPIC -o ") + library_path + " " + source_path + " -lm";
+    ASSERT_EQ(std::system(command.c_str()), 0) << command;
+    void *library = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    ASSERT_NE(library, nullptr) << dlerror();
+    typedef void (*exported_predict_t)(const float*, float*);
+    exported_predict_t predict = (exported_predict_t) dlsym(library, EXPORT_PREDICT_FUNCTION);
+    ASSERT_NE(predict, nullptr);
+
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, model->input_layer->layer.input.input_values.n_elements, 1));
+    nmatrix_t expected = nmatrix_copy(&model->output_layer->layer.output.output_values);
+    nmatrix_t actual = nmatrix_copy(&expected);
+    for (int example = 0; example < 8; example++) {
+        model_initialize_matrix_normal_distribution(input, 0, 1);
+        model_predict(model, input, expected);
+        predict(input.matrix, actual.matrix);
+        for (int i = 0; i < expected.n_elements; i++) {
+            EXPECT_NEAR(expected.matrix[i], actual.matrix[i], 1e-5);
+        }
+    }
+
+    nmatrix_free(&input);
+    nmatrix_free(&expected);
+    nmatrix_free(&actual);
+    dlclose(library);
+    std::remove(library_path.c_str());
+#endif
+}
+
+TEST(model, export_c_writes_specialized_source) {
+    neural_network_model_t model;
+    srand(13);
+    build_test_model(&model);
+    layer_dense_prune(model.input_layer->next, 0.8);
+
+    const char *path = "model_test_export.c";
+    ASSERT_TRUE(model_export_c(&model, path));
+    FILE *file = std::fopen(path, "r");
+    ASSERT_NE(file, nullptr);
+    std::string source;
+    char chunk[256];
+    while (std::fgets(chunk, sizeof(chunk), file) != nullptr) {
+        source += chunk;
+    }
+    std::fclose(file);
+
+    EXPECT_NE(source.find("#define EXPORTED_MODEL_N_INPUTS 3"), std::string::npos);
+    EXPECT_NE(source.find("#define EXPORTED_MODEL_N_OUTPUTS 2"), std::string::npos);
+    EXPECT_NE(source.find("void " EXPORT_PREDICT_FUNCTION "(const float *restrict input, float *restrict output)"), std::string::npos);
+    EXPECT_NE(source.find("softmax(y, 2);"), std::string::npos);
+    EXPECT_EQ(source.find("#include <model"), std::string::npos);
+    EXPECT_EQ(source.find("#include <util"), std::string::npos);
+
+    // the pruned layer's 3 kept weights are the only multiplications of its unrolled rows
+    size_t op_0 = source.find("static inline void op_0");
+    size_t op_1 = source.find("static inline void op_1");
+    ASSERT_NE(op_0, std::string::npos);
+    ASSERT_NE(op_1, std::string::npos);
+    int n_products = 0;
+    for (size_t i = source.find(" * x[", op_0); i < op_1; i = source.find(" * x[", i + 1)) {
+        n_products++;
+    }
+    EXPECT_EQ(n_products, 3);
+
+    expect_exported_predictions_match(&model, path);
+    model_free(&model);
+    std::remove(path);
+
+    // convolution, pooling and fused activations
+    build_test_model(&model, pipeline_test_model);
+    ASSERT_TRUE(model_export_c(&model, path));
+    expect_exported_predictions_match(&model, path);
+    model_free(&model);
+    std::remove(path);
+}
+
+TEST(model, checkpoint_writer_saves_in_background) {
+    neural_network_model_t model;
+    srand(17);
+    build_test_model(&model);
+
+    const int n_examples = 8;
+    nmatrix_t train_x[n_examples];
+    int train_labels[n_examples];
+    for (int i = 0; i < n_examples; i++) {
+        train_x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(train_x[i], 0, 1);
+        train_labels[i] = i % 2;
+    }
+    training_info_t training_info = build_training_info(train_x, NULL, train_labels, n_examples, 2, 0.1, 3);
+    training_info.model = &model;
+
+    const char *path = "model_test_background.model";
+    training_info.checkpoint_writer = checkpoint_writer_create(&model, path, 1, 0);
+    model_train_info(&training_info);
+    ASSERT_TRUE(checkpoint_writer_wait(training_info.checkpoint_writer));
+    EXPECT_GE(checkpoint_writer_written(training_info.checkpoint_writer), 1u);
+    checkpoint_writer_free(training_info.checkpoint_writer);
+
+    // the last snapshot was taken after the final update
+    neural_network_model_t loaded = {};
+    ASSERT_TRUE(model_load(&loaded, path));
+    ASSERT_EQ(loaded.parameters.n_parameters, model.parameters.n_parameters);
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        EXPECT_EQ(loaded.parameters.parameters[i], model.parameters.parameters[i]);
+    }
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&train_x[i]);
+    }
+    model_free(&loaded);
+    model_free(&model);
+    std::remove(path);
+    std::remove((std::string(path) + ".state").c_str());
+}
+
+TEST(model, training_state_resumes_run_exactly) {
+    const int n_examples = 8;
+    nmatrix_t train_x[n_examples];
+    int train_labels[n_examples];
+    srand(23);
+    for (int i = 0; i < n_examples; i++) {
+        train_x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(train_x[i], 0, 1);
+        train_labels[i] = i % 2;
+    }
+    training_info_t training_info = build_training_info(train_x, NULL, train_labels, n_examples, 2, 0.1, 0);
+    training_info.shuffle = true;
+
+    // uninterrupted run
+    neural_network_model_t model;
+    srand(17);
+    build_test_model(&model);
+    training_info_t full_run = training_info;
+    full_run.model = &model;
+    full_run.target_epochs = 4;
+    model_train_info(&full_run);
+
+    // the same run stopped after two epochs, its last checkpoint carries the training state
+    neural_network_model_t interrupted;
+    srand(17);
+    build_test_model(&interrupted);
+    training_info_t first_half = training_info;
+    first_half.model = &interrupted;
+    first_half.target_epochs = 2;
+    const char *path = "model_test_resume.model";
+    const std::string state_path = std::string(path) + ".state";
+    first_half.checkpoint_writer = checkpoint_writer_create(&interrupted, path, 1, 0);
+    model_train_info(&first_half);
+    ASSERT_TRUE(checkpoint_writer_wait(first_half.checkpoint_writer));
+    checkpoint_writer_free(first_half.checkpoint_writer);
+
+    // a state does not resume weights from a different point of the run
+    training_info_t mismatched = training_info;
+    mismatched.model = &model;
+    EXPECT_FALSE(training_state_load(&mismatched, state_path.c_str()));
+
+    neural_network_model_t resumed = {};
+    ASSERT_TRUE(model_load(&resumed, path));
+    training_info_t second_half = training_info;
+    second_half.model = &resumed;
+    second_half.shuffle = false;
+    second_half.target_epochs = 4;
+    ASSERT_TRUE(training_state_load(&second_half, state_path.c_str()));
+    EXPECT_TRUE(second_half.shuffle);
+    EXPECT_EQ(second_half.epoch, 2u);
+    EXPECT_EQ(second_half.train_index, 0u);
+    model_train_info(&second_half);
+
+    ASSERT_EQ(resumed.parameters.n_parameters, model.parameters.n_parameters);
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        EXPECT_EQ(resumed.parameters.parameters[i], model.parameters.parameters[i]);
+    }
+    EXPECT_EQ(resumed.random.state, model.random.state);
+
+    // saving between runs continues the same way
+    ASSERT_TRUE(training_state_save(&second_half, state_path.c_str()));
+    ASSERT_TRUE(training_state_load(&second_half, state_path.c_str()));
+    EXPECT_EQ(second_half.epoch, 4u);
+    EXPECT_EQ(second_half.train_index, 0u);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&train_x[i]);
+    }
+    free(full_run.train_order);
+    free(first_half.train_order);
+    free(second_half.train_order);
+    model_free(&resumed);
+    model_free(&interrupted);
+    model_free(&model);
+    std::remove(path);
+    std::remove(state_path.c_str());
+}
+
+// stands in for the output's make_guess to save a run in the middle of an epoch, when the training pass reaches the
+// first example of a batch. the checkpoint is written with the usual make_guess in place so it can be saved
+static struct {
+    training_info_t *training_info;
+    unsigned int epoch;
+    unsigned int train_index;
+    const char *path;
+    const char *state_path;
+    bool saved;
+} mid_epoch_save;
+
+static nmatrix_t make_guess_saving_mid_epoch(layer_t *output_layer, nmatrix_t output) {
+    training_info_t *training_info = mid_epoch_save.training_info;
+    if (training_info->model->is_training && !mid_epoch_save.saved && training_info->epoch == mid_epoch_save.epoch
+            && training_info->train_index == mid_epoch_save.train_index) {
+        output_layer->layer.output.make_guess = output_make_guess_one_hot_encoded;
+        mid_epoch_save.saved = model_save(training_info->model, mid_epoch_save.path)
+                && training_state_save(training_info, mid_epoch_save.state_path);
+        output_layer->layer.output.make_guess = make_guess_saving_mid_epoch;
+    }
+    return output_make_guess_one_hot_encoded(output_layer, output);
+}
+
+TEST(model, training_state_resumes_mid_epoch_exactly) {
+    const int n_examples = 8;
+    nmatrix_t train_x[n_examples];
+    int train_labels[n_examples];
+    srand(59);
+    for (int i = 0; i < n_examples; i++) {
+        train_x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(train_x[i], 0, 1);
+        train_labels[i] = train_x[i].matrix[2] > 0;
+    }
+    training_info_t training_info = build_training_info(train_x, NULL, train_labels, n_examples, 2, 0.1, 4);
+    training_info.shuffle = true;
+
+    // uninterrupted run
+    neural_network_model_t model;
+    srand(17);
+    build_test_model(&model);
+    training_info_t full_run = training_info;
+    full_run.model = &model;
+    model_train_info(&full_run);
+
+    // the same run saved at the start of the third batch of its third epoch, after its order was shuffled
+    neural_network_model_t interrupted;
+    srand(17);
+    build_test_model(&interrupted);
+    training_info_t saving = training_info;
+    saving.model = &interrupted;
+    const char *path = "model_test_mid_epoch.model";
+    const std::string state_path = std::string(path) + ".state";
+    mid_epoch_save = {&saving, 2, 4, path, state_path.c_str(), false};
+    interrupted.output_layer->layer.output.make_guess = make_guess_saving_mid_epoch;
+    model_train_info(&saving);
+    ASSERT_TRUE(mid_epoch_save.saved);
+
+    neural_network_model_t resumed = {};
+    ASSERT_TRUE(model_load(&resumed, path));
+    training_info_t rest = training_info;
+    rest.model = &resumed;
+    ASSERT_TRUE(training_state_load(&rest, state_path.c_str()));
+    EXPECT_EQ(rest.epoch, 2u);
+    EXPECT_EQ(rest.train_index, 4u);
+    model_train_info(&rest);
+
+    ASSERT_EQ(resumed.parameters.n_parameters, model.parameters.n_parameters);
+    for (unsigned int i = 0; i < model.parameters.n_parameters; i++) {
+        EXPECT_EQ(resumed.parameters.parameters[i], model.parameters.parameters[i]);
+    }
+    EXPECT_EQ(resumed.random.state, model.random.state);
+    EXPECT_EQ(memcmp(rest.train_order, full_run.train_order, sizeof(uint32_t) * n_examples), 0);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&train_x[i]);
+    }
+    free(full_run.train_order);
+    free(saving.train_order);
+    free(rest.train_order);
+    model_free(&resumed);
+    model_free(&interrupted);
+    model_free(&model);
+    std::remove(path);
+    std::remove(state_path.c_str());
+}
+
+TEST(model, sweep_trains_every_configuration_reproducibly) {
+    // xor as four labelled classes of two
+    const int n_examples = 4;
+    nmatrix_t train_x[n_examples];
+    int train_labels[n_examples];
+    for (int i = 0; i < n_examples; i++) {
+        train_x[i] = nmatrix_allocator(SHAPE(2, 2, 1));
+        train_x[i].matrix[0] = i & 1;
+        train_x[i].matrix[1] = (i >> 1) & 1;
+        train_labels[i] = (i & 1) ^ ((i >> 1) & 1);
+    }
+    training_info_t data = {};
+    data.train_size = n_examples;
+    data.train_x = train_x;
+    data.train_labels = train_labels;
+    data.test_size = n_examples;
+    data.test_x = train_x;
+    data.test_labels = train_labels;
+    data.target_epochs = 300;
+    data.target_accuracy = 1;
+    data.shuffle = true;
+
+    const float learning_rates[] = {0.05, 0.2};
+    const unsigned int batch_sizes[] = {1};
+    const int depths[] = {1};
+    const int widths[] = {4, 8};
+    const dense_activation_t activations[] = {DENSE_ACTIVATION_TANH, DENSE_ACTIVATION_SIGMOID};
+    sweep_space_t space = {};
+    space.learning_rates = learning_rates;
+    space.n_learning_rates = 2;
+    space.batch_sizes = batch_sizes;
+    space.n_batch_sizes = 1;
+    space.depths = depths;
+    space.n_depths = 1;
+    space.widths = widths;
+    space.n_widths = 2;
+    space.activations = activations;
+    space.n_activations = 2;
+    space.seed = 7;
+
+    const char *csv_path = "model_test_sweep.csv";
+    sweep_result_t *results;
+    ASSERT_EQ(model_sweep(&data, &space, 3, csv_path, &results), 8);
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(results[i].config.learning_rate, learning_rates[i % 2]);
+        EXPECT_EQ(results[i].config.width, widths[(i / 2) % 2]);
+        EXPECT_EQ(results[i].config.activation, activations[i / 4]);
+        EXPECT_GE(results[i].epochs, 1u);
+    }
+    EXPECT_EQ(results[sweep_best_result(results, 8)].test_accuracy, 1);
+
+    // one line per configuration after the header
+    FILE *csv = fopen(csv_path, "r");
+    ASSERT_NE(csv, nullptr);
+    int lines = 0;
+    for (int c = fgetc(csv); c != EOF; c = fgetc(csv)) {
+        lines += c == '\n';
+    }
+    fclose(csv);
+    EXPECT_EQ(lines, 9);
+
+    // independent generators, the same configurations train the same on a different number of threads
+    sweep_result_t *serial;
+    ASSERT_EQ(model_sweep(&data, &space, 1, NULL, &serial), 8);
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(serial[i].epochs, results[i].epochs);
+        EXPECT_EQ(serial[i].avg_train_error, results[i].avg_train_error);
+    }
+
+    // random search stays inside the space
+    space.n_samples = 5;
+    sweep_result_t *sampled;
+    ASSERT_EQ(model_sweep(&data, &space, 2, NULL, &sampled), 5);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_GE(sampled[i].config.learning_rate, 0.05f * 0.999f);
+        EXPECT_LE(sampled[i].config.learning_rate, 0.2f * 1.001f);
+    }
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&train_x[i]);
+    }
+    free(results);
+    free(serial);
+    free(sampled);
+    std::remove(csv_path);
+}
+
+TEST(model, async_evaluation_matches_serial_evaluation) {
+    const int n_examples = 16;
+    nmatrix_t train_x[n_examples];
+    int train_labels[n_examples];
+    srand(29);
+    for (int i = 0; i < n_examples; i++) {
+        train_x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(train_x[i], 0, 1);
+        train_labels[i] = train_x[i].matrix[0] > 0;
+    }
+    training_info_t training_info = build_training_info(train_x, NULL, train_labels, n_examples, 4, 0.1, 5);
+
+    neural_network_model_t serial_model;
+    srand(17);
+    build_test_model(&serial_model);
+    training_info_t serial = training_info;
+    serial.model = &serial_model;
+    model_train_info(&serial);
+
+    neural_network_model_t async_model;
+    srand(17);
+    build_test_model(&async_model);
+    training_info_t async = training_info;
+    async.model = &async_model;
+    async.async_evaluation = true;
+    model_train_info(&async);
+
+    // evaluation never touches the live weights, and the last epoch's result is waited for
+    for (unsigned int i = 0; i < serial_model.parameters.n_parameters; i++) {
+        EXPECT_EQ(async_model.parameters.parameters[i], serial_model.parameters.parameters[i]);
+    }
+    EXPECT_EQ(async.test_accuracy, serial.test_accuracy);
+    EXPECT_NEAR(async.avg_test_error, serial.avg_test_error, 1e-4);
+
+    // early stopping acts on the evaluation once it arrives
+    neural_network_model_t stopping_model;
+    srand(17);
+    build_test_model(&stopping_model);
+    training_info_t stopping = training_info;
+    stopping.model = &stopping_model;
+    stopping.async_evaluation = true;
+    stopping.target_epochs = 200;
+    stopping.target_accuracy = 0.9;
+    model_train_info(&stopping);
+    EXPECT_LT(stopping.epoch, 200u);
+    EXPECT_GE(stopping.test_accuracy, 0.9);
+    EXPECT_FALSE(stopping_model.is_training);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&train_x[i]);
+    }
+    model_free(&serial_model);
+    model_free(&async_model);
+    model_free(&stopping_model);
+}
+
+TEST(model, evaluate_matches_example_by_example_predictions) {
+    neural_network_model_t model;
+    srand(31);
+    build_test_model(&model);
+
+    const int n_examples = 37; // not a multiple of the batch size
+    nmatrix_t x[n_examples];
+    nmatrix_t y[n_examples];
+    int labels[n_examples];
+    for (int i = 0; i < n_examples; i++) {
+        x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(x[i], 0, 1);
+        labels[i] = x[i].matrix[1] > 0;
+        y[i] = nmatrix_allocator(SHAPE(2, 2, 1));
+        y[i].matrix[labels[i]] = 1;
+    }
+
+    // reference, one example at a time through the model itself
+    nmatrix_t output = nmatrix_allocator(SHAPE(2, 2, 1));
+    float loss = 0;
+    int n_correct = 0;
+    unsigned int confusion[4] = {0};
+    for (int i = 0; i < n_examples; i++) {
+        model_predict(&model, x[i], output);
+        loss += output_cost_categorical_cross_entropy(model.output_layer, y[i]);
+        int predicted = nmatrix_argmax(&output);
+        n_correct += predicted == labels[i];
+        confusion[labels[i] * 2 + predicted]++;
+    }
+
+    evaluate_options_t options = {};
+    options.batch_size = 8;
+    options.n_threads = 3;
+    evaluation_stats_t stats = model_evaluate(&model, x, y, n_examples, &options);
+    EXPECT_EQ(stats.n_examples, (unsigned int) n_examples);
+    EXPECT_EQ(stats.n_classes, 2);
+    EXPECT_EQ(stats.n_correct, n_correct);
+    EXPECT_FLOAT_EQ(stats.accuracy, n_correct / (float) n_examples);
+    EXPECT_NEAR(stats.loss, loss / n_examples, 1e-4);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(stats.confusion[i], confusion[i]);
+    }
+
+    // class index targets and a single thread reduce to the same numbers
+    options.labels = labels;
+    options.n_threads = 1;
+    evaluation_stats_t serial = model_evaluate(&model, x, NULL, n_examples, &options);
+    EXPECT_EQ(serial.n_correct, stats.n_correct);
+    EXPECT_EQ(serial.loss, stats.loss);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(serial.confusion[i], stats.confusion[i]);
+    }
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&x[i]);
+        nmatrix_free(&y[i]);
+    }
+    nmatrix_free(&output);
+    evaluation_stats_free(&stats);
+    evaluation_stats_free(&serial);
+    model_free(&model);
+}
+
+static void expect_pipeline_matches_serial(const test_model_spec_t &spec, training_info_t training_info,
+        unsigned int n_stages, bool freeze_first) {
+    neural_network_model_t serial_model, pipeline_model;
+    srand(41);
+    build_test_model(&serial_model, spec);
+    srand(41);
+    build_test_model(&pipeline_model, spec);
+    if (freeze_first) {
+        layer_freeze(serial_model.input_layer->next);
+        layer_freeze(pipeline_model.input_layer->next);
+    }
+
+    training_info_t serial = training_info;
+    serial.model = &serial_model;
+    model_train_info(&serial);
+
+    training_info_t pipelined = training_info;
+    pipelined.model = &pipeline_model;
+    pipelined.pipeline_stages = n_stages;
+    testing::internal::CaptureStdout();
+    model_train_info(&pipelined);
+    // the plan is only listed when asked for
+    EXPECT_EQ(testing::internal::GetCapturedStdout().find("Pipeline stage"), std::string::npos);
+
+    // every stage accumulates its micro-batches in example order, so the run is exactly the serial one
+    for (unsigned int i = 0; i < serial_model.parameters.n_parameters; i++) {
+        ASSERT_EQ(pipeline_model.parameters.parameters[i], serial_model.parameters.parameters[i]) << n_stages << " stages";
+    }
+    EXPECT_EQ(pipelined.avg_train_error, serial.avg_train_error);
+    EXPECT_EQ(pipelined.train_accuracy, serial.train_accuracy);
+    EXPECT_EQ(pipelined.test_accuracy, serial.test_accuracy);
+
+    // the layers get their own buffers back
+    nmatrix_t input = nmatrix_allocator(SHAPE(2, serial_model.input_layer->layer.input.input_values.n_elements, 1));
+    model_initialize_matrix_normal_distribution(input, 0, 1);
+    nmatrix_t serial_output = nmatrix_copy(&serial_model.output_layer->layer.output.output_values);
+    nmatrix_t pipeline_output = nmatrix_copy(&serial_output);
+    model_predict(&serial_model, input, serial_output);
+    model_predict(&pipeline_model, input, pipeline_output);
+    EXPECT_TRUE(nmatrix_equal(&serial_output, &pipeline_output));
+
+    free(serial.train_order);
+    free(pipelined.train_order);
+    nmatrix_free(&input);
+    nmatrix_free(&serial_output);
+    nmatrix_free(&pipeline_output);
+    model_free(&serial_model);
+    model_free(&pipeline_model);
+}
+
+TEST(model, pipeline_training_matches_serial_training) {
+    const int n_examples = 23; // the last batch is short
+    nmatrix_t image_x[n_examples];
+    nmatrix_t x[n_examples];
+    nmatrix_t y[n_examples];
+    int labels[n_examples];
+    srand(37);
+    for (int i = 0; i < n_examples; i++) {
+        image_x[i] = nmatrix_allocator(SHAPE(2, 16, 1));
+        model_initialize_matrix_normal_distribution(image_x[i], 0, 1);
+        x[i] = nmatrix_allocator(SHAPE(2, 3, 1));
+        model_initialize_matrix_normal_distribution(x[i], 0, 1);
+        labels[i] = image_x[i].matrix[5] + x[i].matrix[0] > 0;
+        y[i] = nmatrix_allocator(SHAPE(2, 2, 1));
+        y[i].matrix[labels[i]] = 1;
+    }
+
+    // class index targets through the fused softmax cross entropy output
+    training_info_t images = build_training_info(image_x, NULL, labels, n_examples, 5, 0.05, 3);
+    images.shuffle = true;
+    for (unsigned int n_stages = 2; n_stages <= 8; n_stages += 2) {
+        expect_pipeline_matches_serial(pipeline_test_model, images, n_stages, false);
+    }
+    // stages before the first trainable layer only run forward passes
+    expect_pipeline_matches_serial(pipeline_test_model, images, 4, true);
+
+    // one hot targets through a separate output layer
+    training_info_t one_hot = build_training_info(x, y, NULL, n_examples, 5, 0.05, 3);
+    one_hot.shuffle = true;
+    expect_pipeline_matches_serial(small_test_model, one_hot, 3, false);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&image_x[i]);
+        nmatrix_free(&x[i]);
+        nmatrix_free(&y[i]);
+    }
+}
+
+TEST(model, pipeline_partition_balances_layer_costs) {
+    // the last layer alone costs as much as the rest, the first stage keeps the input with the layer after it
+    const double costs[6] = {0, 1, 1, 1, 1, 4};
+    int stage_first[3];
+    ASSERT_EQ(pipeline_partition(costs, 6, 3, stage_first), 3);
+    EXPECT_EQ(stage_first[0], 0);
+    EXPECT_EQ(stage_first[1], 3);
+    EXPECT_EQ(stage_first[2], 5);
+
+    const double even[7] = {0, 2, 2, 2, 2, 2, 2};
+    ASSERT_EQ(pipeline_partition(even, 7, 3, stage_first), 3);
+    EXPECT_EQ(stage_first[1], 3);
+    EXPECT_EQ(stage_first[2], 5);
+
+    // no more stages than layers to give them
+    ASSERT_EQ(pipeline_partition(costs, 3, 5, stage_first), 2);
+    EXPECT_EQ(stage_first[0], 0);
+    EXPECT_EQ(stage_first[1], 2);
+}
+
+TEST(model, dense_backward_tasks_match_inline_gradients) {
+    const int n_examples = 12;
+    nmatrix_t x[n_examples];
+    int labels[n_examples];
+    srand(43);
+    for (int i = 0; i < n_examples; i++) {
+        x[i] = nmatrix_allocator(SHAPE(2, 64, 1));
+        model_initialize_matrix_normal_distribution(x[i], 0, 1);
+        labels[i] = (x[i].matrix[0] > 0) + 2 * (x[i].matrix[1] > 0);
+    }
+    training_info_t training_info = build_training_info(x, NULL, labels, n_examples, 4, 0.05, 2);
+
+    neural_network_model_t inline_model;
+    srand(47);
+    build_test_model(&inline_model, wide_test_model);
+    training_info_t serial = training_info;
+    serial.model = &inline_model;
+    model_train_info(&serial);
+
+    // the two middle layers are past DENSE_PARALLEL_MIN_WEIGHTS and pass dE/dX on, so their weight gradients run
+    // on the pool, alone and from pipeline stages
+    thread_pool_t *pool = thread_pool_create(3);
+    for (unsigned int n_stages = 1; n_stages <= 3; n_stages += 2) {
+        neural_network_model_t pooled_model;
+        srand(47);
+        build_test_model(&pooled_model, wide_test_model);
+        pooled_model.pool = pool;
+        training_info_t pooled = training_info;
+        pooled.model = &pooled_model;
+        pooled.pipeline_stages = n_stages;
+        model_train_info(&pooled);
+
+        layer_t *dense_2 = pooled_model.ops[2].layer;
+        EXPECT_NE(dense_2->layer.dense.gradient_task, nullptr);
+        EXPECT_EQ(pooled_model.ops[1].layer->layer.dense.gradient_task, nullptr); // first trainable layer, no dE/dX
+        for (unsigned int i = 0; i < inline_model.parameters.n_parameters; i++) {
+            ASSERT_EQ(pooled_model.parameters.parameters[i], inline_model.parameters.parameters[i]) << n_stages << " stages";
+        }
+        EXPECT_EQ(pooled.avg_train_error, serial.avg_train_error);
+        // the test pass runs its batches on the same pool
+        EXPECT_EQ(pooled.avg_test_error, serial.avg_test_error);
+        EXPECT_EQ(pooled.test_accuracy, serial.test_accuracy);
+        model_free(&pooled_model);
+    }
+    thread_pool_free(pool);
+
+    for (int i = 0; i < n_examples; i++) {
+        nmatrix_free(&x[i]);
+    }
+    model_free(&inline_model);
+}
+
+TEST(model, training_without_test_set_reports_zero_test_stats) {
+    neural_network_model_t model;
+    srand(53);
+    build_test_model(&model);
+    float a[3] = {0.5, -0.25, 1};
+    float b[2] = {0, 1};
+    nmatrix_t x = nmatrix_constructor(3, a, SHAPE(2, 3, 1));
+    nmatrix_t y = nmatrix_constructor(2, b, SHAPE(2, 2, 1));
+
+    training_info_t training_info = {};
+    training_info.model = &model;
+    training_info.train_size = 1;
+    training_info.train_x = &x;
+    training_info.train_y = &y;
+    training_info.batch_size = 1;
+    training_info.learning_rate = 0.1;
+    training_info.target_epochs = 20;
+    training_info.target_accuracy = 1;
+    model_train_info(&training_info);
+
+    // the train accuracy meets the target, but without a test set the run trains every epoch
+    EXPECT_EQ(training_info.train_accuracy, 1);
+    EXPECT_EQ(training_info.epoch, 20u);
+    EXPECT_EQ(training_info.test_accuracy, 0);
+    EXPECT_EQ(training_info.avg_test_error, 0);
+
+    training_info.test_accuracy = -1;
+    model_test_info(&training_info);
+    EXPECT_EQ(training_info.test_accuracy, 0);
+    EXPECT_EQ(training_info.avg_test_error, 0);
+
+    model_free(&model);
+}
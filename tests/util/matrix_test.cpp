@@ -15,6 +15,19 @@ TEST(nmatrix, nmatrix_allocator) {
     nmatrix_free(&m);
 }
 
+TEST(nmatrix, nmatrix_aligned_alloc) {
+    float *data = nmatrix_aligned_alloc(5);
+
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ((uintptr_t) data % NMATRIX_ALIGNMENT, 0u);
+    EXPECT_EQ(nmatrix_aligned_size(5) % (NMATRIX_ALIGNMENT / sizeof(float)), 0u);
+    EXPECT_GE(nmatrix_aligned_size(5), 5);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(data[i], 0.0);
+    }
+    nmatrix_aligned_free(data);
+}
+
 TEST(nmatrix, nmatrix_constructor) {
     float a[6] = {0, 1, 2, 3, 4, 5};
     nmatrix_t m = nmatrix_constructor(6, a, SHAPE(2, 2, 3));
@@ -75,6 +88,18 @@ TEST(nmatrix, nmatrix_memcpy) {
     EXPECT_TRUE(nmatrix_equal(&copy, &m));
 }
 
+TEST(nmatrix, nmatrix_from_uint8) {
+    uint8_t values[6] = {0, 1, 64, 128, 255, 32};
+    nmatrix_t m = nmatrix_allocator(SHAPE(2, 2, 3));
+    nmatrix_from_uint8(&m, values, -1.0 / 256.0, 1);
+
+    for (int i = 0; i < 6; i++) {
+        EXPECT_FLOAT_EQ(m.matrix[i], 1 - values[i] / 256.0);
+    }
+    EXPECT_EQ(nmatrix_argmax(&m), 0);
+    nmatrix_free(&m);
+}
+
 TEST(nmatrix, nmatrix_multiply) {
     float a1[6] = {0, 1, 2, 3, 4, 5};
     nmatrix_t m1 = nmatrix_constructor(6, a1, SHAPE(2, 2, 3));
@@ -110,6 +135,118 @@ TEST(nmatrix, nmatrix_multiply_stacked) {
     EXPECT_TRUE(nmatrix_equal(&exp, &result));
 }
 
+TEST(nmatrix, nmatrix_gemm_transposed) {
+    // stored transposed, op(A) and op(B) are the matrices of nmatrix_multiply
+    float a1[6] = {0, 3, 1, 4, 2, 5};
+    nmatrix_t m1 = nmatrix_constructor(6, a1, SHAPE(2, 3, 2));
+
+    float a2[6] = {5, 3, 1, 4, 2, 0};
+    nmatrix_t m2 = nmatrix_constructor(6, a2, SHAPE(2, 2, 3));
+
+    float expected[4] = {5, 2, 32, 20};
+    nmatrix_t exp = nmatrix_constructor(4, expected, SHAPE(2, 2, 2));
+
+    nmatrix_t result = nmatrix_allocator(SHAPE(2, 2, 2));
+    nmatrix_gemm(true, true, 1, &m1, &m2, 0, &result);
+    EXPECT_TRUE(nmatrix_equal(&exp, &result));
+
+    // accumulate, C = 2 * A.B + C
+    nmatrix_gemm(true, true, 2, &m1, &m2, 1, &result);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(result.matrix[i], 3 * expected[i]);
+    }
+    nmatrix_free(&result);
+}
+
+TEST(nmatrix, nmatrix_factorize_low_rank) {
+    // rank 2: outer products of (1, 2, 3)(1, 0, 1, 2) * 3 and (1, 0, -1)(0, 1, 1, -1)
+    float a[12];
+    float u1[3] = {1, 2, 3}, v1[4] = {1, 0, 1, 2}, u2[3] = {1, 0, -1}, v2[4] = {0, 1, 1, -1};
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            a[r * 4 + c] = 3 * u1[r] * v1[c] + u2[r] * v2[c];
+        }
+    }
+    nmatrix_t m = nmatrix_constructor(12, a, SHAPE(2, 3, 4));
+    nmatrix_t u = nmatrix_allocator(SHAPE(2, 3, 2));
+    nmatrix_t v = nmatrix_allocator(SHAPE(2, 2, 4));
+    nmatrix_t product = nmatrix_allocator(SHAPE(2, 3, 4));
+    nmatrix_factorize_low_rank(&m, 100, &u, &v);
+    nmatrix_gemm(false, false, 1, &u, &v, 0, &product);
+
+    for (int i = 0; i < 12; i++) {
+        EXPECT_NEAR(product.matrix[i], a[i], 1e-4);
+    }
+    float dot = 0;
+    for (int c = 0; c < 4; c++) {
+        dot += v.matrix[c] * v.matrix[4 + c];
+    }
+    EXPECT_NEAR(dot, 0, 1e-5);
+
+    nmatrix_free(&u);
+    nmatrix_free(&v);
+    nmatrix_free(&product);
+}
+
+TEST(nmatrix, nmatrix_convolve_im2col) {
+    float a[9] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    nmatrix_t image = nmatrix_constructor(9, a, SHAPE(2, 3, 3));
+
+    float k[4] = {1, 2, 0, 1};
+    nmatrix_t kernel = nmatrix_constructor(4, k, SHAPE(2, 2, 2));
+
+    float expected[4] = {10, 14, 22, 26};
+    nmatrix_t exp = nmatrix_constructor(4, expected, SHAPE(2, 2, 2));
+
+    nmatrix_t result = nmatrix_allocator(SHAPE(2, 2, 2));
+    nmatrix_convolve(&image, &kernel, &result);
+    EXPECT_TRUE(nmatrix_equal(&exp, &result));
+
+    // the same convolution lowered to a matrix multiply
+    nmatrix_t image_3d = nmatrix_constructor(9, a, SHAPE(3, 1, 3, 3));
+    nmatrix_t kernel_row = nmatrix_constructor(4, k, SHAPE(2, 1, 4));
+    nmatrix_t columns = nmatrix_allocator(SHAPE(2, 4, 4));
+    nmatrix_t flat = nmatrix_constructor(4, result.matrix, SHAPE(2, 1, 4));
+    nmatrix_im2col(&image_3d, 2, 1, 0, &columns);
+    nmatrix_gemm(false, false, 1, &kernel_row, &columns, 0, &flat);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(result.matrix[i], expected[i]);
+    }
+
+    nmatrix_free(&columns);
+    nmatrix_free(&result);
+}
+
+TEST(nmatrix, nmatrix_maxpool_indexed) {
+    // 2 channels of 3x4, the last row does not fill a 2x2 window and is dropped
+    float a[24] = {1, 5, 2, 0,
+                   3, 4, 8, 6,
+                   9, 9, 9, 9,
+
+                   -1, -2, -3, -4,
+                   -5, -6, -7, -8,
+                   0, 0, 0, 0};
+    nmatrix_t m = nmatrix_constructor(24, a, SHAPE(3, 2, 3, 4));
+
+    float expected[4] = {5, 8, -1, -3};
+    nmatrix_t exp = nmatrix_constructor(4, expected, SHAPE(3, 2, 1, 2));
+
+    int indices[4];
+    nmatrix_t result = nmatrix_allocator(SHAPE(3, 2, 1, 2));
+    nmatrix_maxpool_indexed(&m, SHAPE(3, 1, 2, 2), &result, indices);
+    EXPECT_TRUE(nmatrix_equal(&exp, &result));
+    EXPECT_EQ(indices[0], 1);
+    EXPECT_EQ(indices[1], 6);
+    EXPECT_EQ(indices[2], 12);
+    EXPECT_EQ(indices[3], 14);
+
+    float expected_avg[4] = {3.25, 4, -3.5, -5.5};
+    nmatrix_t exp_avg = nmatrix_constructor(4, expected_avg, SHAPE(3, 2, 1, 2));
+    nmatrix_avgpool(&m, SHAPE(3, 1, 2, 2), &result);
+    EXPECT_TRUE(nmatrix_equal(&exp_avg, &result));
+    nmatrix_free(&result);
+}
+
 TEST(nmatrix, nmatrix_multiply_scalar) {
     float a[6] = {0, 1, 2, 3, 4, 5};
     nmatrix_t m = nmatrix_constructor(6, a, SHAPE(2, 2, 3));
@@ -0,0 +1,48 @@
+#include <tests/thread_pool_test.h>
+
+#include <atomic>
+
+struct spawn_args {
+    thread_pool_t *pool;
+    std::atomic<int> *count;
+    int children;
+};
+
+static void count_task(void *argument) {
+    (*(std::atomic<int>*) argument)++;
+}
+
+static void spawn_task(void *argument) {
+    spawn_args *args = (spawn_args*) argument;
+    for (int i = 0; i < args->children; i++) {
+        thread_pool_submit(args->pool, count_task, args->count);
+    }
+    (*args->count)++;
+}
+
+TEST(thread_pool, runs_every_task_before_wait_returns) {
+    thread_pool_t *pool = thread_pool_create(4);
+    EXPECT_EQ(thread_pool_size(pool), 4);
+
+    // more tasks than the initial queue holds, and tasks that submit more tasks
+    std::atomic<int> count(0);
+    spawn_args args = {pool, &count, 3};
+    for (int i = 0; i < 100; i++) {
+        thread_pool_submit(pool, count_task, &count);
+    }
+    for (int i = 0; i < 50; i++) {
+        thread_pool_submit(pool, spawn_task, &args);
+    }
+    thread_pool_wait(pool);
+    EXPECT_EQ(count.load(), 100 + 50 * 4);
+
+    // the pool is reusable after waiting
+    thread_pool_submit(pool, count_task, &count);
+    thread_pool_wait(pool);
+    EXPECT_EQ(count.load(), 301);
+    thread_pool_free(pool);
+
+    pool = thread_pool_create(0);
+    EXPECT_EQ(thread_pool_size(pool), thread_pool_default_threads());
+    thread_pool_free(pool);
+}